@@ -0,0 +1,112 @@
+/* =============
+ * arena allocator
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "inc/types.h"
+#include "inc/arena.h"
+
+struct os_arena_chunk_t {
+	struct os_arena_chunk_t *next;
+	size_t size;
+	size_t used;
+	// 16-byte aligned payload follows
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+static __thread struct os_arena_t scratch = ARENA_INIT;
+
+static struct os_arena_chunk_t *chunk_new(size_t size)
+{
+	struct os_arena_chunk_t *c = malloc(sizeof(struct os_arena_chunk_t) + size);
+
+	assert(c != NULL);
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+
+	return(c);
+}
+
+void *arena_alloc(struct os_arena_t *arena, size_t len)
+{
+	struct os_arena_chunk_t *c, *prev;
+	void *p;
+
+	len = (len + 15) & ~(size_t)15;
+	if (arena->cur == NULL) {
+		if (arena->head == NULL)
+			arena->head = chunk_new(len > ARENA_CHUNK ? len : ARENA_CHUNK);
+		arena->cur = arena->head;
+		arena->cur->used = 0;
+	}
+
+	// move on to the next retained chunk that fits, or add a new one
+	c = arena->cur;
+	while (c->size - c->used < len) {
+		prev = c;
+		c = c->next;
+		if (c == NULL) {
+			c = chunk_new(len > ARENA_CHUNK ? len : ARENA_CHUNK);
+			c->next = prev->next;
+			prev->next = c;
+		}
+		c->used = 0;
+	}
+	arena->cur = c;
+
+	p = c->data + c->used;
+	c->used += len;
+	return(p);
+}
+
+struct os_arena_mark_t arena_mark(struct os_arena_t *arena)
+{
+	struct os_arena_mark_t mark;
+
+	mark.chunk = arena->cur;
+	mark.used = arena->cur ? arena->cur->used : 0;
+	return(mark);
+}
+
+void arena_release(struct os_arena_t *arena, struct os_arena_mark_t mark)
+{
+	arena->cur = mark.chunk;
+	if (mark.chunk)
+		mark.chunk->used = mark.used;
+}
+
+void arena_reset(struct os_arena_t *arena)
+{
+	arena->cur = NULL;
+}
+
+void arena_free(struct os_arena_t *arena)
+{
+	struct os_arena_chunk_t *c, *next;
+
+	for (c = arena->head; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	arena->head = arena->cur = NULL;
+}
+
+size_t arena_bytes(struct os_arena_t *arena)
+{
+	struct os_arena_chunk_t *c;
+	size_t bytes = 0;
+
+	for (c = arena->head; c; c = c->next)
+		bytes += sizeof(struct os_arena_chunk_t) + c->size;
+	return(bytes);
+}
+
+struct os_arena_t *arena_scratch(void)
+{
+	return(&scratch);
+}
@@ -0,0 +1,231 @@
+/* =============
+ * batch mode
+ * =============
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/bcache.h"
+#include "inc/threadpool.h"
+#include "inc/parentmap.h"
+#include "inc/query.h"
+#include "inc/oneshot.h"
+#include "inc/batch.h"
+#include "inc/journal.h"
+#include "inc/memgov.h"
+
+struct image {
+	char *path;
+	os_uint64_t size;             // of the file, to schedule big ones first
+};
+
+struct batch {
+	struct image *images;
+	os_uint32_t nimages;
+	int flags;
+	const char *op;
+	const char *path;             // ls, stat, cat
+	struct os_query_t q;          // query
+	int names;
+
+	pthread_mutex_t out_lock;
+	os_uint32_t failed;
+};
+
+static int by_size(const void *a, const void *b)
+{
+	const struct image *x = a, *y = b;
+
+	return(x->size > y->size ? -1 : x->size < y->size);
+}
+
+static void read_manifest(struct batch *b, FILE *f)
+{
+	os_uint32_t cap = 0;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	struct stat st;
+
+	while ((len = getline(&line, &linecap, f)) != -1) {
+		while (len > 0 && strchr(" \t\r\n", line[len - 1]))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		if (b->nimages == cap) {
+			cap = cap ? cap * 2 : 256;
+			b->images = realloc(b->images, cap * sizeof(struct image));
+			assert(b->images != NULL);
+		}
+		b->images[b->nimages].path = strdup(line);
+		assert(b->images[b->nimages].path != NULL);
+		b->images[b->nimages].size = stat(line, &st) == 0 ? st.st_size : 0;
+		b->nimages++;
+	}
+	free(line);
+}
+
+struct match_print {
+	FILE *out;
+	struct os_parentmap_t *parents;
+};
+
+static void print_match(os_uint32_t ino, const struct os_inode_t *inode, void *arg)
+{
+	struct match_print *mp = arg;
+	char path[4096];
+
+	fprintf(mp->out, "%u\t%llu", ino, file_size((struct os_inode_t *)inode));
+	if (mp->parents == NULL)
+		fprintf(mp->out, "\n");
+	else if (pmap_path(mp->parents, ino, path, sizeof(path)))
+		fprintf(mp->out, "\t%s\n", path);
+	else
+		fprintf(mp->out, "\t?\n");
+}
+
+static int run_query(struct batch *b, int fd, struct os_fs_metadata_t *fs, FILE *out)
+{
+	struct match_print mp = { out, NULL };
+
+	if (b->names && (mp.parents = pmap_get(fd, fs)) == NULL)
+		return(EIO);
+	if (query_run(fd, fs, &b->q, tp_shared(), print_match, &mp) < 0)
+		return(EIO);
+	return(0);
+}
+
+/* run_image
+ *
+ * Opens one image, runs the command on it into a memory buffer and
+ * writes the buffer out.  The output of cat is as big as the file,
+ * which may be as big as the image, so it is written straight to
+ * stdout instead, holding the output lock meanwhile.  Inode tables are only worth caching for a
+ * query with paths, which reads them twice (once for the parent map,
+ * once for the query itself), and the memory governor only lets them
+ * be cached while they fit.
+ */
+
+static void run_image(os_uint32_t i, void *arg)
+{
+	struct batch *b = arg;
+	const char *image = b->images[i].path;
+	struct os_fs_metadata_t *fs = NULL;
+	struct os_journal_info_t jinfo;
+	const char *what = NULL;
+	size_t len = 0;
+	char *buf = NULL;
+	int fd, err = 0;
+	os_bool_t direct = !strcmp(b->op, "cat"), locked = FALSE;
+	FILE *out;
+
+	out = direct ? stdout : open_memstream(&buf, &len);
+	assert(out != NULL);
+
+	fd = img_open(image, b->flags);
+	if (fd == -1) {
+		err = errno;
+		what = "Could NOT open the image";
+	} else if ((fs = load_fs_metadata(fd)) == NULL) {
+		err = EINVAL;
+		what = "No ext2 filesystem";
+	} else if (!journal_attach(fd, &fs, &jinfo)) {
+		err = EINVAL;
+		what = jinfo.error;
+	} else if (!strcmp(b->op, "query")) {
+		if (b->names && !preload_metadata(fd, fs, tp_shared(), TRUE, NULL))
+			err = EIO;
+		if (err == 0)
+			err = run_query(b, fd, fs, out);
+	} else {
+		if (direct) {
+			pthread_mutex_lock(&b->out_lock);
+			printf("==> %s <==\n", image);
+			locked = TRUE;
+		}
+		err = oneshot_run(fd, fs, b->op, b->path, out);
+		what = b->path;
+	}
+
+	if (fd != -1) {
+		bcache_forget(fd);
+		free_fs_metadata(fs);
+		img_close(fd);
+	}
+	if (!direct)
+		fclose(out);
+
+	if (!locked) {
+		pthread_mutex_lock(&b->out_lock);
+		printf("==> %s <==\n", image);
+		if (!direct)
+			fwrite(buf, 1, len, stdout);
+	}
+	fflush(stdout);
+	if (err) {
+		fprintf(stderr, "%s: %s: %s\n", image, what ? what : b->op, strerror(err));
+		b->failed++;
+	}
+	pthread_mutex_unlock(&b->out_lock);
+	free(buf);
+}
+
+int batch(const char *manifest, char **cmd, int ncmd, int flags, size_t mem)
+{
+	struct batch b;
+	struct timespec t0, t1;
+	os_uint32_t i;
+	FILE *f;
+
+	memset(&b, 0, sizeof(b));
+	b.flags = flags;
+	b.op = cmd[0];
+	b.names = 1;
+	if (!strcmp(b.op, "query")) {
+		if (ncmd > 1 && !strcmp(cmd[1], "-n")) {
+			b.names = 0;
+			cmd++, ncmd--;
+		}
+		if (ncmd < 2 || !query_parse(&b.q, ncmd - 1, cmd + 1))
+			return(1);
+	} else if (oneshot_op(b.op) && ncmd == 2) {
+		b.path = cmd[1];
+	} else {
+		fprintf(stderr, "batch commands: ls|stat|cat <path>, query [-n] <pred>...\n");
+		return(1);
+	}
+
+	f = fopen(manifest, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Could NOT open manifest \"%s\"\n", manifest);
+		return(1);
+	}
+	read_manifest(&b, f);
+	fclose(f);
+	qsort(b.images, b.nimages, sizeof(struct image), by_size);
+
+	mg_set_limit(mem ? mem : BATCH_DEFAULT_MEM);
+	pthread_mutex_init(&b.out_lock, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	tp_parallel_for(tp_shared(), b.nimages, run_image, &b);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "%u images, %u failed (%d threads, %.1f s)\n", b.nimages, b.failed,
+		tp_size(tp_shared()), (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+	for (i = 0; i < b.nimages; i++)
+		free(b.images[i].path);
+	free(b.images);
+	return(b.failed != 0);
+}
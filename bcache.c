@@ -0,0 +1,264 @@
+/* =============
+ * metadata block cache
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/bcache.h"
+#include "inc/memgov.h"
+#include "inc/trace.h"
+
+#define SHARD_BUCKETS 4096
+
+struct bentry {
+	os_uint64_t key;             // fd << 32 | block number
+	struct bentry *hnext;        // hash chain
+	struct bentry *prev, *next;  // LRU list, most recent first
+	os_uint32_t len;
+	unsigned char data[];
+};
+
+struct shard {
+	pthread_mutex_t lock;
+	struct bentry *buckets[SHARD_BUCKETS];
+	struct bentry lru;           // sentinel
+	size_t bytes;
+};
+
+struct bcache {
+	const char *name;
+	const char *what;            // trace label of the blocks
+	struct shard shards[BCACHE_SHARDS];
+	struct os_memgov_cache_t *mg;
+	unsigned int hand;           // next shard to evict from
+};
+
+static struct bcache indirect = { "indirect", TRACE_INDIRECT };
+static struct bcache inodes = { "inodes", TRACE_INODES };
+static size_t budget = BCACHE_DEFAULT_BYTES;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static size_t evict(void *arg, size_t bytes);
+
+static void init_cache(struct bcache *c)
+{
+	int i;
+
+	for (i = 0; i < BCACHE_SHARDS; i++) {
+		pthread_mutex_init(&c->shards[i].lock, NULL);
+		c->shards[i].lru.prev = c->shards[i].lru.next = &c->shards[i].lru;
+	}
+	c->mg = mg_register(c->name, evict, c);
+}
+
+static void init_shards(void)
+{
+	init_cache(&indirect);
+	init_cache(&inodes);
+}
+
+static inline os_uint64_t hash_key(os_uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return(key);
+}
+
+static void lru_unlink(struct bentry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push(struct shard *s, struct bentry *e)
+{
+	e->next = s->lru.next;
+	e->prev = &s->lru;
+	s->lru.next->prev = e;
+	s->lru.next = e;
+}
+
+// returns the bytes freed
+static size_t remove_entry(struct shard *s, struct bentry *e)
+{
+	struct bentry **pp = &s->buckets[(hash_key(e->key) / BCACHE_SHARDS) % SHARD_BUCKETS];
+	size_t len = sizeof(struct bentry) + e->len;
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	lru_unlink(e);
+	s->bytes -= len;
+	free(e);
+	return(len);
+}
+
+// evicts from the cold end until the shard is within its share of the
+// cache's own budget, which only applies without a memory limit
+static size_t shrink(struct shard *s)
+{
+	size_t freed = 0;
+
+	while (mg_limit() == 0 && s->bytes > budget / BCACHE_SHARDS && s->lru.prev != &s->lru)
+		freed += remove_entry(s, s->lru.prev);
+	return(freed);
+}
+
+/* evict
+ *
+ * The memory governor's evict function: takes the coldest block of one
+ * shard after the other, which keeps the shards about even.
+ */
+
+static size_t evict(void *arg, size_t bytes)
+{
+	struct bcache *c = arg;
+	struct shard *s;
+	size_t freed = 0;
+	int empty = 0;
+
+	while (freed < bytes && empty < BCACHE_SHARDS) {
+		s = &c->shards[__atomic_fetch_add(&c->hand, 1, __ATOMIC_RELAXED) % BCACHE_SHARDS];
+		pthread_mutex_lock(&s->lock);
+		if (s->lru.prev != &s->lru) {
+			freed += remove_entry(s, s->lru.prev);
+			empty = 0;
+		} else {
+			empty++;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	mg_uncharge(c->mg, freed);
+	return(freed);
+}
+
+static void cache_read(struct bcache *c, int fd, struct os_fs_metadata_t *metadata,
+                       os_uint32_t blocknum, void *buffer)
+{
+	os_uint64_t key = (os_uint64_t)fd << 32 | blocknum, h = hash_key(key);
+	struct shard *s = &c->shards[h % BCACHE_SHARDS];
+	struct bentry **bucket = &s->buckets[(h / BCACHE_SHARDS) % SHARD_BUCKETS];
+	struct bentry *e, *dup;
+	os_uint64_t t0;
+	size_t freed;
+
+	pthread_mutex_lock(&s->lock);
+	for (e = *bucket; e; e = e->hnext) {
+		if (e->key == key && e->len == metadata->block_size) {
+			lru_unlink(e);
+			lru_push(s, e);
+			memcpy(buffer, e->data, e->len);
+			pthread_mutex_unlock(&s->lock);
+			mg_hit(c->mg);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	mg_miss(c->mg);
+	t0 = trace_begin();
+	read_block_as(fd, metadata, blocknum, buffer, c->what);
+	trace_end(t0, "bcache miss", TRACE_CACHE, "block", blocknum);
+	if (budget == 0 && mg_limit() == 0)
+		return;
+
+	e = malloc(sizeof(struct bentry) + metadata->block_size);
+	assert(e != NULL);
+	e->key = key;
+	e->len = metadata->block_size;
+	memcpy(e->data, buffer, e->len);
+
+	pthread_mutex_lock(&s->lock);
+	// another thread may have cached it meanwhile
+	for (dup = *bucket; dup; dup = dup->hnext) {
+		if (dup->key == key) {
+			pthread_mutex_unlock(&s->lock);
+			free(e);
+			return;
+		}
+	}
+	e->hnext = *bucket;
+	*bucket = e;
+	lru_push(s, e);
+	s->bytes += sizeof(struct bentry) + e->len;
+	freed = shrink(s);
+	pthread_mutex_unlock(&s->lock);
+
+	// may evict, so not under the shard lock
+	mg_charge(c->mg, sizeof(struct bentry) + metadata->block_size);
+	mg_uncharge(c->mg, freed);
+}
+
+void bcache_read(int fd, struct os_fs_metadata_t *metadata,
+                 os_uint32_t blocknum, void *buffer)
+{
+	pthread_once(&init_once, init_shards);
+	cache_read(&indirect, fd, metadata, blocknum, buffer);
+}
+
+void bcache_read_inodes(int fd, struct os_fs_metadata_t *metadata,
+                        os_uint32_t blocknum, void *buffer)
+{
+	pthread_once(&init_once, init_shards);
+	cache_read(&inodes, fd, metadata, blocknum, buffer);
+}
+
+static void forget(struct bcache *c, int fd)
+{
+	struct bentry *e, *prev;
+	size_t freed = 0;
+	int i;
+
+	for (i = 0; i < BCACHE_SHARDS; i++) {
+		pthread_mutex_lock(&c->shards[i].lock);
+		for (e = c->shards[i].lru.prev; e != &c->shards[i].lru; e = prev) {
+			prev = e->prev;
+			if ((int)(e->key >> 32) == fd)
+				freed += remove_entry(&c->shards[i], e);
+		}
+		pthread_mutex_unlock(&c->shards[i].lock);
+	}
+	mg_uncharge(c->mg, freed);
+}
+
+void bcache_forget(int fd)
+{
+	pthread_once(&init_once, init_shards);
+	forget(&indirect, fd);
+	forget(&inodes, fd);
+}
+
+static void set_limit(struct bcache *c)
+{
+	size_t freed = 0;
+	int i;
+
+	for (i = 0; i < BCACHE_SHARDS; i++) {
+		pthread_mutex_lock(&c->shards[i].lock);
+		freed += shrink(&c->shards[i]);
+		pthread_mutex_unlock(&c->shards[i].lock);
+	}
+	mg_uncharge(c->mg, freed);
+}
+
+void bcache_set_limit(size_t bytes)
+{
+	pthread_once(&init_once, init_shards);
+	budget = bytes;
+	set_limit(&indirect);
+	set_limit(&inodes);
+}
+
+void bcache_stats(os_uint64_t *h, os_uint64_t *m, size_t *bytes)
+{
+	pthread_once(&init_once, init_shards);
+	mg_stats(indirect.mg, h, m, bytes);
+}
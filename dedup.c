@@ -0,0 +1,467 @@
+/* =============
+ * duplicate block detector
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/dedup.h"
+#include "inc/revmap.h"
+#include "inc/threadpool.h"
+#include "inc/arena.h"
+#include "inc/trace.h"
+
+#define BUCKET_BITS 6   // candidates are counted per 1/64th of hash space
+
+struct entry {
+	os_uint64_t h1, h2;
+	os_uint32_t block;
+	os_uint32_t used;
+};
+
+struct scan {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	struct os_revmap_t *owners;
+	os_uint64_t *regular;   // bit per inode: is a regular file
+	int pass;
+	int failed;
+
+	// sketch: slot = top slot_bits of h1
+	os_uint64_t *seen, *twice;
+	int slot_bits;
+	os_uint64_t candidates[1 << BUCKET_BITS];
+	os_uint64_t data_blocks, zero_blocks;
+
+	// pass 2: one partition = top part_bits of h1
+	int part_bits;
+	os_uint32_t part;
+	struct entry *table;
+	os_uint64_t table_mask;
+};
+
+struct run {
+	os_uint32_t start, count;
+};
+
+struct chunk_arg {
+	struct scan *s;
+	struct run *runs;
+	os_uint32_t n, lo, hi;
+};
+
+static inline os_uint64_t rotl(os_uint64_t x, int r)
+{
+	return((x << r) | (x >> (64 - r)));
+}
+
+static inline os_uint64_t fmix(os_uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return(x);
+}
+
+/* hash_block
+ *
+ * 128-bit hash of a block, four independent 64-bit lanes so the
+ * multiplies overlap.  Also tells whether the block is all zeros, from
+ * the OR of every word, at no extra cost.
+ */
+
+static os_bool_t hash_block(const unsigned char *p, os_uint32_t len,
+                            os_uint64_t *h1, os_uint64_t *h2)
+{
+	const os_uint64_t k = 0x9E3779B97F4A7C15ULL;
+	os_uint64_t a = 1, b = 2, c = 3, d = 4, any = 0, w[4];
+	os_uint32_t i;
+
+	for (i = 0; i < len; i += 32) {
+		memcpy(w, p + i, 32);
+		any |= w[0] | w[1] | w[2] | w[3];
+		a = rotl((a ^ w[0]) * k, 31);
+		b = rotl((b ^ w[1]) * k, 29);
+		c = rotl((c ^ w[2]) * k, 27);
+		d = rotl((d ^ w[3]) * k, 25);
+	}
+	*h1 = fmix(a ^ rotl(b, 17) ^ rotl(c, 31) ^ rotl(d, 47));
+	*h2 = fmix(b ^ rotl(c, 13) ^ rotl(d, 29) ^ rotl(a, 41) ^ len);
+
+	return(any == 0);
+}
+
+static void visit(struct scan *s, os_uint32_t block, const unsigned char *data)
+{
+	os_uint64_t h1, h2, slot, bit, word, i;
+	struct entry *e;
+
+	if (hash_block(data, s->fs->block_size, &h1, &h2)) {
+		if (s->pass == 1)
+			__atomic_add_fetch(&s->zero_blocks, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (s->pass == 1)
+		__atomic_add_fetch(&s->data_blocks, 1, __ATOMIC_RELAXED);
+
+	slot = h1 >> (64 - s->slot_bits);
+	word = slot / 64;
+	bit = 1ULL << (slot % 64);
+
+	if (s->pass == 1) {
+		if (!(__atomic_fetch_or(&s->seen[word], bit, __ATOMIC_RELAXED) & bit))
+			return;
+		// the slot's first block becomes a candidate too
+		__atomic_add_fetch(&s->candidates[h1 >> (64 - BUCKET_BITS)],
+				   (__atomic_fetch_or(&s->twice[word], bit, __ATOMIC_RELAXED) & bit) ? 1 : 2,
+				   __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (!(s->twice[word] & bit) ||
+	    (s->part_bits && (h1 >> (64 - s->part_bits)) != s->part))
+		return;
+	for (i = fmix(h2) & s->table_mask; ; i = (i + 1) & s->table_mask) {
+		e = &s->table[i];
+		if (__atomic_exchange_n(&e->used, 1, __ATOMIC_ACQ_REL) == 0)
+			break;
+	}
+	e->h1 = h1;
+	e->h2 = h2;
+	e->block = block;
+}
+
+static void collect_run(const struct os_revmap_ext_t *ext, void *arg)
+{
+	struct chunk_arg *ca = arg;
+	os_uint32_t start, end;
+	struct run *last;
+
+	if (ext->logical == REVMAP_INDIRECT || ca->n == DEDUP_CHUNK ||
+	    !(ca->s->regular[ext->inode / 64] & (1ULL << (ext->inode % 64))))
+		return;
+	start = ext->start > ca->lo ? ext->start : ca->lo;
+	end = ext->start + ext->count - 1 < ca->hi ? ext->start + ext->count - 1 : ca->hi;
+
+	// cross-linked blocks are hashed once
+	last = ca->n ? &ca->runs[ca->n - 1] : NULL;
+	if (last && start < last->start + last->count)
+		start = last->start + last->count;
+	if (start > end)
+		return;
+
+	if (last && last->start + last->count == start) {
+		last->count += end - start + 1;
+	} else {
+		ca->runs[ca->n].start = start;
+		ca->runs[ca->n].count = end - start + 1;
+		ca->n++;
+	}
+}
+
+static void scan_chunk(os_uint32_t c, void *arg)
+{
+	struct scan *s = arg;
+	os_uint32_t bs = s->fs->block_size, r, b;
+	struct os_arena_mark_t mark = arena_mark(arena_scratch());
+	struct chunk_arg ca;
+	unsigned char *buf;
+	os_uint64_t t0;
+	size_t len;
+
+	ca.s = s;
+	ca.runs = arena_alloc(arena_scratch(), DEDUP_CHUNK * sizeof(struct run));
+	ca.n = 0;
+	ca.lo = c * DEDUP_CHUNK;
+	ca.hi = ca.lo + DEDUP_CHUNK - 1;
+	if (ca.hi >= s->fs->num_blocks)
+		ca.hi = s->fs->num_blocks - 1;
+	revmap_lookup(s->owners, ca.lo, ca.hi, collect_run, &ca);
+
+	buf = arena_alloc(arena_scratch(), (size_t)DEDUP_CHUNK * bs);
+	for (r = 0; r < ca.n && !s->failed; r++) {
+		len = (size_t)ca.runs[r].count * bs;
+		t0 = trace_begin();
+		if (img_pread(s->fd, buf, len, (os_uint64_t)ca.runs[r].start * bs) != (ssize_t)len) {
+			s->failed = 1;
+			break;
+		}
+		trace_end(t0, TRACE_DATA, TRACE_IO, "block", ca.runs[r].start);
+		for (b = 0; b < ca.runs[r].count; b++)
+			visit(s, ca.runs[r].start + b, buf + (size_t)b * bs);
+	}
+
+	arena_release(arena_scratch(), mark);
+}
+
+// directory blocks repeat a lot (empty ones especially) but cannot be shared
+static void find_regular(os_uint32_t g, void *arg)
+{
+	struct scan *s = arg;
+	struct os_fs_metadata_t *fs = s->fs;
+	size_t table_len = (size_t)fs->inodes_per_group * fs->inode_size;
+	struct os_arena_mark_t mark;
+	const unsigned char *table;
+	struct os_inode_t inode;
+	os_uint32_t i, ino, first_ino;
+
+	first_ino = fs->sb->s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_FIRST_INO : fs->sb->s_first_ino;
+	if (fs->bgdt[g].bg_free_inodes_count == fs->inodes_per_group)
+		return;
+
+	mark = arena_mark(arena_scratch());
+	table = group_inode_table(s->fd, fs, g,
+				  fs->inode_table ? NULL : arena_alloc(arena_scratch(), table_len));
+	if (table == NULL) {
+		s->failed = 1;
+		arena_release(arena_scratch(), mark);
+		return;
+	}
+	for (i = 0; i < fs->inodes_per_group; i++) {
+		ino = g * fs->inodes_per_group + i + 1;
+		if (ino > fs->sb->s_inodes_count)
+			break;
+		// reserved inodes (resize, journal, ...) are not files
+		if (ino < first_ino)
+			continue;
+		memcpy(&inode, table + (size_t)i * fs->inode_size, sizeof(inode));
+		if ((inode.i_mode & 0xF000) == EXT2_S_IFREG && inode.i_links_count && !inode.i_dtime)
+			__atomic_fetch_or(&s->regular[ino / 64], 1ULL << (ino % 64), __ATOMIC_RELAXED);
+	}
+	arena_release(arena_scratch(), mark);
+}
+
+static int entry_cmp(const void *x, const void *y)
+{
+	const struct entry *a = x, *b = y;
+
+	if (a->h1 != b->h1)
+		return(a->h1 < b->h1 ? -1 : 1);
+	if (a->h2 != b->h2)
+		return(a->h2 < b->h2 ? -1 : 1);
+	return(a->block < b->block ? -1 : a->block > b->block);
+}
+
+static int u32_cmp(const void *x, const void *y)
+{
+	os_uint32_t a = *(const os_uint32_t *)x, b = *(const os_uint32_t *)y;
+
+	return(a < b ? -1 : a > b);
+}
+
+// adds 'n' twins of 'inode' to the files kept in the report, which stay
+// sorted by dup_blocks
+static void add_file(struct os_dedup_report_t *r, os_uint32_t inode, os_uint64_t n)
+{
+	struct os_dedup_file_t f;
+	int i;
+
+	for (i = 0; i < r->nfiles && r->files[i].inode != inode; i++)
+		;
+	if (i < r->nfiles) {
+		n += r->files[i].dup_blocks;
+	} else if (r->nfiles < DEDUP_TOP) {
+		i = r->nfiles++;
+	} else if (n > r->files[DEDUP_TOP - 1].dup_blocks) {
+		i = DEDUP_TOP - 1;
+	} else {
+		return;
+	}
+	f.inode = inode;
+	f.dup_blocks = n;
+	for (; i > 0 && n > r->files[i - 1].dup_blocks; i--)
+		r->files[i] = r->files[i - 1];
+	r->files[i] = f;
+}
+
+static void first_owner(const struct os_revmap_ext_t *ext, void *arg)
+{
+	os_uint32_t *ino = arg;
+
+	if (*ino == 0 && ext->logical != REVMAP_INDIRECT)
+		*ino = ext->inode;
+}
+
+static os_uint64_t table_size(os_uint64_t candidates)
+{
+	os_uint64_t size;
+
+	for (size = 16; size < candidates * 2; size <<= 1)
+		;
+	return(size);
+}
+
+// largest table pass 2 needs when split into 2^part_bits partitions
+static os_uint64_t max_table(struct scan *s, int part_bits)
+{
+	os_uint64_t n, max = 0;
+	os_uint32_t p, b, per = 1U << (BUCKET_BITS - part_bits);
+
+	for (p = 0; p < (1U << part_bits); p++) {
+		for (n = 0, b = p * per; b < (p + 1) * per; b++)
+			n += s->candidates[b];
+		if (table_size(n) > max)
+			max = table_size(n);
+	}
+	return(max * sizeof(struct entry));
+}
+
+static void add_top(struct os_dedup_report_t *r, struct entry *set, os_uint32_t n)
+{
+	int i, j;
+
+	if (r->ntop == DEDUP_TOP && n <= r->top[DEDUP_TOP - 1].copies)
+		return;
+	if (r->ntop < DEDUP_TOP)
+		r->ntop++;
+	for (i = r->ntop - 1; i > 0 && n > r->top[i - 1].copies; i--)
+		r->top[i] = r->top[i - 1];
+	r->top[i].copies = n;
+	for (j = 0; j < DEDUP_SET_BLOCKS; j++)
+		r->top[i].blocks[j] = (os_uint32_t)j < n ? set[j].block : 0;
+}
+
+/* dedup_scan
+ *
+ * The memory goes first to the bit per inode that tells regular files
+ * apart and, when it takes at most a quarter of 'mem_limit', to a
+ * counter per inode of the blocks that have a twin; the sketch and the
+ * pass 2 table then share what is left.  Without the counters the twins
+ * of each partition are counted in place, in the table memory, and
+ * folded into the report's top files, so with several partitions a
+ * file whose twins span them may be ranked too low (report->files_exact
+ * is FALSE).
+ */
+
+os_bool_t dedup_scan(int fd, struct os_fs_metadata_t *metadata,
+                     struct os_revmap_t *owners, struct os_threadpool_t *tp,
+                     size_t mem_limit, struct os_dedup_report_t *report)
+{
+	struct scan s;
+	struct entry *ents;
+	os_uint32_t *counts = NULL, *twins, ino, nchunks;
+	os_uint64_t i, j, k, n, w, size, total = 0, sketch_bits;
+	size_t fixed, avail;
+
+	memset(report, 0, sizeof(*report));
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+	s.fs = metadata;
+	s.owners = owners;
+
+	for (i = 0; i < owners->n; i++)
+		if (owners->ext[i].logical != REVMAP_INDIRECT)
+			total += owners->ext[i].count;
+
+	fixed = (metadata->sb->s_inodes_count / 64 + 1) * sizeof(os_uint64_t);
+	s.regular = calloc(metadata->sb->s_inodes_count / 64 + 1, sizeof(os_uint64_t));
+	assert(s.regular != NULL);
+	if (((size_t)metadata->sb->s_inodes_count + 1) * sizeof(os_uint32_t) <= mem_limit / 4) {
+		counts = calloc((size_t)metadata->sb->s_inodes_count + 1, sizeof(os_uint32_t));
+		assert(counts != NULL);
+		fixed += ((size_t)metadata->sb->s_inodes_count + 1) * sizeof(os_uint32_t);
+	}
+	avail = mem_limit > fixed ? mem_limit - fixed : 0;
+	tp_parallel_for(tp, metadata->num_blockgroups, find_regular, &s);
+
+	// pass 1: the sketch gets half of the memory at 2 bits per slot,
+	// grown until ~8 slots per block keep false twins rare
+	for (s.slot_bits = 6; s.slot_bits < 40; s.slot_bits++) {
+		sketch_bits = 2ULL << (s.slot_bits + 1);   // at slot_bits + 1
+		if (sketch_bits / 8 > avail / 2 || (1ULL << s.slot_bits) >= total * 8)
+			break;
+	}
+	s.seen = calloc((1ULL << s.slot_bits) / 64 + 1, sizeof(os_uint64_t));
+	s.twice = calloc((1ULL << s.slot_bits) / 64 + 1, sizeof(os_uint64_t));
+	assert(s.seen != NULL && s.twice != NULL);
+
+	nchunks = (metadata->num_blocks + DEDUP_CHUNK - 1) / DEDUP_CHUNK;
+	s.pass = 1;
+	tp_parallel_for(tp, nchunks, scan_chunk, &s);
+	free(s.seen);
+	s.seen = NULL;
+	report->data_blocks = s.data_blocks + s.zero_blocks;
+	report->zero_blocks = s.zero_blocks;
+
+	// pass 2, as many times as the candidate table has to be split
+	for (s.part_bits = 0; s.part_bits < BUCKET_BITS &&
+	     max_table(&s, s.part_bits) > avail / 2; s.part_bits++)
+		;
+	report->partitions = 1U << s.part_bits;
+	report->files_exact = counts != NULL || report->partitions == 1;
+	s.pass = 2;
+
+	for (s.part = 0; s.part < report->partitions && !s.failed; s.part++) {
+		for (n = 0, k = s.part << (BUCKET_BITS - s.part_bits);
+		     k < (os_uint64_t)(s.part + 1) << (BUCKET_BITS - s.part_bits); k++)
+			n += s.candidates[k];
+		if (n == 0)
+			continue;
+
+		size = table_size(n);
+		s.table = calloc(size, sizeof(struct entry));
+		assert(s.table != NULL);
+		s.table_mask = size - 1;
+		tp_parallel_for(tp, nchunks, scan_chunk, &s);
+
+		// squeeze the used entries together and group equal hashes
+		ents = s.table;
+		for (i = j = 0; i < size; i++)
+			if (ents[i].used)
+				ents[j++] = ents[i];
+		qsort(ents, j, sizeof(struct entry), entry_cmp);
+
+		// the owners of the twins go to the front of the table, over
+		// entries already looked at: twin w is written at or before
+		// entry w, which is 24 bytes wide
+		twins = (os_uint32_t *)s.table;
+		for (i = w = 0; i < j; i = k) {
+			for (k = i + 1; k < j && ents[k].h1 == ents[i].h1 && ents[k].h2 == ents[i].h2; k++)
+				;
+			if (k - i < 2)
+				continue;
+			report->sets++;
+			report->dup_blocks += k - i;
+			report->reclaimable += k - i - 1;
+			add_top(report, ents + i, k - i);
+
+			for (n = i; n < k; n++) {
+				ino = 0;
+				revmap_lookup(owners, ents[n].block, ents[n].block, first_owner, &ino);
+				if (counts != NULL)
+					counts[ino]++;
+				else
+					twins[w++] = ino;
+			}
+		}
+
+		qsort(twins, w, sizeof(os_uint32_t), u32_cmp);
+		for (i = 0; i < w; i = k) {
+			for (k = i + 1; k < w && twins[k] == twins[i]; k++)
+				;
+			add_file(report, twins[i], k - i);
+		}
+		free(s.table);
+		s.table = NULL;
+	}
+	free(s.twice);
+	free(s.regular);
+
+	// files with the most blocks that have a twin somewhere
+	if (counts != NULL) {
+		for (ino = 0; ino <= metadata->sb->s_inodes_count; ino++)
+			if (counts[ino])
+				add_file(report, ino, counts[ino]);
+		free(counts);
+	}
+
+	return(!s.failed);
+}
@@ -0,0 +1,120 @@
+/* =============
+ * I/O elevator
+ * =============
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/arena.h"
+#include "inc/image.h"
+#include "inc/trace.h"
+#include "inc/elevator.h"
+
+static size_t gap = ELV_DEFAULT_GAP;
+static os_uint64_t requests, reads;
+
+void elv_set_gap(size_t bytes)
+{
+	gap = bytes;
+}
+
+size_t elv_gap(void)
+{
+	return(gap);
+}
+
+static int req_cmp(const void *a, const void *b)
+{
+	const struct os_io_req_t *x = *(struct os_io_req_t * const *)a;
+	const struct os_io_req_t *y = *(struct os_io_req_t * const *)b;
+
+	if (x->off != y->off)
+		return(x->off < y->off ? -1 : 1);
+	return(x->len < y->len ? -1 : x->len > y->len);
+}
+
+// the part of 'req' that a read of 'got' bytes at 'start' covered
+static ssize_t covered(const struct os_io_req_t *req, os_uint64_t start, ssize_t got)
+{
+	os_uint64_t skip = req->off - start;
+
+	if (got < 0)
+		return(-1);
+	if ((os_uint64_t)got <= skip)
+		return(0);
+	return((os_uint64_t)got - skip < req->len ? (ssize_t)(got - skip) : (ssize_t)req->len);
+}
+
+/* elv_submit
+ *
+ * Sorts pointers to the requests, not the requests, so that callers
+ * find their results where they put them.  Each merged read takes the
+ * requests that follow in offset order while the next one starts at
+ * most 'gap' bytes after the end of the run and the run stays within
+ * ELV_MAX_READ; a request bigger than that is read on its own.
+ */
+
+size_t elv_submit(int fd, struct os_io_req_t *reqs, size_t n, const char *what)
+{
+	struct os_arena_mark_t mark, run;
+	struct os_io_req_t **order;
+	os_uint64_t start, end, t0;
+	size_t i, j, k, failed = 0, issued = 0;
+	unsigned char *buf;
+	ssize_t got;
+
+	if (n == 0)
+		return(0);
+
+	mark = arena_mark(arena_scratch());
+	order = arena_alloc(arena_scratch(), n * sizeof(*order));
+	for (i = 0; i < n; i++)
+		order[i] = &reqs[i];
+	qsort(order, n, sizeof(*order), req_cmp);
+
+	for (i = 0; i < n; i = j) {
+		start = order[i]->off;
+		end = start + order[i]->len;
+		for (j = i + 1; j < n && order[j]->off <= end + gap; j++) {
+			if (order[j]->off + order[j]->len > end) {
+				if (order[j]->off + order[j]->len - start > ELV_MAX_READ)
+					break;
+				end = order[j]->off + order[j]->len;
+			}
+		}
+
+		t0 = trace_begin();
+		if (j == i + 1) {
+			order[i]->done = img_pread(fd, order[i]->buf, order[i]->len, start);
+		} else {
+			run = arena_mark(arena_scratch());
+			buf = arena_alloc(arena_scratch(), end - start);
+			got = img_pread(fd, buf, end - start, start);
+			for (k = i; k < j; k++) {
+				order[k]->done = covered(order[k], start, got);
+				if (order[k]->done > 0)
+					memcpy(order[k]->buf, buf + (order[k]->off - start), order[k]->done);
+			}
+			arena_release(arena_scratch(), run);
+		}
+		trace_end(t0, what, TRACE_IO, "requests", j - i);
+		issued++;
+
+		for (k = i; k < j; k++)
+			if (order[k]->done != (ssize_t)order[k]->len)
+				failed++;
+	}
+
+	arena_release(arena_scratch(), mark);
+	__atomic_add_fetch(&requests, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&reads, issued, __ATOMIC_RELAXED);
+	return(failed);
+}
+
+void elv_stats(os_uint64_t *nrequests, os_uint64_t *nreads)
+{
+	*nrequests = __atomic_load_n(&requests, __ATOMIC_RELAXED);
+	*nreads = __atomic_load_n(&reads, __ATOMIC_RELAXED);
+}
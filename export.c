@@ -0,0 +1,736 @@
+/* =============
+ * tar/cpio export
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/export.h"
+#include "inc/trace.h"
+
+#define BATCH_IOV	512
+#define BATCH_STAGE	(1 << 20)
+#define BATCH_BYTES	(8 << 20)
+#define ZERO_LEN	65536
+#define TAR_RECORD	10240
+#define WALK_BATCH	128		// entries of a directory whose inodes are read at once
+
+static const unsigned char zeros[ZERO_LEN];
+
+// One half of the double buffer: an iovec list whose entries point
+// either into the image mapping, into 'zeros', or into 'stage', which
+// holds headers and any data that had to be copied.
+struct batch {
+	struct iovec iov[BATCH_IOV];
+	int niov;
+	unsigned char *stage;
+	size_t staged;
+	size_t bytes;
+};
+
+struct stream {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	const unsigned char *map;
+	os_uint64_t map_len;
+	int out_fd;
+	int format;
+	os_uint64_t offset;
+	os_int64_t entries;
+
+	struct batch batch[2];
+	int cur;
+	int pending[2];
+	int finished;
+	int error;		// set by either thread, see failed()
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	char path[PATH_MAX];
+	unsigned char *block;
+
+	// regular files with more than one name: inode -> first path
+	struct link_seen *links;
+	os_uint32_t links_size, links_used;
+};
+
+struct link_seen {
+	os_uint32_t ino;
+	char *path;
+};
+
+struct ustar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+/* --- double-buffered output ------------------------------------------ */
+
+static int failed(struct stream *st)
+{
+	return(__atomic_load_n(&st->error, __ATOMIC_ACQUIRE));
+}
+
+static void fail(struct stream *st)
+{
+	__atomic_store_n(&st->error, 1, __ATOMIC_RELEASE);
+}
+
+static int write_batch(int out_fd, struct batch *b)
+{
+	struct iovec *iov = b->iov;
+	int n = b->niov;
+	ssize_t w;
+
+	while (n > 0) {
+		w = writev(out_fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return(-1);
+		}
+		while (n > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return(0);
+}
+
+static void *writer_main(void *arg)
+{
+	struct stream *st = arg;
+	int k = 0, ret;
+
+	for (;;) {
+		pthread_mutex_lock(&st->lock);
+		while (!st->pending[k] && !st->finished)
+			pthread_cond_wait(&st->cond, &st->lock);
+		if (!st->pending[k]) {
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		pthread_mutex_unlock(&st->lock);
+
+		ret = failed(st) ? 0 : write_batch(st->out_fd, &st->batch[k]);
+		if (ret)
+			fail(st);
+
+		pthread_mutex_lock(&st->lock);
+		st->pending[k] = 0;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		k ^= 1;
+	}
+
+	return(NULL);
+}
+
+// hands the current batch to the writer and waits for the other one
+static void flush_batch(struct stream *st)
+{
+	struct batch *b = &st->batch[st->cur];
+
+	if (b->niov == 0)
+		return;
+
+	pthread_mutex_lock(&st->lock);
+	st->pending[st->cur] = 1;
+	pthread_cond_broadcast(&st->cond);
+	st->cur ^= 1;
+	while (st->pending[st->cur])
+		pthread_cond_wait(&st->cond, &st->lock);
+	pthread_mutex_unlock(&st->lock);
+
+	b = &st->batch[st->cur];
+	b->niov = 0;
+	b->staged = 0;
+	b->bytes = 0;
+}
+
+static struct batch *make_room(struct stream *st, size_t stage_len)
+{
+	struct batch *b = &st->batch[st->cur];
+
+	if (b->niov == BATCH_IOV || b->bytes >= BATCH_BYTES ||
+	    b->staged + stage_len > BATCH_STAGE)
+		flush_batch(st);
+	return(&st->batch[st->cur]);
+}
+
+static void add_iov(struct stream *st, struct batch *b, const void *p, size_t len)
+{
+	struct iovec *last = b->niov ? &b->iov[b->niov-1] : NULL;
+
+	if (len == 0)
+		return;
+	if (last && (const char *)last->iov_base + last->iov_len == (const char *)p)
+		last->iov_len += len;
+	else {
+		b->iov[b->niov].iov_base = (void *)p;
+		b->iov[b->niov].iov_len = len;
+		b->niov++;
+	}
+	b->bytes += len;
+	st->offset += len;
+}
+
+static void emit_copy(struct stream *st, const void *p, size_t len)
+{
+	struct batch *b = make_room(st, len);
+
+	assert(len <= BATCH_STAGE);
+	memcpy(b->stage + b->staged, p, len);
+	add_iov(st, b, b->stage + b->staged, len);
+	b->staged += len;
+}
+
+static void emit_ref(struct stream *st, const void *p, size_t len)
+{
+	add_iov(st, make_room(st, 0), p, len);
+}
+
+static void emit_zeros(struct stream *st, os_uint64_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = len < ZERO_LEN ? len : ZERO_LEN;
+		emit_ref(st, zeros, n);
+		len -= n;
+	}
+}
+
+/* --- file bodies ----------------------------------------------------- */
+
+struct body_arg {
+	struct stream *st;
+	os_uint64_t size;
+};
+
+static int body_extent(os_uint32_t logical, os_uint32_t physical,
+		       os_uint32_t count, void *arg)
+{
+	struct body_arg *ba = arg;
+	struct stream *st = ba->st;
+	os_uint64_t bs = st->fs->block_size;
+	os_uint64_t off = logical * bs, len = count * bs, disk = physical * bs;
+	os_uint64_t page = sysconf(_SC_PAGESIZE), start, t0;
+	struct batch *b;
+	size_t n;
+
+	if (off + len > ba->size)
+		len = ba->size - off;
+
+	if (physical == 0) {
+		emit_zeros(st, len);
+	} else if (st->map != NULL) {
+		if (disk + len > st->map_len) {
+			fail(st);
+			return(1);
+		}
+		// start reading the pages in while the writer is busy with
+		// the previous batch
+		start = disk & ~(page - 1);
+		madvise((void *)(st->map + start), disk + len - start, MADV_WILLNEED);
+		emit_ref(st, st->map + disk, len);
+	} else {
+		while (len) {
+			n = len < BATCH_STAGE ? len : BATCH_STAGE;
+			b = make_room(st, n);
+			t0 = trace_begin();
+			if (img_pread(st->fd, b->stage + b->staged, n, disk) != (ssize_t)n) {
+				fail(st);
+				return(1);
+			}
+			trace_end(t0, TRACE_DATA, TRACE_IO, "block", disk / bs);
+			add_iov(st, b, b->stage + b->staged, n);
+			b->staged += n;
+			disk += n;
+			len -= n;
+		}
+	}
+
+	return(failed(st));
+}
+
+static void emit_body(struct stream *st, struct os_inode_t *inode, os_uint64_t size)
+{
+	struct body_arg ba = { st, size };
+
+	file_extents(inode, st->fd, st->fs, body_extent, &ba);
+}
+
+/* --- headers --------------------------------------------------------- */
+
+static void octal(char *field, int width, os_uint64_t v)
+{
+	char tmp[32];
+
+	snprintf(tmp, sizeof(tmp), "%0*llo", width - 1, (unsigned long long)v);
+	memcpy(field, tmp, width - 1);
+	field[width-1] = '\0';
+}
+
+static void pax_record(char *buf, size_t *len, const char *key, const char *value)
+{
+	size_t n = strlen(key) + strlen(value) + 3, digits = 1, total;
+
+	// the length prefix counts its own digits
+	for (total = n + 1; ; total = n + digits) {
+		char tmp[24];
+
+		digits = snprintf(tmp, sizeof(tmp), "%zu", total);
+		if (n + digits == total)
+			break;
+	}
+	*len += sprintf(buf + *len, "%zu %s=%s\n", total, key, value);
+}
+
+static void tar_finish_header(struct ustar_header *h)
+{
+	unsigned char *p = (unsigned char *)h;
+	unsigned int sum = 0;
+	size_t i;
+
+	memcpy(h->magic, "ustar", 6);
+	memcpy(h->version, "00", 2);
+	memset(h->chksum, ' ', sizeof(h->chksum));
+	for (i = 0; i < sizeof(*h); i++)
+		sum += p[i];
+	snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+}
+
+// fits 'path' into the name/prefix fields; returns FALSE if it does not fit
+static os_bool_t tar_set_name(struct ustar_header *h, const char *path)
+{
+	size_t len = strlen(path), i;
+
+	if (len <= sizeof(h->name)) {
+		memcpy(h->name, path, len);
+		return(TRUE);
+	}
+	for (i = len - 1; i > 0; i--) {
+		if (path[i] != '/')
+			continue;
+		if (len - i - 1 > sizeof(h->name) || len - i - 1 == 0)
+			return(FALSE);
+		if (i <= sizeof(h->prefix)) {
+			memcpy(h->prefix, path, i);
+			memcpy(h->name, path + i + 1, len - i - 1);
+			return(TRUE);
+		}
+	}
+	return(FALSE);
+}
+
+static void tar_entry(struct stream *st, struct os_inode_t *inode, char type,
+		      const char *link, os_uint64_t size, os_uint32_t uid,
+		      os_uint32_t gid, os_uint32_t major, os_uint32_t minor)
+{
+	struct ustar_header h, x;
+	char pax[2 * PATH_MAX + 256], value[32];
+	size_t pax_len = 0;
+
+	memset(&h, 0, sizeof(h));
+	if (!tar_set_name(&h, st->path)) {
+		pax_record(pax, &pax_len, "path", st->path);
+		strncpy(h.name, st->path, sizeof(h.name));
+	}
+	if (link != NULL) {
+		if (strlen(link) > sizeof(h.linkname))
+			pax_record(pax, &pax_len, "linkpath", link);
+		strncpy(h.linkname, link, sizeof(h.linkname));
+	}
+	if (size > 077777777777ULL) {
+		snprintf(value, sizeof(value), "%llu", (unsigned long long)size);
+		pax_record(pax, &pax_len, "size", value);
+	}
+	if (uid > 07777777) {
+		snprintf(value, sizeof(value), "%u", uid);
+		pax_record(pax, &pax_len, "uid", value);
+	}
+	if (gid > 07777777) {
+		snprintf(value, sizeof(value), "%u", gid);
+		pax_record(pax, &pax_len, "gid", value);
+	}
+
+	if (pax_len) {
+		memset(&x, 0, sizeof(x));
+		snprintf(x.name, sizeof(x.name), "PaxHeaders/%u", (unsigned)st->entries);
+		octal(x.mode, sizeof(x.mode), 0644);
+		octal(x.uid, sizeof(x.uid), 0);
+		octal(x.gid, sizeof(x.gid), 0);
+		octal(x.size, sizeof(x.size), pax_len);
+		octal(x.mtime, sizeof(x.mtime), inode->i_mtime);
+		x.typeflag = 'x';
+		tar_finish_header(&x);
+		emit_copy(st, &x, sizeof(x));
+		emit_copy(st, pax, pax_len);
+		emit_zeros(st, (512 - pax_len % 512) % 512);
+	}
+
+	octal(h.mode, sizeof(h.mode), inode->i_mode & 07777);
+	octal(h.uid, sizeof(h.uid), uid & 07777777);
+	octal(h.gid, sizeof(h.gid), gid & 07777777);
+	octal(h.size, sizeof(h.size), size > 077777777777ULL ? 0 : size);
+	octal(h.mtime, sizeof(h.mtime), inode->i_mtime);
+	octal(h.devmajor, sizeof(h.devmajor), major);
+	octal(h.devminor, sizeof(h.devminor), minor);
+	h.typeflag = type;
+	tar_finish_header(&h);
+	emit_copy(st, &h, sizeof(h));
+
+	if (type == '0') {
+		emit_body(st, inode, size);
+		emit_zeros(st, (512 - size % 512) % 512);
+	}
+}
+
+static void cpio_header(struct stream *st, const char *name, os_uint32_t ino,
+			os_uint32_t mode, os_uint32_t uid, os_uint32_t gid,
+			os_uint32_t nlink, os_uint32_t mtime, os_uint32_t size,
+			os_uint32_t major, os_uint32_t minor)
+{
+	char hdr[111];
+	size_t namesize = strlen(name) + 1;
+
+	snprintf(hdr, sizeof(hdr),
+		 "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+		 ino, mode, uid, gid, nlink, mtime, size, 0, 0, major, minor,
+		 (unsigned)namesize, 0);
+	emit_copy(st, hdr, 110);
+	emit_copy(st, name, namesize);
+	emit_zeros(st, (4 - (110 + namesize) % 4) % 4);
+}
+
+// 'again' marks a further name of a regular file already stored: as in
+// cpio itself, it shares the inode number and carries no data
+static void cpio_entry(struct stream *st, os_uint32_t ino, struct os_inode_t *inode,
+		       const char *link, os_uint64_t size, os_uint32_t uid,
+		       os_uint32_t gid, os_uint32_t major, os_uint32_t minor,
+		       os_bool_t again)
+{
+	os_uint32_t type = inode->i_mode & 0xF000;
+
+	if (size > 0xFFFFFFFFULL) {
+		fprintf(stderr, "export: %s is too big for cpio, skipped\n", st->path);
+		return;
+	}
+
+	if (again)
+		size = 0;
+	cpio_header(st, st->path, ino, inode->i_mode, uid, gid,
+		    inode->i_links_count, inode->i_mtime,
+		    link ? strlen(link) : (type == EXT2_S_IFREG ? size : 0),
+		    major, minor);
+	if (link) {
+		emit_copy(st, link, strlen(link));
+		emit_zeros(st, (4 - strlen(link) % 4) % 4);
+	} else if (type == EXT2_S_IFREG) {
+		emit_body(st, inode, size);
+		emit_zeros(st, (4 - size % 4) % 4);
+	}
+}
+
+/* --- hard links ------------------------------------------------------ */
+
+static struct link_seen *link_slot(struct stream *st, os_uint32_t ino)
+{
+	os_uint32_t i = (ino * 2654435761u) & (st->links_size - 1);
+
+	while (st->links[i].ino && st->links[i].ino != ino)
+		i = (i + 1) & (st->links_size - 1);
+	return(&st->links[i]);
+}
+
+/* link_first
+ *
+ * Returns the path under which regular file 'ino' was stored before,
+ * or NULL after remembering st->path for it, so that every further
+ * name becomes a link to the first rather than another copy of the
+ * data.  Only files with more than one name are looked up.
+ */
+
+static const char *link_first(struct stream *st, os_uint32_t ino)
+{
+	struct link_seen *old = st->links, *e;
+	os_uint32_t i, old_size = st->links_size;
+
+	if (2 * (st->links_used + 1) > st->links_size) {
+		st->links_size = st->links_size ? st->links_size * 2 : 256;
+		st->links = calloc(st->links_size, sizeof(struct link_seen));
+		assert(st->links != NULL);
+		for (i = 0; i < old_size; i++) {
+			if (old[i].ino == 0)
+				continue;
+			e = link_slot(st, old[i].ino);
+			*e = old[i];
+		}
+		free(old);
+	}
+
+	e = link_slot(st, ino);
+	if (e->ino)
+		return(e->path);
+	e->ino = ino;
+	e->path = strdup(st->path);
+	assert(e->path != NULL);
+	st->links_used++;
+	return(NULL);
+}
+
+/* --- tree walk ------------------------------------------------------- */
+
+struct walk_entry {
+	os_uint8_t name_len;
+	char name[EXT2_NAME_LEN];
+};
+
+static void export_dir(struct stream *st, struct os_inode_t *dir, size_t path_len);
+
+static void export_inode(struct stream *st, os_uint32_t ino, struct os_inode_t *inode_p,
+			 size_t path_len)
+{
+	struct os_inode_t inode = *inode_p;
+	os_uint32_t type, uid, gid, major = 0, minor = 0, dev;
+	os_uint64_t size;
+	char link[PATH_MAX];
+	const char *first = NULL;
+	os_bool_t is_link = FALSE;
+
+	type = inode.i_mode & 0xF000;
+	size = file_size(&inode);
+	uid = inode.i_uid | (os_uint32_t)inode.i_osd2.linux2.l_i_uid_high << 16;
+	gid = inode.i_gid | (os_uint32_t)inode.i_osd2.linux2.l_i_gid_high << 16;
+
+	if (type == EXT2_S_IFREG && inode.i_links_count > 1)
+		first = link_first(st, ino);
+
+	if (type == EXT2_S_IFLNK) {
+		if (size >= sizeof(link))
+			size = sizeof(link) - 1;
+		if (inode.i_blocks == 0 && size < sizeof(inode.i_block)) {
+			memcpy(link, inode.i_block, size);
+		} else {
+			file_blockread(inode, st->fd, st->fs, 0, st->block);
+			if (size > st->fs->block_size)
+				size = st->fs->block_size;
+			memcpy(link, st->block, size);
+		}
+		link[size] = '\0';
+		is_link = TRUE;
+	} else if (type == EXT2_S_IFCHR || type == EXT2_S_IFBLK) {
+		// old-style device numbers live in i_block[0], new-style in i_block[1]
+		if (inode.i_block[0]) {
+			major = (inode.i_block[0] >> 8) & 0xff;
+			minor = inode.i_block[0] & 0xff;
+		} else {
+			dev = inode.i_block[1];
+			major = (dev & 0xfff00) >> 8;
+			minor = (dev & 0xff) | ((dev >> 12) & 0xfff00);
+		}
+	}
+
+	if (st->format == EXPORT_CPIO) {
+		cpio_entry(st, ino, &inode, is_link ? link : NULL, size, uid, gid, major, minor,
+			   first != NULL);
+	} else {
+		switch (type) {
+		case EXT2_S_IFREG:
+			if (first != NULL)
+				tar_entry(st, &inode, '1', first, 0, uid, gid, 0, 0);
+			else
+				tar_entry(st, &inode, '0', NULL, size, uid, gid, 0, 0);
+			break;
+		case EXT2_S_IFDIR:
+			st->path[path_len] = '/';
+			st->path[path_len+1] = '\0';
+			tar_entry(st, &inode, '5', NULL, 0, uid, gid, 0, 0);
+			st->path[path_len] = '\0';
+			break;
+		case EXT2_S_IFLNK:
+			tar_entry(st, &inode, '2', link, 0, uid, gid, 0, 0);
+			break;
+		case EXT2_S_IFCHR:
+			tar_entry(st, &inode, '3', NULL, 0, uid, gid, major, minor);
+			break;
+		case EXT2_S_IFBLK:
+			tar_entry(st, &inode, '4', NULL, 0, uid, gid, major, minor);
+			break;
+		case EXT2_S_IFIFO:
+			tar_entry(st, &inode, '6', NULL, 0, uid, gid, 0, 0);
+			break;
+		default:
+			fprintf(stderr, "export: %s cannot be stored in tar, skipped\n", st->path);
+			return;
+		}
+	}
+	st->entries++;
+
+	if (type == EXT2_S_IFDIR && !failed(st))
+		export_dir(st, &inode, path_len);
+}
+
+// exports the first n entries of a directory below st->path[0..path_len)
+static void export_children(struct stream *st, struct walk_entry *ents, os_uint32_t *inos,
+			    struct os_inode_t *inodes, int n, size_t path_len)
+{
+	int i;
+
+	fetch_inodes(inos, n, st->fd, st->fs, inodes);
+	for (i = 0; i < n && !failed(st); i++) {
+		// not read: fetch_inodes() zeroed it
+		if (inodes[i].i_mode == 0)
+			continue;
+		if (path_len + 1 + ents[i].name_len + 2 > sizeof(st->path)) {
+			fprintf(stderr, "export: path too long below %.*s, skipped\n",
+				(int)path_len, st->path);
+			continue;
+		}
+		st->path[path_len] = '/';
+		memcpy(st->path + path_len + 1, ents[i].name, ents[i].name_len);
+		st->path[path_len + 1 + ents[i].name_len] = '\0';
+
+		export_inode(st, inos[i], &inodes[i], path_len + 1 + ents[i].name_len);
+		st->path[path_len] = '\0';
+	}
+}
+
+/* export_dir
+ *
+ * Exports the entries of a directory in directory order.  Their inodes
+ * are read WALK_BATCH entries at a time, in one batch sorted by disk
+ * position, rather than one by one; the batch stays on the scratch
+ * arena while its subdirectories are walked.
+ */
+
+static void export_dir(struct stream *st, struct os_inode_t *dir, size_t path_len)
+{
+	struct os_dirent_view_t v;
+	struct os_dir_iter_t it;
+	struct os_arena_mark_t mark;
+	struct walk_entry *ents;
+	struct os_inode_t *inodes;
+	os_uint32_t *inos;
+	int n = 0;
+
+	dir_iter_init(&it, dir, st->fd, st->fs, NULL);
+	mark = arena_mark(arena_scratch());
+	ents = arena_alloc(arena_scratch(), WALK_BATCH * sizeof(struct walk_entry));
+	inos = arena_alloc(arena_scratch(), WALK_BATCH * sizeof(os_uint32_t));
+	inodes = arena_alloc(arena_scratch(), WALK_BATCH * sizeof(struct os_inode_t));
+	while (!failed(st) && dir_iter_next(&it, &v)) {
+		if ((v.name_len == 1 && v.name[0] == '.') ||
+		    (v.name_len == 2 && v.name[0] == '.' && v.name[1] == '.'))
+			continue;
+		inos[n] = v.inode;
+		ents[n].name_len = v.name_len;
+		memcpy(ents[n].name, v.name, v.name_len);
+		if (++n == WALK_BATCH) {
+			export_children(st, ents, inos, inodes, n, path_len);
+			n = 0;
+		}
+	}
+	if (!failed(st))
+		export_children(st, ents, inos, inodes, n, path_len);
+	arena_release(arena_scratch(), mark);
+	dir_iter_end(&it);
+}
+
+os_int64_t export_tree(int fd, struct os_fs_metadata_t *metadata,
+                       os_uint32_t dir_inode, const char *root_name,
+                       int out_fd, int format)
+{
+	struct stream *st = calloc(1, sizeof(struct stream));
+	struct os_inode_t root;
+	void (*old_sigpipe)(int);
+	os_int64_t entries;
+	int k;
+
+	assert(st != NULL);
+	st->fd = fd;
+	st->fs = metadata;
+	st->out_fd = out_fd;
+	st->format = format;
+	st->map = img_map(fd, &st->map_len);
+	st->block = malloc(metadata->block_size);
+	assert(st->block != NULL);
+	for (k = 0; k < 2; k++) {
+		st->batch[k].stage = img_alloc(BATCH_STAGE);
+		assert(st->batch[k].stage != NULL);
+	}
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+
+	// a reader that goes away shows up as a write error, not a signal
+	old_sigpipe = signal(SIGPIPE, SIG_IGN);
+	assert(pthread_create(&st->writer, NULL, writer_main, st) == 0);
+
+	snprintf(st->path, sizeof(st->path), "%s", root_name);
+	if (fetch_inode(dir_inode, fd, metadata, &root))
+		export_inode(st, dir_inode, &root, strlen(st->path));
+
+	if (format == EXPORT_CPIO) {
+		cpio_header(st, "TRAILER!!!", 0, 0, 0, 0, 1, 0, 0, 0, 0);
+		emit_zeros(st, (512 - st->offset % 512) % 512);
+	} else {
+		emit_zeros(st, 1024);
+		emit_zeros(st, (TAR_RECORD - st->offset % TAR_RECORD) % TAR_RECORD);
+	}
+	flush_batch(st);
+
+	pthread_mutex_lock(&st->lock);
+	st->finished = 1;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+	pthread_join(st->writer, NULL);
+	signal(SIGPIPE, old_sigpipe);
+
+	entries = failed(st) ? -1 : st->entries;
+	for (k = 0; k < 2; k++)
+		free(st->batch[k].stage);
+	for (k = 0; k < (int)st->links_size; k++)
+		free(st->links[k].path);
+	free(st->links);
+	free(st->block);
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->cond);
+	free(st);
+
+	return(entries);
+}
@@ -0,0 +1,261 @@
+/* =============
+ * ext-shell --serve client and load generator
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "inc/types.h"
+#include "inc/serve.h"
+
+#define BENCH_MAX_SAMPLES (1 << 20)   // latencies kept per thread
+
+struct request {
+	struct os_serve_req_t rq;
+	char payload[2 * 4096];
+	os_uint32_t len;                  // of the payload
+};
+
+struct bench {
+	const char *sock;
+	struct request *req;
+	double seconds;
+	pthread_t thread;
+	os_uint64_t requests, errors, bytes;
+	double *lat;                      // milliseconds
+	os_uint32_t nlat;
+};
+
+static int connect_to(const char *sock)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sock, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Could NOT connect to \"%s\": %s\n", sock, strerror(errno));
+		exit(1);
+	}
+	return(fd);
+}
+
+static int io_all(int fd, void *buf, size_t len, int writing)
+{
+	unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = writing ? write(fd, p, len) : read(fd, p, len);
+		if (n <= 0)
+			return(-1);
+		p += n;
+		len -= n;
+	}
+	return(0);
+}
+
+/* roundtrip
+ *
+ * Sends one request and reads its response into *body (grown as
+ * needed).  Returns the status, or -1 if the connection broke.
+ */
+
+static int roundtrip(int fd, struct request *r, char **body, os_uint32_t *cap, os_uint32_t *len)
+{
+	os_uint32_t n = sizeof(r->rq) + r->len, status;
+
+	if (io_all(fd, &n, 4, 1) || io_all(fd, &r->rq, sizeof(r->rq), 1) ||
+	    io_all(fd, r->payload, r->len, 1))
+		return(-1);
+	if (io_all(fd, &n, 4, 0) || n < 4 || io_all(fd, &status, 4, 0))
+		return(-1);
+	*len = n - 4;
+	if (*len > *cap) {
+		*cap = *len;
+		*body = realloc(*body, *cap);
+		assert(*body != NULL);
+	}
+	if (io_all(fd, *body, *len, 0))
+		return(-1);
+	return(status);
+}
+
+static double now_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return(t.tv_sec * 1e3 + t.tv_nsec / 1e6);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench *b = arg;
+	int fd = connect_to(b->sock), status;
+	double start = now_ms(), t;
+	os_uint32_t cap = 0, len;
+	char *body = NULL;
+
+	while ((t = now_ms()) - start < b->seconds * 1e3) {
+		status = roundtrip(fd, b->req, &body, &cap, &len);
+		if (status < 0)
+			break;
+		if (status > 0)
+			b->errors++;
+		b->requests++;
+		b->bytes += len;
+		if (b->nlat < BENCH_MAX_SAMPLES)
+			b->lat[b->nlat++] = now_ms() - t;
+	}
+	close(fd);
+	free(body);
+	return(NULL);
+}
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+/* bench
+ *
+ * Runs 'conns' connections, each sending the request back to back for
+ * 'seconds', and reports the throughput and the latency percentiles.
+ */
+
+static int bench(const char *sock, struct request *req, int conns, double seconds)
+{
+	struct bench *b = calloc(conns, sizeof(struct bench));
+	os_uint64_t requests = 0, errors = 0, bytes = 0, n = 0;
+	double *all, start;
+	int i;
+
+	assert(b != NULL);
+	start = now_ms();
+	for (i = 0; i < conns; i++) {
+		b[i].sock = sock;
+		b[i].req = req;
+		b[i].seconds = seconds;
+		b[i].lat = malloc(BENCH_MAX_SAMPLES * sizeof(double));
+		assert(b[i].lat != NULL);
+		assert(pthread_create(&b[i].thread, NULL, bench_thread, &b[i]) == 0);
+	}
+	for (i = 0; i < conns; i++) {
+		pthread_join(b[i].thread, NULL);
+		requests += b[i].requests;
+		errors += b[i].errors;
+		bytes += b[i].bytes;
+		n += b[i].nlat;
+	}
+	seconds = (now_ms() - start) / 1e3;
+
+	all = malloc((n ? n : 1) * sizeof(double));
+	assert(all != NULL);
+	for (n = 0, i = 0; i < conns; i++) {
+		memcpy(all + n, b[i].lat, b[i].nlat * sizeof(double));
+		n += b[i].nlat;
+		free(b[i].lat);
+	}
+	qsort(all, n, sizeof(double), dbl_cmp);
+
+	printf("%d connections, %.1f s: %llu requests (%llu errors), %.0f req/s, %.1f MB/s\n",
+	       conns, seconds, requests, errors, requests / seconds, bytes / seconds / 1e6);
+	if (n)
+		printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+		       all[n / 2], all[n * 9 / 10], all[n * 99 / 100], all[n - 1]);
+	free(all);
+	free(b);
+	return(0);
+}
+
+static void usage(void)
+{
+	printf("usage:  ext-client <sock> [-i image] ls|stat <path>\n");
+	printf("        ext-client <sock> [-i image] cat <path> [offset [len]]\n");
+	printf("        ext-client <sock> [-i image] find <path> <pattern>\n");
+	printf("        ext-client <sock> [-i image] bench <conns> <seconds> <request...>\n");
+	exit(1);
+}
+
+// fills 'r' from "ls|stat|cat|find <args>"
+static void parse_request(struct request *r, int argc, char **argv)
+{
+	size_t plen;
+
+	if (argc < 2)
+		usage();
+	plen = strlen(argv[1]);
+	if (plen >= 4096)
+		usage();
+	memcpy(r->payload, argv[1], plen);
+	r->len = plen;
+
+	if (!strcmp(argv[0], "ls")) {
+		r->rq.op = SERVE_LS;
+	} else if (!strcmp(argv[0], "stat")) {
+		r->rq.op = SERVE_STAT;
+	} else if (!strcmp(argv[0], "cat")) {
+		r->rq.op = SERVE_READ;
+		r->rq.offset = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+		r->rq.len = argc > 3 ? strtoul(argv[3], NULL, 0) : SERVE_MAX_READ;
+	} else if (!strcmp(argv[0], "find") && argc > 2 && strlen(argv[2]) < 4096) {
+		r->rq.op = SERVE_FIND;
+		r->payload[r->len++] = '\0';
+		memcpy(r->payload + r->len, argv[2], strlen(argv[2]));
+		r->len += strlen(argv[2]);
+	} else {
+		usage();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct request req;
+	os_uint32_t cap = 0, len;
+	char *body = NULL;
+	int fd, status, a = 2;
+
+	memset(&req, 0, sizeof(req));
+	if (argc > 4 && !strcmp(argv[a], "-i")) {
+		req.rq.image = atoi(argv[a + 1]);
+		a += 2;
+	}
+	if (argc - a < 2)
+		usage();
+
+	if (!strcmp(argv[a], "bench")) {
+		if (argc - a < 5)
+			usage();
+		parse_request(&req, argc - a - 3, argv + a + 3);
+		return(bench(argv[1], &req, atoi(argv[a + 1]), atof(argv[a + 2])));
+	}
+
+	parse_request(&req, argc - a, argv + a);
+	fd = connect_to(argv[1]);
+	status = roundtrip(fd, &req, &body, &cap, &len);
+	close(fd);
+	if (status < 0) {
+		fprintf(stderr, "Connection lost\n");
+		return(1);
+	}
+	if (status > 0) {
+		fprintf(stderr, "%s: %s\n", argv[a + 1], strerror(status));
+		return(1);
+	}
+	fwrite(body, 1, len, stdout);
+	free(body);
+	return(0);
+}
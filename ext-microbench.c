@@ -0,0 +1,508 @@
+/* =============
+ * microbenchmarks of the parsing primitives
+ * =============
+ *
+ * Runs directory parsing, calculate_offsets, fetch_inode, bitmap
+ * scanning and name hashing on blocks built in memory, so nothing is
+ * read from a disk, and prints one JSON object with the cost of one
+ * operation of each.  Cycles, instructions, cache misses and branch
+ * misses come from perf_event_open(2) when the kernel allows it; the
+ * wall time is always there.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/htree.h"
+
+#define DIR_BLOCKS 64                 // directory of 256 KiB
+#define BLOCK_SIZE 4096
+#define NUM_INODES (1 << 16)          // 16 MiB of inode table, past the caches
+#define INODE_SIZE 256
+#define BITMAP_BLOCKS 16
+#define NUM_KEYS 4096                 // random inputs cycled through
+#define MIN_REP_NS 20000000ULL        // a repetition runs at least this long
+#define CHECK_ITERS 64                // iterations whose result is printed
+#define NUM_COUNTERS 4
+
+static const struct {
+	const char *name;
+	os_uint32_t config;
+} counters[NUM_COUNTERS] = {
+	{ "cycles", PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache_misses", PERF_COUNT_HW_CACHE_MISSES },
+	{ "branch_misses", PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int counter_fd[NUM_COUNTERS] = { -1, -1, -1, -1 };
+
+// the data the benchmarks work on
+static unsigned char *directory;      // DIR_BLOCKS blocks of entries
+static char **names;                  // names of its live entries
+static os_uint32_t num_names;
+static struct os_fs_metadata_t fs;
+static struct os_superblock_t sb;
+static unsigned char *bitmaps;        // BITMAP_BLOCKS block bitmaps
+static os_uint32_t keys[NUM_KEYS];
+
+// one repetition's result
+struct sample {
+	os_uint64_t ns;
+	os_uint64_t count[NUM_COUNTERS];
+	int valid[NUM_COUNTERS];
+};
+
+struct bench {
+	const char *name;
+	const char *op;               // what one iteration is
+	os_uint64_t (*run)(os_uint64_t iters);
+};
+
+static os_uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return((os_uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec);
+}
+
+static os_uint32_t xorshift(os_uint32_t *state)
+{
+	os_uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return(*state = x);
+}
+
+/* --- counters ------------------------------------------------------------ */
+
+/* counters_open
+ *
+ * Opens each hardware counter on its own, for this thread in user
+ * mode only, so that a machine that lacks one of them (a VM often has
+ * no cache-miss event) still reports the others.  Returns the number
+ * that could be opened; none at all with perf_event_paranoid too high
+ * or without a PMU.
+ */
+
+static int counters_open(void)
+{
+	struct perf_event_attr attr;
+	int i, n = 0;
+
+	for (i = 0; i < NUM_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = counters[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		counter_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counter_fd[i] != -1)
+			n++;
+	}
+	return(n);
+}
+
+static void counters_start(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_COUNTERS; i++) {
+		if (counter_fd[i] == -1)
+			continue;
+		ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+// reads the counters, scaled up if the kernel had to multiplex them
+static void counters_stop(struct sample *s)
+{
+	os_uint64_t v[3];
+	int i;
+
+	for (i = 0; i < NUM_COUNTERS; i++) {
+		s->valid[i] = 0;
+		if (counter_fd[i] == -1)
+			continue;
+		ioctl(counter_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter_fd[i], v, sizeof(v)) != sizeof(v) || v[2] == 0)
+			continue;
+		s->count[i] = v[2] < v[1] ? (os_uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+		s->valid[i] = 1;
+	}
+}
+
+/* --- test data ----------------------------------------------------------- */
+
+/* make_directory
+ *
+ * Fills DIR_BLOCKS blocks with entries the way a directory looks after
+ * a while: names of mixed lengths, every ninth entry deleted (inode
+ * 0), and the last entry of each block stretched to its end.
+ */
+
+static void make_directory(void)
+{
+	static const char *patterns[] = {
+		"%u", "file-%06u.dat", "libfoo.so.%u", "IMG_%u.JPG",
+		"a-rather-long-name-for-entry-number-%u.tar.gz",
+	};
+	struct os_direntry_t *e, *last;
+	os_uint32_t b, off, len, n = 0, cap = 0;
+	char name[EXT2_NAME_LEN + 1];
+
+	directory = calloc(DIR_BLOCKS, BLOCK_SIZE);
+	assert(directory != NULL);
+	for (b = 0; b < DIR_BLOCKS; b++) {
+		last = NULL;
+		for (off = 0; ; off += e->rec_len) {
+			snprintf(name, sizeof(name), patterns[n % 5], n);
+			len = (8 + strlen(name) + 3) & ~3U;
+			if (off + len > BLOCK_SIZE)
+				break;
+			e = (struct os_direntry_t *)(directory + b * BLOCK_SIZE + off);
+			e->inode = n % 9 == 8 ? 0 : n + 11;
+			e->rec_len = len;
+			e->name_len = strlen(name);
+			e->file_type = EXT2_FT_REG_FILE;
+			memcpy(e->file_name, name, e->name_len);
+			if (e->inode) {
+				if (num_names == cap) {
+					cap = cap ? cap * 2 : 1024;
+					names = realloc(names, cap * sizeof(char *));
+					assert(names != NULL);
+				}
+				names[num_names++] = strdup(name);
+			}
+			last = e;
+			n++;
+		}
+		last->rec_len += BLOCK_SIZE - off;
+	}
+}
+
+// just what fetch_inode() needs of a filesystem whose tables are cached
+static void make_inode_table(void)
+{
+	struct os_inode_t *inode;
+	os_uint32_t i;
+
+	sb.s_inodes_count = NUM_INODES;
+	fs.sb = &sb;
+	fs.block_size = BLOCK_SIZE;
+	fs.inodes_per_group = 8192;
+	fs.num_blockgroups = NUM_INODES / fs.inodes_per_group;
+	fs.inode_size = INODE_SIZE;
+	fs.inode_table = malloc((size_t)NUM_INODES * INODE_SIZE);
+	assert(fs.inode_table != NULL);
+	memset(fs.inode_table, 0, (size_t)NUM_INODES * INODE_SIZE);
+	for (i = 0; i < NUM_INODES; i++) {
+		inode = (struct os_inode_t *)(fs.inode_table + (size_t)i * INODE_SIZE);
+		inode->i_mode = EXT2_S_IFREG | 0644;
+		inode->i_size = i;
+		inode->i_links_count = 1;
+	}
+}
+
+// free runs of every length between used runs of every length
+static void make_bitmaps(void)
+{
+	os_uint32_t state = 12345, i = 0, run, nbits = BITMAP_BLOCKS * BLOCK_SIZE * 8;
+	int used = 1;
+
+	bitmaps = calloc(BITMAP_BLOCKS, BLOCK_SIZE);
+	assert(bitmaps != NULL);
+	while (i < nbits) {
+		run = xorshift(&state) % (used ? 2000 : 40) + 1;
+		for (; run > 0 && i < nbits; run--, i++)
+			if (used)
+				bitmaps[i / 8] |= 1 << (i % 8);
+		used = !used;
+	}
+}
+
+static void make_keys(void)
+{
+	os_uint32_t state = 2463534242U, i;
+
+	for (i = 0; i < NUM_KEYS; i++)
+		keys[i] = xorshift(&state);
+}
+
+/* --- benchmarks ---------------------------------------------------------- */
+
+static os_uint64_t run_dir_iter(os_uint64_t iters)
+{
+	struct os_dir_iter_t it;
+	struct os_dirent_view_t v;
+	os_uint64_t sum = 0;
+
+	while (iters--) {
+		dir_iter_buffer(&it, directory, DIR_BLOCKS * BLOCK_SIZE, NULL);
+		while (dir_iter_next(&it, &v))
+			sum += v.inode + v.name_len;
+		dir_iter_end(&it);
+	}
+	return(sum);
+}
+
+static os_uint64_t run_ls_dir(os_uint64_t iters)
+{
+	os_uint32_t n;
+	os_uint64_t sum = 0;
+	char **list;
+
+	while (iters--) {
+		ls_dir(directory, DIR_BLOCKS * BLOCK_SIZE, &list, &n);
+		sum += n + (unsigned char)list[n - 1][0];
+		free(list);
+	}
+	return(sum);
+}
+
+static os_uint64_t run_scan_dir(os_uint64_t iters)
+{
+	os_uint64_t sum = 0, i;
+
+	for (i = 0; i < iters; i++)
+		sum += scan_dir(directory, DIR_BLOCKS * BLOCK_SIZE,
+				names[keys[i % NUM_KEYS] % num_names]);
+	return(sum);
+}
+
+/* run_calculate_offsets
+ *
+ * Spreads the blocks over all four levels of the block map, a quarter
+ * each, so that the branches are as hard to predict as in a walk of
+ * files of every size.
+ */
+
+static os_uint64_t run_calculate_offsets(os_uint64_t iters)
+{
+	os_uint64_t p = BLOCK_SIZE / 4, sum = 0, i;
+	os_int32_t d, ind, dbl, tpl;
+	os_uint32_t blk, k;
+
+	for (i = 0; i < iters; i++) {
+		k = keys[i % NUM_KEYS];
+		switch (k % 4) {
+		case 0: blk = k % 12; break;
+		case 1: blk = 12 + k % p; break;
+		case 2: blk = 12 + p + k % (p * p); break;
+		default: blk = 12 + p + p * p + k % (0xFFFFFFFF - 12 - p - p * p);
+		}
+		calculate_offsets(blk, BLOCK_SIZE, &d, &ind, &dbl, &tpl);
+		sum += d + ind + dbl + tpl;
+	}
+	return(sum);
+}
+
+static os_uint64_t run_fetch_inode(os_uint64_t iters)
+{
+	struct os_inode_t inode;
+	os_uint64_t sum = 0, i;
+
+	for (i = 0; i < iters; i++) {
+		fetch_inode(keys[i % NUM_KEYS] % NUM_INODES + 1, -1, &fs, &inode);
+		sum += inode.i_size;
+	}
+	return(sum);
+}
+
+// counts the free runs of every bitmap, as put does to allocate blocks
+static os_uint64_t run_bitmap_find(os_uint64_t iters)
+{
+	os_uint32_t nbits = BLOCK_SIZE * 8, i, end;
+	const unsigned char *bits;
+	os_uint64_t sum = 0, n;
+
+	for (n = 0; n < iters; n++) {
+		bits = bitmaps + (n % BITMAP_BLOCKS) * BLOCK_SIZE;
+		for (i = bitmap_find(bits, 0, nbits, 0); i < nbits; i = bitmap_find(bits, end, nbits, 0)) {
+			end = bitmap_find(bits, i, nbits, 1);
+			sum += end - i;
+		}
+	}
+	return(sum);
+}
+
+static os_uint64_t run_dirhash(os_uint64_t iters, int version)
+{
+	static const os_uint32_t seed[4] = { 0x11111111, 0x22222222, 0x33333333, 0x44444444 };
+	os_uint64_t sum = 0, i;
+	const char *name;
+
+	for (i = 0; i < iters; i++) {
+		name = names[i % num_names];
+		sum += ext2_dirhash(name, strlen(name), version, seed);
+	}
+	return(sum);
+}
+
+static os_uint64_t run_dirhash_legacy(os_uint64_t iters)
+{
+	return(run_dirhash(iters, EXT2_HASH_LEGACY));
+}
+
+static os_uint64_t run_dirhash_half_md4(os_uint64_t iters)
+{
+	return(run_dirhash(iters, EXT2_HASH_HALF_MD4));
+}
+
+static os_uint64_t run_dirhash_tea(os_uint64_t iters)
+{
+	return(run_dirhash(iters, EXT2_HASH_TEA));
+}
+
+static struct bench benches[] = {
+	{ "dir_iter", "directory", run_dir_iter },
+	{ "ls_dir", "directory", run_ls_dir },
+	{ "scan_dir", "lookup", run_scan_dir },
+	{ "calculate_offsets", "call", run_calculate_offsets },
+	{ "fetch_inode", "call", run_fetch_inode },
+	{ "bitmap_find", "bitmap block", run_bitmap_find },
+	{ "dirhash_legacy", "name", run_dirhash_legacy },
+	{ "dirhash_half_md4", "name", run_dirhash_half_md4 },
+	{ "dirhash_tea", "name", run_dirhash_tea },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/* --- driver -------------------------------------------------------------- */
+
+static void measure(struct bench *b, os_uint64_t iters, struct sample *s)
+{
+	os_uint64_t t0;
+
+	counters_start();
+	t0 = now_ns();
+	b->run(iters);
+	s->ns = now_ns() - t0;
+	counters_stop(s);
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	const struct sample *x = a, *y = b;
+
+	return(x->ns < y->ns ? -1 : x->ns > y->ns);
+}
+
+/* bench_one
+ *
+ * Raises the iteration count until one repetition takes MIN_REP_NS,
+ * which also warms the caches up, then reports the median of 'reps'
+ * repetitions: its time and counters divided by the operations done.
+ */
+
+static void bench_one(struct bench *b, int reps, int first)
+{
+	struct sample *s = calloc(reps, sizeof(struct sample)), warm;
+	os_uint64_t iters = 1, check;
+	double per;
+	int r, i;
+
+	assert(s != NULL);
+	// the same fixed inputs whatever the timing, so a change between
+	// builds means a primitive's result changed
+	check = b->run(CHECK_ITERS);
+	for (;;) {
+		measure(b, iters, &warm);
+		if (warm.ns >= MIN_REP_NS || iters >= (1ULL << 40))
+			break;
+		iters *= warm.ns < MIN_REP_NS / 16 ? 8 : 2;
+	}
+	for (r = 0; r < reps; r++)
+		measure(b, iters, &s[r]);
+	qsort(s, reps, sizeof(struct sample), sample_cmp);
+
+	printf("%s    {\"name\": \"%s\", \"op\": \"%s\", \"iters\": %llu, \"reps\": %d,\n"
+	       "     \"ns_per_op\": %.3f", first ? "" : ",\n", b->name, b->op,
+	       (unsigned long long)iters, reps, (double)s[reps / 2].ns / iters);
+	for (i = 0; i < NUM_COUNTERS; i++) {
+		if (counter_fd[i] == -1)
+			continue;
+		per = (double)s[reps / 2].count[i] / iters;
+		if (s[reps / 2].valid[i])
+			printf(", \"%s_per_op\": %.3f", counters[i].name, per);
+		else
+			printf(", \"%s_per_op\": null", counters[i].name);
+	}
+	printf(",\n     \"check\": %llu}", (unsigned long long)(check % 1000000007ULL));
+	fflush(stdout);
+	free(s);
+}
+
+static void usage(void)
+{
+	size_t i;
+
+	printf("usage:  ext-microbench [-r reps] [name...]\n");
+	printf("  benchmarks:");
+	for (i = 0; i < NUM_BENCHES; i++)
+		printf(" %s", benches[i].name);
+	printf("\n");
+}
+
+static int selected(const char *name, char **only, int nonly)
+{
+	int i;
+
+	if (nonly == 0)
+		return(1);
+	for (i = 0; i < nonly; i++)
+		if (strstr(name, only[i]) != NULL)
+			return(1);
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	int reps = 7, opt, nperf, first = 1, i;
+	size_t b;
+
+	while ((opt = getopt(argc, argv, "r:h")) != -1) {
+		if (opt == 'r' && (reps = atoi(optarg)) > 0)
+			continue;
+		usage();
+		return(1);
+	}
+
+	make_directory();
+	make_inode_table();
+	make_bitmaps();
+	make_keys();
+	nperf = counters_open();
+
+	printf("{\n  \"counters\": \"%s\",\n  \"events\": [", nperf ? "perf" : "wall");
+	for (i = 0; i < NUM_COUNTERS; i++)
+		if (counter_fd[i] != -1)
+			printf("%s\"%s\"", first ? "" : ", ", counters[i].name), first = 0;
+	printf("],\n  \"compiler\": \"%s\",\n  \"benchmarks\": [\n", __VERSION__);
+
+	first = 1;
+	for (b = 0; b < NUM_BENCHES; b++) {
+		if (!selected(benches[b].name, argv + optind, argc - optind))
+			continue;
+		bench_one(&benches[b], reps, first);
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+	return(0);
+}
@@ -4,6 +4,7 @@
  * =============
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <assert.h>
 #include <fcntl.h>
@@ -13,67 +14,54 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "inc/types.h"
 #include "inc/superblock.h"
 #include "inc/blockgroup_descriptor.h"
 #include "inc/inode.h"
 #include "inc/directoryentry.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/diff.h"
+#include "inc/export.h"
+#include "inc/threadpool.h"
+#include "inc/inostore.h"
+#include "inc/arena.h"
+#include "inc/query.h"
+#include "inc/parentmap.h"
+#include "inc/revmap.h"
+#include "inc/frag.h"
+#include "inc/dedup.h"
+#include "inc/put.h"
+#include "inc/serve.h"
+#include "inc/bcache.h"
+#include "inc/trace.h"
+#include "inc/oneshot.h"
+#include "inc/batch.h"
+#include "inc/journal.h"
+#include "inc/memgov.h"
+#include "inc/elevator.h"
 
 #define DEBUG 0 
+#define CAT_CHUNK (1 << 20)       // bytes per read of cat
+#define LS_BATCH 256              // entries whose inodes ls reads at once
 
 #define debug(...) \
             do { if (DEBUG) printf("<debug> " __VA_ARGS__); } while (0)
 
 
-struct os_superblock_t *superblock;
-struct os_blockgroup_descriptor_t *blockgroup;
-struct os_inode_t *inodes;
+struct os_fs_metadata_t *fs;
 
-void read_superblock(int fd)
-{
-	superblock = malloc(sizeof(struct os_superblock_t));
-	assert(superblock != NULL);
-       
-	assert(lseek(fd, (off_t)1024, SEEK_SET) == (off_t)1024);
-	assert(read(fd, (void *)superblock, sizeof(struct os_superblock_t)) == sizeof(struct os_superblock_t));
-}
+// where the banner and the prompt go: stderr when the shell is driven by
+// a script, so that stdout only carries command output (e.g. export -).
+FILE *console;
 
-void read_blockgroup(int fd)
-{
-	blockgroup = malloc(sizeof(struct os_blockgroup_descriptor_t));
-	assert(blockgroup != NULL);
-       
-	assert(lseek(fd, (off_t)2048, SEEK_SET) == (off_t)2048);
-	assert(read(fd, (void *)blockgroup, sizeof(struct os_blockgroup_descriptor_t)) == sizeof(struct os_blockgroup_descriptor_t));
-}
-
-void read_inodeTable(int fd)
-{
-#if 0
-	int i;
-#endif
-	// preparing to cache inode table in inodes
-	inodes = (struct os_inode_t*)malloc(superblock->s_inodes_count*superblock->s_inode_size);
-	assert(inodes != NULL);
-
-	// seek to start of inode_table
-	assert(lseek(fd, (off_t)(blockgroup->bg_inode_table*1024), SEEK_SET) == (off_t)(blockgroup->bg_inode_table*1024));
-
-#if 0
-	// read-in every inode into cache
-	for(i=0; i<superblock->s_inodes_count;i++) {
-		printf("%lld\n", lseek(fd, (off_t)superblock->s_inode_size , SEEK_CUR));
-		assert(read(fd, (void *)&inodes[i], sizeof(struct os_inode_t)) == sizeof(struct os_inode_t));
-		//assert(lseek(fd, (off_t)superblock->s_inode_size , SEEK_CUR) == (off_t)superblock->s_inode_size);
-	}	
-#else
-
-	assert(read(fd, (void *)inodes, 0x40000) == 0x40000);
-
-#endif
-
-}
+// set by --write, which opens the image read-write for put
+int writable;
 
 void printInodeType(int inode_type)
 {
@@ -106,11 +94,8 @@ void printInodeType(int inode_type)
 	}
 }
 
-void printInodePerm(int fd, int inode_num)
+void printInodePerm(short int mode)
 {
-	//int curr_pos = lseek(fd, 0, SEEK_CUR);
-	short int mode = inodes[inode_num-1].i_mode;
-
 	mode & EXT2_S_IRUSR ? printf("r") : printf("-");
 	mode & EXT2_S_IWUSR ? printf("w") : printf("-");
 	mode & EXT2_S_IXUSR ? printf("x") : printf("-");
@@ -122,8 +107,6 @@ void printInodePerm(int fd, int inode_num)
 	mode & EXT2_S_IXOTH ? printf("x") : printf("-");
 
 	printf("\t");
-
-	//lseek(fd, curr_pos, SEEK_SET);
 }
 
 
@@ -138,108 +121,254 @@ void printInodePerm(int fd, int inode_num)
  * int			valid inode-num if found, else -1.
  */
 
+struct find_arg {
+	const char *name;
+	int len;
+	int filetype;
+	int found;
+};
+
+static int find_entry(struct os_direntry_t *entry, void *arg)
+{
+	struct find_arg *fa = arg;
+
+	if (entry->file_type != fa->filetype || entry->name_len != fa->len ||
+	    memcmp(entry->file_name, fa->name, fa->len))
+		return(0);
+	fa->found = entry->inode;
+	return(1);
+}
+
 int findInodeByName(int fd, int base_inode_num, char* filename, int filetype)
 {
-	char* name;
-	int curr_inode_num;
-	int curr_inode_type;
+	struct os_inode_t base_inode;
+	struct find_arg fa = { filename, strlen(filename), filetype, -1 };
 
-	debug("data block addr\t= 0x%x\n", inodes[base_inode_num-1].i_block[0]);
+	assert(fetch_inode(base_inode_num, fd, fs, &base_inode));
+	debug("data block addr\t= 0x%x\n", base_inode.i_block[0]);
 
-	struct os_direntry_t* dirEntry = malloc(sizeof(struct os_direntry_t));
-	assert (dirEntry != NULL);
-	assert(lseek(fd, (off_t)(inodes[base_inode_num-1].i_block[0]*1024), SEEK_SET) == (off_t)(inodes[base_inode_num-1].i_block[0]*1024));
-	assert(read(fd, (void *)dirEntry, sizeof(struct os_direntry_t)) == sizeof(struct os_direntry_t));
+	dir_foreach(&base_inode, fd, fs, find_entry, &fa);
+	return(fa.found);
+}
 
-	 while (dirEntry->inode) {
+/* block_is_zero
+ *
+ * Checks 'len' bytes of 'buf' for any non-zero byte. The bulk of the
+ * buffer is OR-ed together 64 bytes at a time in SSE2 registers, so
+ * the common all-zero case costs one pass with no branches per byte.
+ *
+ * Returns:
+ * int			1 if every byte is zero, else 0.
+ */
 
-		name = (char*)malloc(dirEntry->name_len+1);
-		memcpy(name, dirEntry->file_name, dirEntry->name_len);
-		name[dirEntry->name_len+1] = '\0';
+int block_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i = 0;
 
-		curr_inode_num = dirEntry->inode;
-		curr_inode_type = dirEntry->file_type;
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
 
-		if (filetype == curr_inode_type) {
-			if(!strcmp(name, filename)) {
-				return(curr_inode_num);
-			}
-		}
+	for (; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i + 48)));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+		return 0;
+#endif
+	for (; i < len; i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+/* saveBlocks
+ *
+ * Copies the part of a file mapped by block pointer 'blk' at indirection
+ * 'level' (0 = data block, 1..3 = single/double/triple indirect) to wfd.
+ * A zero pointer is a hole: the whole range it would map, including
+ * every block below an empty indirect block, is skipped with one lseek
+ * so the host file stays sparse. With 'zero_detect' set, data blocks that
+ * are allocated but hold only zeros are skipped the same way.
+ *
+ * Returns:
+ * os_uint64_t		bytes of the file still left to copy.
+ */
 
-		lseek(fd, (dirEntry->rec_len - sizeof(struct os_direntry_t)), SEEK_CUR);
-		assert(read(fd, (void *)dirEntry, sizeof(struct os_direntry_t)) == sizeof(struct os_direntry_t));
+os_uint64_t saveBlocks(int fd, int wfd, os_uint32_t blk, int level,
+		       os_uint64_t left, int zero_detect)
+{
+	os_uint64_t span = fs->block_size;
+	struct os_arena_mark_t mark;
+	os_uint32_t *ptrs;
+	int i, nptrs = fs->block_size / sizeof(os_uint32_t);
+
+	for (i = 0; i < level; i++)
+		span *= nptrs;
+	if (span > left)
+		span = left;
+
+	if (blk == 0) {
+		assert(lseek(wfd, (off_t)span, SEEK_CUR) != (off_t)-1);
+		return(left - span);
+	}
 
-	} 
+	mark = arena_mark(arena_scratch());
+	ptrs = arena_alloc(arena_scratch(), fs->block_size);
+	read_block_as(fd, fs, blk, ptrs, level ? TRACE_INDIRECT : TRACE_DATA);
+
+	if (level == 0) {
+		if (zero_detect && block_is_zero(ptrs, span))
+			assert(lseek(wfd, (off_t)span, SEEK_CUR) != (off_t)-1);
+		else
+			assert(write(wfd, ptrs, span) == (ssize_t)span);
+		left -= span;
+	} else if (block_is_zero(ptrs, fs->block_size)) {
+		assert(lseek(wfd, (off_t)span, SEEK_CUR) != (off_t)-1);
+		left -= span;
+	} else {
+		for (i = 0; i < nptrs && left; i++)
+			left = saveBlocks(fd, wfd, ptrs[i], level - 1, left, zero_detect);
+	}
 
-	return(-1);	
+	arena_release(arena_scratch(), mark);
+	return(left);
 }
 
-void saveInode(int fd, int inode_num, char* filename)
+/* saveInode
+ *
+ * Extracts the contents of inode 'inode_num' into host file 'filename'.
+ * Holes in the block map are preserved as holes in the host file; the
+ * final ftruncate sets the length when the file ends in a hole.
+ */
+
+void saveInode(int fd, int inode_num, char* filename, int zero_detect)
 {
-	int wfd = open(filename, O_RDWR | O_CREAT);
+	struct os_inode_t inode;
+	os_uint64_t size, left;
+	int i;
+
+	assert(fetch_inode(inode_num, fd, fs, &inode));
+	size = left = file_size(&inode);
+
+	int wfd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (wfd == -1) {
 		printf("Could NOT open file \"%s\"\n", filename);
+		return;
 	}
 
-	char* buffer = malloc(1024);
-	assert (buffer != NULL);
-	assert(lseek(fd, (off_t)(inodes[inode_num-1].i_block[0]*1024), SEEK_SET) == (off_t)(inodes[inode_num-1].i_block[0]*1024));
-	assert(read(fd, (void *)buffer, 1024) == 1024);
+	for (i = 0; i < 12 && left; i++)
+		left = saveBlocks(fd, wfd, inode.i_block[i], 0, left, zero_detect);
+	for (i = 0; i < 3 && left; i++)
+		left = saveBlocks(fd, wfd, inode.i_block[12+i], i+1, left, zero_detect);
 
-	write(wfd, buffer, inodes[inode_num-1].i_size);
+	assert(ftruncate(wfd, (off_t)size) == 0);
 	close(wfd);
-
 }
 
-void ls(int fd, int base_inode_num)
-{
-	char* name;
-	int curr_inode_num;
-	int curr_inode_type;
-
-	debug("data block addr\t= 0x%x\n", inodes[base_inode_num-1].i_block[0]);
+struct ls_entry {
+	os_uint32_t inode;
+	os_uint8_t file_type;
+	os_uint8_t name_len;
+	char name[EXT2_NAME_LEN];
+};
 
-	struct os_direntry_t* dirEntry = malloc(sizeof(struct os_direntry_t));
-	assert (dirEntry != NULL);
-	assert(lseek(fd, (off_t)(inodes[base_inode_num-1].i_block[0]*1024), SEEK_SET) == (off_t)(inodes[base_inode_num-1].i_block[0]*1024));
-	assert(read(fd, (void *)dirEntry, sizeof(struct os_direntry_t)) == sizeof(struct os_direntry_t));
-
-	 while (dirEntry->inode) {
+// prints the first n entries, whose inodes are in inos[]
+static void ls_flush(int fd, struct ls_entry *ents, os_uint32_t *inos,
+		     struct os_inode_t *inodes, int n)
+{
+	int i;
 
-		name = (char*)malloc(dirEntry->name_len+1);
-		memcpy(name, dirEntry->file_name, dirEntry->name_len);
-		name[dirEntry->name_len+1] = '\0';
+	if (fs->columns == NULL)
+		fetch_inodes(inos, n, fd, fs, inodes);
+	for (i = 0; i < n; i++) {
+		printInodeType(ents[i].file_type);
+		if (fs->columns == NULL)
+			printInodePerm(inodes[i].i_mode);
+		else if (inos[i] >= 1 && inos[i] <= fs->columns->count)
+			printInodePerm(fs->columns->mode[inos[i] - 1]);
+		else
+			printInodePerm(0);
+		printf("%d\t", ents[i].inode);
+		printf("%.*s\t", ents[i].name_len, ents[i].name);
+		printf("\n");
+	}
+}
 
-		curr_inode_num = dirEntry->inode;
-		curr_inode_type = dirEntry->file_type;
+/* ls
+ *
+ * ls [pattern]
+ *
+ * Lists the present directory, or only the entries whose names match
+ * the glob 'pattern' (e.g. *.log).  The entries are collected
+ * LS_BATCH at a time so that their inodes are read in one batch,
+ * in disk order, instead of one by one in directory order.
+ */
 
-		lseek(fd, (dirEntry->rec_len - sizeof(struct os_direntry_t)), SEEK_CUR);
-		assert(read(fd, (void *)dirEntry, sizeof(struct os_direntry_t)) == sizeof(struct os_direntry_t));
+void ls(int fd, int base_inode_num)
+{
+	struct os_inode_t base_inode, *inodes;
+	struct os_name_filter_t filter;
+	struct os_dir_iter_t it;
+	struct os_dirent_view_t e;
+	struct os_arena_mark_t mark;
+	struct ls_entry *ents;
+	os_uint32_t *inos;
+	char line[512], pattern[512];
+	int n = 0;
+
+	// the pattern is optional, so take whatever is left on the line
+	if (fgets(line, sizeof(line), stdin) == NULL || sscanf(line, "%511s", pattern) != 1)
+		pattern[0] = '\0';
+	if (pattern[0] && !name_filter_init(&filter, pattern)) {
+		printf("Pattern too long: %s\n", pattern);
+		return;
+	}
 
-		if (name[0] == '.') {
-			if ( name[1]=='.' || name[1]=='\0')
-				continue;
-		} else {
-			debug("rec_len\t\t= %d\n", dirEntry->rec_len);
-			debug("dirEntry->inode\t= %d\n",dirEntry->inode);
-			printInodeType(curr_inode_type);
-			printInodePerm(fd, curr_inode_num);
-			printf("%d\t", curr_inode_num);
-			printf("%s\t", name);
-			printf("\n");
+	assert(fetch_inode(base_inode_num, fd, fs, &base_inode));
+	debug("data block addr\t= 0x%x\n", base_inode.i_block[0]);
+
+	dir_iter_init(&it, &base_inode, fd, fs, pattern[0] ? &filter : NULL);
+	mark = arena_mark(arena_scratch());
+	ents = arena_alloc(arena_scratch(), LS_BATCH * sizeof(struct ls_entry));
+	inos = arena_alloc(arena_scratch(), LS_BATCH * sizeof(os_uint32_t));
+	inodes = arena_alloc(arena_scratch(), LS_BATCH * sizeof(struct os_inode_t));
+	while (dir_iter_next(&it, &e)) {
+		// names are not NUL-terminated on disk, so print them by length
+		if (e.name[0] == '.' && (e.name_len == 1 || (e.name_len == 2 && e.name[1] == '.')))
+			continue;
+
+		debug("rec_len\t\t= %d\n", e.entry->rec_len);
+		debug("dirEntry->inode\t= %d\n", e.inode);
+		ents[n].inode = inos[n] = e.inode;
+		ents[n].file_type = e.file_type;
+		ents[n].name_len = e.name_len;
+		memcpy(ents[n].name, e.name, e.name_len);
+		if (++n == LS_BATCH) {
+			ls_flush(fd, ents, inos, inodes, n);
+			n = 0;
 		}
-	} 
-
-	return;
+	}
+	ls_flush(fd, ents, inos, inodes, n);
+	arena_release(arena_scratch(), mark);
+	dir_iter_end(&it);
 }
 
 void cp(int fd, int base_inode_num)
 {
 	char filename[255];
 	int ret;
+	int zero_detect = 0;
 
 	//printf("Enter filename:");
-	scanf("%s", filename);
+	scanf("%254s", filename);
+	if (!strcmp(filename, "-z")) {
+		zero_detect = 1;
+		scanf("%254s", filename);
+	}
 
 	ret = findInodeByName(fd, base_inode_num, filename, EXT2_FT_REG_FILE);
 	debug("findInodeByName=%d\n", ret);
@@ -248,18 +377,76 @@ void cp(int fd, int base_inode_num)
 		printf("File %s does not exist\n", filename);
 	} else {
 		printf("Saving file %s\n", filename);
-		saveInode(fd, ret, filename);
+		saveInode(fd, ret, filename, zero_detect);
 	}
 
 }
 
+/* cat
+ *
+ * cat [-o <offset>] [-n <len>] <path>
+ *
+ * Writes 'len' bytes of file 'path' (default: up to its end), starting at
+ * byte 'offset' (default 0), to stdout.
+ */
+
+void cat(int fd, int base_inode_num)
+{
+	char line[4096], *tok, *path = NULL;
+	os_uint64_t off = 0, len = ~0ULL;
+	struct os_inode_t inode;
+	unsigned char *buf;
+	os_uint32_t ino;
+	ssize_t n;
+
+	if (fgets(line, sizeof(line), stdin) == NULL)
+		return;
+	for (tok = strtok(line, " \t\n"); tok; tok = strtok(NULL, " \t\n")) {
+		if (!strcmp(tok, "-o") && (tok = strtok(NULL, " \t\n")))
+			off = strtoull(tok, NULL, 0);
+		else if (!strcmp(tok, "-n") && (tok = strtok(NULL, " \t\n")))
+			len = strtoull(tok, NULL, 0);
+		else
+			path = tok;
+	}
+	if (path == NULL) {
+		printf("usage: cat [-o <offset>] [-n <len>] <path>\n");
+		return;
+	}
+
+	ino = path_lookup(path, base_inode_num, fd, fs);
+	if (ino == 0 || !fetch_inode(ino, fd, fs, &inode)) {
+		printf("File %s does not exist\n", path);
+		return;
+	}
+	if ((inode.i_mode & 0xF000) != EXT2_S_IFREG) {
+		printf("%s is not a regular file\n", path);
+		return;
+	}
+
+	buf = malloc(CAT_CHUNK);
+	assert(buf != NULL);
+	while (len > 0) {
+		n = file_pread(fd, fs, &inode, off, len < CAT_CHUNK ? len : CAT_CHUNK, buf);
+		if (n < 0)
+			printf("Could NOT read %s\n", path);
+		if (n <= 0)
+			break;
+		fwrite(buf, 1, n, stdout);
+		off += n;
+		len -= n;
+	}
+	fflush(stdout);
+	free(buf);
+}
+
 int cd(int fd, int base_inode_num)
 {
 	char dirname[255];
 	int ret;
 
 	//printf("Enter directory name:");
-	scanf("%s", dirname);
+	scanf("%254s", dirname);
 
 	ret = findInodeByName(fd, base_inode_num, dirname, EXT2_FT_DIR);
 	debug("findInodeByName=%d\n", ret);
@@ -274,13 +461,478 @@ int cd(int fd, int base_inode_num)
 
 }
 
+/* exportDir
+ *
+ * export [-c] <dir> <file|->
+ *
+ * Writes the subtree 'dir' as a tar (or with -c, cpio newc) stream to
+ * 'file', or to stdout for "-".
+ */
+
+void exportDir(int fd, int base_inode_num)
+{
+	char dirname[4096], outname[4096];
+	const char *root_name;
+	int format = EXPORT_TAR;
+	os_uint32_t ino;
+	os_int64_t entries;
+	int out_fd;
+
+	scanf("%4095s", dirname);
+	if (!strcmp(dirname, "-c")) {
+		format = EXPORT_CPIO;
+		scanf("%4095s", dirname);
+	}
+	scanf("%4095s", outname);
+
+	ino = path_lookup(dirname, base_inode_num, fd, fs);
+	if (ino == 0) {
+		printf("Directory %s does not exist\n", dirname);
+		return;
+	}
+
+	// name the entries after the last component of the exported path
+	root_name = strrchr(dirname, '/');
+	root_name = root_name && root_name[1] ? root_name + 1 : dirname;
+	if (!strcmp(root_name, "/") || !strcmp(root_name, ""))
+		root_name = ".";
+
+	if (!strcmp(outname, "-")) {
+		fflush(stdout);
+		out_fd = STDOUT_FILENO;
+	} else {
+		out_fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd == -1) {
+			printf("Could NOT open file \"%s\"\n", outname);
+			return;
+		}
+	}
+
+	entries = export_tree(fd, fs, ino, root_name, out_fd, format);
+	if (out_fd != STDOUT_FILENO)
+		close(out_fd);
+
+	if (entries < 0)
+		fprintf(stderr, "Export of %s failed: %s\n", dirname, strerror(errno));
+	else
+		fprintf(stderr, "Exported %lld entries from %s\n", (long long)entries, dirname);
+}
+
+static double ms_since(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return((t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6);
+}
+
+struct query_print {
+	int fd;
+	struct os_parentmap_t *parents;
+};
+
+static void printMatch(os_uint32_t ino, const struct os_inode_t *inode, void *arg)
+{
+	static const int types[16] = {
+		[EXT2_S_IFREG >> 12] = EXT2_FT_REG_FILE, [EXT2_S_IFDIR >> 12] = EXT2_FT_DIR,
+		[EXT2_S_IFCHR >> 12] = EXT2_FT_CHRDEV, [EXT2_S_IFBLK >> 12] = EXT2_FT_BLKDEV,
+		[EXT2_S_IFIFO >> 12] = EXT2_FT_FIFO, [EXT2_S_IFSOCK >> 12] = EXT2_FT_SOCK,
+		[EXT2_S_IFLNK >> 12] = EXT2_FT_SYMLINK,
+	};
+	struct query_print *qp = arg;
+	char path[4096];
+
+	printInodeType(types[inode->i_mode >> 12]);
+	printInodePerm(inode->i_mode);
+	printf("%u\t%llu\t", ino, file_size((struct os_inode_t *)inode));
+	if (qp->parents == NULL)
+		printf("\n");
+	else if (pmap_path(qp->parents, ino, path, sizeof(path)))
+		printf("%s\n", path);
+	else
+		printf("?\n");
+}
+
+/* query
+ *
+ * query [-n] <pred>...
+ *
+ * Lists every inode for which all predicates hold (see inc/query.h),
+ * with its path, or with -n without resolving paths.
+ */
+
+void query(int fd)
+{
+	char line[4096], *argv[QUERY_MAX_PREDS + 2], *tok;
+	struct os_query_t q;
+	struct query_print qp = { fd, NULL };
+	struct timespec t0;
+	os_int64_t matches;
+	int argc = 0, names = 1;
+
+	if (fgets(line, sizeof(line), stdin) == NULL)
+		return;
+	for (tok = strtok(line, " \t\n"); tok && argc < QUERY_MAX_PREDS + 1;
+	     tok = strtok(NULL, " \t\n"))
+		argv[argc++] = tok;
+	if (argc && !strcmp(argv[0], "-n")) {
+		names = 0;
+		memmove(argv, argv + 1, --argc * sizeof(char *));
+	}
+	if (!query_parse(&q, argc, argv))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (names && (qp.parents = pmap_get(fd, fs)) == NULL) {
+		printf("Could NOT read the directory tree\n");
+		return;
+	}
+	matches = query_run(fd, fs, &q, tp_shared(), printMatch, &qp);
+	if (matches < 0)
+		printf("Could NOT read the inode tables\n");
+	else
+		fprintf(stderr, "%lld matches (%.1f ms)\n", (long long)matches, ms_since(&t0));
+}
+
+struct owner_print {
+	os_uint32_t first, last;
+	struct os_parentmap_t *parents;
+};
+
+static void printOwner(const struct os_revmap_ext_t *ext, void *arg)
+{
+	struct owner_print *op = arg;
+	os_uint32_t first = ext->start > op->first ? ext->start : op->first;
+	os_uint32_t last = ext->start + ext->count - 1 < op->last ? ext->start + ext->count - 1 : op->last;
+	char path[4096];
+
+	if (first == last)
+		printf("%u\t", first);
+	else
+		printf("%u-%u\t", first, last);
+	printf("%u\t", ext->inode);
+	if (ext->logical == REVMAP_INDIRECT)
+		printf("indirect\t");
+	else
+		printf("data @%u\t", ext->logical + (first - ext->start));
+	if (op->parents && pmap_path(op->parents, ext->inode, path, sizeof(path)))
+		printf("%s\n", path);
+	else
+		printf("?\n");
+}
+
+/* owner
+ *
+ * owner <block>[-<last>]...
+ *
+ * Prints the inode owning each block (or every owner within a range),
+ * whether it holds file data (with the file block) or is an indirect
+ * block, and the file's path.
+ */
+
+void owner(int fd)
+{
+	char line[4096], *tok, *end;
+	struct owner_print op;
+	struct os_revmap_t *map;
+	struct timespec t0;
+	const char *role;
+	unsigned long first, last;
+
+	if (fgets(line, sizeof(line), stdin) == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((map = revmap_get(fd, fs)) == NULL || (op.parents = pmap_get(fd, fs)) == NULL) {
+		printf("Could NOT read the block maps\n");
+		return;
+	}
+	debug("reverse map: %llu extents, %.1f ms\n", map->n, ms_since(&t0));
+
+	for (tok = strtok(line, " \t\n"); tok; tok = strtok(NULL, " \t\n")) {
+		first = last = strtoul(tok, &end, 0);
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 0);
+		if (*end != '\0' || last < first || last >= fs->num_blocks) {
+			printf("Bad block or range: %s\n", tok);
+			continue;
+		}
+		op.first = first;
+		op.last = last;
+		if (revmap_lookup(map, first, last, printOwner, &op) == 0) {
+			role = first == last ? revmap_fs_block(fs, first) : NULL;
+			printf("%s\t-\t%s\n", tok, role ? role : "not in any file");
+		}
+	}
+}
+
+static int printExtent(os_uint32_t logical, os_uint32_t physical,
+                       os_uint32_t count, void *arg)
+{
+	if (physical)
+		printf("  %u-%u\t%u-%u\n", logical, logical + count - 1,
+		       physical, physical + count - 1);
+	return(0);
+}
+
+/* frag
+ *
+ * frag [path]
+ *
+ * For a file: its extents, their average length and the seek distance
+ * between them, with the extent list.  For a directory, or the whole
+ * filesystem without a path: totals over every file below it, a
+ * histogram of extents per file and the most fragmented files.
+ */
+
+void frag(int fd, int base_inode_num)
+{
+	char line[4096], path[4096];
+	struct os_frag_report_t r;
+	struct os_frag_file_t f;
+	struct os_parentmap_t *parents;
+	struct os_inode_t inode;
+	struct timespec t0;
+	os_uint32_t ino = EXT2_ROOT_INO;
+	int b, i;
+
+	if (fgets(line, sizeof(line), stdin) == NULL)
+		return;
+	if (sscanf(line, "%4095s", path) == 1) {
+		ino = path_lookup(path, base_inode_num, fd, fs);
+		if (ino == 0 || !fetch_inode(ino, fd, fs, &inode)) {
+			printf("File %s does not exist\n", path);
+			return;
+		}
+		if ((inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+			frag_file(&inode, ino, fd, fs, &f);
+			printf("extents\t\t%u\n", f.extents);
+			printf("blocks\t\t%llu\n", f.blocks);
+			printf("avg extent\t%.1f blocks\n", f.extents ? (double)f.blocks / f.extents : 0.0);
+			printf("seek distance\t%llu blocks\n", f.seek);
+			printf("file blocks\tdisk blocks\n");
+			file_extents(&inode, fd, fs, printExtent, NULL);
+			return;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((parents = pmap_get(fd, fs)) == NULL ||
+	    !frag_scan(fd, fs, tp_shared(), ino == EXT2_ROOT_INO ? 0 : ino, parents, &r)) {
+		printf("Could NOT read the block maps\n");
+		return;
+	}
+
+	printf("files\t\t%llu (%llu fragmented, %.1f%%)\n", r.files, r.fragmented,
+	       r.files ? 100.0 * r.fragmented / r.files : 0.0);
+	printf("extents\t\t%llu (%.2f per file)\n", r.extents,
+	       r.files ? (double)r.extents / r.files : 0.0);
+	printf("avg extent\t%.1f blocks\n", r.extents ? (double)r.blocks / r.extents : 0.0);
+	printf("seek distance\t%llu blocks\n", r.seek);
+	printf("extents/file\tfiles\n");
+	for (b = 0; b < FRAG_HIST; b++) {
+		if (r.hist[b] == 0)
+			continue;
+		if (b == 0)
+			printf("  1\t\t%llu\n", r.hist[b]);
+		else if (b == FRAG_HIST - 1)
+			printf("  >%u\t\t%llu\n", 1U << (b - 1), r.hist[b]);
+		else if (b == 1)
+			printf("  2\t\t%llu\n", r.hist[b]);
+		else
+			printf("  %u-%u\t\t%llu\n", (1U << (b - 1)) + 1, 1U << b, r.hist[b]);
+	}
+	if (r.nworst)
+		printf("extents\tavg\tseek\tpath\n");
+	for (i = 0; i < r.nworst; i++) {
+		if (!pmap_path(parents, r.worst[i].inode, path, sizeof(path)))
+			snprintf(path, sizeof(path), "<inode %u>", r.worst[i].inode);
+		printf("%u\t%.1f\t%llu\t%s\n", r.worst[i].extents,
+		       (double)r.worst[i].blocks / r.worst[i].extents, r.worst[i].seek, path);
+	}
+	fprintf(stderr, "frag: %.1f ms\n", ms_since(&t0));
+}
+
+static void printOwnerPath(os_uint32_t ino, struct os_parentmap_t *parents)
+{
+	char path[4096];
+
+	if (parents && pmap_path(parents, ino, path, sizeof(path)))
+		printf("%s\n", path);
+	else
+		printf("<inode %u>\n", ino);
+}
+
+static void firstDataOwner(const struct os_revmap_ext_t *ext, void *arg)
+{
+	os_uint32_t *ino = arg;
+
+	if (*ino == 0 && ext->logical != REVMAP_INDIRECT)
+		*ino = ext->inode;
+}
+
+/* dedup
+ *
+ * dedup [-m <MiB>]
+ *
+ * Looks for data blocks with identical contents anywhere on the disk
+ * and reports how much space sharing them would free, the biggest sets
+ * of identical blocks and the files holding the most of them.  -m caps
+ * the memory used for hashes (default 256 MiB); a smaller cap costs
+ * extra passes over the disk rather than failing.
+ */
+
+void dedup(int fd)
+{
+	char line[4096];
+	struct os_dedup_report_t r;
+	struct os_parentmap_t *parents;
+	struct os_revmap_t *map;
+	struct timespec t0;
+	size_t mem = DEDUP_DEFAULT_MEM;
+	unsigned long mib;
+	os_uint32_t ino;
+	int i, j, n;
+
+	if (fgets(line, sizeof(line), stdin) == NULL)
+		return;
+	if (sscanf(line, " -m %lu", &mib) == 1 && mib > 0)
+		mem = (size_t)mib << 20;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((map = revmap_get(fd, fs)) == NULL || (parents = pmap_get(fd, fs)) == NULL) {
+		printf("Could NOT read the block maps\n");
+		return;
+	}
+	if (!dedup_scan(fd, fs, map, tp_shared(), mem, &r)) {
+		printf("Could NOT read the data blocks\n");
+		return;
+	}
+
+	printf("data blocks\t%llu\n", r.data_blocks);
+	printf("zero blocks\t%llu (could be holes)\n", r.zero_blocks);
+	printf("duplicate sets\t%llu (%llu blocks)\n", r.sets, r.dup_blocks);
+	printf("reclaimable\t%llu blocks, %llu KiB (%.1f%%)\n", r.reclaimable,
+	       r.reclaimable * fs->block_size / 1024,
+	       r.data_blocks ? 100.0 * r.reclaimable / r.data_blocks : 0.0);
+	if (r.ntop)
+		printf("copies\tblock\tpath\n");
+	for (i = 0; i < r.ntop; i++) {
+		n = r.top[i].copies < DEDUP_SET_BLOCKS ? r.top[i].copies : DEDUP_SET_BLOCKS;
+		for (j = 0; j < n; j++) {
+			ino = 0;
+			revmap_lookup(map, r.top[i].blocks[j], r.top[i].blocks[j], firstDataOwner, &ino);
+			if (j == 0)
+				printf("%u", r.top[i].copies);
+			printf("\t%u\t", r.top[i].blocks[j]);
+			printOwnerPath(ino, parents);
+		}
+		if (r.top[i].copies > DEDUP_SET_BLOCKS)
+			printf("\t...\n");
+	}
+	if (r.nfiles)
+		printf("dup blocks\tpath%s\n", r.files_exact ? "" : " (at least, -m too small to count all)");
+	for (i = 0; i < r.nfiles; i++) {
+		printf("%llu\t\t", r.files[i].dup_blocks);
+		printOwnerPath(r.files[i].inode, parents);
+	}
+	fprintf(stderr, "dedup: %u pass(es) over the data, %.1f ms\n",
+		1 + r.partitions, ms_since(&t0));
+}
+
+/* put
+ *
+ * put [-r] <hostfile> <path>
+ *
+ * Copies a host file (or with -r, a directory tree) into the image as
+ * 'path', or into 'path' under its own name if that is a directory.
+ * Needs --write.
+ */
+
+void put(int fd, int base_inode_num)
+{
+	char host[4096], path[4096], *name, *slash;
+	struct os_put_report_t r;
+	struct os_inode_t inode;
+	struct timespec t0;
+	os_uint32_t dir, ino;
+	int recursive = 0;
+
+	scanf("%4095s", host);
+	if (!strcmp(host, "-r")) {
+		recursive = 1;
+		scanf("%4095s", host);
+	}
+	scanf("%4095s", path);
+
+	if (!writable) {
+		printf("The image is read-only (start ext-shell with --write)\n");
+		return;
+	}
+
+	// into an existing directory under the host name, else as 'path'
+	ino = path_lookup(path, base_inode_num, fd, fs);
+	if (ino && fetch_inode(ino, fd, fs, &inode) && (inode.i_mode & 0xF000) == EXT2_S_IFDIR) {
+		dir = ino;
+		while ((slash = strrchr(host, '/')) && slash != host && slash[1] == '\0')
+			*slash = '\0';
+		name = strrchr(host, '/') ? strrchr(host, '/') + 1 : host;
+	} else if (ino) {
+		printf("File %s already exists\n", path);
+		return;
+	} else {
+		slash = strrchr(path, '/');
+		name = slash ? slash + 1 : path;
+		if (slash == path)
+			dir = EXT2_ROOT_INO;
+		else if (slash) {
+			*slash = '\0';
+			dir = path_lookup(path, base_inode_num, fd, fs);
+		} else
+			dir = base_inode_num;
+		if (dir == 0 || *name == '\0') {
+			printf("Directory of %s does not exist\n", path);
+			return;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (!put_tree(fd, fs, host, dir, name, recursive, &r)) {
+		printf("Could NOT put %s: %s\n", host, r.error);
+		return;
+	}
+
+	// everything derived from the old tree is stale now
+	bcache_forget(fd);
+	pmap_free(fs->parents);
+	fs->parents = NULL;
+	revmap_free(fs->owners);
+	fs->owners = NULL;
+	if (fs->columns) {
+		inostore_free(fs->columns);
+		fs->columns = inostore_build(fd, fs, tp_shared());
+		assert(fs->columns != NULL);
+	}
+
+	fprintf(stderr, "put %u files, %u dirs, %u symlinks", r.files, r.dirs, r.symlinks);
+	if (r.skipped)
+		fprintf(stderr, " (%u special files skipped)", r.skipped);
+	fprintf(stderr, ": %llu bytes in %llu blocks from %u free run(s), "
+		"%u metadata updates in %u writes, %.1f ms\n",
+		r.bytes, r.blocks, r.runs, r.records, r.writes, ms_since(&t0));
+}
+
 int extShell(int fd )
 {
-	char cmd[4];
+	char cmd[16];
 	static int pwd_inode = 2;
+	os_uint64_t t0;
 
-	printf("ext-shell$ ");
-	scanf("%s", cmd);
+	fprintf(console, "ext-shell$ ");
+	fflush(console);
+	if (scanf("%15s", cmd) != 1)
+		return(-1);
+	t0 = trace_begin();
 
 	debug("cmd=%s\n", cmd);
 
@@ -296,41 +948,187 @@ int extShell(int fd )
 	} else if(!strcmp(cmd, "cp")) {
 		cp(fd, pwd_inode);
 
+	} else if(!strcmp(cmd, "cat")) {
+		cat(fd, pwd_inode);
+
+	} else if(!strcmp(cmd, "export")) {
+		exportDir(fd, pwd_inode);
+
+	} else if(!strcmp(cmd, "query")) {
+		query(fd);
+
+	} else if(!strcmp(cmd, "owner")) {
+		owner(fd);
+
+	} else if(!strcmp(cmd, "frag")) {
+		frag(fd, pwd_inode);
+
+	} else if(!strcmp(cmd, "dedup")) {
+		dedup(fd);
+
+	} else if(!strcmp(cmd, "put")) {
+		put(fd, pwd_inode);
+
+	} else if(!strcmp(cmd, "stats")) {
+		os_uint64_t requests, reads;
+
+		mg_report(stdout);
+		elv_stats(&requests, &reads);
+		printf("elevator: %llu requests in %llu reads, gap %zu KiB\n",
+		       requests, reads, elv_gap() >> 10);
+
 	} else {
 		printf("Unknown command: %s\n", cmd);
 		return(-EINVAL);
 	}
 
+	trace_end(t0, cmd, TRACE_CMD, NULL, 0);
 	return(0);
 }
 
 int main(int argc, char **argv)
 {
+	int columnar = 0, preload = 0, direct = 0, journal = 0;
+	struct os_journal_info_t jinfo;
+	size_t mem_limit = 0;
+	os_uint32_t bad_groups;
+	struct timespec start, t0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (argc >= 4 && !strcmp(argv[1], "--diff")) {
+		int compare_data = argc == 5 && !strcmp(argv[4], "--data");
+
+		return(diff_images(argv[2], argv[3], compare_data));
+	}
+
+	while (argc > 2 && !strncmp(argv[1], "--", 2)) {
+		if (!strcmp(argv[1], "--columnar")) {
+			columnar = 1;
+		} else if (!strcmp(argv[1], "--preload")) {
+			preload = 1;
+		} else if (!strcmp(argv[1], "--write")) {
+			writable = 1;
+		} else if (!strcmp(argv[1], "--direct")) {
+			direct = O_DIRECT;
+		} else if (!strcmp(argv[1], "--journal")) {
+			journal = 1;
+			journal_use_overlay(TRUE);
+		} else if (!strcmp(argv[1], "--threads") && argc > 3) {
+			tp_set_threads(atoi(argv[2]));
+			argc--, argv++;
+		} else if (!strcmp(argv[1], "--mem-limit") && argc > 3) {
+			mem_limit = (size_t)atoi(argv[2]) << 20;
+			mg_set_limit(mem_limit);
+			argc--, argv++;
+		} else if (!strcmp(argv[1], "--io-gap") && argc > 3) {
+			elv_set_gap((size_t)atoi(argv[2]) << 10);
+			argc--, argv++;
+		} else if (!strcmp(argv[1], "--trace") && argc > 3) {
+			if (!trace_start(argv[2])) {
+				printf("Could NOT create trace file \"%s\"\n", argv[2]);
+				return -1;
+			}
+			argc--, argv++;
+		} else {
+			break;
+		}
+		argc--, argv++;
+	}
+
+	if (writable && direct) {
+		printf("--direct only works for reading\n");
+		return -1;
+	}
+	if (writable && journal) {
+		printf("--journal only works for reading\n");
+		return -1;
+	}
+
+	if (argc >= 4 && !strcmp(argv[1], "--serve"))
+		return(serve(argv[2], argv + 3, argc - 3, O_RDONLY | direct));
+
+	if (argc >= 4 && !strcmp(argv[1], "--batch"))
+		return(batch(argv[2], argv + 3, argc - 3, O_RDONLY | direct, mem_limit));
+
+	if (argc == 4 && oneshot_op(argv[2]))
+		return(oneshot(argv[1], O_RDONLY | direct, argv[2], argv[3]));
+
 	// open up the disk file
 	if (argc !=2) {
-	printf("usage:  ext-shell <file.img>\n");
+	printf("usage:  ext-shell [--columnar] [--preload] [--threads N] [--write|--direct]\n");
+	printf("                  [--journal] [--mem-limit MiB] [--io-gap KiB] [--trace <out.json>]\n");
+	printf("                  <file.img>\n");
+	printf("        ext-shell [--direct] [--journal] <file.img> ls|cat|stat <path>\n");
+	printf("        ext-shell --diff <a.img> <b.img> [--data]\n");
+	printf("        ext-shell [--threads N] [--direct] [--journal] [--mem-limit MiB] [--trace <out.json>]\n");
+	printf("                  --serve <sock> <file.img>...\n");
+	printf("        ext-shell [--threads N] [--direct] [--journal] [--mem-limit MiB] --batch <manifest> <command...>\n");
 		return -1; 
 	}
 
-	int fd = open(argv[1], O_RDONLY|O_SYNC);
+	int fd = img_open(argv[1], writable ? O_RDWR : O_RDONLY|O_SYNC|direct);
 	if (fd == -1) {
-		printf("Could NOT open file \"%s\"\n", argv[1]);
+		printf("Could NOT open file \"%s\"%s\n", argv[1],
+		       direct && errno == EINVAL ? " (no O_DIRECT support)" : "");
 		return -1; 
 	}
+	if (writable && img_is_compressed(fd)) {
+		printf("Compressed images cannot be written\n");
+		return -1;
+	}
 
-	// reading superblock
-	read_superblock(fd);
-	printf("block size \t\t= %d bytes\n", 1<<(10 + superblock->s_log_block_size));
-	printf("inode count \t\t= 0x%x\n", superblock->s_inodes_count);
-	printf("inode size \t\t= 0x%x\n", superblock->s_inode_size);
-
-	// reading blockgroup
-	read_blockgroup(fd);
-	printf("inode table address \t= 0x%x\n", blockgroup->bg_inode_table);
-	printf("inode table size \t= %dKB\n", (superblock->s_inodes_count*superblock->s_inode_size)>>10);
+	// reading superblock and blockgroup descriptors
+	fs = load_fs_metadata(fd);
+	if (fs == NULL) {
+		printf("No ext2 filesystem in \"%s\"\n", argv[1]);
+		return -1;
+	}
+	if (!journal_attach(fd, &fs, &jinfo)) {
+		printf("Could NOT read the journal of \"%s\": %s\n", argv[1], jinfo.error);
+		return -1;
+	}
+	console = isatty(STDIN_FILENO) ? stdout : stderr;
+	if (jinfo.transactions)
+		fprintf(console, "journal \t\t= %u transactions, %u blocks\n",
+			jinfo.transactions, jinfo.blocks);
+	fprintf(console, "block size \t\t= %d bytes\n", fs->block_size);
+	fprintf(console, "inode count \t\t= 0x%x\n", fs->sb->s_inodes_count);
+	fprintf(console, "inode size \t\t= 0x%x\n", fs->inode_size);
+	fprintf(console, "block groups \t\t= %d\n", fs->num_blockgroups);
+	fprintf(console, "inode table address \t= 0x%x\n", fs->bgdt[0].bg_inode_table);
+	fprintf(console, "inode table size \t= %lluKB\n",
+		((unsigned long long)fs->sb->s_inodes_count*fs->inode_size)>>10);
+
+	// bitmaps and inode tables of all groups at once, in parallel
+	if (preload) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (!preload_metadata(fd, fs, tp_shared(), !columnar, &bad_groups)) {
+			printf("Could NOT read the metadata of \"%s\"\n", argv[1]);
+			return -1;
+		}
+		fprintf(console, "preloaded metadata \t= %d threads, %.1f ms\n",
+			tp_size(tp_shared()), ms_since(&t0));
+		if (bad_groups)
+			fprintf(console, "bad blockgroups \t= %u\n", bad_groups);
+		if (!columnar && fs->inode_table == NULL)
+			fprintf(console, "inode tables \t\t= not cached (over --mem-limit)\n");
+	}
 
-	// reading inode table
-	read_inodeTable(fd);
+	// reading inode table, or just its hot columns
+	if (columnar) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		fs->columns = inostore_build(fd, fs, tp_shared());
+		assert(fs->columns != NULL);
+		fprintf(console, "inode columns \t\t= %lluKB (%d threads, %.1f ms)\n",
+			(unsigned long long)inostore_bytes(fs->columns)>>10, tp_size(tp_shared()),
+			ms_since(&t0));
+	} else if (!preload) {
+		assert(read_inode_tables(fd, fs));
+		if (fs->inode_table == NULL)
+			fprintf(console, "inode tables \t\t= not cached (over --mem-limit)\n");
+	}
+	fprintf(console, "time to prompt \t\t= %.1f ms\n", ms_since(&start));
 
 	while(1) {
 		// extShell waits for one cmd and executes it.
@@ -341,6 +1139,8 @@ int main(int argc, char **argv)
 			break;
 	}
 
-	printf("\n\nQuitting ext-shell.\n\n");
+	bcache_forget(fd);
+	img_close(fd);
+	fprintf(console, "\n\nQuitting ext-shell.\n\n");
 	return(0);
 }
@@ -0,0 +1,99 @@
+/* =============
+ * time-to-first-byte benchmark for one-shot commands
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static double now_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return(t.tv_sec * 1e3 + t.tv_nsec / 1e6);
+}
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+static void report(const char *what, double *ms, int n)
+{
+	qsort(ms, n, sizeof(double), dbl_cmp);
+	printf("%-12s p50 %.3f  p90 %.3f  p99 %.3f  max %.3f ms\n", what,
+	       ms[n / 2], ms[n * 9 / 10], ms[n * 99 / 100], ms[n - 1]);
+}
+
+/* run
+ *
+ * Starts 'argv' with its stdout on a pipe and measures the time until
+ * its first byte of output arrives and until it has exited.  Returns
+ * the exit status.
+ */
+
+static int run(char **argv, double *first, double *total)
+{
+	char buf[65536];
+	double start = now_ms();
+	int p[2], status;
+	pid_t pid;
+	ssize_t n;
+
+	assert(pipe(p) == 0);
+	pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		dup2(p[1], STDOUT_FILENO);
+		close(p[0]);
+		close(p[1]);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	close(p[1]);
+
+	*first = -1;
+	while ((n = read(p[0], buf, sizeof(buf))) > 0)
+		if (*first < 0)
+			*first = now_ms() - start;
+	close(p[0]);
+	waitpid(pid, &status, 0);
+	*total = now_ms() - start;
+	if (*first < 0)
+		*first = *total;
+	return(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+int main(int argc, char **argv)
+{
+	double *first, *total;
+	int runs, i, failed = 0;
+
+	if (argc < 3 || (runs = atoi(argv[1])) <= 0) {
+		printf("usage:  ext-ttfb <runs> <program> [args...]\n");
+		printf("  e.g.  ext-ttfb 1000 ./ext-shell disk.img stat /etc/passwd\n");
+		return(1);
+	}
+
+	first = malloc(runs * sizeof(double));
+	total = malloc(runs * sizeof(double));
+	assert(first != NULL && total != NULL);
+	for (i = 0; i < runs; i++)
+		if (run(argv + 2, &first[i], &total[i]) != 0)
+			failed++;
+
+	printf("%d runs of %s (%d failed)\n", runs, argv[2], failed);
+	report("first byte", first, runs);
+	report("exit", total, runs);
+	free(first);
+	free(total);
+	return(failed != 0);
+}
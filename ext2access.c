@@ -0,0 +1,1054 @@
+/* =============
+ * ext2 access
+ * =============
+ *
+ * Filesystem-level helpers shared by the shell and the batch tools:
+ * everything here works on an (fd, os_fs_metadata_t) pair so several
+ * images can be open at once.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/arena.h"
+#include "inc/threadpool.h"
+#include "inc/bcache.h"
+#include "inc/trace.h"
+#include "inc/htree.h"
+#include "inc/inostore.h"
+#include "inc/parentmap.h"
+#include "inc/revmap.h"
+#include "inc/memgov.h"
+#include "inc/elevator.h"
+
+// img_pread recorded in the trace as a read of block 'blk'
+static ssize_t traced_pread(int fd, void *buf, size_t len, os_uint64_t off,
+			    const char *what, os_uint32_t blk)
+{
+	os_uint64_t t0 = trace_begin();
+	ssize_t n = img_pread(fd, buf, len, off);
+
+	trace_end(t0, what, TRACE_IO, "block", blk);
+	return(n);
+}
+
+struct os_superblock_t *read_superblock(int fd)
+{
+	struct os_superblock_t *sb = malloc(sizeof(struct os_superblock_t));
+	assert(sb != NULL);
+
+	if (traced_pread(fd, (void *)sb, sizeof(struct os_superblock_t), 1024,
+			 TRACE_SUPERBLOCK, 1) != sizeof(struct os_superblock_t) ||
+	    sb->s_magic != EXT2_SUPER_MAGIC || sb->s_log_block_size > EXT2_MAX_LOG_BLOCK_SIZE) {
+		free(sb);
+		return(NULL);
+	}
+
+	return(sb);
+}
+
+struct os_fs_metadata_t *calc_metadata(int fd, struct os_superblock_t *sb)
+{
+	struct os_fs_metadata_t *fsm = calloc(1, sizeof(struct os_fs_metadata_t));
+	os_uint32_t i;
+
+	assert(fsm != NULL);
+	fsm->sb = sb;
+	fsm->block_size = 1024 << sb->s_log_block_size;
+	fsm->num_blocks = sb->s_blocks_count;
+	fsm->disk_size = (os_uint64_t)fsm->num_blocks * fsm->block_size;
+	fsm->blockgroup_size = sb->s_blocks_per_group;
+	fsm->inodes_per_group = sb->s_inodes_per_group;
+	fsm->inode_size = sb->s_rev_level == EXT2_GOOD_OLD_REV ?
+		EXT2_GOOD_OLD_INODE_SIZE : sb->s_inode_size;
+	fsm->inode_blocks_per_group =
+		(fsm->inodes_per_group * fsm->inode_size + fsm->block_size - 1) / fsm->block_size;
+	fsm->num_blockgroups =
+		(sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) /
+		sb->s_blocks_per_group;
+	fsm->num_blocks_per_desc_table =
+		(fsm->num_blockgroups * sizeof(struct os_blockgroup_descriptor_t) +
+		 fsm->block_size - 1) / fsm->block_size;
+
+	fsm->offsets = malloc(fsm->num_blockgroups * sizeof(struct os_blockgroup_offsets_t));
+	assert(fsm->offsets != NULL);
+	for (i = 0; i < fsm->num_blockgroups; i++) {
+		fsm->offsets[i].first_block_in_blockgroup =
+			sb->s_first_data_block + i * sb->s_blocks_per_group;
+		fsm->offsets[i].last_block_in_blockgroup =
+			fsm->offsets[i].first_block_in_blockgroup + sb->s_blocks_per_group - 1;
+		if (fsm->offsets[i].last_block_in_blockgroup >= sb->s_blocks_count)
+			fsm->offsets[i].last_block_in_blockgroup = sb->s_blocks_count - 1;
+	}
+
+	return(fsm);
+}
+
+struct os_blockgroup_descriptor_t *read_bgdt(int fd,
+                                             struct os_fs_metadata_t *fsm)
+{
+	size_t len = fsm->num_blockgroups * sizeof(struct os_blockgroup_descriptor_t);
+	struct os_blockgroup_descriptor_t *bgdt = malloc(len);
+
+	// the descriptor table lives in the block after the superblock
+	assert(bgdt != NULL);
+	assert(traced_pread(fd, (void *)bgdt, len,
+			    (os_uint64_t)(fsm->sb->s_first_data_block + 1) * fsm->block_size,
+			    TRACE_DESCRIPTORS, fsm->sb->s_first_data_block + 1) == (ssize_t)len);
+
+	return(bgdt);
+}
+
+struct os_fs_metadata_t *load_fs_metadata(int fd)
+{
+	struct os_superblock_t *sb = read_superblock(fd);
+	struct os_fs_metadata_t *fsm;
+
+	if (sb == NULL)
+		return(NULL);
+
+	fsm = calc_metadata(fd, sb);
+	fsm->bgdt = read_bgdt(fd, fsm);
+
+	return(fsm);
+}
+
+struct os_fs_metadata_t *load_fs_metadata_lazy(int fd)
+{
+	struct os_superblock_t *sb = read_superblock(fd);
+	struct os_fs_metadata_t *fsm;
+
+	if (sb == NULL)
+		return(NULL);
+
+	fsm = calc_metadata(fd, sb);
+	fsm->bgdt = calloc(fsm->num_blockgroups, sizeof(struct os_blockgroup_descriptor_t));
+	fsm->bgdt_loaded = calloc((fsm->num_blocks_per_desc_table + 7) / 8, 1);
+	assert(fsm->bgdt != NULL && fsm->bgdt_loaded != NULL);
+
+	return(fsm);
+}
+
+// bytes of the inode tables and of the bitmaps cached in the metadata
+static size_t tables_bytes(struct os_fs_metadata_t *metadata)
+{
+	return((size_t)metadata->num_blockgroups * metadata->inodes_per_group * metadata->inode_size);
+}
+
+static size_t bitmaps_bytes(struct os_fs_metadata_t *metadata)
+{
+	return(2 * (size_t)metadata->num_blockgroups * metadata->block_size);
+}
+
+void free_fs_metadata(struct os_fs_metadata_t *metadata)
+{
+	struct os_memgov_cache_t *mg = mg_register(MG_TABLES, NULL, NULL);
+
+	if (metadata == NULL)
+		return;
+	if (metadata->inode_table != NULL)
+		mg_uncharge(mg, tables_bytes(metadata));
+	if (metadata->block_bitmap != NULL)
+		mg_uncharge(mg, bitmaps_bytes(metadata));
+	revmap_free(metadata->owners);
+	pmap_free(metadata->parents);
+	inostore_free(metadata->columns);
+	free(metadata->block_bitmap);
+	free(metadata->inode_bitmap);
+	free(metadata->inode_table);
+	free(metadata->bgdt_loaded);
+	free(metadata->bgdt);
+	free(metadata->offsets);
+	free(metadata->sb);
+	free(metadata);
+}
+
+/* need_desc
+ *
+ * Makes sure the descriptor of blockgroup 'group' is in metadata->bgdt,
+ * reading the descriptor table block that holds it if the table is
+ * loaded lazily.
+ *
+ * Returns:
+ * os_bool_t		FALSE on a read error.
+ */
+
+static os_bool_t need_desc(int fd, struct os_fs_metadata_t *metadata, os_uint32_t group)
+{
+	os_uint32_t per = metadata->block_size / sizeof(struct os_blockgroup_descriptor_t);
+	os_uint32_t b = group / per, n = per;
+	os_uint32_t blk = metadata->sb->s_first_data_block + 1 + b;
+
+	if (metadata->bgdt_loaded == NULL || (metadata->bgdt_loaded[b / 8] & (1 << b % 8)))
+		return(TRUE);
+
+	if (n > metadata->num_blockgroups - b * per)
+		n = metadata->num_blockgroups - b * per;
+	n *= sizeof(struct os_blockgroup_descriptor_t);
+	if (traced_pread(fd, metadata->bgdt + b * per, n, (os_uint64_t)blk * metadata->block_size,
+			 TRACE_DESCRIPTORS, blk) != (ssize_t)n)
+		return(FALSE);
+	metadata->bgdt_loaded[b / 8] |= 1 << b % 8;
+	return(TRUE);
+}
+
+os_bool_t read_inode_tables(int fd, struct os_fs_metadata_t *metadata)
+{
+	struct os_memgov_cache_t *mg = mg_register(MG_TABLES, NULL, NULL);
+	size_t table_len = (size_t)metadata->inodes_per_group * metadata->inode_size;
+	os_uint32_t g;
+
+	if (!mg_reserve(mg, tables_bytes(metadata)))
+		return(TRUE);
+	metadata->inode_table = img_alloc(table_len * metadata->num_blockgroups);
+	if (metadata->inode_table == NULL) {
+		mg_uncharge(mg, tables_bytes(metadata));
+		return(FALSE);
+	}
+
+	for (g = 0; g < metadata->num_blockgroups; g++) {
+		if (traced_pread(fd, metadata->inode_table + g * table_len, table_len,
+				 (os_uint64_t)metadata->bgdt[g].bg_inode_table * metadata->block_size,
+				 TRACE_INODES, metadata->bgdt[g].bg_inode_table) != (ssize_t)table_len) {
+			free(metadata->inode_table);
+			metadata->inode_table = NULL;
+			mg_uncharge(mg, tables_bytes(metadata));
+			return(FALSE);
+		}
+	}
+
+	return(TRUE);
+}
+
+struct preload_arg {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	os_bool_t tables;
+	os_uint32_t bad;
+	int failed;
+};
+
+static os_bool_t desc_valid(struct os_fs_metadata_t *fs, os_uint32_t g)
+{
+	struct os_blockgroup_descriptor_t *d = &fs->bgdt[g];
+	os_uint32_t first = fs->sb->s_first_data_block, end = fs->num_blocks;
+
+	return(d->bg_block_bitmap >= first && d->bg_block_bitmap < end &&
+	       d->bg_inode_bitmap >= first && d->bg_inode_bitmap < end &&
+	       d->bg_inode_table >= first &&
+	       (os_uint64_t)d->bg_inode_table + fs->inode_blocks_per_group <= end &&
+	       d->bg_free_blocks_count <= fs->blockgroup_size &&
+	       d->bg_free_inodes_count <= fs->inodes_per_group);
+}
+
+static void preload_group(os_uint32_t g, void *arg)
+{
+	struct preload_arg *pa = arg;
+	struct os_fs_metadata_t *fs = pa->fs;
+	struct os_blockgroup_descriptor_t *d = &fs->bgdt[g];
+	size_t bs = fs->block_size;
+	size_t table_len = (size_t)fs->inodes_per_group * fs->inode_size;
+
+	if (!desc_valid(fs, g)) {
+		fprintf(stderr, "blockgroup %u: bad descriptor (bitmaps %u/%u, inode table %u)\n",
+			g, d->bg_block_bitmap, d->bg_inode_bitmap, d->bg_inode_table);
+		__atomic_add_fetch(&pa->bad, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (traced_pread(pa->fd, fs->block_bitmap + g * bs, bs,
+			 (os_uint64_t)d->bg_block_bitmap * bs,
+			 TRACE_BITMAP, d->bg_block_bitmap) != (ssize_t)bs ||
+	    traced_pread(pa->fd, fs->inode_bitmap + g * bs, bs,
+			 (os_uint64_t)d->bg_inode_bitmap * bs,
+			 TRACE_BITMAP, d->bg_inode_bitmap) != (ssize_t)bs ||
+	    (pa->tables &&
+	     traced_pread(pa->fd, fs->inode_table + g * table_len, table_len,
+			  (os_uint64_t)d->bg_inode_table * bs,
+			  TRACE_INODES, d->bg_inode_table) != (ssize_t)table_len))
+		pa->failed = 1;
+}
+
+os_bool_t preload_metadata(int fd, struct os_fs_metadata_t *metadata,
+                           struct os_threadpool_t *tp, os_bool_t tables,
+                           os_uint32_t *bad_groups)
+{
+	size_t table_len = (size_t)metadata->inodes_per_group * metadata->inode_size;
+	size_t bitmaps_len = (size_t)metadata->block_size * metadata->num_blockgroups;
+	struct os_memgov_cache_t *mg = mg_register(MG_TABLES, NULL, NULL);
+	struct preload_arg pa = { fd, metadata, FALSE, 0, 0 };
+
+	// the tables only if they fit in the memory limit
+	pa.tables = tables = tables && mg_reserve(mg, tables_bytes(metadata));
+	mg_charge(mg, bitmaps_bytes(metadata));
+
+	// groups with bad descriptors are left zeroed: nothing allocated
+	metadata->block_bitmap = img_alloc(bitmaps_len);
+	metadata->inode_bitmap = img_alloc(bitmaps_len);
+	if (tables)
+		metadata->inode_table = img_alloc((size_t)metadata->num_blockgroups * table_len);
+	if (metadata->block_bitmap == NULL || metadata->inode_bitmap == NULL ||
+	    (tables && metadata->inode_table == NULL))
+		pa.failed = 1;
+	else
+		tp_parallel_for(tp, metadata->num_blockgroups, preload_group, &pa);
+
+	if (pa.failed) {
+		free(metadata->block_bitmap);
+		free(metadata->inode_bitmap);
+		metadata->block_bitmap = metadata->inode_bitmap = NULL;
+		mg_uncharge(mg, bitmaps_bytes(metadata));
+		if (tables) {
+			free(metadata->inode_table);
+			metadata->inode_table = NULL;
+			mg_uncharge(mg, tables_bytes(metadata));
+		}
+		return(FALSE);
+	}
+
+	if (bad_groups)
+		*bad_groups = pa.bad;
+	return(TRUE);
+}
+
+const unsigned char *group_inode_table(int fd, struct os_fs_metadata_t *metadata,
+                                       os_uint32_t group, unsigned char *buffer)
+{
+	size_t table_len = (size_t)metadata->inodes_per_group * metadata->inode_size;
+
+	if (metadata->inode_table != NULL)
+		return(metadata->inode_table + group * table_len);
+	if (!need_desc(fd, metadata, group))
+		return(NULL);
+
+	if (traced_pread(fd, buffer, table_len,
+			 (os_uint64_t)metadata->bgdt[group].bg_inode_table * metadata->block_size,
+			 TRACE_INODES, metadata->bgdt[group].bg_inode_table) != (ssize_t)table_len)
+		return(NULL);
+	return(buffer);
+}
+
+/* bitmap_find
+ *
+ * Bit i of a bitmap is bit i % 8 of byte i / 8, so on a little-endian
+ * cpu 64 bits starting at a byte boundary load as one word in the same
+ * order.  Whole words are skipped at once; only the bits before the
+ * first byte boundary and after the last whole word are looked at one
+ * by one.
+ */
+
+os_uint32_t bitmap_find(const unsigned char *bits, os_uint32_t from,
+                        os_uint32_t nbits, int value)
+{
+	os_uint64_t word, flip = value ? 0 : ~0ULL;
+	os_uint32_t i = from;
+
+	while (i < nbits) {
+		if (i % 8 == 0 && nbits - i >= 64) {
+			memcpy(&word, bits + i / 8, sizeof(word));
+			word ^= flip;
+			if (word)
+				return(i + __builtin_ctzll(word));
+			i += 64;
+			continue;
+		}
+		if ((bits[i / 8] >> (i % 8) & 1) == (value != 0))
+			return(i);
+		i++;
+	}
+	return(nbits);
+}
+
+void read_block_as(int fd, struct os_fs_metadata_t *metadata,
+                   os_uint32_t blocknum, void *buffer, const char *what)
+{
+	assert(traced_pread(fd, buffer, metadata->block_size,
+			    (os_uint64_t)blocknum * metadata->block_size,
+			    what, blocknum) == metadata->block_size);
+}
+
+void read_block(int fd, struct os_fs_metadata_t *metadata,
+                os_uint32_t blocknum, void *buffer)
+{
+	read_block_as(fd, metadata, blocknum, buffer, TRACE_DATA);
+}
+
+/* fetch_inode
+ *
+ * Copies inode 'inode_number' into returned_inode, from the cached
+ * inode tables when they are loaded, else straight from the disk, or
+ * through the inode block cache when there is a memory limit.
+ *
+ * Returns:
+ * os_bool_t		FALSE if inode_number is out of range.
+ */
+
+os_bool_t fetch_inode(os_uint32_t inode_number, int fd,
+                      struct os_fs_metadata_t *metadata,
+                      struct os_inode_t *returned_inode)
+{
+	os_uint32_t group, index;
+	struct os_arena_mark_t mark;
+	unsigned char *block;
+	os_uint64_t off, blocknum;
+
+	if (inode_number < 1 || inode_number > metadata->sb->s_inodes_count)
+		return(FALSE);
+
+	group = (inode_number - 1) / metadata->inodes_per_group;
+	index = (inode_number - 1) % metadata->inodes_per_group;
+
+	if (metadata->inode_table != NULL) {
+		memcpy(returned_inode, metadata->inode_table +
+		       (size_t)(inode_number - 1) * metadata->inode_size,
+		       sizeof(struct os_inode_t));
+		return(TRUE);
+	}
+
+	if (!need_desc(fd, metadata, group))
+		return(FALSE);
+	off = (os_uint64_t)index * metadata->inode_size;
+	blocknum = metadata->bgdt[group].bg_inode_table + off / metadata->block_size;
+
+	if (mg_limit() == 0 || blocknum >= metadata->num_blocks)
+		return(traced_pread(fd, returned_inode, sizeof(struct os_inode_t),
+				    (os_uint64_t)metadata->bgdt[group].bg_inode_table *
+				    metadata->block_size + off, TRACE_INODES,
+				    blocknum) == sizeof(struct os_inode_t));
+
+	// the tables are left to the inode block cache under a memory limit
+	mark = arena_mark(arena_scratch());
+	block = arena_alloc(arena_scratch(), metadata->block_size);
+	bcache_read_inodes(fd, metadata, blocknum, block);
+	memcpy(returned_inode, block + off % metadata->block_size, sizeof(struct os_inode_t));
+	arena_release(arena_scratch(), mark);
+	return(TRUE);
+}
+
+/* fetch_inodes
+ *
+ * fetch_inode() for 'n' inodes at once.  Unless the tables are cached
+ * the records are read through the elevator in one batch, also under
+ * a memory limit (past the inode block cache), so the inodes of a
+ * directory cost a sweep over the inode table blocks they live in
+ * rather than one read each.  Inodes that cannot be read are zeroed.
+ *
+ * Returns:
+ * os_bool_t		FALSE if any inode was out of range or not read.
+ */
+
+os_bool_t fetch_inodes(const os_uint32_t *inode_numbers, os_uint32_t n, int fd,
+                       struct os_fs_metadata_t *metadata,
+                       struct os_inode_t *returned_inodes)
+{
+	os_uint32_t i, group, index, nreqs = 0;
+	struct os_arena_mark_t mark;
+	struct os_io_req_t *reqs;
+	os_bool_t ok = TRUE;
+
+	if (metadata->inode_table != NULL) {
+		for (i = 0; i < n; i++) {
+			if (!fetch_inode(inode_numbers[i], fd, metadata, &returned_inodes[i])) {
+				memset(&returned_inodes[i], 0, sizeof(struct os_inode_t));
+				ok = FALSE;
+			}
+		}
+		return(ok);
+	}
+
+	mark = arena_mark(arena_scratch());
+	reqs = arena_alloc(arena_scratch(), (size_t)n * sizeof(struct os_io_req_t));
+	for (i = 0; i < n; i++) {
+		group = (inode_numbers[i] - 1) / metadata->inodes_per_group;
+		index = (inode_numbers[i] - 1) % metadata->inodes_per_group;
+		if (inode_numbers[i] < 1 || inode_numbers[i] > metadata->sb->s_inodes_count ||
+		    !need_desc(fd, metadata, group)) {
+			memset(&returned_inodes[i], 0, sizeof(struct os_inode_t));
+			ok = FALSE;
+			continue;
+		}
+		reqs[nreqs].off = (os_uint64_t)metadata->bgdt[group].bg_inode_table *
+			metadata->block_size + (os_uint64_t)index * metadata->inode_size;
+		reqs[nreqs].len = sizeof(struct os_inode_t);
+		reqs[nreqs].buf = &returned_inodes[i];
+		nreqs++;
+	}
+
+	if (elv_submit(fd, reqs, nreqs, TRACE_INODES) != 0) {
+		for (i = 0; i < nreqs; i++) {
+			if (reqs[i].done != (ssize_t)reqs[i].len) {
+				memset(reqs[i].buf, 0, sizeof(struct os_inode_t));
+				ok = FALSE;
+			}
+		}
+	}
+	arena_release(arena_scratch(), mark);
+	return(ok);
+}
+
+os_uint64_t file_size(struct os_inode_t *inode)
+{
+	os_uint64_t size = inode->i_size;
+
+	if ((inode->i_mode & 0xF000) == EXT2_S_IFREG)
+		size |= (os_uint64_t)inode->i_dir_acl << 32;
+
+	return(size);
+}
+
+/* calculate_offsets
+ *
+ * Splits logical file block 'blocknum' into the path through the block
+ * map: direct_num is the index into i_block[] (0..14), and for blocks
+ * behind i_block[12..14] the triple, double and single indirect block
+ * indices follow in that order.  Unused levels are set to -1.
+ */
+
+void calculate_offsets(os_uint32_t blocknum,
+                       os_uint32_t blocksize,
+                       os_int32_t *direct_num,
+                       os_int32_t *indirect_index,
+                       os_int32_t *double_index,
+                       os_int32_t *triple_index)
+{
+	os_uint64_t nptrs = blocksize / sizeof(os_uint32_t);
+	os_uint64_t b = blocknum;
+
+	*indirect_index = *double_index = *triple_index = -1;
+
+	if (b < 12) {
+		*direct_num = b;
+		return;
+	}
+	b -= 12;
+	if (b < nptrs) {
+		*direct_num = 12;
+		*indirect_index = b;
+		return;
+	}
+	b -= nptrs;
+	if (b < nptrs * nptrs) {
+		*direct_num = 13;
+		*double_index = b / nptrs;
+		*indirect_index = b % nptrs;
+		return;
+	}
+	b -= nptrs * nptrs;
+	*direct_num = 14;
+	*triple_index = b / (nptrs * nptrs);
+	*double_index = (b / nptrs) % nptrs;
+	*indirect_index = b % nptrs;
+}
+
+os_uint32_t file_bmap(struct os_inode_t *file_inode, int fd,
+                      struct os_fs_metadata_t *metadata,
+                      os_uint32_t blocknum)
+{
+	struct os_arena_mark_t mark;
+	os_int32_t path[4];
+	os_uint32_t blk, *ptrs;
+	int level;
+
+	calculate_offsets(blocknum, metadata->block_size,
+			  &path[0], &path[3], &path[2], &path[1]);
+
+	blk = file_inode->i_block[path[0]];
+	if (blk == 0 || path[3] == -1)
+		return(blk);
+
+	mark = arena_mark(arena_scratch());
+	ptrs = arena_alloc(arena_scratch(), metadata->block_size);
+	for (level = 1; level < 4 && blk; level++) {
+		if (path[level] == -1)
+			continue;
+		bcache_read(fd, metadata, blk, ptrs);
+		blk = ptrs[path[level]];
+	}
+	arena_release(arena_scratch(), mark);
+
+	return(blk);
+}
+
+/* bmap_run
+ *
+ * Maps logical block 'blocknum' like file_bmap(), and sets *count to the
+ * length of the run it starts, at most 'max' blocks: the following
+ * blocks that come next on disk, or that are holes as well.  A run ends
+ * with the pointer block that maps 'blocknum', so mapping any block
+ * costs one cached read per indirection level, whatever its offset.
+ */
+
+static os_uint32_t bmap_run(struct os_inode_t *file_inode, int fd,
+			    struct os_fs_metadata_t *metadata,
+			    os_uint32_t blocknum, os_uint32_t max, os_uint32_t *count)
+{
+	os_uint32_t nptrs = metadata->block_size / sizeof(os_uint32_t);
+	struct os_arena_mark_t mark;
+	os_uint32_t blk, idx, lim, n, *ptrs;
+	const os_uint32_t *p;
+	os_int32_t path[4];
+	int level;
+
+	calculate_offsets(blocknum, metadata->block_size,
+			  &path[0], &path[3], &path[2], &path[1]);
+
+	mark = arena_mark(arena_scratch());
+	if (path[3] == -1) {
+		p = file_inode->i_block;
+		idx = path[0];
+		lim = 12;
+	} else {
+		// a missing pointer block makes the rest of its range a hole
+		ptrs = arena_alloc(arena_scratch(), metadata->block_size);
+		p = ptrs;
+		idx = path[3];
+		lim = nptrs;
+		blk = file_inode->i_block[path[0]];
+		for (level = 1; level < 4 && blk; level++) {
+			if (path[level] == -1)
+				continue;
+			bcache_read(fd, metadata, blk, ptrs);
+			if (level < 3)
+				blk = ptrs[path[level]];
+		}
+		if (blk == 0) {
+			*count = lim - idx < max ? lim - idx : max;
+			arena_release(arena_scratch(), mark);
+			return(0);
+		}
+	}
+
+	blk = p[idx];
+	for (n = 1; n < max && idx + n < lim; n++)
+		if (p[idx + n] != (blk ? blk + n : 0))
+			break;
+	*count = n;
+	arena_release(arena_scratch(), mark);
+
+	return(blk);
+}
+
+ssize_t file_pread(int fd, struct os_fs_metadata_t *metadata,
+                   struct os_inode_t *file_inode, os_uint64_t offset,
+                   size_t len, void *buf)
+{
+	os_uint64_t size = file_size(file_inode), bs = metadata->block_size, want, pos;
+	unsigned char *dst = buf;
+	os_uint32_t phys, count;
+	size_t done = 0, n;
+
+	if (offset >= size)
+		return(0);
+	if (len > size - offset)
+		len = size - offset;
+
+	// fast symlinks keep their target in i_block
+	if ((file_inode->i_mode & 0xF000) == EXT2_S_IFLNK && file_inode->i_blocks == 0) {
+		memcpy(buf, (const unsigned char *)file_inode->i_block + offset, len);
+		return(len);
+	}
+
+	while (done < len) {
+		pos = offset + done;
+		want = (pos % bs + (len - done) + bs - 1) / bs;
+		phys = bmap_run(file_inode, fd, metadata, pos / bs,
+				want < 0xFFFFFFFF ? want : 0xFFFFFFFF, &count);
+		n = count * bs - pos % bs;
+		if (n > len - done)
+			n = len - done;
+		if (phys == 0)
+			memset(dst + done, 0, n);
+		else if (traced_pread(fd, dst + done, n, phys * bs + pos % bs,
+				      TRACE_DATA, phys) != (ssize_t)n)
+			return(-1);
+		done += n;
+	}
+
+	return(done);
+}
+
+/* file_blockread
+ *
+ * Reads logical block 'blocknum' of a file into buffer; holes read as
+ * zeros.
+ *
+ * Returns:
+ * os_uint32_t		number of bytes of the block that lie within the
+ *			file, 0 past the end of the file.
+ */
+
+os_uint32_t file_blockread(struct os_inode_t file_inode, int fd,
+                           struct os_fs_metadata_t *metadata,
+                           os_uint32_t blocknum, unsigned char *buffer)
+{
+	os_uint64_t size = file_size(&file_inode);
+	os_uint64_t start = (os_uint64_t)blocknum * metadata->block_size;
+	os_uint32_t blk;
+
+	if (start >= size)
+		return(0);
+
+	blk = file_bmap(&file_inode, fd, metadata, blocknum);
+	if (blk)
+		read_block(fd, metadata, blk, buffer);
+	else
+		memset(buffer, 0, metadata->block_size);
+
+	return(size - start < metadata->block_size ? size - start : metadata->block_size);
+}
+
+void dir_iter_init(struct os_dir_iter_t *it, struct os_inode_t *dir_inode,
+                   int fd, struct os_fs_metadata_t *metadata,
+                   const struct os_name_filter_t *filter)
+{
+	memset(it, 0, sizeof(*it));
+	it->fd = fd;
+	it->fs = metadata;
+	it->inode = *dir_inode;
+	it->filter = filter;
+	it->nblocks = (dir_inode->i_size + metadata->block_size - 1) / metadata->block_size;
+	it->map = img_map(fd, &it->map_len);
+	it->mark = arena_mark(arena_scratch());
+	it->buf = arena_alloc(arena_scratch(), metadata->block_size);
+	if (it->map == NULL && it->nblocks > 0) {
+		it->win_cap = DIR_WINDOW / metadata->block_size;
+		if (it->win_cap == 0)
+			it->win_cap = 1;
+		if (it->win_cap > it->nblocks)
+			it->win_cap = it->nblocks;
+		it->window = arena_alloc(arena_scratch(), (size_t)it->win_cap * metadata->block_size);
+		it->win_blk = arena_alloc(arena_scratch(), it->win_cap * sizeof(os_uint32_t));
+	}
+}
+
+/* fill_window
+ *
+ * Maps the next win_cap blocks of the directory from logical block
+ * 'first' on and reads those that are not holes in one elevator batch.
+ */
+
+static void fill_window(struct os_dir_iter_t *it, os_uint32_t first)
+{
+	os_uint32_t bs = it->fs->block_size, i, n = 0;
+	struct os_arena_mark_t mark;
+	struct os_io_req_t *reqs;
+
+	it->win_first = first;
+	it->win_count = it->nblocks - first < it->win_cap ? it->nblocks - first : it->win_cap;
+
+	mark = arena_mark(arena_scratch());
+	reqs = arena_alloc(arena_scratch(), it->win_count * sizeof(struct os_io_req_t));
+	for (i = 0; i < it->win_count; i++) {
+		it->win_blk[i] = file_bmap(&it->inode, it->fd, it->fs, first + i);
+		if (it->win_blk[i] == 0)
+			continue;
+		reqs[n].off = (os_uint64_t)it->win_blk[i] * bs;
+		reqs[n].len = bs;
+		reqs[n].buf = it->window + (size_t)i * bs;
+		n++;
+	}
+	assert(elv_submit(it->fd, reqs, n, TRACE_DIRECTORY) == 0);
+	arena_release(arena_scratch(), mark);
+}
+
+void dir_iter_buffer(struct os_dir_iter_t *it, const unsigned char *directory,
+                     os_uint32_t len, const struct os_name_filter_t *filter)
+{
+	memset(it, 0, sizeof(*it));
+	it->filter = filter;
+	it->block = directory;
+	it->block_len = len;
+	it->mark = arena_mark(arena_scratch());
+}
+
+os_bool_t dir_iter_next(struct os_dir_iter_t *it, struct os_dirent_view_t *view)
+{
+	const struct os_direntry_t *entry;
+	os_uint32_t blk, bs, rec_len, i;
+	os_uint64_t pos;
+
+	for (;;) {
+		while (it->off + 8 <= it->block_len) {
+			entry = (const struct os_direntry_t *)(it->block + it->off);
+			rec_len = dirent_rec_len(entry->rec_len, it->block_len);
+			if (rec_len < 8 || it->off + rec_len > it->block_len ||
+			    entry->name_len + 8 > rec_len)
+				break;
+			it->off += rec_len;
+
+			if (entry->inode == 0 ||
+			    (it->filter && !name_filter_match(it->filter, (const char *)entry->file_name, entry->name_len)))
+				continue;
+
+			view->inode = entry->inode;
+			view->file_type = entry->file_type;
+			view->name_len = entry->name_len;
+			view->name = (const char *)entry->file_name;
+			view->entry = entry;
+			return(TRUE);
+		}
+
+		// on to the next block that is not a hole
+		it->block_len = 0;
+		it->off = 0;
+		if (it->next_block >= it->nblocks)
+			return(FALSE);
+		bs = it->fs->block_size;
+		if (it->window != NULL) {
+			if (it->next_block >= it->win_first + it->win_count)
+				fill_window(it, it->next_block);
+			i = it->next_block++ - it->win_first;
+			if (it->win_blk[i] == 0)
+				continue;
+			it->block = it->window + (size_t)i * bs;
+			it->block_len = bs;
+			continue;
+		}
+
+		blk = file_bmap(&it->inode, it->fd, it->fs, it->next_block++);
+		if (blk == 0)
+			continue;
+
+		pos = (os_uint64_t)blk * bs;
+		if (it->map != NULL && pos + bs <= it->map_len) {
+			it->block = it->map + pos;
+		} else {
+			read_block_as(it->fd, it->fs, blk, it->buf, TRACE_DIRECTORY);
+			it->block = it->buf;
+		}
+		it->block_len = bs;
+	}
+}
+
+void dir_iter_end(struct os_dir_iter_t *it)
+{
+	arena_release(arena_scratch(), it->mark);
+}
+
+os_bool_t dir_foreach(struct os_inode_t *dir_inode, int fd,
+                      struct os_fs_metadata_t *metadata,
+                      os_dirent_cb_t cb, void *arg)
+{
+	struct os_dir_iter_t it;
+	struct os_dirent_view_t view;
+	os_bool_t stopped = FALSE;
+
+	dir_iter_init(&it, dir_inode, fd, metadata, NULL);
+	while (!stopped && dir_iter_next(&it, &view))
+		stopped = cb((struct os_direntry_t *)view.entry, arg) != 0;
+	dir_iter_end(&it);
+
+	return(stopped);
+}
+
+os_uint32_t scan_dir(unsigned char *directory,
+                     os_uint32_t directory_length,
+                     char *filename)
+{
+	struct os_name_filter_t filter;
+	struct os_dir_iter_t it;
+	struct os_dirent_view_t view;
+	os_uint32_t ino = 0;
+
+	if (strlen(filename) > EXT2_NAME_LEN)
+		return(0);
+
+	// an exact-name filter, so wildcards in filename are not expanded
+	memset(&filter, 0, sizeof(filter));
+	filter.kind = NAME_FILTER_EXACT;
+	filter.prefix_len = filter.min_len = strlen(filename);
+	memcpy(filter.prefix, filename, filter.prefix_len);
+
+	dir_iter_buffer(&it, directory, directory_length, &filter);
+	if (dir_iter_next(&it, &view))
+		ino = view.inode;
+	dir_iter_end(&it);
+
+	return(ino);
+}
+
+void ls_dir(unsigned char *directory, os_uint32_t directory_length,
+            char ***filenames, os_uint32_t *num_files)
+{
+	struct os_dir_iter_t it;
+	struct os_dirent_view_t view;
+	os_uint32_t n = 0;
+	size_t bytes = 0;
+	char **names, *p;
+
+	dir_iter_buffer(&it, directory, directory_length, NULL);
+	while (dir_iter_next(&it, &view)) {
+		n++;
+		bytes += view.name_len + 1;
+	}
+	dir_iter_end(&it);
+
+	names = malloc((n + 1) * sizeof(char *) + bytes);
+	assert(names != NULL);
+	p = (char *)(names + n + 1);
+
+	n = 0;
+	dir_iter_buffer(&it, directory, directory_length, NULL);
+	while (dir_iter_next(&it, &view)) {
+		names[n++] = p;
+		memcpy(p, view.name, view.name_len);
+		p[view.name_len] = '\0';
+		p += view.name_len + 1;
+	}
+	dir_iter_end(&it);
+	names[n] = NULL;
+
+	*filenames = names;
+	*num_files = n;
+}
+
+struct extent_walk {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	os_extent_cb_t cb;
+	os_extent_cb_t meta_cb;
+	void *arg;
+	os_uint32_t nblocks;
+	os_uint32_t logical;
+	os_uint32_t run_logical, run_physical, run_count;
+	os_bool_t stopped;
+	os_uint32_t *ptrs[4];
+};
+
+static void extent_emit(struct extent_walk *w, os_uint32_t physical, os_uint32_t count)
+{
+	if (w->run_count &&
+	    ((physical == 0 && w->run_physical == 0) ||
+	     (physical != 0 && w->run_physical != 0 &&
+	      w->run_physical + w->run_count == physical))) {
+		w->run_count += count;
+	} else {
+		if (w->run_count && w->cb(w->run_logical, w->run_physical, w->run_count, w->arg))
+			w->stopped = TRUE;
+		w->run_logical = w->logical;
+		w->run_physical = physical;
+		w->run_count = count;
+	}
+	w->logical += count;
+}
+
+static void extent_walk(struct extent_walk *w, os_uint32_t blk, int level)
+{
+	os_uint64_t span = 1;
+	os_uint32_t i, nptrs = w->fs->block_size / sizeof(os_uint32_t);
+
+	for (i = 0; i < (os_uint32_t)level; i++)
+		span *= nptrs;
+	if (span > w->nblocks - w->logical)
+		span = w->nblocks - w->logical;
+
+	if (blk == 0 || level == 0) {
+		extent_emit(w, blk, blk ? 1 : span);
+		return;
+	}
+
+	if (w->meta_cb && w->meta_cb(w->logical, blk, level, w->arg))
+		w->stopped = TRUE;
+	bcache_read(w->fd, w->fs, blk, w->ptrs[level]);
+	for (i = 0; i < nptrs && w->logical < w->nblocks && !w->stopped; i++)
+		extent_walk(w, w->ptrs[level][i], level - 1);
+}
+
+os_bool_t file_extents(struct os_inode_t *file_inode, int fd,
+                       struct os_fs_metadata_t *metadata,
+                       os_extent_cb_t cb, void *arg)
+{
+	return(file_map_walk(file_inode, fd, metadata, cb, NULL, arg));
+}
+
+os_bool_t file_map_walk(struct os_inode_t *file_inode, int fd,
+                        struct os_fs_metadata_t *metadata,
+                        os_extent_cb_t cb, os_extent_cb_t meta_cb, void *arg)
+{
+	struct os_arena_mark_t mark;
+	struct extent_walk w;
+	int i;
+
+	memset(&w, 0, sizeof(w));
+	w.fd = fd;
+	w.fs = metadata;
+	w.cb = cb;
+	w.meta_cb = meta_cb;
+	w.arg = arg;
+	w.nblocks = (file_size(file_inode) + metadata->block_size - 1) / metadata->block_size;
+
+	// fast symlinks keep their target in i_block, not in blocks
+	if ((file_inode->i_mode & 0xF000) == EXT2_S_IFLNK && file_inode->i_blocks == 0)
+		return(FALSE);
+
+	mark = arena_mark(arena_scratch());
+	for (i = 1; i < 4; i++)
+		w.ptrs[i] = arena_alloc(arena_scratch(), metadata->block_size);
+
+	for (i = 0; i < 12 && w.logical < w.nblocks && !w.stopped; i++)
+		extent_walk(&w, file_inode->i_block[i], 0);
+	for (i = 0; i < 3 && w.logical < w.nblocks && !w.stopped; i++)
+		extent_walk(&w, file_inode->i_block[12+i], i+1);
+	if (w.run_count && !w.stopped && cb(w.run_logical, w.run_physical, w.run_count, arg))
+		w.stopped = TRUE;
+
+	arena_release(arena_scratch(), mark);
+
+	return(w.stopped);
+}
+
+struct lookup_arg {
+	const char *name;
+	int len;
+	os_uint32_t found;
+};
+
+static int match_entry(struct os_direntry_t *entry, void *arg)
+{
+	struct lookup_arg *la = arg;
+
+	if (entry->name_len != la->len || memcmp(entry->file_name, la->name, la->len))
+		return(0);
+	la->found = entry->inode;
+	return(1);
+}
+
+os_uint32_t path_lookup(const char *path, os_uint32_t base_inode, int fd,
+                        struct os_fs_metadata_t *metadata)
+{
+	os_uint32_t ino = *path == '/' ? EXT2_ROOT_INO : base_inode, found;
+	struct os_inode_t inode;
+	struct lookup_arg la;
+
+	while (*path) {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+
+		la.name = path;
+		while (*path && *path != '/')
+			path++;
+		la.len = path - la.name;
+		la.found = 0;
+
+		if (!fetch_inode(ino, fd, metadata, &inode) ||
+		    (inode.i_mode & 0xF000) != EXT2_S_IFDIR)
+			return(0);
+
+		// large directories are indexed; the others are scanned
+		found = htree_lookup(fd, metadata, &inode, la.name, la.len);
+		if (found == HTREE_NONE)
+			found = dir_foreach(&inode, fd, metadata, match_entry, &la) ? la.found : 0;
+		if (found == 0)
+			return(0);
+		ino = found;
+	}
+
+	return(ino);
+}
@@ -0,0 +1,190 @@
+/* =============
+ * fragmentation analyzer
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/frag.h"
+#include "inc/parentmap.h"
+#include "inc/threadpool.h"
+#include "inc/arena.h"
+
+struct scan_arg {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	os_uint32_t under;
+	struct os_parentmap_t *parents;
+	struct os_frag_report_t *groups;
+	int failed;
+};
+
+struct file_walk {
+	struct os_frag_file_t *f;
+	os_uint32_t next;   // block after the previous extent, 0 before the first
+};
+
+static int count_extent(os_uint32_t logical, os_uint32_t physical,
+                        os_uint32_t count, void *arg)
+{
+	struct file_walk *fw = arg;
+
+	if (physical == 0)
+		return(0);
+	if (fw->next)
+		fw->f->seek += physical > fw->next ? physical - fw->next : fw->next - physical;
+	fw->f->extents++;
+	fw->f->blocks += count;
+	fw->next = physical + count;
+	return(0);
+}
+
+void frag_file(struct os_inode_t *inode, os_uint32_t inode_num, int fd,
+               struct os_fs_metadata_t *metadata, struct os_frag_file_t *out)
+{
+	struct file_walk fw = { out, 0 };
+
+	memset(out, 0, sizeof(*out));
+	out->inode = inode_num;
+	file_extents(inode, fd, metadata, count_extent, &fw);
+}
+
+int frag_bucket(os_uint32_t extents)
+{
+	int b = 0;
+
+	// 1, 2, 3-4, 5-8, ...
+	while (b < FRAG_HIST - 1 && extents > (1U << b))
+		b++;
+	return(b);
+}
+
+static int worse(const struct os_frag_file_t *a, const struct os_frag_file_t *b)
+{
+	if (a->extents != b->extents)
+		return(a->extents > b->extents);
+	return(a->seek > b->seek);
+}
+
+static void add_worst(struct os_frag_report_t *r, const struct os_frag_file_t *f)
+{
+	int i;
+
+	if (r->nworst == FRAG_WORST && !worse(f, &r->worst[FRAG_WORST - 1]))
+		return;
+	if (r->nworst < FRAG_WORST)
+		r->nworst++;
+	for (i = r->nworst - 1; i > 0 && worse(f, &r->worst[i - 1]); i--)
+		r->worst[i] = r->worst[i - 1];
+	r->worst[i] = *f;
+}
+
+static void add_file(struct os_frag_report_t *r, const struct os_frag_file_t *f)
+{
+	if (f->extents == 0)
+		return;
+	r->files++;
+	if (f->extents > 1)
+		r->fragmented++;
+	r->extents += f->extents;
+	r->blocks += f->blocks;
+	r->seek += f->seek;
+	r->hist[frag_bucket(f->extents)]++;
+	if (f->extents > 1)
+		add_worst(r, f);
+}
+
+static os_bool_t is_below(struct os_parentmap_t *parents, os_uint32_t ino, os_uint32_t dir)
+{
+	int depth;
+
+	for (depth = 0; ino && ino != EXT2_ROOT_INO && depth < 4096; depth++) {
+		ino = pmap_parent(parents, ino);
+		if (ino == dir)
+			return(TRUE);
+	}
+	return(dir == EXT2_ROOT_INO && ino == EXT2_ROOT_INO);
+}
+
+static void scan_group(os_uint32_t g, void *arg)
+{
+	struct scan_arg *sa = arg;
+	struct os_fs_metadata_t *fs = sa->fs;
+	size_t table_len = (size_t)fs->inodes_per_group * fs->inode_size;
+	struct os_arena_mark_t mark;
+	const unsigned char *table;
+	struct os_frag_file_t f;
+	struct os_inode_t inode;
+	os_uint32_t i, ino, fmt, first_ino;
+
+	if (fs->bgdt[g].bg_free_inodes_count == fs->inodes_per_group)
+		return;
+
+	first_ino = fs->sb->s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_FIRST_INO : fs->sb->s_first_ino;
+
+	mark = arena_mark(arena_scratch());
+	table = group_inode_table(sa->fd, fs, g,
+				  fs->inode_table ? NULL : arena_alloc(arena_scratch(), table_len));
+	if (table == NULL) {
+		sa->failed = 1;
+		arena_release(arena_scratch(), mark);
+		return;
+	}
+
+	for (i = 0; i < fs->inodes_per_group; i++) {
+		memcpy(&inode, table + (size_t)i * fs->inode_size, sizeof(inode));
+		fmt = inode.i_mode & 0xF000;
+		if ((fmt != EXT2_S_IFREG && fmt != EXT2_S_IFDIR) ||
+		    inode.i_links_count == 0 || inode.i_dtime != 0)
+			continue;
+		ino = g * fs->inodes_per_group + i + 1;
+		if (ino > fs->sb->s_inodes_count)
+			break;
+		// reserved inodes (resize, journal, ...) are not files
+		if (ino < first_ino && ino != EXT2_ROOT_INO)
+			continue;
+		if (sa->under && !is_below(sa->parents, ino, sa->under))
+			continue;
+		frag_file(&inode, ino, sa->fd, fs, &f);
+		add_file(&sa->groups[g], &f);
+	}
+
+	arena_release(arena_scratch(), mark);
+}
+
+os_bool_t frag_scan(int fd, struct os_fs_metadata_t *metadata,
+                    struct os_threadpool_t *tp, os_uint32_t under,
+                    struct os_parentmap_t *parents,
+                    struct os_frag_report_t *report)
+{
+	struct scan_arg sa = { fd, metadata, under, parents, NULL, 0 };
+	struct os_frag_report_t *r;
+	os_uint32_t g;
+	int b, i;
+
+	sa.groups = calloc(metadata->num_blockgroups, sizeof(struct os_frag_report_t));
+	assert(sa.groups != NULL);
+	tp_parallel_for(tp, metadata->num_blockgroups, scan_group, &sa);
+
+	memset(report, 0, sizeof(*report));
+	for (g = 0; g < metadata->num_blockgroups; g++) {
+		r = &sa.groups[g];
+		report->files += r->files;
+		report->fragmented += r->fragmented;
+		report->extents += r->extents;
+		report->blocks += r->blocks;
+		report->seek += r->seek;
+		for (b = 0; b < FRAG_HIST; b++)
+			report->hist[b] += r->hist[b];
+		for (i = 0; i < r->nworst; i++)
+			add_worst(report, &r->worst[i]);
+	}
+	free(sa.groups);
+
+	return(!sa.failed);
+}
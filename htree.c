@@ -0,0 +1,298 @@
+/* =============
+ * hashed directory index
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/htree.h"
+#include "inc/arena.h"
+#include "inc/trace.h"
+
+#define ROOT_INFO_OFF 24              // after the "." and ".." records
+#define NODE_ENTRIES_OFF 8            // after the empty record of a node
+
+struct dx_root_info {
+	os_uint32_t reserved_zero;
+	os_uint8_t hash_version;
+	os_uint8_t info_length;
+	os_uint8_t indirect_levels;
+	os_uint8_t unused_flags;
+};
+
+// entries[0].hash holds the limit and count of the array instead: the
+// first entry covers every hash below entries[1].hash.
+struct dx_entry {
+	os_uint32_t hash;
+	os_uint32_t block;                // logical block of the directory
+};
+
+struct dx_countlimit {
+	os_uint16_t limit;
+	os_uint16_t count;
+};
+
+/* --- hashes, as in the kernel's fs/ext4/hash.c ------------------------ */
+
+#define ROL(x, s) ((x) << (s) | (x) >> (32 - (s)))
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL(a, s))
+#define K2 013240474631U
+#define K3 015666365641U
+
+static void half_md4(os_uint32_t buf[4], const os_uint32_t in[8])
+{
+	os_uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	ROUND(F, a, b, c, d, in[0], 3);
+	ROUND(F, d, a, b, c, in[1], 7);
+	ROUND(F, c, d, a, b, in[2], 11);
+	ROUND(F, b, c, d, a, in[3], 19);
+	ROUND(F, a, b, c, d, in[4], 3);
+	ROUND(F, d, a, b, c, in[5], 7);
+	ROUND(F, c, d, a, b, in[6], 11);
+	ROUND(F, b, c, d, a, in[7], 19);
+
+	ROUND(G, a, b, c, d, in[1] + K2, 3);
+	ROUND(G, d, a, b, c, in[3] + K2, 5);
+	ROUND(G, c, d, a, b, in[5] + K2, 9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2, 3);
+	ROUND(G, d, a, b, c, in[2] + K2, 5);
+	ROUND(G, c, d, a, b, in[4] + K2, 9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	ROUND(H, a, b, c, d, in[3] + K3, 3);
+	ROUND(H, d, a, b, c, in[7] + K3, 9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3, 3);
+	ROUND(H, d, a, b, c, in[5] + K3, 9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static void tea(os_uint32_t buf[4], const os_uint32_t in[4])
+{
+	os_uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+	int n;
+
+	for (n = 0; n < 16; n++) {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+		b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+static os_uint32_t legacy(const char *name, int len, int is_unsigned)
+{
+	os_uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	int c, i;
+
+	for (i = 0; i < len; i++) {
+		c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+		hash = hash1 + (hash0 ^ (os_uint32_t)(c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return(hash0 << 1);
+}
+
+// packs up to 4 * 'num' bytes of the name into 'num' words, padded
+static void name_words(const char *name, int len, os_uint32_t *buf, int num, int is_unsigned)
+{
+	os_uint32_t pad = (os_uint32_t)len | (os_uint32_t)len << 8, val;
+	int i, c;
+
+	pad |= pad << 16;
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++) {
+		c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+		val = c + (val << 8);
+		if (i % 4 == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+os_uint32_t ext2_dirhash(const char *name, int len, int version,
+                         const os_uint32_t seed[4])
+{
+	os_uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	os_uint32_t in[8], hash;
+	int is_unsigned = version >= EXT2_HASH_UNSIGNED;
+
+	if (seed[0] || seed[1] || seed[2] || seed[3])
+		memcpy(buf, seed, sizeof(buf));
+
+	switch (version % EXT2_HASH_UNSIGNED) {
+	case EXT2_HASH_HALF_MD4:
+		for (; len > 0; len -= 32, name += 32) {
+			name_words(name, len, in, 8, is_unsigned);
+			half_md4(buf, in);
+		}
+		hash = buf[1];
+		break;
+	case EXT2_HASH_TEA:
+		for (; len > 0; len -= 16, name += 16) {
+			name_words(name, len, in, 4, is_unsigned);
+			tea(buf, in);
+		}
+		hash = buf[0];
+		break;
+	default:
+		hash = legacy(name, len, is_unsigned);
+	}
+	return(hash & ~1U);
+}
+
+/* --- lookup ------------------------------------------------------------ */
+
+static os_bool_t dir_block(int fd, struct os_fs_metadata_t *metadata, struct os_inode_t *dir,
+			   os_uint32_t logical, unsigned char *buf)
+{
+	os_uint32_t blk;
+
+	if ((os_uint64_t)logical * metadata->block_size >= dir->i_size ||
+	    (blk = file_bmap(dir, fd, metadata, logical)) == 0)
+		return(FALSE);
+	read_block_as(fd, metadata, blk, buf, TRACE_DIRECTORY);
+	return(TRUE);
+}
+
+// the inode of 'name' in leaf block 'buf', or 0
+static os_uint32_t leaf_find(const unsigned char *buf, os_uint32_t bs,
+			     const char *name, os_uint32_t len)
+{
+	const struct os_direntry_t *e;
+	os_uint32_t off, rec_len;
+
+	for (off = 0; off + 8 <= bs; off += rec_len) {
+		e = (const struct os_direntry_t *)(buf + off);
+		rec_len = dirent_rec_len(e->rec_len, bs);
+		if (rec_len < 8 || off + rec_len > bs || e->name_len + 8 > rec_len)
+			break;
+		if (e->inode && e->name_len == len && !memcmp(e->file_name, name, len))
+			return(e->inode);
+	}
+	return(0);
+}
+
+/* htree_lookup
+ *
+ * Descends from the root to the leaf whose hash range holds the name,
+ * taking in every node the last entry whose hash is not above it.  Names
+ * whose hashes collide may spill into the following leaves, which the
+ * index marks by setting the low bit of their starting hash.
+ */
+
+os_uint32_t htree_lookup(int fd, struct os_fs_metadata_t *metadata,
+                         struct os_inode_t *dir, const char *name, os_uint32_t len)
+{
+	struct os_superblock_t *sb = metadata->sb;
+	os_uint32_t bs = metadata->block_size, ino = HTREE_NONE, hash, off, lo, hi, mid, at;
+	struct os_arena_mark_t mark;
+	const struct dx_root_info *info;
+	const struct os_direntry_t *fake;
+	const struct dx_countlimit *cl;
+	const struct dx_entry *entries;
+	unsigned char *node, *leaf;
+	int version, level, levels;
+
+	if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) ||
+	    !(dir->i_flags & EXT2_INDEX_FL))
+		return(HTREE_NONE);
+
+	mark = arena_mark(arena_scratch());
+	node = arena_alloc(arena_scratch(), bs);
+	leaf = arena_alloc(arena_scratch(), bs);
+	if (!dir_block(fd, metadata, dir, 0, node))
+		goto out;
+
+	info = (const struct dx_root_info *)(node + ROOT_INFO_OFF);
+	if (info->reserved_zero || info->info_length != 8 ||
+	    info->hash_version > EXT2_HASH_TEA || info->indirect_levels > 2)
+		goto out;
+	version = info->hash_version;
+	if (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+		version += EXT2_HASH_UNSIGNED;
+	hash = ext2_dirhash(name, len, version, sb->s_hash_seed);
+	levels = info->indirect_levels;
+	off = ROOT_INFO_OFF + info->info_length;
+
+	for (level = 0; ; level++) {
+		cl = (const struct dx_countlimit *)(node + off);
+		entries = (const struct dx_entry *)(node + off);
+		if (cl->limit != (bs - off) / sizeof(struct dx_entry) ||
+		    cl->count == 0 || cl->count > cl->limit)
+			goto out;
+
+		lo = 1;
+		hi = cl->count - 1;
+		while (lo <= hi) {
+			mid = lo + (hi - lo) / 2;
+			if (entries[mid].hash > hash)
+				hi = mid - 1;
+			else
+				lo = mid + 1;
+		}
+		at = lo - 1;
+		if (level == levels)
+			break;
+
+		if (!dir_block(fd, metadata, dir, entries[at].block, node))
+			goto out;
+		fake = (const struct os_direntry_t *)node;
+		if (fake->inode != 0 || dirent_rec_len(fake->rec_len, bs) != bs)
+			goto out;
+		off = NODE_ENTRIES_OFF;
+	}
+
+	for (;;) {
+		if (!dir_block(fd, metadata, dir, entries[at].block, leaf)) {
+			ino = HTREE_NONE;
+			break;
+		}
+		if ((ino = leaf_find(leaf, bs, name, len)) != 0)
+			break;
+		if (at + 1 < cl->count) {
+			if ((entries[at + 1].hash & 1) == 0 || (entries[at + 1].hash & ~1U) != hash)
+				break;
+			at++;
+		} else if (levels > 0) {
+			// the collision run may go on in the next node
+			ino = HTREE_NONE;
+			break;
+		} else {
+			break;
+		}
+	}
+
+out:
+	arena_release(arena_scratch(), mark);
+	return(ino);
+}
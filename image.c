@@ -0,0 +1,860 @@
+/* =============
+ * image backends
+ * =============
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "inc/types.h"
+#include "inc/image.h"
+#include "inc/trace.h"
+#include "inc/memgov.h"
+
+#define IMG_RAW		0
+#define IMG_GZIP	1
+#define IMG_ZSTD	2
+
+#define IDX_MAGIC	"EXTZIDX1"
+#define GZ_WINSIZE	32768
+#define IO_CHUNK	(1 << 16)
+#define MAX_FDS		(1 << 20)     // per-fd tables never get bigger
+
+// One access point: decompression of chunk i starts at compressed
+// offset 'in' and produces bytes from uncompressed offset 'out' up to
+// the 'out' of point i+1.  gzip points additionally need the bit
+// offset into the byte before 'in' and the 32KiB of output preceding
+// them, which is kept compressed in the index file at 'woff'.
+struct zpoint {
+	os_uint64_t out;
+	os_uint64_t in;
+	os_uint32_t bits;
+	os_uint32_t wlen;
+	os_uint64_t woff;
+};
+
+struct zchunk {
+	os_int64_t idx;
+	unsigned char *data;
+	os_uint64_t len;
+	os_uint64_t tick;
+};
+
+struct zimage {
+	int type;
+	int fd;
+	int idx_fd;
+	os_uint64_t in_size;
+	os_uint64_t out_size;
+	os_uint32_t npoints;
+	struct zpoint *points;
+	struct zchunk cache[IMG_CHUNK_CACHE];
+	os_uint64_t tick;
+	pthread_mutex_t lock;
+};
+
+struct zidx_header {
+	char magic[8];
+	os_uint32_t type;
+	os_uint32_t npoints;
+	os_uint64_t in_size;
+	os_uint64_t out_size;
+};
+
+// The per-fd tables below are allocated once, for every fd the process
+// may hold (RLIMIT_NOFILE at the first img_open()), so that reads can
+// look an image up without a lock from any thread.  An entry is set
+// before img_open() hands out its fd and cleared, under the lock of its
+// table, before img_close() closes it.  Lookups load entries with
+// __atomic, as a reused fd may be looked up by another thread than the
+// one that cleared it.
+static int nfds;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static struct zimage **zimages;
+static int nzimages;              // highest compressed image fd + 1
+static pthread_mutex_t zimages_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct os_memgov_cache_t *chunks_mg;
+static unsigned int evict_hand;  // next image to evict a chunk from
+
+static size_t evict_chunks(void *arg, size_t bytes);
+
+// read-only mappings of raw images, created on demand by img_map()
+struct rawmap {
+	void *addr;
+	os_uint64_t len;
+};
+
+static struct rawmap *rawmaps;
+static pthread_mutex_t rawmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// raw images opened with O_DIRECT, indexed by fd
+static char *directs;
+
+// read overlays set with img_set_overlay(), indexed by fd
+struct overlay {
+	img_overlay_fn fn;
+	void (*release)(void *arg);
+	void *arg;
+};
+
+static struct overlay *overlays;
+
+// per-thread aligned buffer for O_DIRECT reads the caller's buffer,
+// offset or length does not allow
+static __thread unsigned char *bounce;
+
+static void alloc_tables(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < MAX_FDS)
+		nfds = rl.rlim_cur;
+	else
+		nfds = MAX_FDS;
+	zimages = calloc(nfds, sizeof(struct zimage *));
+	rawmaps = calloc(nfds, sizeof(struct rawmap));
+	directs = calloc(nfds, 1);
+	overlays = calloc(nfds, sizeof(struct overlay));
+	assert(zimages && rawmaps && directs && overlays);
+	chunks_mg = mg_register("chunks", evict_chunks, NULL);
+}
+
+static int is_direct(int fd)
+{
+	return(fd >= 0 && fd < nfds && __atomic_load_n(&directs[fd], __ATOMIC_ACQUIRE));
+}
+
+static struct zimage *zimage_of(int fd)
+{
+	if (fd < 0 || fd >= nfds)
+		return(NULL);
+	return(__atomic_load_n(&zimages[fd], __ATOMIC_ACQUIRE));
+}
+
+static int detect_type(int fd)
+{
+	unsigned char magic[4];
+
+	if (pread(fd, magic, 4, 0) != 4)
+		return(IMG_RAW);
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		return(IMG_GZIP);
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return(IMG_ZSTD);
+	return(IMG_RAW);
+}
+
+static void add_point(struct zimage *z, os_uint32_t *cap, os_uint64_t in,
+		      os_uint64_t out, os_uint32_t bits)
+{
+	if (z->npoints == *cap) {
+		*cap = *cap ? *cap * 2 : 256;
+		z->points = realloc(z->points, *cap * sizeof(struct zpoint));
+		assert(z->points != NULL);
+	}
+	z->points[z->npoints].in = in;
+	z->points[z->npoints].out = out;
+	z->points[z->npoints].bits = bits;
+	z->points[z->npoints].wlen = 0;
+	z->points[z->npoints].woff = 0;
+	z->npoints++;
+}
+
+/* gz_build_index
+ *
+ * Inflates the whole gzip stream once, recording an access point at
+ * the first deflate block boundary after every IMG_GZ_SPAN bytes of
+ * output.  The window of each point is compressed and appended to the
+ * index file right away, so only the point table stays in memory.
+ *
+ * Returns:
+ * int			0 on success, -1 on a corrupt stream.
+ */
+
+static int gz_build_index(struct zimage *z, int wfd)
+{
+	unsigned char *input = malloc(IO_CHUNK);
+	unsigned char *window = malloc(GZ_WINSIZE);
+	unsigned char *ordered = malloc(GZ_WINSIZE);
+	uLongf clen = compressBound(GZ_WINSIZE);
+	unsigned char *packed = malloc(clen);
+	os_uint64_t totin = 0, totout = 0, last = 0, rpos = 0;
+	os_uint64_t woff = sizeof(struct zidx_header);
+	os_uint32_t cap = 0;
+	z_stream strm;
+	ssize_t n;
+	int ret;
+
+	assert(input && window && ordered && packed);
+	memset(&strm, 0, sizeof(strm));
+	assert(inflateInit2(&strm, 47) == Z_OK);
+	strm.avail_out = 0;
+
+	do {
+		n = pread(z->fd, input, IO_CHUNK, rpos);
+		if (n <= 0) {
+			ret = Z_DATA_ERROR;
+			break;
+		}
+		rpos += n;
+		strm.avail_in = n;
+		strm.next_in = input;
+		do {
+			if (strm.avail_out == 0) {
+				strm.avail_out = GZ_WINSIZE;
+				strm.next_out = window;
+			}
+			totin += strm.avail_in;
+			totout += strm.avail_out;
+			ret = inflate(&strm, Z_BLOCK);
+			totin -= strm.avail_in;
+			totout -= strm.avail_out;
+			if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+				ret = Z_DATA_ERROR;
+				break;
+			}
+			if (ret == Z_STREAM_END)
+				break;
+			if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+			    (totout == 0 || totout - last > IMG_GZ_SPAN)) {
+				unsigned left = strm.avail_out;
+				struct zpoint *p;
+
+				add_point(z, &cap, totin, totout, strm.data_type & 7);
+				p = &z->points[z->npoints-1];
+
+				// unroll the circular output buffer into the
+				// 32KiB that precede this point
+				if (left)
+					memcpy(ordered, window + GZ_WINSIZE - left, left);
+				if (left < GZ_WINSIZE)
+					memcpy(ordered + left, window, GZ_WINSIZE - left);
+
+				clen = compressBound(GZ_WINSIZE);
+				assert(compress2(packed, &clen, ordered, GZ_WINSIZE, 6) == Z_OK);
+				p->wlen = clen;
+				p->woff = woff;
+				if (wfd != -1)
+					assert(pwrite(wfd, packed, clen, woff) == (ssize_t)clen);
+				woff += clen;
+				last = totout;
+			}
+		} while (strm.avail_in != 0);
+	} while (ret != Z_STREAM_END && ret != Z_DATA_ERROR);
+
+	inflateEnd(&strm);
+	free(input);
+	free(window);
+	free(ordered);
+	free(packed);
+
+	z->out_size = totout;
+	return(ret == Z_STREAM_END ? 0 : -1);
+}
+
+static int gz_read_chunk(struct zimage *z, os_uint32_t i, unsigned char *dst,
+			 os_uint64_t len)
+{
+	struct zpoint *p = &z->points[i];
+	unsigned char *input = malloc(IO_CHUNK);
+	unsigned char *window = malloc(GZ_WINSIZE);
+	unsigned char *packed = malloc(p->wlen);
+	uLongf wlen = GZ_WINSIZE;
+	os_uint64_t rpos = p->in - (p->bits ? 1 : 0);
+	z_stream strm;
+	ssize_t n;
+	int ret = Z_OK;
+
+	assert(input && window && packed);
+	assert(pread(z->idx_fd, packed, p->wlen, p->woff) == (ssize_t)p->wlen);
+	assert(uncompress(window, &wlen, packed, p->wlen) == Z_OK);
+
+	memset(&strm, 0, sizeof(strm));
+	assert(inflateInit2(&strm, -15) == Z_OK);
+	if (p->bits) {
+		unsigned char c;
+
+		assert(pread(z->fd, &c, 1, rpos++) == 1);
+		inflatePrime(&strm, p->bits, c >> (8 - p->bits));
+	}
+	inflateSetDictionary(&strm, window, GZ_WINSIZE);
+
+	strm.next_out = dst;
+	strm.avail_out = len;
+	while (strm.avail_out && ret != Z_STREAM_END) {
+		n = pread(z->fd, input, IO_CHUNK, rpos);
+		if (n <= 0)
+			break;
+		rpos += n;
+		strm.next_in = input;
+		strm.avail_in = n;
+		while (strm.avail_in && strm.avail_out) {
+			ret = inflate(&strm, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END)
+				break;
+			if (ret == Z_STREAM_END)
+				break;
+		}
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			break;
+	}
+
+	inflateEnd(&strm);
+	free(input);
+	free(window);
+	free(packed);
+	return(strm.avail_out == 0 ? 0 : -1);
+}
+
+#ifdef HAVE_ZSTD
+/* zstd_build_index
+ *
+ * zstd frames are independent, so every frame start is an access point
+ * and no window has to be saved.  Images compressed as a single frame
+ * still work, but every read then decompresses the whole image; use a
+ * multi-frame (seekable) compressor for random access.
+ */
+
+static int zstd_build_index(struct zimage *z)
+{
+	ZSTD_DStream *ds = ZSTD_createDStream();
+	size_t ilen = ZSTD_DStreamInSize(), olen = ZSTD_DStreamOutSize();
+	unsigned char *ibuf = malloc(ilen), *obuf = malloc(olen);
+	os_uint64_t rpos = 0, out = 0, frame_in = 0, frame_out = 0;
+	os_uint32_t cap = 0;
+	size_t ret = 1;
+	ssize_t n;
+
+	assert(ds && ibuf && obuf);
+	ZSTD_initDStream(ds);
+
+	while ((n = pread(z->fd, ibuf, ilen, rpos)) > 0) {
+		ZSTD_inBuffer in = { ibuf, n, 0 };
+
+		while (in.pos < in.size) {
+			ZSTD_outBuffer o = { obuf, olen, 0 };
+
+			ret = ZSTD_decompressStream(ds, &o, &in);
+			if (ZSTD_isError(ret))
+				goto out;
+			out += o.pos;
+			if (ret == 0) {
+				// skippable frames produce no output and
+				// do not get an access point
+				if (out > frame_out)
+					add_point(z, &cap, frame_in, frame_out, 0);
+				frame_in = rpos + in.pos;
+				frame_out = out;
+			}
+		}
+		rpos += n;
+	}
+
+out:
+	ZSTD_freeDStream(ds);
+	free(ibuf);
+	free(obuf);
+
+	z->out_size = out;
+	return(ret == 0 ? 0 : -1);
+}
+
+static int zstd_read_chunk(struct zimage *z, os_uint32_t i, unsigned char *dst,
+			   os_uint64_t len)
+{
+	os_uint64_t in = z->points[i].in;
+	os_uint64_t in_end = i + 1 < z->npoints ? z->points[i+1].in : z->in_size;
+	unsigned char *src = malloc(in_end - in);
+	size_t ret;
+
+	assert(src != NULL);
+	assert(pread(z->fd, src, in_end - in, in) == (ssize_t)(in_end - in));
+	ret = ZSTD_decompress(dst, len, src, in_end - in);
+	free(src);
+
+	return(!ZSTD_isError(ret) && ret == len ? 0 : -1);
+}
+#endif
+
+/* load_index
+ *
+ * Uses "<image>.idx" if it was written for this exact image, else
+ * rebuilds it.  A failure to save the index is not fatal: gzip windows
+ * then live in an unlinked temporary file for the session.
+ */
+
+static int load_index(struct zimage *z, const char *path)
+{
+	char idx_path[4096];
+	struct zidx_header hdr;
+	struct stat img_st, idx_st;
+	size_t plen;
+	int ret;
+
+	snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+	assert(fstat(z->fd, &img_st) == 0);
+	z->in_size = img_st.st_size;
+
+	z->idx_fd = open(idx_path, O_RDONLY);
+	if (z->idx_fd != -1) {
+		if (fstat(z->idx_fd, &idx_st) == 0 && idx_st.st_mtime >= img_st.st_mtime &&
+		    pread(z->idx_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+		    !memcmp(hdr.magic, IDX_MAGIC, 8) && hdr.type == (os_uint32_t)z->type &&
+		    hdr.in_size == z->in_size) {
+			z->npoints = hdr.npoints;
+			z->out_size = hdr.out_size;
+			plen = z->npoints * sizeof(struct zpoint);
+			z->points = malloc(plen);
+			assert(z->points != NULL);
+			if (pread(z->idx_fd, z->points, plen,
+				  idx_st.st_size - plen) == (ssize_t)plen)
+				return(0);
+			free(z->points);
+			z->points = NULL;
+			z->npoints = 0;
+		}
+		close(z->idx_fd);
+	}
+
+	printf("Building chunk index for \"%s\" ...\n", path);
+	z->idx_fd = open(idx_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (z->idx_fd == -1) {
+		char tmp[] = "/tmp/ext-shell-idx.XXXXXX";
+
+		z->idx_fd = mkstemp(tmp);
+		assert(z->idx_fd != -1);
+		unlink(tmp);
+		idx_path[0] = '\0';
+	}
+
+	if (z->type == IMG_GZIP)
+		ret = gz_build_index(z, z->idx_fd);
+#ifdef HAVE_ZSTD
+	else
+		ret = zstd_build_index(z);
+#else
+	else
+		ret = -1;
+#endif
+	if (ret)
+		return(-1);
+
+	memcpy(hdr.magic, IDX_MAGIC, 8);
+	hdr.type = z->type;
+	hdr.npoints = z->npoints;
+	hdr.in_size = z->in_size;
+	hdr.out_size = z->out_size;
+	plen = z->npoints * sizeof(struct zpoint);
+	assert(fstat(z->idx_fd, &idx_st) == 0);
+	if (idx_st.st_size < (off_t)sizeof(hdr))
+		idx_st.st_size = sizeof(hdr);
+	assert(pwrite(z->idx_fd, z->points, plen, idx_st.st_size) == (ssize_t)plen);
+	assert(pwrite(z->idx_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+
+	if (idx_path[0])
+		printf("Saved %u access points to \"%s\"\n", z->npoints, idx_path);
+	return(0);
+}
+
+/* open_direct
+ *
+ * Switches raw image 'fd' to O_DIRECT.  The flag is set after the open
+ * so that detect_type() can still peek at the first bytes unaligned.
+ */
+
+static int open_direct(int fd)
+{
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) != 0) {
+		close(fd);
+		return(-1);
+	}
+
+	pthread_mutex_lock(&rawmap_lock);
+	__atomic_store_n(&directs[fd], 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rawmap_lock);
+	return(fd);
+}
+
+int img_open(const char *path, int flags)
+{
+	struct zimage *z;
+	int fd;
+
+	pthread_once(&tables_once, alloc_tables);
+	fd = open(path, flags & ~O_DIRECT);
+	if (fd == -1)
+		return(fd);
+	if (fd >= nfds) {
+		// the limit was raised after the tables were sized
+		close(fd);
+		errno = EMFILE;
+		return(-1);
+	}
+	if (detect_type(fd) == IMG_RAW)
+		return(flags & O_DIRECT ? open_direct(fd) : fd);
+
+	z = calloc(1, sizeof(struct zimage));
+	assert(z != NULL);
+	z->fd = fd;
+	z->type = detect_type(fd);
+	pthread_mutex_init(&z->lock, NULL);
+
+#ifndef HAVE_ZSTD
+	if (z->type == IMG_ZSTD) {
+		printf("zstd images need ext-shell built with ZSTD=1\n");
+		free(z);
+		close(fd);
+		return(-1);
+	}
+#endif
+	if (load_index(z, path)) {
+		printf("Could NOT index compressed image \"%s\"\n", path);
+		free(z->points);
+		free(z);
+		close(fd);
+		return(-1);
+	}
+
+	pthread_mutex_lock(&zimages_lock);
+	if (fd >= nzimages)
+		nzimages = fd + 1;
+	__atomic_store_n(&zimages[fd], z, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&zimages_lock);
+	return(fd);
+}
+
+ssize_t img_pwrite(int fd, const void *buf, size_t len, os_uint64_t off)
+{
+	if (zimage_of(fd) != NULL) {
+		errno = EROFS;
+		return(-1);
+	}
+	return(pwrite(fd, buf, len, (off_t)off));
+}
+
+ssize_t img_pwritev(int fd, const struct iovec *iov, int iovcnt, os_uint64_t off)
+{
+	if (zimage_of(fd) != NULL) {
+		errno = EROFS;
+		return(-1);
+	}
+	return(pwritev(fd, iov, iovcnt, (off_t)off));
+}
+
+os_bool_t img_is_compressed(int fd)
+{
+	return(zimage_of(fd) != NULL);
+}
+
+/* evict_chunks
+ *
+ * The memory governor's evict function: frees the least recently used
+ * chunk of one compressed image after the other.
+ */
+
+static size_t evict_chunks(void *arg, size_t bytes)
+{
+	struct zchunk *victim;
+	struct zimage *z;
+	size_t freed = 0;
+	int i, s, empty = 0;
+
+	pthread_mutex_lock(&zimages_lock);
+	while (freed < bytes && nzimages > 0 && empty < nzimages) {
+		i = evict_hand++ % nzimages;
+		if ((z = zimages[i]) == NULL) {
+			empty++;
+			continue;
+		}
+		pthread_mutex_lock(&z->lock);
+		victim = NULL;
+		for (s = 0; s < IMG_CHUNK_CACHE; s++)
+			if (z->cache[s].data && (victim == NULL || z->cache[s].tick < victim->tick))
+				victim = &z->cache[s];
+		if (victim != NULL) {
+			free(victim->data);
+			victim->data = NULL;
+			freed += victim->len;
+			empty = 0;
+		} else {
+			empty++;
+		}
+		pthread_mutex_unlock(&z->lock);
+	}
+	pthread_mutex_unlock(&zimages_lock);
+	mg_uncharge(chunks_mg, freed);
+	return(freed);
+}
+
+/* get_chunk
+ *
+ * Returns the cached, decompressed chunk 'i', decompressing it into the
+ * least recently used slot on a miss.  Called with z->lock held; the
+ * bytes of a newly cached chunk are added to *grown, for the caller to
+ * charge to the memory governor once it has let go of the lock.
+ */
+
+static struct zchunk *get_chunk(struct zimage *z, os_uint32_t i, size_t *grown)
+{
+	struct zchunk *c, *victim = &z->cache[0];
+	os_uint64_t end, t0;
+	int s, ret;
+
+	for (s = 0; s < IMG_CHUNK_CACHE; s++) {
+		c = &z->cache[s];
+		if (c->data && c->idx == i) {
+			c->tick = ++z->tick;
+			mg_hit(chunks_mg);
+			return(c);
+		}
+		if (!c->data || (victim->data && c->tick < victim->tick))
+			victim = c;
+	}
+
+	mg_miss(chunks_mg);
+	end = i + 1 < z->npoints ? z->points[i+1].out : z->out_size;
+	if (victim->data != NULL)
+		mg_uncharge(chunks_mg, victim->len);
+	free(victim->data);
+	victim->len = end - z->points[i].out;
+	victim->data = malloc(victim->len);
+	assert(victim->data != NULL);
+
+	t0 = trace_begin();
+	if (z->type == IMG_GZIP)
+		ret = gz_read_chunk(z, i, victim->data, victim->len);
+#ifdef HAVE_ZSTD
+	else
+		ret = zstd_read_chunk(z, i, victim->data, victim->len);
+#else
+	else
+		ret = -1;
+#endif
+	trace_end(t0, "chunk miss", TRACE_CACHE, "chunk", i);
+	if (ret) {
+		free(victim->data);
+		victim->data = NULL;
+		return(NULL);
+	}
+
+	victim->idx = i;
+	victim->tick = ++z->tick;
+	*grown += victim->len;
+	return(victim);
+}
+
+void *img_alloc(size_t len)
+{
+	void *p;
+
+	if (posix_memalign(&p, IMG_DIRECT_ALIGN, len ? len : 1) != 0)
+		return(NULL);
+	memset(p, 0, len);
+	return(p);
+}
+
+/* direct_pread
+ *
+ * img_pread for O_DIRECT images.  Aligned requests go straight to the
+ * file; others are widened to aligned bounds and read through the
+ * thread's bounce buffer, IMG_DIRECT_BOUNCE bytes at a time.
+ */
+
+static ssize_t direct_pread(int fd, unsigned char *buf, size_t len, os_uint64_t off)
+{
+	const os_uint64_t mask = IMG_DIRECT_ALIGN - 1;
+	os_uint64_t start, end;
+	size_t done = 0, n;
+	ssize_t r;
+
+	if (((uintptr_t)buf & mask) == 0 && (off & mask) == 0 && (len & mask) == 0)
+		return(pread(fd, buf, len, (off_t)off));
+
+	if (bounce == NULL)
+		assert((bounce = img_alloc(IMG_DIRECT_BOUNCE)) != NULL);
+	while (done < len) {
+		start = off & ~mask;
+		end = (off + (len - done) + mask) & ~mask;
+		if (end - start > IMG_DIRECT_BOUNCE)
+			end = start + IMG_DIRECT_BOUNCE;
+
+		r = pread(fd, bounce, end - start, (off_t)start);
+		if (r < 0)
+			return(done ? (ssize_t)done : -1);
+		if ((os_uint64_t)r <= off - start)
+			break;
+
+		n = r - (off - start);
+		if (n > len - done)
+			n = len - done;
+		memcpy(buf + done, bounce + (off - start), n);
+		done += n;
+		off += n;
+		if ((os_uint64_t)r < end - start)
+			break;
+	}
+	return(done);
+}
+
+// the overlay of 'fd' and its argument in *arg, or NULL
+static img_overlay_fn overlay_of(int fd, void **arg)
+{
+	img_overlay_fn fn;
+
+	if (fd < 0 || fd >= nfds)
+		return(NULL);
+	fn = __atomic_load_n(&overlays[fd].fn, __ATOMIC_ACQUIRE);
+	if (fn != NULL)
+		*arg = __atomic_load_n(&overlays[fd].arg, __ATOMIC_RELAXED);
+	return(fn);
+}
+
+void img_set_overlay(int fd, img_overlay_fn fn, void (*release)(void *arg), void *arg)
+{
+	assert(fd >= 0 && fd < nfds);
+	pthread_mutex_lock(&rawmap_lock);
+	overlays[fd].release = release;
+	__atomic_store_n(&overlays[fd].arg, arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&overlays[fd].fn, fn, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rawmap_lock);
+}
+
+ssize_t img_pread(int fd, void *buf, size_t len, os_uint64_t off)
+{
+	void *arg = NULL;
+	img_overlay_fn fn = overlay_of(fd, &arg);
+	ssize_t n = img_pread_raw(fd, buf, len, off);
+
+	if (n > 0 && fn != NULL)
+		fn(arg, fd, buf, n, off);
+	return(n);
+}
+
+ssize_t img_pread_raw(int fd, void *buf, size_t len, os_uint64_t off)
+{
+	struct zimage *z = zimage_of(fd);
+	unsigned char *dst = buf;
+	struct zchunk *c;
+	os_uint32_t lo, hi, mid;
+	size_t done = 0, n, grown = 0;
+
+	if (z == NULL && is_direct(fd))
+		return(direct_pread(fd, buf, len, off));
+	if (z == NULL)
+		return(pread(fd, buf, len, (off_t)off));
+
+	pthread_mutex_lock(&z->lock);
+	while (done < len && off < z->out_size) {
+		// last access point at or before 'off'
+		lo = 0;
+		hi = z->npoints;
+		while (hi - lo > 1) {
+			mid = (lo + hi) / 2;
+			if (z->points[mid].out <= off)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		c = get_chunk(z, lo, &grown);
+		if (c == NULL) {
+			pthread_mutex_unlock(&z->lock);
+			mg_charge(chunks_mg, grown);
+			return(-1);
+		}
+
+		n = c->len - (off - z->points[lo].out);
+		if (n > len - done)
+			n = len - done;
+		memcpy(dst + done, c->data + (off - z->points[lo].out), n);
+		done += n;
+		off += n;
+	}
+	pthread_mutex_unlock(&z->lock);
+	mg_charge(chunks_mg, grown);
+
+	return(done);
+}
+
+const unsigned char *img_map(int fd, os_uint64_t *len)
+{
+	struct stat st;
+	void *addr;
+
+	// a mapping would go through the page cache O_DIRECT avoids, and
+	// around an overlay
+	if (zimage_of(fd) != NULL || fd < 0 || fd >= nfds || is_direct(fd) ||
+	    overlay_of(fd, &addr) != NULL)
+		return(NULL);
+
+	pthread_mutex_lock(&rawmap_lock);
+	if (rawmaps[fd].addr == NULL && fstat(fd, &st) == 0 && st.st_size > 0) {
+		addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr != MAP_FAILED) {
+			rawmaps[fd].addr = addr;
+			rawmaps[fd].len = st.st_size;
+		}
+	}
+	addr = rawmaps[fd].addr;
+	*len = rawmaps[fd].len;
+	pthread_mutex_unlock(&rawmap_lock);
+
+	return(addr);
+}
+
+void img_close(int fd)
+{
+	struct zimage *z = zimage_of(fd);
+	struct overlay o = { NULL, NULL, NULL };
+	int s;
+
+	if (fd >= 0 && fd < nfds) {
+		pthread_mutex_lock(&rawmap_lock);
+		o = overlays[fd];
+		__atomic_store_n(&overlays[fd].fn, NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&directs[fd], 0, __ATOMIC_RELEASE);
+		if (rawmaps[fd].addr != NULL) {
+			munmap(rawmaps[fd].addr, rawmaps[fd].len);
+			rawmaps[fd].addr = NULL;
+			rawmaps[fd].len = 0;
+		}
+		pthread_mutex_unlock(&rawmap_lock);
+	}
+	if (o.fn != NULL && o.release != NULL)
+		o.release(o.arg);
+
+	if (z != NULL) {
+		// out of reach of evict_chunks() first
+		pthread_mutex_lock(&zimages_lock);
+		__atomic_store_n(&zimages[fd], NULL, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&zimages_lock);
+		for (s = 0; s < IMG_CHUNK_CACHE; s++) {
+			if (z->cache[s].data != NULL)
+				mg_uncharge(chunks_mg, z->cache[s].len);
+			free(z->cache[s].data);
+		}
+		free(z->points);
+		close(z->idx_fd);
+		pthread_mutex_destroy(&z->lock);
+		free(z);
+	}
+	close(fd);
+}
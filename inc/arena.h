@@ -0,0 +1,52 @@
+// This file defines a simple bump ("arena") allocator.
+//
+// Memory is handed out from large chunks and given back all at once,
+// either completely with arena_reset() or down to an earlier
+// arena_mark().  Chunks are kept for reuse rather than freed, so after
+// the first few commands a session runs with no heap traffic at all and
+// its footprint is bounded by the largest single command.
+
+#ifndef EXT2READER_INC_ARENA_H
+#define EXT2READER_INC_ARENA_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+#define ARENA_CHUNK (256 * 1024)
+
+struct os_arena_chunk_t;
+
+struct os_arena_t {
+  struct os_arena_chunk_t *head;  // first chunk, NULL until first use
+  struct os_arena_chunk_t *cur;   // chunk allocations currently come from
+};
+
+// A position in the arena that arena_release() can roll back to.
+struct os_arena_mark_t {
+  struct os_arena_chunk_t *chunk;
+  size_t used;
+};
+
+#define ARENA_INIT { NULL, NULL }
+
+// Returns 'len' bytes aligned to 16; never fails (asserts on OOM).
+void *arena_alloc(struct os_arena_t *arena, size_t len);
+
+struct os_arena_mark_t arena_mark(struct os_arena_t *arena);
+void arena_release(struct os_arena_t *arena, struct os_arena_mark_t mark);
+
+// Releases everything allocated, keeping the chunks.
+void arena_reset(struct os_arena_t *arena);
+
+// Gives all chunks back to the system.
+void arena_free(struct os_arena_t *arena);
+
+// Bytes of chunk memory held by the arena.
+size_t arena_bytes(struct os_arena_t *arena);
+
+// Per-thread arena for short-lived buffers (directory and indirect
+// blocks).  Users must take a mark and release it before returning.
+struct os_arena_t *arena_scratch(void);
+
+#endif  // EXT2READER_INC_ARENA_H
@@ -0,0 +1,36 @@
+// This file defines batch mode, 'ext-shell --batch <manifest> <command>',
+// which runs one command on every image listed in a manifest from a
+// single process.
+//
+// The images are handed out one at a time to the shared thread pool,
+// biggest file first, so the long runs start early and the small
+// images fill the gaps around them; a command that works per
+// blockgroup (query) spreads over whichever workers are idle.  Each
+// image's output is collected in memory and written out in one piece
+// as soon as it is done, after a "==> <image> <==" line, so results
+// stream in completion order and never interleave.  cat is the
+// exception: a file can be too big to hold, so it is written out as it
+// is read, with the other images' output waiting meanwhile.
+//
+// All images share one memory budget, the memory governor's limit
+// (memgov.h): the block caches and the chunk caches of compressed
+// images give memory back as the images being worked on need it, and
+// the inode tables of images being queried are cached only when they
+// fit and are otherwise read one blockgroup at a time.
+
+#ifndef EXT2READER_INC_BATCH_H
+#define EXT2READER_INC_BATCH_H
+
+#include <stddef.h>
+
+#define BATCH_DEFAULT_MEM ((size_t)1 << 30)
+
+// Runs 'cmd' (ls|stat|cat <path>, or query [-n] <pred>...) on every
+// image in the file 'manifest', one path per line; empty lines and
+// lines starting with '#' are skipped.  Images are opened with
+// img_open() 'flags'.  'mem' is the memory limit in bytes, 0 for
+// BATCH_DEFAULT_MEM.  Returns the process exit status: non-zero if
+// any image failed.
+int batch(const char *manifest, char **cmd, int ncmd, int flags, size_t mem);
+
+#endif  // EXT2READER_INC_BATCH_H
@@ -0,0 +1,42 @@
+// This file defines the block caches for filesystem metadata blocks:
+// one for indirect blocks of the block map, one for inode table blocks
+// when the tables are not cached whole.
+//
+// The caches are shared by all images and threads of the process.  Each
+// is split into shards with one lock each, every shard keeping its
+// blocks in LRU order.  Both register with the memory governor
+// (memgov.h), which bounds them when there is a memory limit; without
+// one each is bounded by its own byte budget.  A lookup copies the
+// block out, so callers never hold references into the cache.
+
+#ifndef EXT2READER_INC_BCACHE_H
+#define EXT2READER_INC_BCACHE_H
+
+#include <stddef.h>
+
+#include "types.h"
+#include "ext2access.h"
+
+#define BCACHE_SHARDS 16
+#define BCACHE_DEFAULT_BYTES (64 << 20)
+
+// Reads indirect block 'blocknum' of image 'fd' into buffer, from the
+// cache if it is there, else from the image (and then caches it).
+void bcache_read(int fd, struct os_fs_metadata_t *metadata,
+                 os_uint32_t blocknum, void *buffer);
+
+// bcache_read() for blocks of the inode tables.
+void bcache_read_inodes(int fd, struct os_fs_metadata_t *metadata,
+                        os_uint32_t blocknum, void *buffer);
+
+// Drops every cached block of image 'fd'; call before closing it.
+void bcache_forget(int fd);
+
+// Sets the byte budget of each cache without a memory limit (0
+// disables caching) and evicts down to it.
+void bcache_set_limit(size_t bytes);
+
+// hits, misses and size of the indirect block cache
+void bcache_stats(os_uint64_t *hits, os_uint64_t *misses, size_t *bytes);
+
+#endif  // EXT2READER_INC_BCACHE_H
@@ -0,0 +1,68 @@
+// This file defines the duplicate block detector behind the 'dedup'
+// command.
+//
+// Every data block of every regular file is hashed (128 bits) while streaming
+// the disk in physical order, in chunks of DEDUP_CHUNK blocks spread
+// over the thread pool.  Memory stays bounded in two ways:
+//
+//  - pass 1 only records each hash in a fixed-size sketch of two bit
+//    arrays ("seen", "seen twice"), so blocks that are certainly
+//    unique are never stored;
+//  - pass 2 re-reads the disk and inserts the remaining candidates
+//    into a concurrent hash table.  If the candidates do not fit the
+//    memory limit, the hash space is split into partitions and pass 2
+//    runs once per partition;
+//  - twins are counted per file in one counter per inode if those fit
+//    a quarter of the limit, else per partition in the table memory.
+//
+// Blocks that hold only zeros are counted apart: they are better
+// turned into holes than shared.
+
+#ifndef EXT2READER_INC_DEDUP_H
+#define EXT2READER_INC_DEDUP_H
+
+#include <stddef.h>
+
+#include "types.h"
+#include "ext2access.h"
+#include "revmap.h"
+#include "threadpool.h"
+
+#define DEDUP_CHUNK 1024              // blocks per task and read window
+#define DEDUP_DEFAULT_MEM (256 << 20)
+#define DEDUP_TOP 10                  // sets and files kept in a report
+#define DEDUP_SET_BLOCKS 8            // blocks listed per reported set
+
+struct os_dedup_set_t {
+  os_uint32_t copies;
+  os_uint32_t blocks[DEDUP_SET_BLOCKS];  // the first few of them
+};
+
+struct os_dedup_file_t {
+  os_uint32_t inode;
+  os_uint64_t dup_blocks;   // blocks of the file that have a twin
+};
+
+struct os_dedup_report_t {
+  os_uint64_t data_blocks;
+  os_uint64_t zero_blocks;
+  os_uint64_t sets;          // groups of identical non-zero blocks
+  os_uint64_t dup_blocks;    // blocks in those groups
+  os_uint64_t reclaimable;   // blocks freed by keeping one per group
+  os_uint32_t partitions;    // pass 2 runs
+  struct os_dedup_set_t top[DEDUP_TOP];    // biggest groups
+  int ntop;
+  struct os_dedup_file_t files[DEDUP_TOP]; // files with most twins
+  int nfiles;
+  os_bool_t files_exact;     // FALSE: counted per partition, may be low
+};
+
+// Scans the data blocks listed in 'owners' using at most about
+// 'mem_limit' bytes for the inode bitmap and counters, the sketch and
+// the table.  Returns FALSE on a
+// read error.
+os_bool_t dedup_scan(int fd, struct os_fs_metadata_t *metadata,
+                     struct os_revmap_t *owners, struct os_threadpool_t *tp,
+                     size_t mem_limit, struct os_dedup_report_t *report);
+
+#endif  // EXT2READER_INC_DEDUP_H
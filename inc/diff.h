@@ -0,0 +1,34 @@
+// This file defines the entry point of 'ext-shell --diff', which
+// compares two images of the same filesystem (e.g. two snapshots) and
+// reports the paths that were added, removed or modified.
+//
+// The comparison works top-down so that its cost follows the size of
+// the change rather than the size of the images:
+//
+//   1. the descriptors, then the inode tables of every blockgroup are
+//      compared and groups equal in both images are skipped;
+//   2. in the remaining groups only inodes whose mode, times, size or
+//      block map differ are looked at;
+//   3. the entries of the directories among them are compared by name,
+//      which catches renames and hard links;
+//   4. the changed inodes are mapped back to paths, starting from the
+//      directories that changed themselves.
+//
+// File contents are only compared when asked to.
+
+#ifndef EXT2READER_INC_DIFF_H
+#define EXT2READER_INC_DIFF_H
+
+#include "types.h"
+
+// Prints one line per changed path to stdout:
+//   A <path>   added in image b
+//   D <path>   removed from image b
+//   M <path>   modified
+//   m <path>   attributes changed, contents equal (compare_data only)
+//
+// Returns 0 if the images are equal, 1 if they differ, -1 on error.
+int diff_images(const char *path_a, const char *path_b,
+                os_bool_t compare_data);
+
+#endif  // EXT2READER_INC_DIFF_H
@@ -82,4 +82,17 @@ struct os_direntry_t {
   os_uint8_t file_name[EXT2_NAME_LEN];
 };
 
+// The length of the record, in bytes.  A 64 KiB block holds lengths up
+// to 65536, which do not fit in rec_len: there, the low two bits
+// (always zero in a real length) carry bits 16 and 17, and 0 or 65535
+// stand for a record spanning the whole block.
+static inline os_uint32_t dirent_rec_len(os_uint16_t rec_len, os_uint32_t block_size)
+{
+  if (block_size < 65536)
+    return rec_len;
+  if (rec_len == 0 || rec_len == 65535)
+    return block_size;
+  return (rec_len & 65532) | ((os_uint32_t)(rec_len & 3) << 16);
+}
+
 #endif // EXT2READER_INC_DIRECTORYENTRY_H
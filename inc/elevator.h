@@ -0,0 +1,48 @@
+// This file defines the I/O elevator: reads of many small pieces of an
+// image (inodes, blocks) that a caller knows about at once are handed
+// over as one batch instead of one img_pread() each.
+//
+// The batch is sorted by image offset and requests that are adjacent,
+// overlap or lie at most the gap tolerance apart are merged into one
+// read, of at most ELV_MAX_READ bytes, into a scratch buffer from which
+// each request is copied out.  Requests are taken in logical order
+// (directory order, tree order) that jumps around the image; on disks
+// and network-backed images where a seek costs more than reading the
+// gap, the sweep in disk order is much cheaper.  Requests that stand
+// alone are read straight into their buffer.
+
+#ifndef EXT2READER_INC_ELEVATOR_H
+#define EXT2READER_INC_ELEVATOR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "types.h"
+
+#define ELV_DEFAULT_GAP (64 << 10)  // bytes read in vain to save a seek
+#define ELV_MAX_READ (1 << 20)      // merged reads are cut at this size
+
+// One read: 'len' bytes at image offset 'off' into 'buf'.  elv_submit()
+// sets 'done' to the bytes read (short at the end of the image), or -1.
+struct os_io_req_t {
+  os_uint64_t off;
+  size_t len;
+  void *buf;
+  ssize_t done;
+};
+
+// Sets the gap tolerance in bytes (0 merges adjacent requests only),
+// process-wide like tp_set_threads().
+void elv_set_gap(size_t bytes);
+size_t elv_gap(void);
+
+// Reads the 'n' requests of image 'fd' in offset order, merging them as
+// above; 'what' labels the reads in the trace (trace.h).  The requests
+// themselves are not reordered.  Returns the number of requests that
+// were not read in full.
+size_t elv_submit(int fd, struct os_io_req_t *reqs, size_t n, const char *what);
+
+// Requests submitted and reads issued for them since the start.
+void elv_stats(os_uint64_t *requests, os_uint64_t *reads);
+
+#endif  // EXT2READER_INC_ELEVATOR_H
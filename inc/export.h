@@ -0,0 +1,28 @@
+// This file defines the archive export used by the shell's 'export'
+// command: a subtree of the image is written as one POSIX tar (ustar,
+// with pax headers for long names and big files) or cpio newc stream.
+//
+// File bodies of raw images are not copied: they are handed to
+// writev(2) as slices of the read-only image mapping.  The stream is
+// assembled into two alternating batches, and a writer thread drains
+// one batch while the tree walk fills the other and asks the kernel to
+// read ahead the image pages the next batch refers to.
+
+#ifndef EXT2READER_INC_EXPORT_H
+#define EXT2READER_INC_EXPORT_H
+
+#include "types.h"
+#include "ext2access.h"
+
+#define EXPORT_TAR   0
+#define EXPORT_CPIO  1
+
+// Writes the subtree rooted at inode 'dir_inode' to out_fd.  Entries
+// are named "<root_name>/...".
+//
+// Returns the number of entries written, or -1 on a write error.
+os_int64_t export_tree(int fd, struct os_fs_metadata_t *metadata,
+                       os_uint32_t dir_inode, const char *root_name,
+                       int out_fd, int format);
+
+#endif  // EXT2READER_INC_EXPORT_H
@@ -10,11 +10,15 @@
 #ifndef EXT2READER_INC_EXT2ACCESS_H
 #define EXT2READER_INC_EXT2ACCESS_H
 
+#include <sys/types.h>
+
 #include "types.h"
 #include "blockgroup_descriptor.h"
 #include "directoryentry.h"
 #include "inode.h"
 #include "superblock.h"
+#include "arena.h"
+#include "namefilter.h"
 
 // For each block group, this structure tracks the block numbers of
 // the first and last block in that blockgroup.
@@ -25,9 +29,13 @@ struct os_blockgroup_offsets_t {
   os_uint32_t last_block_in_blockgroup;   // blocknum of last block
 };
 
+struct os_inostore_t;
+struct os_parentmap_t;
+struct os_revmap_t;
+
 // some useful metadata that you will calculate about the disk
 struct os_fs_metadata_t {
-  os_uint32_t disk_size;              // # of bytes in disk image
+  os_uint64_t disk_size;              // # of bytes in disk image
   os_uint32_t block_size;             // blocksize, as defined in superblock
   os_uint32_t num_blocks;             // # of blocks in this disk
   os_uint32_t blockgroup_size;        // # of blocks per blockgroup
@@ -46,12 +54,203 @@ struct os_fs_metadata_t {
   // pointer to the blockgroup descriptor table (one entry per
   // block group).  you'll malloc space for this.
   struct os_blockgroup_descriptor_t *bgdt;
+
+  // with load_fs_metadata_lazy(), one bit per block of the descriptor
+  // table, set once that block has been read into bgdt; NULL when the
+  // whole table was read up front.
+  unsigned char *bgdt_loaded;
+
+  // size in bytes of one on-disk inode record (128 for revision 0).
+  os_uint32_t inode_size;
+
+  // cached copy of every blockgroup's inode table, laid out back to
+  // back with inode_size bytes per inode, or NULL if not loaded.
+  unsigned char *inode_table;
+
+  // cached block and inode bitmaps, block_size bytes per blockgroup,
+  // or NULL if not loaded (see preload_metadata()).
+  unsigned char *block_bitmap;
+  unsigned char *inode_bitmap;
+
+  // columnar copy of the hot inode fields (see inostore.h), used
+  // instead of inode_table on large filesystems, or NULL.
+  struct os_inostore_t *columns;
+
+  // child -> (parent, name) map of the whole tree, built on first use
+  // by commands that turn inode numbers into paths, or NULL.
+  struct os_parentmap_t *parents;
+
+  // block -> owning inode map (see revmap.h), built on first use, or NULL.
+  struct os_revmap_t *owners;
+};
+
+// Callback for dir_foreach(), called once per live directory entry.
+// Return non-zero to stop the iteration.
+typedef int (*os_dirent_cb_t)(struct os_direntry_t *entry, void *arg);
+
+// Callback for file_extents(): 'count' logical blocks starting at
+// 'logical' live in disk blocks physical..physical+count-1, or are a
+// hole if physical is 0.  Return non-zero to stop the walk.
+typedef int (*os_extent_cb_t)(os_uint32_t logical, os_uint32_t physical,
+                              os_uint32_t count, void *arg);
+
+// One directory entry as returned by dir_iter_next().  'name' points
+// into the directory block itself and is NOT NUL-terminated; the view
+// is valid until the next call on the iterator.
+struct os_dirent_view_t {
+  os_uint32_t inode;
+  os_uint8_t file_type;
+  os_uint8_t name_len;
+  const char *name;
+  const struct os_direntry_t *entry;
+};
+
+// Iterator over the live entries of a directory.  Blocks of raw images
+// are looked at in place in the image mapping.  Others are read into a
+// window from the scratch arena, up to DIR_WINDOW bytes of consecutive
+// directory blocks at a time in one batch through the elevator
+// (elevator.h), so nothing is copied per entry and a directory costs a
+// few sorted, merged reads rather than one per block.
+// Iterators use the scratch arena, so they must be ended in the
+// reverse order they were started.
+struct os_dir_iter_t {
+  int fd;
+  struct os_fs_metadata_t *fs;
+  struct os_inode_t inode;
+  const struct os_name_filter_t *filter;  // or NULL for all entries
+  const unsigned char *map;               // image mapping, or NULL
+  os_uint64_t map_len;
+  os_uint32_t nblocks;                    // blocks still to visit ...
+  os_uint32_t next_block;                 // ... starting at this one
+  const unsigned char *block;             // current block
+  os_uint32_t block_len;
+  os_uint32_t off;                        // next entry within block
+  unsigned char *buf;
+  unsigned char *window;                  // blocks win_first.. of the
+  os_uint32_t *win_blk;                   // directory, and their disk
+  os_uint32_t win_first, win_count, win_cap;  // blocks (0: hole)
+  struct os_arena_mark_t mark;
 };
 
+#define DIR_WINDOW (128 << 10)
+
 // Function prototypes for the functions you'll implement.
 //
 struct os_superblock_t *read_superblock(int fd);
 
+// reads superblock, metadata and blockgroup descriptor table in one go.
+// returns NULL if fd does not contain an ext2 filesystem.
+struct os_fs_metadata_t *load_fs_metadata(int fd);
+
+// like load_fs_metadata(), but descriptors are read one table block at
+// a time as fetch_inode() and group_inode_table() need them, so that a
+// short lookup on a huge filesystem does not read the whole table.
+// Only those two may be used on groups whose descriptor was not read
+// yet, and the metadata must not be shared between threads.
+struct os_fs_metadata_t *load_fs_metadata_lazy(int fd);
+
+// frees the metadata and everything cached in it (inode tables,
+// bitmaps, columns, parent and owner maps).
+void free_fs_metadata(struct os_fs_metadata_t *metadata);
+
+// caches every inode table in metadata->inode_table, if they fit in
+// the memory limit (see mg_reserve() in memgov.h); they are left NULL
+// otherwise.  Returns FALSE on a read error.
+os_bool_t read_inode_tables(int fd, struct os_fs_metadata_t *metadata);
+
+struct os_threadpool_t;
+
+// loads the block and inode bitmaps and, if 'tables' is set and they
+// fit in the memory limit, the inode tables of every blockgroup, one
+// group per task on 'tp'.  Descriptors
+// pointing outside the filesystem are reported on stderr and their
+// group is skipped; *bad_groups gets their number.  Returns FALSE on a
+// read error.
+os_bool_t preload_metadata(int fd, struct os_fs_metadata_t *metadata,
+                           struct os_threadpool_t *tp, os_bool_t tables,
+                           os_uint32_t *bad_groups);
+
+// returns the inode table of blockgroup 'group': the cached copy if the
+// tables are loaded, else it is read into 'buffer', which must hold
+// inodes_per_group * inode_size bytes.  NULL on a read error.
+const unsigned char *group_inode_table(int fd, struct os_fs_metadata_t *metadata,
+                                       os_uint32_t group, unsigned char *buffer);
+
+// returns the first bit at or after 'from' in the first 'nbits' bits
+// of a block or inode bitmap that is set (value 1) or clear (value 0),
+// or nbits if there is none.
+os_uint32_t bitmap_find(const unsigned char *bits, os_uint32_t from,
+                        os_uint32_t nbits, int value);
+
+// reads block 'blocknum' of the disk into buffer (block_size bytes).
+void read_block(int fd, struct os_fs_metadata_t *metadata,
+                os_uint32_t blocknum, void *buffer);
+
+// read_block for blocks that hold metadata: 'what' (one of the TRACE_*
+// block names in trace.h) labels the read in the trace.
+void read_block_as(int fd, struct os_fs_metadata_t *metadata,
+                   os_uint32_t blocknum, void *buffer, const char *what);
+
+// the size of a file in bytes, including the upper 32 bits that
+// regular files keep in i_dir_acl.
+os_uint64_t file_size(struct os_inode_t *inode);
+
+// maps logical block 'blocknum' of a file to its disk block; returns 0
+// for holes.
+os_uint32_t file_bmap(struct os_inode_t *file_inode, int fd,
+                      struct os_fs_metadata_t *metadata,
+                      os_uint32_t blocknum);
+
+// reads up to 'len' bytes of a file starting at byte 'offset' into buf,
+// like pread(2); holes read as zeros.  The offset is mapped straight to
+// its block and each run of contiguous blocks is read at once, so a
+// small read costs the same anywhere in a file.  Returns the number of
+// bytes read (short only at the end of the file), or -1 on a read error.
+ssize_t file_pread(int fd, struct os_fs_metadata_t *metadata,
+                   struct os_inode_t *file_inode, os_uint64_t offset,
+                   size_t len, void *buf);
+
+// walks the block map of a file in logical order and calls cb once per
+// run of physically contiguous blocks (or of holes).  returns TRUE if
+// cb stopped the walk.
+os_bool_t file_extents(struct os_inode_t *file_inode, int fd,
+                       struct os_fs_metadata_t *metadata,
+                       os_extent_cb_t cb, void *arg);
+
+// like file_extents(), and also calls meta_cb(logical, block, level)
+// for every indirect block, before the blocks it maps; 'logical' is the
+// first file block behind it and 'level' is 1..3 for single, double
+// and triple indirect blocks.
+os_bool_t file_map_walk(struct os_inode_t *file_inode, int fd,
+                        struct os_fs_metadata_t *metadata,
+                        os_extent_cb_t cb, os_extent_cb_t meta_cb, void *arg);
+
+// resolves 'path', absolute or relative to directory 'base_inode'.
+// returns the inode number, or 0 if the path does not exist.
+os_uint32_t path_lookup(const char *path, os_uint32_t base_inode, int fd,
+                        struct os_fs_metadata_t *metadata);
+
+// calls cb for every live entry in the directory 'dir_inode'.
+// returns TRUE if cb stopped the iteration.
+os_bool_t dir_foreach(struct os_inode_t *dir_inode, int fd,
+                      struct os_fs_metadata_t *metadata,
+                      os_dirent_cb_t cb, void *arg);
+
+// starts iterating directory 'dir_inode', yielding only the entries
+// whose names match 'filter' (NULL for all).
+void dir_iter_init(struct os_dir_iter_t *it, struct os_inode_t *dir_inode,
+                   int fd, struct os_fs_metadata_t *metadata,
+                   const struct os_name_filter_t *filter);
+
+// the same, over 'len' bytes of directory data already in memory.
+void dir_iter_buffer(struct os_dir_iter_t *it, const unsigned char *directory,
+                     os_uint32_t len, const struct os_name_filter_t *filter);
+
+// fills in the next entry; returns FALSE at the end of the directory.
+os_bool_t dir_iter_next(struct os_dir_iter_t *it, struct os_dirent_view_t *view);
+
+void dir_iter_end(struct os_dir_iter_t *it);
+
 struct os_fs_metadata_t *calc_metadata(int fd, struct os_superblock_t *sb);
 
 struct os_blockgroup_descriptor_t *read_bgdt(int fd,
@@ -61,6 +260,14 @@ os_bool_t fetch_inode(os_uint32_t inode_number, int fd,
                       struct os_fs_metadata_t *metadata,
                       struct os_inode_t *returned_inode);
 
+// fetch_inode() for 'n' inodes at once, in one sorted and merged batch
+// of reads (see elevator.h) when they come from the image.  Inodes that
+// cannot be read are zeroed, so their i_mode is 0.  Returns FALSE if
+// there were any.
+os_bool_t fetch_inodes(const os_uint32_t *inode_numbers, os_uint32_t n, int fd,
+                       struct os_fs_metadata_t *metadata,
+                       struct os_inode_t *returned_inodes);
+
 
 void calculate_offsets(os_uint32_t blocknum,
                        os_uint32_t blocksize,
@@ -80,10 +287,13 @@ os_bool_t file_read(int fd, int file_inode_num,
 os_bool_t pop_dir_component(char *path,
                             char **next_component);
 
+// returns the inode of entry 'filename' in the directory data, or 0.
 os_uint32_t scan_dir(unsigned char *directory,
                      os_uint32_t directory_length,
                      char *filename);
 
+// returns the names in the directory data as an array of strings.  The
+// array and the strings are one allocation; free(*filenames) frees all.
 void ls_dir(unsigned char *directory, os_uint32_t directory_length,
             char ***filenames, os_uint32_t *num_files);
 
@@ -0,0 +1,55 @@
+// This file defines the fragmentation analyzer behind the 'frag'
+// command.
+//
+// For a file, fragmentation is measured on its data extents (runs of
+// physically contiguous blocks, as file_extents() reports them; holes
+// do not count): how many there are, how long they are on average, and
+// the seek distance, i.e. the blocks skipped over or moved back between
+// the end of one extent and the start of the next.
+
+#ifndef EXT2READER_INC_FRAG_H
+#define EXT2READER_INC_FRAG_H
+
+#include "types.h"
+#include "ext2access.h"
+#include "parentmap.h"
+#include "threadpool.h"
+
+#define FRAG_HIST 12    // files with 1, 2, 3-4, 5-8, ... >1024 extents
+#define FRAG_WORST 10   // most fragmented files kept in a report
+
+struct os_frag_file_t {
+  os_uint32_t inode;
+  os_uint32_t extents;
+  os_uint64_t blocks;
+  os_uint64_t seek;     // in blocks
+};
+
+struct os_frag_report_t {
+  os_uint64_t files;
+  os_uint64_t fragmented;   // files with more than one extent
+  os_uint64_t extents;
+  os_uint64_t blocks;
+  os_uint64_t seek;
+  os_uint64_t hist[FRAG_HIST];
+  struct os_frag_file_t worst[FRAG_WORST];  // most extents first
+  int nworst;
+};
+
+// Measures one file or directory.
+void frag_file(struct os_inode_t *inode, os_uint32_t inode_num, int fd,
+               struct os_fs_metadata_t *metadata, struct os_frag_file_t *out);
+
+// Histogram bucket of a file with 'extents' extents.
+int frag_bucket(os_uint32_t extents);
+
+// Measures every regular file and directory, one blockgroup of inodes
+// per task on 'tp'.  If 'under' is not 0, only files below directory
+// 'under' are counted, which needs the parent map 'parents'.  Returns
+// FALSE on a read error.
+os_bool_t frag_scan(int fd, struct os_fs_metadata_t *metadata,
+                    struct os_threadpool_t *tp, os_uint32_t under,
+                    struct os_parentmap_t *parents,
+                    struct os_frag_report_t *report);
+
+#endif  // EXT2READER_INC_FRAG_H
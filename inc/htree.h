@@ -0,0 +1,40 @@
+// This file defines name lookups through the hashed index (htree) that
+// ext3 and later keep in large directories when the filesystem has the
+// dir_index feature.
+//
+// An indexed directory still is a valid linear directory: its first
+// block starts with "." and "..", whose record hides the index root,
+// and every other index block looks like one empty entry.  The index
+// maps ranges of name hashes to the leaf blocks holding those names,
+// so a lookup reads the root, at most two index nodes and (collisions
+// aside) one leaf block instead of the whole directory.
+
+#ifndef EXT2READER_INC_HTREE_H
+#define EXT2READER_INC_HTREE_H
+
+#include "types.h"
+#include "ext2access.h"
+
+#define EXT2_HASH_LEGACY   0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA      2
+#define EXT2_HASH_UNSIGNED 3          // added to the above for unsigned chars
+
+#define HTREE_NONE 0xFFFFFFFF         // htree_lookup(): no usable index
+
+// The hash of 'name' used by the index, with the low bit cleared as the
+// index stores it.  'version' is one of EXT2_HASH_*, plus
+// EXT2_HASH_UNSIGNED when names hash as unsigned chars; 'seed' comes
+// from the superblock (all zeros for the default seed).
+os_uint32_t ext2_dirhash(const char *name, int len, int version,
+                         const os_uint32_t seed[4]);
+
+// Looks 'name' up in directory 'dir' through its index.
+//
+// Returns the inode number, 0 if the name is not in the directory, or
+// HTREE_NONE if the directory is not indexed or its index cannot be
+// trusted, in which case the caller scans the directory instead.
+os_uint32_t htree_lookup(int fd, struct os_fs_metadata_t *metadata,
+                         struct os_inode_t *dir, const char *name, os_uint32_t len);
+
+#endif  // EXT2READER_INC_HTREE_H
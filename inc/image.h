@@ -0,0 +1,86 @@
+// This file defines the interface through which ext-shell reads the
+// filesystem image.
+//
+// An image is identified by the fd returned from img_open(), and all
+// reads go through img_pread(), which behaves like pread(2).  Raw
+// images are read straight from the file.  Compressed images (gzip,
+// and zstd when built with ZSTD=1) are served through a chunk index:
+// the compressed stream is scanned once, the offsets of a set of
+// access points are recorded, and the index is stored next to the
+// image as "<image>.idx" so later runs can skip the scan.  A read
+// then only decompresses the chunks it touches, and recently used
+// chunks are kept in a small cache, whose memory the governor
+// (memgov.h) counts and takes back under pressure.
+
+#ifndef EXT2READER_INC_IMAGE_H
+#define EXT2READER_INC_IMAGE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "types.h"
+
+// Uncompressed bytes between two gzip access points.  Each access
+// point costs a 32KiB window in the index file, so smaller spans give
+// cheaper random reads at the price of a bigger index.
+#define IMG_GZ_SPAN (1 << 20)
+
+// Number of decompressed chunks kept in the cache of each image.
+#define IMG_CHUNK_CACHE 64
+
+// Raw images opened with O_DIRECT bypass the page cache.  Reads whose
+// buffer, offset and length are multiples of IMG_DIRECT_ALIGN go to the
+// disk as they are; any other read is widened to aligned bounds and
+// copied out of a per-thread buffer of IMG_DIRECT_BOUNCE bytes.
+#define IMG_DIRECT_ALIGN 4096
+#define IMG_DIRECT_BOUNCE (1 << 20)
+
+// Opens the image at 'path' with open(2) 'flags'.  If the file is
+// compressed, its chunk index is loaded (or built and saved).  O_DIRECT
+// applies to raw images only, and only to reads: open them read-only.
+// Compressed images keep their chunk cache instead.
+//
+// Returns the image fd, or -1 on error.
+int img_open(const char *path, int flags);
+
+// Reads up to 'len' bytes of the uncompressed image starting at 'off'.
+//
+// Returns the number of bytes read, 0 at end of image, -1 on error.
+ssize_t img_pread(int fd, void *buf, size_t len, os_uint64_t off);
+
+// img_pread() without the overlay, if the image has one.
+ssize_t img_pread_raw(int fd, void *buf, size_t len, os_uint64_t off);
+
+// An overlay sees every read of an image after it is done, with the
+// 'len' bytes read at 'off' in 'buf', and may replace some of them:
+// the journal (journal.h) patches in the newest copies of the blocks it
+// holds.  It reads those with img_pread_raw().  Images with an overlay
+// cannot be mapped.
+typedef void (*img_overlay_fn)(void *arg, int fd, void *buf, size_t len, os_uint64_t off);
+
+// Sets the overlay of image 'fd'; img_close() calls release(arg).
+void img_set_overlay(int fd, img_overlay_fn fn, void (*release)(void *arg), void *arg);
+
+// Write counterparts of img_pread() for raw images opened with O_RDWR,
+// behaving like pwrite(2) and pwritev(2).  Compressed images are
+// read-only: both fail with errno set to EROFS.
+ssize_t img_pwrite(int fd, const void *buf, size_t len, os_uint64_t off);
+ssize_t img_pwritev(int fd, const struct iovec *iov, int iovcnt, os_uint64_t off);
+
+// Maps a raw image read-only into memory and returns the mapping, with
+// its length in *len.  Returns NULL for compressed images, images
+// opened with O_DIRECT and images with an overlay, which have to be
+// read through img_pread().  The mapping lives until img_close().
+const unsigned char *img_map(int fd, os_uint64_t *len);
+
+// Allocates 'len' zeroed bytes aligned for O_DIRECT reads; free() them.
+// Buffers that take whole-table or bitmap reads come from here.
+void *img_alloc(size_t len);
+
+// Returns TRUE if the image behind 'fd' is compressed.
+os_bool_t img_is_compressed(int fd);
+
+// Closes the image and releases its index and chunk cache.
+void img_close(int fd);
+
+#endif  // EXT2READER_INC_IMAGE_H
@@ -60,6 +60,8 @@
 #define EXT2_S_IROTH  0x0004
 #define EXT2_S_IWOTH  0x0002
 #define EXT2_S_IXOTH  0x0001
+#define EXT2_INDEX_FL 0x00001000  // i_flags: directory has a hashed index
+#define EXT4_EXTENTS_FL 0x00080000 // i_flags: blocks are mapped by extents
 
 // This structure represents an inode.  In ext2, an inode is 128 bytes.
 
@@ -134,7 +136,7 @@ struct os_inode_t {
   // contain data of this inode, regardless of whether these blocks
   // are used.  The block numbers of these are contained in the
   // i_block array.
-  os_uint16_t i_blocks;
+  os_uint32_t i_blocks;
 
   // 32-bit value indicating flags controlling how the filesystem
   // should access the data of this node.
@@ -0,0 +1,40 @@
+// This file defines the columnar (struct-of-arrays) inode store.
+//
+// Instead of caching whole inode records, the store keeps only the
+// fields that listing and analytics look at, each in its own dense
+// array indexed by inode number - 1.  At 24 bytes per inode it is
+// 5-10x smaller than the inode tables it is built from, and a scan over
+// one field touches only that field's cache lines.  Everything else is
+// read from the disk with fetch_inode() when it is needed.
+
+#ifndef EXT2READER_INC_INOSTORE_H
+#define EXT2READER_INC_INOSTORE_H
+
+#include "types.h"
+#include "ext2access.h"
+#include "threadpool.h"
+
+struct os_inostore_t {
+  os_uint32_t count;          // # of inodes, i.e. s_inodes_count
+
+  os_uint16_t *mode;          // i_mode
+  os_uint16_t *links;         // i_links_count
+  os_uint64_t *size;          // file_size(), i.e. i_size + i_dir_acl
+  os_uint32_t *mtime;         // i_mtime
+  os_uint32_t *uid;           // i_uid, including the high 16 bits
+  os_uint32_t *first_block;   // i_block[0]
+
+  size_t charged;             // bytes counted by the memory governor
+};
+
+// Builds the store from the inode tables, one blockgroup per task on
+// 'tp'.  Groups with no inodes in use are not read at all.
+struct os_inostore_t *inostore_build(int fd, struct os_fs_metadata_t *metadata,
+                                     struct os_threadpool_t *tp);
+
+// Bytes of memory held by the store.
+os_uint64_t inostore_bytes(struct os_inostore_t *store);
+
+void inostore_free(struct os_inostore_t *store);
+
+#endif  // EXT2READER_INC_INOSTORE_H
@@ -0,0 +1,45 @@
+// This file defines the journal overlay: a read-only view of an ext3
+// image as it would be after its journal was replayed, without writing
+// to the image or copying it.
+//
+// An image taken from a live system (or not cleanly unmounted) has
+// metadata updates that were committed to the journal but not yet
+// written back to their home locations.  The journal is scanned once,
+// the way the kernel recovers it: the transactions are followed from
+// the start of the log up to the last one with a commit record, and
+// revoke records cancel the copies of earlier transactions.  What is
+// left is a hash map from filesystem block to the journal block that
+// holds its newest committed copy, and every read of the image goes
+// through it (see img_set_overlay() in image.h).
+//
+// Only internal JBD/JBD2 journals mapped by block pointers are read;
+// checksums are not verified.
+
+#ifndef EXT2READER_INC_JOURNAL_H
+#define EXT2READER_INC_JOURNAL_H
+
+#include "types.h"
+#include "ext2access.h"
+
+struct os_journal_info_t {
+  os_uint32_t transactions;     // committed transactions in the log
+  os_uint32_t blocks;           // filesystem blocks with a newer copy
+  os_uint32_t revoked;          // journaled copies cancelled by revokes
+  char error[128];              // why the journal was not used
+};
+
+// Turns the overlay on for the images opened after this, process-wide,
+// like tp_set_threads().
+void journal_use_overlay(os_bool_t on);
+
+// If the overlay is on and the filesystem has a journal that needs
+// recovery, scans it, puts the overlay on image 'fd' and reloads
+// *metadata through it (freeing the old one), since the superblock and
+// descriptors may be in the journal too.  Fills 'info'.
+//
+// Returns FALSE, with info->error set, if the journal cannot be read;
+// the image is then left as it was.
+os_bool_t journal_attach(int fd, struct os_fs_metadata_t **metadata,
+                         struct os_journal_info_t *info);
+
+#endif  // EXT2READER_INC_JOURNAL_H
@@ -0,0 +1,78 @@
+// This file defines the memory governor: one byte budget for all the
+// caches of the process, set with --mem-limit, so that the memory an
+// ext-shell takes is known in advance whatever the image.
+//
+// Every cache registers once under a name and reports the bytes it
+// takes and gives back, and its hits and misses.  Caches that can drop
+// entries at any time (blocks, decompressed chunks) register an evict
+// function and share what the others leave of the budget; each gets a
+// target share, recomputed as they are used: a floor for every cache,
+// and the rest in proportion to the hits each earned recently (with
+// older windows counting half as much as the one before), so memory
+// moves to the cache that turns it into hits.  When a charge takes the
+// total over the limit, the caches furthest over their targets are
+// asked to evict until everything fits again.
+//
+// Caches that cannot drop anything while it may be in use (whole inode
+// tables, bitmaps, the parent and owner maps) register without an
+// evict function.  They are only counted, and squeeze the others; the
+// biggest of them ask first with mg_reserve() and are not built if
+// they would not fit.
+//
+// Without a limit (the default) nothing is evicted by the governor,
+// caches keep their own bounds, and it only keeps the accounts.
+
+#ifndef EXT2READER_INC_MEMGOV_H
+#define EXT2READER_INC_MEMGOV_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "types.h"
+
+#define MG_MAX_CACHES 16
+#define MG_REBALANCE  4096          // accesses between target updates
+
+// the pinned caches of ext2access.h
+#define MG_TABLES  "tables"         // inode tables, bitmaps, columns
+#define MG_INDEXES "indexes"        // parent and owner maps
+
+struct os_memgov_cache_t;
+
+// Frees about 'bytes' of the cache (calling mg_uncharge() for them) and
+// returns how many were freed; 0 if it has nothing left to give.
+typedef size_t (*os_memgov_evict_t)(void *arg, size_t bytes);
+
+// Registers cache 'name', or returns it if it already is.  'evict' is
+// NULL for caches that are only counted.
+struct os_memgov_cache_t *mg_register(const char *name, os_memgov_evict_t evict,
+                                      void *arg);
+
+// Sets the limit in bytes (0: none) and evicts down to it, process-wide
+// like tp_set_threads().
+void mg_set_limit(size_t bytes);
+size_t mg_limit(void);
+
+// Counts 'bytes' more for cache 'c'.  This may evict from any cache,
+// 'c' included, so it must not be called with a lock held that an
+// evict function takes.
+void mg_charge(struct os_memgov_cache_t *c, size_t bytes);
+
+// Like mg_charge(), for a pinned cache, but only if all the pinned
+// caches would still leave a quarter of the limit to the evictable
+// ones with 'bytes' more.  Returns FALSE, charging nothing, otherwise.
+os_bool_t mg_reserve(struct os_memgov_cache_t *c, size_t bytes);
+
+// Counts 'bytes' less for cache 'c'; callable with any lock held.
+void mg_uncharge(struct os_memgov_cache_t *c, size_t bytes);
+
+void mg_hit(struct os_memgov_cache_t *c);
+void mg_miss(struct os_memgov_cache_t *c);
+
+void mg_stats(struct os_memgov_cache_t *c, os_uint64_t *hits, os_uint64_t *misses,
+              size_t *bytes);
+
+// Prints the limit and one line per cache: bytes, target, hits, misses.
+void mg_report(FILE *out);
+
+#endif  // EXT2READER_INC_MEMGOV_H
@@ -0,0 +1,38 @@
+// This file defines name filters for directory listings: an exact
+// name, a prefix ("foo*"), a suffix ("*.log"), "prefix*suffix", or any
+// other fnmatch(3) glob.
+//
+// A filter is compiled once from the pattern.  Matching a name first
+// rejects it on its length, then compares the literal prefix and suffix
+// of the pattern 16 bytes at a time, and only calls fnmatch() for
+// patterns with wildcards between the two.  Names are taken as
+// (pointer, length), so they can be matched in place in a directory
+// block.
+
+#ifndef EXT2READER_INC_NAMEFILTER_H
+#define EXT2READER_INC_NAMEFILTER_H
+
+#include "types.h"
+#include "directoryentry.h"
+
+#define NAME_FILTER_EXACT   0   // no wildcards
+#define NAME_FILTER_AFFIX   1   // prefix*suffix, either part may be empty
+#define NAME_FILTER_GLOB    2   // anything else
+
+struct os_name_filter_t {
+  int kind;
+  os_uint32_t min_len;                    // shortest name that can match
+  os_uint32_t prefix_len, suffix_len;
+  char prefix[EXT2_NAME_LEN + 1];
+  char suffix[EXT2_NAME_LEN + 1];
+  char pattern[EXT2_NAME_LEN + 1];        // for NAME_FILTER_GLOB
+};
+
+// Compiles 'pattern'.  Returns FALSE if it is longer than a name can be.
+os_bool_t name_filter_init(struct os_name_filter_t *filter, const char *pattern);
+
+// Returns TRUE if the 'len' bytes at 'name' match the filter.
+os_bool_t name_filter_match(const struct os_name_filter_t *filter,
+                            const char *name, os_uint32_t len);
+
+#endif  // EXT2READER_INC_NAMEFILTER_H
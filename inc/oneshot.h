@@ -0,0 +1,36 @@
+// This file defines the one-shot commands, 'ext-shell <img> ls|cat|stat
+// <path>', which run a single operation and exit.
+//
+// They are meant for scripts that run many short lookups, so they read
+// as little as possible before the first byte of output: the
+// superblock, the descriptor table block of each group the path goes
+// through, and one inode at a time.  No inode table is cached and no
+// thread pool is started.  Output uses the formats of the --serve
+// protocol (see serve.h): "<inode>\t<type>\t<name>" lines for ls, one
+// "<inode> <mode> <links> <uid> <gid> <size> <mtime> <blocks>" line for
+// stat, and the raw contents for cat.
+
+#ifndef EXT2READER_INC_ONESHOT_H
+#define EXT2READER_INC_ONESHOT_H
+
+#include <stdio.h>
+
+#include "types.h"
+#include "ext2access.h"
+
+#define ONESHOT_FIRST_READ (64 << 10)   // cat: bytes read before the first write
+#define ONESHOT_READ (1 << 20)          // cat: bytes per read after that
+
+// Returns TRUE if 'op' names a one-shot command.
+int oneshot_op(const char *op);
+
+// Runs 'op' on 'path' in an open image, writing the output to 'out'.
+// Returns 0 or an errno value (ENOENT, ENOTDIR, EISDIR, EIO, ...).
+int oneshot_run(int fd, struct os_fs_metadata_t *fs, const char *op,
+                const char *path, FILE *out);
+
+// Runs 'op' on 'path' in the image at 'image', opened with img_open()
+// 'flags'.  Errors go to stderr.  Returns the process exit status.
+int oneshot(const char *image, int flags, const char *op, const char *path);
+
+#endif  // EXT2READER_INC_ONESHOT_H
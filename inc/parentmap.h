@@ -0,0 +1,39 @@
+// This file defines the parent map: for every inode reachable from the
+// root, the directory it is linked from and its name there.  It is
+// built from the directory blocks in one parallel pass over the inode
+// tables (no path walking), and turns inode numbers found by scans
+// (query, owner, frag, ...) back into paths.  A file with several hard
+// links is known by the first link found.
+
+#ifndef EXT2READER_INC_PARENTMAP_H
+#define EXT2READER_INC_PARENTMAP_H
+
+#include <stddef.h>
+
+#include "types.h"
+#include "ext2access.h"
+#include "threadpool.h"
+
+struct os_parentmap_t;
+
+// Builds the map, one blockgroup's directories per task on 'tp'.
+struct os_parentmap_t *pmap_build(int fd, struct os_fs_metadata_t *metadata,
+                                  struct os_threadpool_t *tp);
+
+// Returns metadata->parents, building it on the first call.
+struct os_parentmap_t *pmap_get(int fd, struct os_fs_metadata_t *metadata);
+
+// Writes the absolute path of 'inode' into buf.  Returns FALSE if the
+// inode is not reachable from the root or the path does not fit.
+os_bool_t pmap_path(struct os_parentmap_t *map, os_uint32_t inode,
+                    char *buf, size_t len);
+
+// Returns the directory 'inode' is linked from, or 0 if not known.
+os_uint32_t pmap_parent(struct os_parentmap_t *map, os_uint32_t inode);
+
+// Number of entries in the map.
+os_uint64_t pmap_size(struct os_parentmap_t *map);
+
+void pmap_free(struct os_parentmap_t *map);
+
+#endif  // EXT2READER_INC_PARENTMAP_H
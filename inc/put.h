@@ -0,0 +1,48 @@
+// This file defines the import path behind the 'put' command, the only
+// place where ext-shell writes to an image.
+//
+// An import runs in three steps.  The host tree is walked first and
+// every inode, block map and directory is sized without touching the
+// image.  Then the inodes and all the blocks the import needs are
+// reserved at once, from as few contiguous free runs as the bitmaps
+// allow, so files come out unfragmented and laid out in tree order.
+// Last, file contents are streamed to their blocks and every metadata
+// update (bitmaps, descriptors, superblock, inode table slots,
+// directory and indirect blocks) is collected in memory and flushed
+// in one pass in disk order, adjacent records merged into one write.
+
+#ifndef EXT2READER_INC_PUT_H
+#define EXT2READER_INC_PUT_H
+
+#include "types.h"
+#include "ext2access.h"
+
+struct os_put_report_t {
+  os_uint32_t files, dirs, symlinks;
+  os_uint32_t skipped;       // devices, fifos and sockets
+  os_uint64_t bytes;         // file contents copied
+  os_uint64_t blocks;        // allocated, indirect and directory blocks included
+  os_uint32_t runs;          // free runs the blocks were carved from
+  os_uint32_t records;       // metadata updates ...
+  os_uint32_t writes;        // ... and the writes they were merged into
+  char error[512];           // why the import failed
+};
+
+// Returns TRUE if the image's features allow put to write to it: plain
+// ext2 block maps, no checksums, no journal left to replay, blocks of
+// at most 32 KiB.
+os_bool_t put_supported(struct os_fs_metadata_t *metadata);
+
+// Copies the host file 'host' into directory 'dir_inode' as 'name'.  A
+// host directory is copied with everything below it if 'recursive' is
+// set, and refused otherwise.  'name' must not exist yet.  The image
+// must be opened read-write; the metadata and the cached inode tables
+// and bitmaps are kept up to date.
+//
+// Returns FALSE with report->error set on failure.  Nothing is written
+// unless the whole import fits.
+os_bool_t put_tree(int fd, struct os_fs_metadata_t *metadata, const char *host,
+                   os_uint32_t dir_inode, const char *name, os_bool_t recursive,
+                   struct os_put_report_t *report);
+
+#endif  // EXT2READER_INC_PUT_H
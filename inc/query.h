@@ -0,0 +1,67 @@
+// This file defines the inode query engine behind the 'query' command.
+//
+// A query is a list of predicates such as
+//
+//     type=f size>1G mtime<7d uid=1000
+//
+// that must all hold.  It is answered from the inode tables alone:
+// every blockgroup's table is unpacked into one column per field and
+// each predicate is applied to a whole column at a time, four inodes
+// per SSE2 compare, with the groups spread over the thread pool.
+// Directories are only read afterwards, to name the matches.
+
+#ifndef EXT2READER_INC_QUERY_H
+#define EXT2READER_INC_QUERY_H
+
+#include "types.h"
+#include "ext2access.h"
+#include "threadpool.h"
+
+#define QUERY_MAX_PREDS 16
+
+#define QUERY_TYPE   0   // type=f|d|l|c|b|p|s    (i_mode & 0xF000)
+#define QUERY_PERM   1   // perm=0644             (i_mode & 07777, octal)
+#define QUERY_SIZE   2   // size>1G               (i_size + i_dir_acl; K/M/G/T)
+#define QUERY_MTIME  3   // mtime<7d, mtime>2024-01-31, mtime>1700000000
+#define QUERY_UID    4   // uid=1000
+#define QUERY_LINKS  5   // links>1
+#define QUERY_DTIME  6   // dtime!=0              (deleted inodes)
+#define QUERY_NFIELDS 7
+
+#define QUERY_EQ 0
+#define QUERY_NE 1
+#define QUERY_LT 2
+#define QUERY_LE 3
+#define QUERY_GT 4
+#define QUERY_GE 5
+
+struct os_query_pred_t {
+  int field;
+  int op;
+  os_uint64_t value;
+};
+
+struct os_query_t {
+  int npreds;
+  struct os_query_pred_t preds[QUERY_MAX_PREDS];
+  os_bool_t any_state;   // set if the query looks at links or dtime
+};
+
+// Called once per matching inode, in inode number order.
+typedef void (*os_query_cb_t)(os_uint32_t inode, const struct os_inode_t *in,
+                              void *arg);
+
+// Parses 'n' predicate strings into q.  Times given as an age (s, m,
+// h, d or w suffix) count back from now, so mtime<7d means modified in
+// the last 7 days.  Prints the offending predicate and returns FALSE on
+// a syntax error.
+os_bool_t query_parse(struct os_query_t *q, int n, char **preds);
+
+// Runs q over every inode on the filesystem.  Unless the query says
+// otherwise with links or dtime, only live inodes (links > 0, dtime 0)
+// are considered.  Returns the number of matches, or -1 on a read error.
+os_int64_t query_run(int fd, struct os_fs_metadata_t *metadata,
+                     struct os_query_t *q, struct os_threadpool_t *tp,
+                     os_query_cb_t cb, void *arg);
+
+#endif  // EXT2READER_INC_QUERY_H
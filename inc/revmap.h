@@ -0,0 +1,56 @@
+// This file defines the reverse block map: which inode owns a given
+// disk block, and whether as file data or as an indirect block.
+//
+// The map is a sorted array of intervals of physical blocks, built by
+// walking every live inode's block map (one blockgroup of inodes per
+// task), sorting each group's intervals in its task and merging the
+// sorted runs.  Alongside it, reach[i] is the last block of any of the
+// intervals 0..i; it never decreases, so a lookup finds by binary
+// search both the first interval that can reach into the range and the
+// first one that starts past it, whatever the lengths of the intervals.
+
+#ifndef EXT2READER_INC_REVMAP_H
+#define EXT2READER_INC_REVMAP_H
+
+#include "types.h"
+#include "ext2access.h"
+#include "threadpool.h"
+
+// 'logical' of an interval made of indirect blocks
+#define REVMAP_INDIRECT 0xFFFFFFFF
+
+struct os_revmap_ext_t {
+  os_uint32_t start;    // first physical block
+  os_uint32_t count;    // # of blocks
+  os_uint32_t inode;    // owner
+  os_uint32_t logical;  // file block at 'start', or REVMAP_INDIRECT
+};
+
+struct os_revmap_t {
+  struct os_revmap_ext_t *ext;
+  os_uint32_t *reach;     // prefix maximum of start + count - 1
+  os_uint64_t n;
+  size_t charged;         // bytes counted by the memory governor
+};
+
+struct os_revmap_t *revmap_build(int fd, struct os_fs_metadata_t *metadata,
+                                 struct os_threadpool_t *tp);
+
+// Returns metadata->owners, building it on the first call.
+struct os_revmap_t *revmap_get(int fd, struct os_fs_metadata_t *metadata);
+
+// Calls cb for every interval that overlaps blocks first..last, in
+// block order.  A block owned twice (a cross-linked filesystem) is
+// reported for each owner.  Returns the number of intervals found.
+os_uint64_t revmap_lookup(struct os_revmap_t *map, os_uint32_t first,
+                          os_uint32_t last,
+                          void (*cb)(const struct os_revmap_ext_t *ext, void *arg),
+                          void *arg);
+
+// Describes blocks no file owns: "superblock", "inode table", ...,
+// or NULL for blocks outside the fixed metadata of their group.
+const char *revmap_fs_block(struct os_fs_metadata_t *metadata, os_uint32_t block);
+
+void revmap_free(struct os_revmap_t *map);
+
+#endif  // EXT2READER_INC_REVMAP_H
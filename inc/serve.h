@@ -0,0 +1,52 @@
+// This file defines the query server behind 'ext-shell --serve' and the
+// protocol its clients (see ext-client.c) speak.
+//
+// The server keeps every image open with its metadata preloaded, and
+// answers requests from any number of local clients on a Unix stream
+// socket.  One thread multiplexes the connections with epoll; each
+// request is handled by a thread pool worker, and all workers share
+// the inode tables, the indirect block cache (bcache.h) and a cache of
+// looked-up directory entries, so a warm server answers without
+// reading metadata again.
+//
+// Every message is a native-endian os_uint32_t length followed by that
+// many bytes.  A request is an os_serve_req_t and the path (for FIND,
+// the path, a NUL and a name pattern); a response is an os_uint32_t
+// status (0 or an errno value) and the body:
+//
+//   SERVE_LS    one "<inode>\t<type>\t<name>\n" line per entry
+//   SERVE_STAT  "<inode> <mode, octal> <links> <uid> <gid> <size> <mtime> <blocks>\n"
+//   SERVE_READ  the file bytes in [offset, offset + len)
+//   SERVE_FIND  one path per line, for every name below the path
+//               that matches the pattern
+//
+// A client may send its next request before the response to the
+// previous one has arrived; responses come back in order.
+
+#ifndef EXT2READER_INC_SERVE_H
+#define EXT2READER_INC_SERVE_H
+
+#include "types.h"
+
+#define SERVE_LS   1
+#define SERVE_STAT 2
+#define SERVE_READ 3
+#define SERVE_FIND 4
+
+#define SERVE_MAX_REQUEST 8192        // longer requests drop the connection
+#define SERVE_MAX_READ (16 << 20)     // bytes returned by one READ at most
+
+struct os_serve_req_t {
+  os_uint8_t op;          // SERVE_*
+  os_uint8_t image;       // index into the server's image list
+  os_uint16_t pad;
+  os_uint32_t len;        // READ: bytes wanted
+  os_uint64_t offset;     // READ: first byte
+};
+
+// Serves 'images', opened with img_open() 'flags', on a socket created
+// at 'sock_path' until SIGINT or SIGTERM.  Returns the process exit
+// status.
+int serve(const char *sock_path, char **images, int nimages, int flags);
+
+#endif  // EXT2READER_INC_SERVE_H
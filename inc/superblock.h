@@ -42,6 +42,9 @@
 // The following constants are used in some of the superblock fields.
 // Search for them in the comments to find out what they mean.
 #define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_MAX_LOG_BLOCK_SIZE 6     // 64 KiB blocks
+#define EXT2_FLAGS_SIGNED_HASH 0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
 #define EXT2_VALID_FS 1
 #define EXT2_ERROR_FS 2
 #define EXT2_ERRORS_CONTINUE 1
@@ -335,8 +338,29 @@ struct os_superblock_t {
   // meta-block group.  (ext3-only extension, I believe).
   os_uint32_t s_first_meta_bg;
 
+  // the time the filesystem was created.
+  os_uint32_t s_mkfs_time;
+
+  // a backup copy of the journal inode's i_block array and (in the
+  // last two words) its size.
+  os_uint32_t s_jnl_blocks[17];
+
+  // upper 32 bits of the block counts, for 64-bit (ext4) filesystems.
+  os_uint32_t s_blocks_count_hi;
+  os_uint32_t s_r_blocks_count_hi;
+  os_uint32_t s_free_blocks_count_hi;
+
+  // extra inode bytes every inode has, and new inodes should have.
+  os_uint16_t s_min_extra_isize;
+  os_uint16_t s_want_extra_isize;
+
+  // miscellaneous flags: EXT2_FLAGS_SIGNED_HASH or
+  // EXT2_FLAGS_UNSIGNED_HASH tell how directory index hashes treat
+  // the bytes of a name.
+  os_uint32_t s_flags;
+
   // unused -- reserved for future revisions
-  os_uint8_t s_unused[760];
+  os_uint8_t s_unused[668];
 };
 
 #endif // EXT2READER_INC_SUPERBLOCK_H
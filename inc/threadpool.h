@@ -0,0 +1,37 @@
+// This file defines a small fixed-size thread pool used to spread
+// per-blockgroup work (inode table scans, index builds, hashing) over
+// all cores.
+//
+// tp_parallel_for() is the main entry point.  The calling thread works
+// on the loop as well, so it may be called from inside a pool task
+// without deadlocking, and several callers may share one pool.
+
+#ifndef EXT2READER_INC_THREADPOOL_H
+#define EXT2READER_INC_THREADPOOL_H
+
+#include "types.h"
+
+struct os_threadpool_t;
+
+// Creates a pool of 'nthreads' workers (0 = one per online cpu).
+struct os_threadpool_t *tp_create(int nthreads);
+
+// Queues fn(arg) to run on one of the workers.
+void tp_submit(struct os_threadpool_t *tp, void (*fn)(void *), void *arg);
+
+// Runs fn(i, arg) for every i in [0, n) and returns when all are done.
+void tp_parallel_for(struct os_threadpool_t *tp, os_uint32_t n,
+                     void (*fn)(os_uint32_t i, void *arg), void *arg);
+
+// Number of worker threads in the pool.
+int tp_size(struct os_threadpool_t *tp);
+
+// Stops the workers once the queue is empty and frees the pool.
+void tp_destroy(struct os_threadpool_t *tp);
+
+// The process-wide pool, created on first use with tp_set_threads()
+// workers (default: one per online cpu).
+struct os_threadpool_t *tp_shared(void);
+void tp_set_threads(int nthreads);
+
+#endif  // EXT2READER_INC_THREADPOOL_H
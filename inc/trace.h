@@ -0,0 +1,69 @@
+// This file defines the opt-in timeline tracer behind 'ext-shell --trace'.
+//
+// Every thread records finished spans (name, category, start, duration
+// and one numeric argument, e.g. the block number) into its own ring
+// buffer, without locks; once a ring is full the oldest spans are
+// overwritten.  At exit all rings are written out as a Chrome
+// trace-event JSON file, which chrome://tracing and Perfetto open.
+//
+// With tracing off a span costs one load and branch of trace_enabled:
+//
+//   os_uint64_t t0 = trace_begin();
+//   read_block(...);
+//   trace_end(t0, "indirect", TRACE_IO, "block", blocknum);
+
+#ifndef EXT2READER_INC_TRACE_H
+#define EXT2READER_INC_TRACE_H
+
+#include "types.h"
+
+#define TRACE_RING_EVENTS (1 << 16)   // spans kept per thread
+#define TRACE_NAME_LEN 32             // longer span names are cut
+
+// categories
+#define TRACE_CMD   "command"
+#define TRACE_IO    "io"
+#define TRACE_CACHE "cache"
+#define TRACE_POOL  "threadpool"
+
+// block read span names, by what the block holds
+#define TRACE_SUPERBLOCK  "superblock"
+#define TRACE_DESCRIPTORS "descriptors"
+#define TRACE_BITMAP      "bitmap"
+#define TRACE_INODES      "inode table"
+#define TRACE_INDIRECT    "indirect"
+#define TRACE_DIRECTORY   "directory"
+#define TRACE_DATA        "data"
+
+extern int trace_enabled;
+
+// Monotonic clock in nanoseconds.
+os_uint64_t trace_clock(void);
+
+// Starts recording; the trace is written to 'path' by trace_stop(),
+// which runs at exit.  Returns FALSE if 'path' cannot be created.
+os_bool_t trace_start(const char *path);
+
+// Writes the trace and stops recording.
+void trace_stop(void);
+
+// Names the calling thread in the trace.
+void trace_thread_name(const char *name);
+
+// Records a span from 't0' to now.  'arg_name' may be NULL.
+void trace_span(os_uint64_t t0, const char *name, const char *cat,
+                const char *arg_name, os_uint64_t arg);
+
+static inline os_uint64_t trace_begin(void)
+{
+  return trace_enabled ? trace_clock() : 0;
+}
+
+static inline void trace_end(os_uint64_t t0, const char *name, const char *cat,
+                             const char *arg_name, os_uint64_t arg)
+{
+  if (t0)
+    trace_span(t0, name, cat, arg_name, arg);
+}
+
+#endif  // EXT2READER_INC_TRACE_H
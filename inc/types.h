@@ -32,6 +32,8 @@ typedef long long os_int64_t;
 typedef unsigned long long os_uint64_t;
 
 // return the offset of 'member' relative to the beginning of a struct type
+#ifndef offsetof
 #define offsetof(type, member) ((os_int32_t) (&((type*)0)->member))
+#endif
 
 #endif  // EXT2READER_INC_TYPES_H
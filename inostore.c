@@ -0,0 +1,119 @@
+/* =============
+ * columnar inode store
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/inostore.h"
+#include "inc/threadpool.h"
+#include "inc/trace.h"
+#include "inc/memgov.h"
+
+// bytes per inode held by the store
+#define INOSTORE_STRIDE (2 + 2 + 8 + 4 + 4 + 4)
+
+struct build_arg {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	struct os_inostore_t *store;
+	int failed;
+};
+
+static void build_group(os_uint32_t g, void *arg)
+{
+	struct build_arg *ba = arg;
+	struct os_fs_metadata_t *fs = ba->fs;
+	struct os_inostore_t *st = ba->store;
+	size_t table_len = (size_t)fs->inodes_per_group * fs->inode_size;
+	os_uint32_t i, ino, used;
+	struct os_inode_t *inode;
+	os_uint64_t t0;
+	unsigned char *table;
+
+	// the arrays start out zeroed, which is what an unused inode reads as
+	if (fs->bgdt[g].bg_free_inodes_count == fs->inodes_per_group)
+		return;
+
+	table = malloc(table_len);
+	assert(table != NULL);
+	t0 = trace_begin();
+	if (img_pread(ba->fd, table, table_len,
+		      (os_uint64_t)fs->bgdt[g].bg_inode_table * fs->block_size) != (ssize_t)table_len) {
+		ba->failed = 1;
+		free(table);
+		return;
+	}
+	trace_end(t0, TRACE_INODES, TRACE_IO, "block", fs->bgdt[g].bg_inode_table);
+
+	used = fs->inodes_per_group;
+	for (i = 0; i < used; i++) {
+		ino = g * fs->inodes_per_group + i;
+		if (ino >= st->count)
+			break;
+		inode = (struct os_inode_t *)(table + (size_t)i * fs->inode_size);
+		st->mode[ino] = inode->i_mode;
+		st->links[ino] = inode->i_links_count;
+		st->size[ino] = file_size(inode);
+		st->mtime[ino] = inode->i_mtime;
+		st->uid[ino] = inode->i_uid | (os_uint32_t)inode->i_osd2.linux2.l_i_uid_high << 16;
+		st->first_block[ino] = inode->i_block[0];
+	}
+
+	free(table);
+}
+
+struct os_inostore_t *inostore_build(int fd, struct os_fs_metadata_t *metadata,
+                                     struct os_threadpool_t *tp)
+{
+	struct os_inostore_t *st = calloc(1, sizeof(struct os_inostore_t));
+	struct build_arg ba = { fd, metadata, st, 0 };
+	os_uint32_t n = metadata->sb->s_inodes_count;
+
+	assert(st != NULL);
+	st->count = n;
+	st->mode = calloc(n, sizeof(os_uint16_t));
+	st->links = calloc(n, sizeof(os_uint16_t));
+	st->size = calloc(n, sizeof(os_uint64_t));
+	st->mtime = calloc(n, sizeof(os_uint32_t));
+	st->uid = calloc(n, sizeof(os_uint32_t));
+	st->first_block = calloc(n, sizeof(os_uint32_t));
+	if (!st->mode || !st->links || !st->size || !st->mtime || !st->uid || !st->first_block) {
+		inostore_free(st);
+		return(NULL);
+	}
+
+	tp_parallel_for(tp, metadata->num_blockgroups, build_group, &ba);
+	if (ba.failed) {
+		inostore_free(st);
+		return(NULL);
+	}
+
+	st->charged = inostore_bytes(st);
+	mg_charge(mg_register(MG_TABLES, NULL, NULL), st->charged);
+	return(st);
+}
+
+os_uint64_t inostore_bytes(struct os_inostore_t *store)
+{
+	return((os_uint64_t)store->count * INOSTORE_STRIDE + sizeof(*store));
+}
+
+void inostore_free(struct os_inostore_t *store)
+{
+	if (store == NULL)
+		return;
+	free(store->mode);
+	free(store->links);
+	free(store->size);
+	free(store->mtime);
+	free(store->uid);
+	free(store->first_block);
+	mg_uncharge(mg_register(MG_TABLES, NULL, NULL), store->charged);
+	free(store);
+}
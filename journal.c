@@ -0,0 +1,505 @@
+/* =============
+ * journal overlay
+ * =============
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/arena.h"
+#include "inc/journal.h"
+#include "inc/bcache.h"
+
+// everything in the journal is big-endian
+#define JBD_MAGIC 0xC03B3998U
+
+#define JBD_DESCRIPTOR 1
+#define JBD_COMMIT     2
+#define JBD_SB_V1      3
+#define JBD_SB_V2      4
+#define JBD_REVOKE     5
+
+#define JBD_INCOMPAT_REVOKE      0x01
+#define JBD_INCOMPAT_64BIT       0x02
+#define JBD_INCOMPAT_CSUM_V2     0x08
+#define JBD_INCOMPAT_CSUM_V3     0x10
+#define JBD_INCOMPAT_FAST_COMMIT 0x20
+
+#define JBD_FLAG_ESCAPE    1          // first 4 bytes of the copy were the magic
+#define JBD_FLAG_SAME_UUID 2          // no 16-byte uuid after the tag
+#define JBD_FLAG_LAST_TAG  8
+
+#define JBD_DEFAULT_FC_BLOCKS 256
+
+struct jbd_header {
+	os_uint32_t magic;
+	os_uint32_t blocktype;
+	os_uint32_t sequence;
+};
+
+struct jbd_superblock {
+	struct jbd_header header;
+	os_uint32_t blocksize;
+	os_uint32_t maxlen;           // blocks in the journal
+	os_uint32_t first;            // first block of the log
+	os_uint32_t sequence;         // first transaction expected in the log
+	os_uint32_t start;            // block where the log starts, 0 if clean
+	os_uint32_t errno_;
+	os_uint32_t feature_compat;
+	os_uint32_t feature_incompat;
+	os_uint32_t feature_ro_compat;
+	os_uint8_t uuid[16];
+	os_uint32_t nr_users;
+	os_uint32_t dynsuper;
+	os_uint32_t max_transaction;
+	os_uint32_t max_trans_data;
+	os_uint8_t checksum_type;
+	os_uint8_t padding[3];
+	os_uint32_t num_fc_blocks;    // fast commit area at the end of the journal
+};
+
+// a journaled copy of filesystem block 'block' in log block 'log'
+struct jtag {
+	os_uint32_t block;
+	os_uint32_t log;
+	os_uint32_t sequence;
+	os_uint8_t escaped;
+};
+
+struct jrevoke {
+	os_uint32_t block;
+	os_uint32_t sequence;
+};
+
+// one slot of the overlay's open-addressing hash map
+struct jslot {
+	os_uint32_t block;
+	os_uint32_t copy;             // disk block of the newest copy
+	os_uint8_t used;
+	os_uint8_t escaped;
+};
+
+struct journal {
+	os_uint32_t block_size;
+	os_uint32_t mask;             // slots - 1
+	os_uint32_t min_block, max_block;
+	struct jslot *slots;
+};
+
+struct scan {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	struct jbd_superblock jsb;
+	os_uint32_t *map;             // disk block of every journal block
+	os_uint32_t tag_bytes;
+	os_uint32_t tail_bytes;       // descriptor checksum at the end
+	os_uint32_t last;             // last block of the log
+	struct jtag *tags;
+	os_uint32_t ntags, tcap;
+	struct jrevoke *revokes;
+	os_uint32_t nrevokes, rcap;
+	struct os_journal_info_t *info;
+};
+
+static const unsigned char jbd_magic[4] = { 0xC0, 0x3B, 0x39, 0x98 };
+static os_bool_t use_overlay;
+
+void journal_use_overlay(os_bool_t on)
+{
+	use_overlay = on;
+}
+
+static os_uint32_t be32(const unsigned char *p)
+{
+	return((os_uint32_t)p[0] << 24 | (os_uint32_t)p[1] << 16 | (os_uint32_t)p[2] << 8 | p[3]);
+}
+
+static os_uint32_t be16(const unsigned char *p)
+{
+	return((os_uint32_t)p[0] << 8 | p[1]);
+}
+
+// transaction ids wrap around
+static int tid_geq(os_uint32_t a, os_uint32_t b)
+{
+	return((os_int32_t)(a - b) >= 0);
+}
+
+static os_uint32_t hash_block(os_uint32_t block)
+{
+	return(block * 0x9E3779B1U);
+}
+
+static struct jslot *lookup(struct journal *j, os_uint32_t block)
+{
+	os_uint32_t i = hash_block(block) & j->mask;
+
+	while (j->slots[i].used) {
+		if (j->slots[i].block == block)
+			return(&j->slots[i]);
+		i = (i + 1) & j->mask;
+	}
+	return(NULL);
+}
+
+static struct jslot *insert(struct journal *j, os_uint32_t block)
+{
+	os_uint32_t i = hash_block(block) & j->mask;
+
+	while (j->slots[i].used && j->slots[i].block != block)
+		i = (i + 1) & j->mask;
+	j->slots[i].used = 1;
+	j->slots[i].block = block;
+	return(&j->slots[i]);
+}
+
+/* patch
+ *
+ * The overlay: copies the journaled version of every block that the
+ * read at 'off' overlaps over what was read from its home location.
+ * Journaled blocks are mostly metadata, so the range check alone lets
+ * most data reads through.
+ */
+
+static void patch(void *arg, int fd, void *buf, size_t len, os_uint64_t off)
+{
+	struct journal *j = arg;
+	os_uint64_t bs = j->block_size, first = off / bs, last = (off + len - 1) / bs, b, from, to;
+	struct os_arena_mark_t mark;
+	unsigned char *copy = NULL;
+	struct jslot *e;
+
+	if (last < j->min_block || first > j->max_block)
+		return;
+	if (first < j->min_block)
+		first = j->min_block;
+	if (last > j->max_block)
+		last = j->max_block;
+
+	mark = arena_mark(arena_scratch());
+	for (b = first; b <= last; b++) {
+		if ((e = lookup(j, b)) == NULL)
+			continue;
+		if (copy == NULL)
+			copy = arena_alloc(arena_scratch(), bs);
+		if (img_pread_raw(fd, copy, bs, (os_uint64_t)e->copy * bs) != (ssize_t)bs)
+			continue;
+		if (e->escaped)
+			memcpy(copy, jbd_magic, sizeof(jbd_magic));
+		from = b * bs > off ? b * bs : off;
+		to = (b + 1) * bs < off + len ? (b + 1) * bs : off + len;
+		memcpy((unsigned char *)buf + (from - off), copy + (from - b * bs), to - from);
+	}
+	arena_release(arena_scratch(), mark);
+}
+
+static void release(void *arg)
+{
+	struct journal *j = arg;
+
+	free(j->slots);
+	free(j);
+}
+
+static os_bool_t fail(struct scan *s, const char *what)
+{
+	snprintf(s->info->error, sizeof(s->info->error), "%s", what);
+	return(FALSE);
+}
+
+static int map_extent(os_uint32_t logical, os_uint32_t physical, os_uint32_t count, void *arg)
+{
+	struct scan *s = arg;
+	os_uint32_t i;
+
+	for (i = 0; i < count && logical + i < s->jsb.maxlen; i++)
+		s->map[logical + i] = physical ? physical + i : 0;
+	return(logical + count >= s->jsb.maxlen);
+}
+
+static os_bool_t read_log(struct scan *s, os_uint32_t blk, unsigned char *buf)
+{
+	os_uint64_t bs = s->fs->block_size;
+
+	return(s->map[blk] != 0 &&
+	       img_pread(s->fd, buf, bs, (os_uint64_t)s->map[blk] * bs) == (ssize_t)bs);
+}
+
+static os_uint32_t next_log(struct scan *s, os_uint32_t blk)
+{
+	return(blk >= s->last ? s->jsb.first : blk + 1);
+}
+
+/* open_journal
+ *
+ * Reads the journal inode and the journal superblock, and maps every
+ * block of the journal to its disk block.
+ */
+
+static os_bool_t open_journal(struct scan *s)
+{
+	struct os_superblock_t *sb = s->fs->sb;
+	struct os_inode_t inode;
+	unsigned char *raw;
+	os_uint32_t *f, i, blk, incompat;
+
+	if (sb->s_journal_inum == 0)
+		return(fail(s, "external journals are not supported"));
+	if (!fetch_inode(sb->s_journal_inum, s->fd, s->fs, &inode))
+		return(fail(s, "cannot read the journal inode"));
+	if (inode.i_flags & EXT4_EXTENTS_FL)
+		return(fail(s, "journals mapped by extents are not supported"));
+	if ((blk = file_bmap(&inode, s->fd, s->fs, 0)) == 0)
+		return(fail(s, "journal has no superblock"));
+
+	raw = malloc(s->fs->block_size);
+	assert(raw != NULL);
+	read_block(s->fd, s->fs, blk, raw);
+	f = (os_uint32_t *)&s->jsb;
+	for (i = 0; i < offsetof(struct jbd_superblock, uuid) / 4; i++)
+		f[i] = be32(raw + i * 4);
+	s->jsb.checksum_type = raw[offsetof(struct jbd_superblock, checksum_type)];
+	s->jsb.num_fc_blocks = be32(raw + offsetof(struct jbd_superblock, num_fc_blocks));
+	free(raw);
+
+	if (s->jsb.header.magic != JBD_MAGIC ||
+	    (s->jsb.header.blocktype != JBD_SB_V1 && s->jsb.header.blocktype != JBD_SB_V2))
+		return(fail(s, "bad journal superblock"));
+	if (s->jsb.blocksize != s->fs->block_size)
+		return(fail(s, "journal block size differs from the filesystem's"));
+	if (s->jsb.maxlen < 2 || s->jsb.first == 0 || s->jsb.first >= s->jsb.maxlen ||
+	    (os_uint64_t)s->jsb.maxlen * s->fs->block_size > file_size(&inode))
+		return(fail(s, "bad journal geometry"));
+
+	incompat = s->jsb.header.blocktype == JBD_SB_V2 ? s->jsb.feature_incompat : 0;
+	if (incompat & ~(JBD_INCOMPAT_REVOKE | JBD_INCOMPAT_64BIT | JBD_INCOMPAT_CSUM_V2 |
+			 JBD_INCOMPAT_CSUM_V3 | JBD_INCOMPAT_FAST_COMMIT))
+		return(fail(s, "unknown journal features"));
+	if (incompat & JBD_INCOMPAT_CSUM_V3) {
+		s->tag_bytes = 16;
+	} else {
+		s->tag_bytes = 8;
+		if (incompat & JBD_INCOMPAT_CSUM_V2)
+			s->tag_bytes += 2;
+		if (incompat & JBD_INCOMPAT_64BIT)
+			s->tag_bytes += 4;
+	}
+	s->jsb.feature_incompat = incompat;
+	s->tail_bytes = incompat & (JBD_INCOMPAT_CSUM_V2 | JBD_INCOMPAT_CSUM_V3) ? 4 : 0;
+
+	// the log ends where the fast commit area begins
+	s->last = s->jsb.maxlen - 1;
+	if (incompat & JBD_INCOMPAT_FAST_COMMIT)
+		s->last -= s->jsb.num_fc_blocks ? s->jsb.num_fc_blocks : JBD_DEFAULT_FC_BLOCKS;
+	if (s->last < s->jsb.first ||
+	    (s->jsb.start != 0 && (s->jsb.start < s->jsb.first || s->jsb.start > s->last)))
+		return(fail(s, "bad journal geometry"));
+
+	s->map = calloc(s->jsb.maxlen, sizeof(os_uint32_t));
+	assert(s->map != NULL);
+	file_extents(&inode, s->fd, s->fs, map_extent, s);
+	return(TRUE);
+}
+
+static void add_tag(struct scan *s, os_uint32_t block, os_uint32_t log,
+		    os_uint32_t sequence, os_uint32_t flags)
+{
+	if (s->ntags == s->tcap) {
+		s->tcap = s->tcap ? s->tcap * 2 : 1024;
+		s->tags = realloc(s->tags, s->tcap * sizeof(struct jtag));
+		assert(s->tags != NULL);
+	}
+	s->tags[s->ntags].block = block;
+	s->tags[s->ntags].log = log;
+	s->tags[s->ntags].sequence = sequence;
+	s->tags[s->ntags].escaped = (flags & JBD_FLAG_ESCAPE) != 0;
+	s->ntags++;
+}
+
+static void add_revoke(struct scan *s, os_uint32_t block, os_uint32_t sequence)
+{
+	if (s->nrevokes == s->rcap) {
+		s->rcap = s->rcap ? s->rcap * 2 : 1024;
+		s->revokes = realloc(s->revokes, s->rcap * sizeof(struct jrevoke));
+		assert(s->revokes != NULL);
+	}
+	s->revokes[s->nrevokes].block = block;
+	s->revokes[s->nrevokes].sequence = sequence;
+	s->nrevokes++;
+}
+
+/* scan_log
+ *
+ * Walks the log from its start, one transaction after the other, for
+ * as long as the blocks carry the sequence number expected next: a
+ * descriptor block lists the filesystem blocks whose copies follow it,
+ * a revoke block lists blocks whose earlier copies must not be used,
+ * and a commit block closes the transaction.  Returns the sequence
+ * number after the last committed transaction; what follows it was
+ * never committed and is ignored.
+ */
+
+static os_uint32_t scan_log(struct scan *s)
+{
+	os_uint32_t bs = s->fs->block_size, blk = s->jsb.start, seq = s->jsb.sequence, end = seq;
+	os_uint32_t steps = 0, off, flags, rec, count, loglen = s->last - s->jsb.first + 1;
+	int is64 = (s->jsb.feature_incompat & JBD_INCOMPAT_64BIT) != 0;
+	int csum3 = (s->jsb.feature_incompat & JBD_INCOMPAT_CSUM_V3) != 0;
+	unsigned char *buf = malloc(bs);
+
+	assert(buf != NULL);
+	while (steps++ < loglen && read_log(s, blk, buf)) {
+		if (be32(buf) != JBD_MAGIC || be32(buf + 8) != seq)
+			break;
+
+		switch (be32(buf + 4)) {
+		case JBD_DESCRIPTOR:
+			for (off = sizeof(struct jbd_header); off + s->tag_bytes <= bs - s->tail_bytes;) {
+				flags = csum3 ? be32(buf + off + 4) : be16(buf + off + 6);
+				blk = next_log(s, blk);
+				steps++;
+				// blocks past 2^32 cannot belong to this filesystem
+				if (!is64 || be32(buf + off + 8) == 0)
+					add_tag(s, be32(buf + off), blk, seq, flags);
+				off += s->tag_bytes;
+				if (!(flags & JBD_FLAG_SAME_UUID))
+					off += 16;
+				if (flags & JBD_FLAG_LAST_TAG)
+					break;
+			}
+			break;
+		case JBD_COMMIT:
+			end = ++seq;
+			break;
+		case JBD_REVOKE:
+			rec = is64 ? 8 : 4;
+			count = be32(buf + sizeof(struct jbd_header));
+			if (count > bs - s->tail_bytes)
+				count = bs - s->tail_bytes;
+			for (off = sizeof(struct jbd_header) + 4; off + rec <= count; off += rec)
+				if (!is64 || be32(buf + off) == 0)
+					add_revoke(s, be32(buf + off + rec - 4), seq);
+			break;
+		default:
+			steps = loglen;
+			continue;
+		}
+		blk = next_log(s, blk);
+	}
+	free(buf);
+	return(end);
+}
+
+/* build_overlay
+ *
+ * Keeps, for every block, the copy of the latest committed transaction,
+ * unless a revoke record of that transaction or a later one cancels it.
+ */
+
+static struct journal *build_overlay(struct scan *s, os_uint32_t end)
+{
+	struct journal *j = calloc(1, sizeof(struct journal)), revoked;
+	os_uint32_t i, n = 0, size = 16;
+	struct jslot *e;
+
+	assert(j != NULL);
+	for (i = 0; i < s->ntags; i++)
+		if (!tid_geq(s->tags[i].sequence, end))
+			n++;
+	while (size < 2 * n || size < 2 * s->nrevokes)
+		size *= 2;
+
+	// revoked block -> latest revoking transaction
+	memset(&revoked, 0, sizeof(revoked));
+	revoked.mask = size - 1;
+	revoked.slots = calloc(size, sizeof(struct jslot));
+	j->mask = size - 1;
+	j->slots = calloc(size, sizeof(struct jslot));
+	assert(revoked.slots != NULL && j->slots != NULL);
+	for (i = 0; i < s->nrevokes; i++) {
+		if (tid_geq(s->revokes[i].sequence, end))
+			continue;
+		e = lookup(&revoked, s->revokes[i].block);
+		if (e == NULL || tid_geq(s->revokes[i].sequence, e->copy))
+			insert(&revoked, s->revokes[i].block)->copy = s->revokes[i].sequence;
+	}
+
+	j->block_size = s->fs->block_size;
+	j->min_block = 0xFFFFFFFF;
+	for (i = 0; i < s->ntags; i++) {
+		if (tid_geq(s->tags[i].sequence, end))
+			continue;
+		if ((e = lookup(&revoked, s->tags[i].block)) != NULL &&
+		    tid_geq(e->copy, s->tags[i].sequence)) {
+			s->info->revoked++;
+			continue;
+		}
+		if (s->map[s->tags[i].log] == 0 || s->tags[i].block >= s->fs->num_blocks)
+			continue;
+		e = insert(j, s->tags[i].block);
+		e->copy = s->map[s->tags[i].log];
+		e->escaped = s->tags[i].escaped;
+		if (s->tags[i].block < j->min_block)
+			j->min_block = s->tags[i].block;
+		if (s->tags[i].block > j->max_block)
+			j->max_block = s->tags[i].block;
+	}
+	for (i = 0; i <= j->mask; i++)
+		s->info->blocks += j->slots[i].used;
+	free(revoked.slots);
+	return(j);
+}
+
+os_bool_t journal_attach(int fd, struct os_fs_metadata_t **metadata,
+                         struct os_journal_info_t *info)
+{
+	struct os_fs_metadata_t *fs = *metadata, *reloaded;
+	struct journal *j;
+	struct scan s;
+	os_uint32_t end;
+	os_bool_t ok;
+
+	memset(info, 0, sizeof(*info));
+	if (!use_overlay || !(fs->sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL))
+		return(TRUE);
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+	s.fs = fs;
+	s.info = info;
+	if (!(ok = open_journal(&s)) || s.jsb.start == 0)
+		goto out;
+
+	end = scan_log(&s);
+	info->transactions = end - s.jsb.sequence;
+	j = build_overlay(&s, end);
+	if (info->blocks == 0) {
+		release(j);
+		goto out;
+	}
+	img_set_overlay(fd, patch, release, j);
+	bcache_forget(fd);
+
+	reloaded = fs->bgdt_loaded ? load_fs_metadata_lazy(fd) : load_fs_metadata(fd);
+	if (reloaded == NULL) {
+		img_set_overlay(fd, NULL, NULL, NULL);
+		bcache_forget(fd);
+		release(j);
+		ok = fail(&s, "no ext2 filesystem after the journal");
+		goto out;
+	}
+	free_fs_metadata(fs);
+	*metadata = reloaded;
+
+out:
+	free(s.map);
+	free(s.tags);
+	free(s.revokes);
+	return(ok);
+}
@@ -0,0 +1,268 @@
+/* =============
+ * memory governor
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/memgov.h"
+
+#define MG_SLACK 32                 // reclaim to 1/32 below the limit
+
+struct os_memgov_cache_t {
+	const char *name;
+	os_memgov_evict_t evict;    // NULL: only counted
+	void *arg;
+	size_t bytes;
+	size_t target;
+	os_uint64_t hits, misses;
+	os_uint64_t seen_hits;      // hits at the last rebalance
+	double score;               // hits of recent windows, older ones halved
+};
+
+static struct os_memgov_cache_t caches[MG_MAX_CACHES];
+static int ncaches;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t limit, used, pinned;
+static int reclaiming;
+static os_uint64_t accesses;
+
+/* set_targets
+ *
+ * Splits what the pinned caches leave of the limit between the
+ * evictable ones: a quarter of it evenly, as a floor that lets an idle
+ * cache earn hits again, the rest by score.  Called with the lock held.
+ */
+
+static void set_targets(void)
+{
+	size_t avail = limit > pinned ? limit - pinned : 0, floor;
+	double total = 0;
+	int i, n = 0;
+
+	for (i = 0; i < ncaches; i++) {
+		if (caches[i].evict != NULL) {
+			total += caches[i].score;
+			n++;
+		}
+	}
+	if (n == 0)
+		return;
+
+	floor = avail / (4 * n);
+	for (i = 0; i < ncaches; i++)
+		if (caches[i].evict != NULL)
+			caches[i].target = floor + (size_t)((avail - floor * n) *
+				((caches[i].score + 1) / (total + n)));
+}
+
+// closes a window of hits: older windows count half as much each time
+static void rebalance(void)
+{
+	os_uint64_t h;
+	int i;
+
+	for (i = 0; i < ncaches; i++) {
+		h = __atomic_load_n(&caches[i].hits, __ATOMIC_RELAXED);
+		caches[i].score = caches[i].score / 2 + (h - caches[i].seen_hits);
+		caches[i].seen_hits = h;
+	}
+	set_targets();
+}
+
+struct os_memgov_cache_t *mg_register(const char *name, os_memgov_evict_t evict,
+                                      void *arg)
+{
+	struct os_memgov_cache_t *c;
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < ncaches; i++) {
+		if (!strcmp(caches[i].name, name)) {
+			pthread_mutex_unlock(&lock);
+			return(&caches[i]);
+		}
+	}
+	assert(ncaches < MG_MAX_CACHES);
+	c = &caches[ncaches++];
+	c->name = name;
+	c->evict = evict;
+	c->arg = arg;
+	set_targets();
+	pthread_mutex_unlock(&lock);
+	return(c);
+}
+
+/* reclaim
+ *
+ * Evicts until the total is a little below the limit, taking from the
+ * cache furthest over its target first.  Only one thread reclaims at a
+ * time; the others carry on over the limit meanwhile.
+ */
+
+static void reclaim(void)
+{
+	struct os_memgov_cache_t *victim;
+	long long over, most;
+	size_t goal, want, freed;
+	int i, stuck = 0;
+
+	pthread_mutex_lock(&lock);
+	if (reclaiming) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	reclaiming = 1;
+	rebalance();
+	goal = limit - limit / MG_SLACK;
+	while (limit && used > goal && stuck < ncaches) {
+		victim = NULL;
+		most = 0;
+		for (i = 0; i < ncaches; i++) {
+			if (caches[i].evict == NULL || caches[i].bytes == 0)
+				continue;
+			over = (long long)caches[i].bytes - (long long)caches[i].target;
+			if (victim == NULL || over > most) {
+				victim = &caches[i];
+				most = over;
+			}
+		}
+		if (victim == NULL)
+			break;
+
+		want = used - goal;
+		if (most > 0 && (size_t)most < want)
+			want = most;
+		pthread_mutex_unlock(&lock);
+		freed = victim->evict(victim->arg, want);
+		pthread_mutex_lock(&lock);
+		stuck = freed ? 0 : stuck + 1;
+	}
+	reclaiming = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+void mg_set_limit(size_t bytes)
+{
+	pthread_mutex_lock(&lock);
+	limit = bytes;
+	set_targets();
+	pthread_mutex_unlock(&lock);
+	if (bytes)
+		reclaim();
+}
+
+size_t mg_limit(void)
+{
+	return(limit);
+}
+
+void mg_charge(struct os_memgov_cache_t *c, size_t bytes)
+{
+	os_bool_t over;
+
+	pthread_mutex_lock(&lock);
+	c->bytes += bytes;
+	used += bytes;
+	if (c->evict == NULL) {
+		pinned += bytes;
+		set_targets();
+	}
+	over = limit && used > limit;
+	pthread_mutex_unlock(&lock);
+	if (over)
+		reclaim();
+}
+
+os_bool_t mg_reserve(struct os_memgov_cache_t *c, size_t bytes)
+{
+	os_bool_t ok;
+
+	pthread_mutex_lock(&lock);
+	ok = limit == 0 || pinned + bytes <= limit - limit / 4;
+	pthread_mutex_unlock(&lock);
+	if (ok)
+		mg_charge(c, bytes);
+	return(ok);
+}
+
+void mg_uncharge(struct os_memgov_cache_t *c, size_t bytes)
+{
+	pthread_mutex_lock(&lock);
+	c->bytes -= bytes;
+	used -= bytes;
+	if (c->evict == NULL) {
+		pinned -= bytes;
+		set_targets();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void accessed(void)
+{
+	if (limit && __atomic_add_fetch(&accesses, 1, __ATOMIC_RELAXED) % MG_REBALANCE == 0) {
+		pthread_mutex_lock(&lock);
+		rebalance();
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void mg_hit(struct os_memgov_cache_t *c)
+{
+	__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+	accessed();
+}
+
+void mg_miss(struct os_memgov_cache_t *c)
+{
+	__atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+	accessed();
+}
+
+void mg_stats(struct os_memgov_cache_t *c, os_uint64_t *hits, os_uint64_t *misses,
+              size_t *bytes)
+{
+	*hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&lock);
+	*bytes = c->bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+void mg_report(FILE *out)
+{
+	struct os_memgov_cache_t *c;
+	os_uint64_t h, m;
+	char target[32];
+	int i;
+
+	pthread_mutex_lock(&lock);
+	if (limit)
+		fprintf(out, "memory limit %.1f MiB, %.1f MiB used\n", limit / 1048576.0,
+			used / 1048576.0);
+	else
+		fprintf(out, "no memory limit, %.1f MiB used\n", used / 1048576.0);
+	fprintf(out, "%-10s %12s %12s %10s %10s %8s\n", "cache", "KiB", "target KiB",
+		"hits", "misses", "hit rate");
+	for (i = 0; i < ncaches; i++) {
+		c = &caches[i];
+		h = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+		m = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+		if (c->evict == NULL)
+			snprintf(target, sizeof(target), "pinned");
+		else if (limit)
+			snprintf(target, sizeof(target), "%zu", c->target >> 10);
+		else
+			snprintf(target, sizeof(target), "-");
+		fprintf(out, "%-10s %12zu %12s %10llu %10llu", c->name, c->bytes >> 10, target, h, m);
+		if (h + m)
+			fprintf(out, " %7.1f%%\n", 100.0 * h / (h + m));
+		else
+			fprintf(out, " %8s\n", "-");
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,121 @@
+/* =============
+ * directory name filters
+ * =============
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "inc/types.h"
+#include "inc/namefilter.h"
+
+static int is_meta(char c)
+{
+	return(c == '*' || c == '?' || c == '[' || c == '\\');
+}
+
+/* literal_eq
+ *
+ * Compares 'len' bytes of a and b.  Full 16-byte lanes are compared with
+ * one SSE2 compare each; only the tail is done byte by byte, and the
+ * loop exits on the first lane that differs.
+ */
+
+static inline int literal_eq(const char *a, const char *b, os_uint32_t len)
+{
+	os_uint32_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+			return(0);
+	}
+#endif
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			return(0);
+
+	return(1);
+}
+
+os_bool_t name_filter_init(struct os_name_filter_t *filter, const char *pattern)
+{
+	size_t len = strlen(pattern), first, last, i;
+	int stars = 0, other = 0, bracket = 0;
+
+	if (len > EXT2_NAME_LEN)
+		return(FALSE);
+
+	memset(filter, 0, sizeof(*filter));
+	memcpy(filter->pattern, pattern, len);
+
+	for (first = 0; first < len && !is_meta(pattern[first]); first++)
+		;
+	if (first == len) {
+		filter->kind = NAME_FILTER_EXACT;
+		memcpy(filter->prefix, pattern, len);
+		filter->prefix_len = filter->min_len = len;
+		return(TRUE);
+	}
+	for (last = len; !is_meta(pattern[last - 1]); last--)
+		;
+
+	for (i = first; i < last; i++) {
+		if (pattern[i] == '*')
+			stars++;
+		else if (pattern[i] == '?')
+			other++;
+		else
+			bracket = 1;
+	}
+
+	memcpy(filter->prefix, pattern, first);
+	filter->prefix_len = first;
+	memcpy(filter->suffix, pattern + last, len - last);
+	filter->suffix_len = len - last;
+	filter->min_len = filter->prefix_len + filter->suffix_len;
+
+	// "prefix*suffix": the literals decide the match on their own.
+	// Otherwise every '?' needs one more byte; brackets and escapes are
+	// left to fnmatch().
+	if (stars == 1 && !other && !bracket) {
+		filter->kind = NAME_FILTER_AFFIX;
+	} else {
+		filter->kind = NAME_FILTER_GLOB;
+		if (!bracket)
+			filter->min_len += other;
+	}
+
+	return(TRUE);
+}
+
+os_bool_t name_filter_match(const struct os_name_filter_t *filter,
+                            const char *name, os_uint32_t len)
+{
+	char buf[EXT2_NAME_LEN + 1];
+
+	if (filter->kind == NAME_FILTER_EXACT)
+		return(len == filter->prefix_len && literal_eq(name, filter->prefix, len));
+
+	if (len < filter->min_len ||
+	    !literal_eq(name, filter->prefix, filter->prefix_len) ||
+	    !literal_eq(name + len - filter->suffix_len, filter->suffix, filter->suffix_len))
+		return(FALSE);
+
+	// like the shell, a leading wildcard does not match a leading '.'
+	if (filter->kind == NAME_FILTER_AFFIX)
+		return(filter->prefix_len || name[0] != '.');
+
+	if (len > EXT2_NAME_LEN)
+		return(FALSE);
+	memcpy(buf, name, len);
+	buf[len] = '\0';
+	return(fnmatch(filter->pattern, buf, FNM_PERIOD) == 0);
+}
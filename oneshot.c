@@ -0,0 +1,169 @@
+/* =============
+ * one-shot commands
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/oneshot.h"
+#include "inc/journal.h"
+
+struct cat_arg {
+	int fd;
+	FILE *out;
+	struct os_fs_metadata_t *fs;
+	os_uint64_t left;             // bytes of the file still to write
+	os_uint32_t chunk;            // bytes to read next
+	unsigned char *buf;
+	int failed;
+};
+
+static int cat_extent(os_uint32_t logical, os_uint32_t physical,
+		      os_uint32_t count, void *arg)
+{
+	struct cat_arg *ca = arg;
+	os_uint64_t bs = ca->fs->block_size, len = count * bs, disk = physical * bs;
+	size_t n;
+
+	if (len > ca->left)
+		len = ca->left;
+	while (len > 0) {
+		n = len < ca->chunk ? len : ca->chunk;
+		if (physical == 0)
+			memset(ca->buf, 0, n);
+		else if (img_pread(ca->fd, ca->buf, n, disk) != (ssize_t)n)
+			ca->failed = EIO;
+		// flushed right away, so the first bytes go out before the
+		// next read
+		if (ca->failed || fwrite(ca->buf, 1, n, ca->out) != n || fflush(ca->out)) {
+			ca->failed = ca->failed ? ca->failed : errno;
+			return(1);
+		}
+		disk += n;
+		len -= n;
+		ca->left -= n;
+		ca->chunk = ONESHOT_READ;
+	}
+	return(ca->left == 0);
+}
+
+static int do_cat(int fd, struct os_fs_metadata_t *fs, struct os_inode_t *inode, FILE *out)
+{
+	struct cat_arg ca;
+
+	if ((inode->i_mode & 0xF000) == EXT2_S_IFDIR)
+		return(EISDIR);
+	if ((inode->i_mode & 0xF000) != EXT2_S_IFREG)
+		return(EINVAL);
+
+	ca.fd = fd;
+	ca.out = out;
+	ca.fs = fs;
+	ca.left = file_size(inode);
+	ca.chunk = ONESHOT_FIRST_READ;
+	ca.buf = img_alloc(ONESHOT_READ);
+	ca.failed = 0;
+	assert(ca.buf != NULL);
+	file_extents(inode, fd, fs, cat_extent, &ca);
+	free(ca.buf);
+	return(ca.failed);
+}
+
+static int do_ls(int fd, struct os_fs_metadata_t *fs, struct os_inode_t *inode, FILE *out)
+{
+	static const char types[] = "?fdcbpsl";
+	struct os_dirent_view_t v;
+	struct os_dir_iter_t it;
+	struct os_inode_t child;
+	char type;
+
+	if ((inode->i_mode & 0xF000) != EXT2_S_IFDIR)
+		return(ENOTDIR);
+
+	dir_iter_init(&it, inode, fd, fs, NULL);
+	while (dir_iter_next(&it, &v)) {
+		// the entry's file type saves reading the inode
+		if (v.file_type && v.file_type < sizeof(types) - 1)
+			type = types[v.file_type];
+		else if (!fetch_inode(v.inode, fd, fs, &child))
+			type = '?';
+		else if ((child.i_mode & 0xF000) == EXT2_S_IFDIR)
+			type = 'd';
+		else if ((child.i_mode & 0xF000) == EXT2_S_IFREG)
+			type = 'f';
+		else if ((child.i_mode & 0xF000) == EXT2_S_IFLNK)
+			type = 'l';
+		else
+			type = '?';
+		fprintf(out, "%u\t%c\t%.*s\n", v.inode, type, v.name_len, v.name);
+	}
+	dir_iter_end(&it);
+	return(0);
+}
+
+static int do_stat(os_uint32_t ino, struct os_inode_t *inode, FILE *out)
+{
+	fprintf(out, "%u %o %u %u %u %llu %u %u\n", ino, inode->i_mode, inode->i_links_count,
+	       inode->i_uid | (os_uint32_t)inode->i_osd2.linux2.l_i_uid_high << 16,
+	       inode->i_gid | (os_uint32_t)inode->i_osd2.linux2.l_i_gid_high << 16,
+	       file_size(inode), inode->i_mtime, inode->i_blocks);
+	return(0);
+}
+
+int oneshot_op(const char *op)
+{
+	return(!strcmp(op, "ls") || !strcmp(op, "cat") || !strcmp(op, "stat"));
+}
+
+int oneshot_run(int fd, struct os_fs_metadata_t *fs, const char *op,
+                const char *path, FILE *out)
+{
+	struct os_inode_t inode;
+	os_uint32_t ino;
+
+	ino = path_lookup(path, EXT2_ROOT_INO, fd, fs);
+	if (ino == 0)
+		return(ENOENT);
+	if (!fetch_inode(ino, fd, fs, &inode))
+		return(EIO);
+	if (!strcmp(op, "ls"))
+		return(do_ls(fd, fs, &inode, out));
+	if (!strcmp(op, "stat"))
+		return(do_stat(ino, &inode, out));
+	return(do_cat(fd, fs, &inode, out));
+}
+
+int oneshot(const char *image, int flags, const char *op, const char *path)
+{
+	struct os_fs_metadata_t *fs;
+	struct os_journal_info_t jinfo;
+	int fd, err;
+
+	fd = img_open(image, flags);
+	if (fd == -1) {
+		fprintf(stderr, "Could NOT open file \"%s\"\n", image);
+		return(1);
+	}
+	fs = load_fs_metadata_lazy(fd);
+	if (fs == NULL) {
+		fprintf(stderr, "No ext2 filesystem in \"%s\"\n", image);
+		return(1);
+	}
+	if (!journal_attach(fd, &fs, &jinfo)) {
+		fprintf(stderr, "Could NOT read the journal of \"%s\": %s\n", image, jinfo.error);
+		return(1);
+	}
+
+	err = oneshot_run(fd, fs, op, path, stdout);
+	fflush(stdout);
+	if (err)
+		fprintf(stderr, "%s: %s\n", path, strerror(err));
+	return(err ? 1 : 0);
+}
@@ -0,0 +1,258 @@
+/* =============
+ * parent map
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/parentmap.h"
+#include "inc/threadpool.h"
+#include "inc/arena.h"
+#include "inc/memgov.h"
+
+struct pm_entry {
+	os_uint32_t child;
+	os_uint32_t parent;
+	os_uint32_t name_off;  // into the names of the entry's group
+	os_uint8_t name_len;
+	os_uint32_t group;
+};
+
+// entries found in the directories of one blockgroup
+struct pm_group {
+	struct pm_entry *ents;
+	os_uint32_t n, cap;
+	char *names;
+	os_uint32_t names_len, names_cap;
+};
+
+struct os_parentmap_t {
+	struct pm_group *groups;
+	os_uint32_t ngroups;
+	struct pm_entry **slots;  // open addressing on child
+	os_uint64_t mask;
+	os_uint64_t count;
+	size_t charged;           // bytes counted by the memory governor
+};
+
+struct build_arg {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	struct os_parentmap_t *map;
+	int failed;
+};
+
+struct dir_arg {
+	struct pm_group *pg;
+	os_uint32_t group;
+	os_uint32_t parent;
+};
+
+static inline os_uint64_t hash32(os_uint32_t x)
+{
+	return((os_uint64_t)x * 0x9E3779B97F4A7C15ULL >> 16);
+}
+
+static int add_entry(struct os_direntry_t *entry, void *arg)
+{
+	struct dir_arg *da = arg;
+	struct pm_group *pg = da->pg;
+	struct pm_entry *e;
+
+	if (entry->file_name[0] == '.' &&
+	    (entry->name_len == 1 || (entry->name_len == 2 && entry->file_name[1] == '.')))
+		return(0);
+
+	if (pg->n == pg->cap) {
+		pg->cap = pg->cap ? pg->cap * 2 : 256;
+		pg->ents = realloc(pg->ents, pg->cap * sizeof(struct pm_entry));
+		assert(pg->ents != NULL);
+	}
+	if (pg->names_len + entry->name_len > pg->names_cap) {
+		pg->names_cap = pg->names_cap ? pg->names_cap * 2 : 4096;
+		if (pg->names_cap < pg->names_len + entry->name_len)
+			pg->names_cap = pg->names_len + entry->name_len;
+		pg->names = realloc(pg->names, pg->names_cap);
+		assert(pg->names != NULL);
+	}
+
+	e = &pg->ents[pg->n++];
+	e->child = entry->inode;
+	e->parent = da->parent;
+	e->name_off = pg->names_len;
+	e->name_len = entry->name_len;
+	e->group = da->group;
+	memcpy(pg->names + pg->names_len, entry->file_name, entry->name_len);
+	pg->names_len += entry->name_len;
+
+	return(0);
+}
+
+static void build_group(os_uint32_t g, void *arg)
+{
+	struct build_arg *ba = arg;
+	struct os_fs_metadata_t *fs = ba->fs;
+	size_t table_len = (size_t)fs->inodes_per_group * fs->inode_size;
+	struct os_arena_mark_t mark;
+	const unsigned char *table;
+	struct os_inode_t inode;
+	struct dir_arg da;
+	os_uint32_t i;
+
+	if (fs->bgdt[g].bg_used_dirs_count == 0)
+		return;
+
+	mark = arena_mark(arena_scratch());
+	table = group_inode_table(ba->fd, fs, g,
+				  fs->inode_table ? NULL : arena_alloc(arena_scratch(), table_len));
+	if (table == NULL) {
+		ba->failed = 1;
+		arena_release(arena_scratch(), mark);
+		return;
+	}
+
+	da.pg = &ba->map->groups[g];
+	da.group = g;
+	for (i = 0; i < fs->inodes_per_group; i++) {
+		memcpy(&inode, table + (size_t)i * fs->inode_size, sizeof(inode));
+		if ((inode.i_mode & 0xF000) != EXT2_S_IFDIR ||
+		    inode.i_links_count == 0 || inode.i_dtime != 0)
+			continue;
+		da.parent = g * fs->inodes_per_group + i + 1;
+		dir_foreach(&inode, ba->fd, fs, add_entry, &da);
+	}
+
+	arena_release(arena_scratch(), mark);
+}
+
+static struct pm_entry *lookup(struct os_parentmap_t *map, os_uint32_t child)
+{
+	os_uint64_t h;
+
+	if (map->slots == NULL)
+		return(NULL);
+	for (h = hash32(child) & map->mask; map->slots[h]; h = (h + 1) & map->mask)
+		if (map->slots[h]->child == child)
+			return(map->slots[h]);
+	return(NULL);
+}
+
+struct os_parentmap_t *pmap_build(int fd, struct os_fs_metadata_t *metadata,
+                                  struct os_threadpool_t *tp)
+{
+	struct os_parentmap_t *map = calloc(1, sizeof(struct os_parentmap_t));
+	struct build_arg ba = { fd, metadata, map, 0 };
+	struct pm_group *pg;
+	os_uint64_t total = 0, size, h;
+	os_uint32_t g, i;
+
+	assert(map != NULL);
+	map->ngroups = metadata->num_blockgroups;
+	map->groups = calloc(map->ngroups, sizeof(struct pm_group));
+	assert(map->groups != NULL);
+
+	tp_parallel_for(tp, map->ngroups, build_group, &ba);
+	if (ba.failed) {
+		pmap_free(map);
+		return(NULL);
+	}
+
+	for (g = 0; g < map->ngroups; g++)
+		total += map->groups[g].n;
+	for (size = 16; size < total * 2; size <<= 1)
+		;
+	map->slots = calloc(size, sizeof(struct pm_entry *));
+	assert(map->slots != NULL);
+	map->mask = size - 1;
+
+	// serial merge in group order, so the first link found wins
+	for (g = 0; g < map->ngroups; g++) {
+		pg = &map->groups[g];
+		for (i = 0; i < pg->n; i++) {
+			for (h = hash32(pg->ents[i].child) & map->mask; map->slots[h];
+			     h = (h + 1) & map->mask)
+				if (map->slots[h]->child == pg->ents[i].child)
+					break;
+			if (map->slots[h] == NULL) {
+				map->slots[h] = &pg->ents[i];
+				map->count++;
+			}
+		}
+	}
+
+	map->charged = sizeof(*map) + size * sizeof(struct pm_entry *) +
+		       map->ngroups * sizeof(struct pm_group);
+	for (g = 0; g < map->ngroups; g++)
+		map->charged += (size_t)map->groups[g].cap * sizeof(struct pm_entry) +
+				map->groups[g].names_cap;
+	mg_charge(mg_register(MG_INDEXES, NULL, NULL), map->charged);
+	return(map);
+}
+
+struct os_parentmap_t *pmap_get(int fd, struct os_fs_metadata_t *metadata)
+{
+	if (metadata->parents == NULL)
+		metadata->parents = pmap_build(fd, metadata, tp_shared());
+	return(metadata->parents);
+}
+
+os_bool_t pmap_path(struct os_parentmap_t *map, os_uint32_t inode,
+                    char *buf, size_t len)
+{
+	struct pm_entry *e;
+	size_t pos = len;
+	int depth;
+
+	if (len < 2)
+		return(FALSE);
+	buf[--pos] = '\0';
+
+	// build the path backwards from the end of buf
+	for (depth = 0; inode != EXT2_ROOT_INO; depth++) {
+		e = lookup(map, inode);
+		if (e == NULL || depth > 4096 || pos < (size_t)e->name_len + 1)
+			return(FALSE);
+		pos -= e->name_len;
+		memcpy(buf + pos, map->groups[e->group].names + e->name_off, e->name_len);
+		buf[--pos] = '/';
+		inode = e->parent;
+	}
+	if (pos == len - 1)
+		buf[--pos] = '/';
+
+	memmove(buf, buf + pos, len - pos);
+	return(TRUE);
+}
+
+os_uint32_t pmap_parent(struct os_parentmap_t *map, os_uint32_t inode)
+{
+	struct pm_entry *e = lookup(map, inode);
+
+	return(e ? e->parent : 0);
+}
+
+os_uint64_t pmap_size(struct os_parentmap_t *map)
+{
+	return(map->count);
+}
+
+void pmap_free(struct os_parentmap_t *map)
+{
+	os_uint32_t g;
+
+	if (map == NULL)
+		return;
+	mg_uncharge(mg_register(MG_INDEXES, NULL, NULL), map->charged);
+	for (g = 0; g < map->ngroups; g++) {
+		free(map->groups[g].ents);
+		free(map->groups[g].names);
+	}
+	free(map->groups);
+	free(map->slots);
+	free(map);
+}
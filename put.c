@@ -0,0 +1,886 @@
+/* =============
+ * importing host files
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/put.h"
+#include "inc/arena.h"
+#include "inc/trace.h"
+
+#define NONE 0xFFFFFFFF
+#define COPY_CHUNK (1 << 20)          // bytes per read/write of file contents
+#define FLUSH_IOV 1024                // records merged into one write at most
+#define FAST_LINK_MAX (sizeof(((struct os_inode_t *)0)->i_block))
+
+// what put knows how to keep consistent
+#define PUT_COMPAT_OK (EXT2_FEATURE_COMPAT_DIR_PREALLOC | EXT2_FEATURE_COMPAT_IMAGIC_INODES | \
+		       EXT3_FEATURE_COMPAT_HAS_JOURNAL | EXT2_FEATURE_COMPAT_EXT_ATTR | \
+		       EXT2_FEATURE_COMPAT_RESIZE_INO | EXT2_FEATURE_COMPAT_DIR_INDEX)
+#define PUT_INCOMPAT_OK EXT2_FEATURE_INCOMPAT_FILETYPE
+#define PUT_RO_COMPAT_OK (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
+
+// bytes a directory entry with an 'n' character name needs
+#define ENTRY_LEN(n) ((8 + (n) + 3) & ~3U)
+
+struct item {
+	const char *host;
+	const char *name;
+	os_uint32_t parent;           // index of the parent item, NONE at the top
+	os_uint32_t first_child, last_child, next_sibling;
+	struct stat st;
+	char *link;                   // symlink target
+	os_uint32_t ino;
+	os_uint32_t nblocks;          // data (or directory) blocks
+	os_uint32_t meta;             // indirect blocks mapping them
+	os_uint32_t *map;             // disk block of each data block
+	os_uint32_t subdirs;
+	unsigned char *raw;           // on-disk inode
+};
+
+// one pending metadata write
+struct record {
+	os_uint64_t off;
+	os_uint32_t len;
+	void *buf;
+};
+
+struct run {
+	os_uint32_t start, count;
+};
+
+struct put {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	struct os_put_report_t *report;
+	struct os_arena_t arena;
+	os_uint32_t ppb;              // block numbers per indirect block
+	os_uint32_t now;
+
+	struct item *items;
+	os_uint32_t nitems, cap;
+
+	struct record *recs;
+	os_uint32_t nrecs, rcap;
+
+	// reserved blocks, handed out in order
+	struct run *runs;
+	os_uint32_t nruns, cur, used;
+
+	// every group's bitmaps, and which of them changed
+	unsigned char *bbitmap, *ibitmap;
+	unsigned char *bdirty, *idirty;
+
+	// the existing directory that gets the new entry
+	os_uint32_t dir_ino;
+	struct os_inode_t dir;
+	unsigned char *dir_block;     // block with room for it, or NULL ...
+	os_uint32_t dir_phys, dir_off, dir_used;
+	os_bool_t dir_grow;           // ... for a new block at the end
+	unsigned char *dir_raw;
+};
+
+static os_bool_t fail(struct put *pt, const char *what)
+{
+	snprintf(pt->report->error, sizeof(pt->report->error), "%s: %s", what, strerror(errno));
+	return(FALSE);
+}
+
+os_bool_t put_supported(struct os_fs_metadata_t *metadata)
+{
+	struct os_superblock_t *sb = metadata->sb;
+
+	// 64 KiB blocks would need rec_len encoded, see dirent_rec_len()
+	return(sb->s_rev_level <= EXT2_DYNAMIC_REV && metadata->block_size < 65536 &&
+	       !(sb->s_feature_compat & ~PUT_COMPAT_OK) &&
+	       !(sb->s_feature_incompat & ~PUT_INCOMPAT_OK) &&
+	       !(sb->s_feature_ro_compat & ~PUT_RO_COMPAT_OK));
+}
+
+static void add_record(struct put *pt, os_uint64_t off, os_uint32_t len, void *buf)
+{
+	if (pt->nrecs == pt->rcap) {
+		pt->rcap = pt->rcap ? pt->rcap * 2 : 256;
+		pt->recs = realloc(pt->recs, pt->rcap * sizeof(struct record));
+		assert(pt->recs != NULL);
+	}
+	pt->recs[pt->nrecs].off = off;
+	pt->recs[pt->nrecs].len = len;
+	pt->recs[pt->nrecs].buf = buf;
+	pt->nrecs++;
+}
+
+static void *new_block(struct put *pt, os_uint32_t blk)
+{
+	void *buf = arena_alloc(&pt->arena, pt->fs->block_size);
+
+	memset(buf, 0, pt->fs->block_size);
+	add_record(pt, (os_uint64_t)blk * pt->fs->block_size, pt->fs->block_size, buf);
+	return(buf);
+}
+
+// indirect blocks needed to map 'n' data blocks
+static os_uint64_t map_blocks(os_uint64_t n, os_uint64_t p)
+{
+	os_uint64_t meta = 0;
+
+	if (n <= 12)
+		return(0);
+	n -= 12;
+	meta++;
+	if (n <= p)
+		return(meta);
+	n -= p;
+	meta += 1 + (n < p * p ? (n + p - 1) / p : p);
+	if (n <= p * p)
+		return(meta);
+	n -= p * p;
+	return(meta + 1 + (n + p * p - 1) / (p * p) + (n + p - 1) / p);
+}
+
+/* pack_dir
+ *
+ * Lays out the entries of new directory 'idx' ('.', '..', then its
+ * children in order) into blocks.  With 'out' NULL only counts the
+ * blocks; else fills them, 'out' holding that many blocks.
+ */
+
+static os_uint32_t pack_dir(struct put *pt, os_uint32_t idx, unsigned char *out)
+{
+	struct item *it = &pt->items[idx];
+	os_uint32_t bs = pt->fs->block_size, blocks = 1, used = 0, c, len, n;
+	struct os_direntry_t *de, *last = NULL;
+	const char *name;
+	os_uint32_t ino;
+	os_uint8_t type;
+
+	for (c = NONE, n = 0; ; n++) {
+		if (n == 0) {
+			name = ".";
+			ino = it->ino;
+			type = EXT2_FT_DIR;
+		} else if (n == 1) {
+			name = "..";
+			ino = it->parent == NONE ? pt->dir_ino : pt->items[it->parent].ino;
+			type = EXT2_FT_DIR;
+			c = it->first_child;
+		} else if (c != NONE) {
+			name = pt->items[c].name;
+			ino = pt->items[c].ino;
+			type = S_ISDIR(pt->items[c].st.st_mode) ? EXT2_FT_DIR :
+			       S_ISLNK(pt->items[c].st.st_mode) ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+			c = pt->items[c].next_sibling;
+		} else {
+			break;
+		}
+
+		len = ENTRY_LEN(strlen(name));
+		if (used + len > bs) {
+			blocks++;
+			used = 0;
+		}
+		if (out) {
+			if (used == 0 && last)
+				last->rec_len += bs - (((unsigned char *)last - out) % bs + last->rec_len);
+			de = (struct os_direntry_t *)(out + (size_t)(blocks - 1) * bs + used);
+			de->inode = ino;
+			de->rec_len = len;
+			de->name_len = strlen(name);
+			de->file_type = (pt->fs->sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) ? type : 0;
+			memcpy(de->file_name, name, de->name_len);
+			last = de;
+		}
+		used += len;
+	}
+	if (out)
+		last->rec_len += bs - used;
+
+	return(blocks);
+}
+
+static int name_cmp(const struct dirent **a, const struct dirent **b)
+{
+	return(strcmp((*a)->d_name, (*b)->d_name));
+}
+
+/* plan
+ *
+ * Adds 'host' and, for directories, everything below it to the item
+ * list and sizes it.  Children are visited in name order so the same
+ * tree always gives the same image.
+ */
+
+static os_bool_t plan(struct put *pt, const char *host, const char *name,
+                      os_uint32_t parent, os_bool_t recursive)
+{
+	os_uint32_t bs = pt->fs->block_size, idx;
+	os_uint64_t p = pt->ppb, max = 12 + p + p * p + p * p * p, n;
+	struct dirent **list;
+	struct item *it;
+	char *path;
+	ssize_t len;
+	int i, j, count;
+
+	if (strlen(name) > EXT2_NAME_LEN) {
+		errno = ENAMETOOLONG;
+		return(fail(pt, host));
+	}
+	if (pt->nitems == pt->cap) {
+		pt->cap = pt->cap ? pt->cap * 2 : 256;
+		pt->items = realloc(pt->items, pt->cap * sizeof(struct item));
+		assert(pt->items != NULL);
+	}
+	idx = pt->nitems;
+	it = &pt->items[idx];
+	memset(it, 0, sizeof(*it));
+	it->host = host;
+	it->name = name;
+	it->parent = parent;
+	it->first_child = it->last_child = it->next_sibling = NONE;
+	if (lstat(host, &it->st) != 0)
+		return(fail(pt, host));
+
+	if (S_ISREG(it->st.st_mode)) {
+		n = ((os_uint64_t)it->st.st_size + bs - 1) / bs;
+		if (n > max || (n + map_blocks(n, p)) * (bs / 512) > 0xFFFFFFFFULL) {
+			errno = EFBIG;
+			return(fail(pt, host));
+		}
+		it->nblocks = n;
+		it->meta = map_blocks(n, p);
+	} else if (S_ISLNK(it->st.st_mode)) {
+		it->link = arena_alloc(&pt->arena, bs + 1);
+		if ((len = readlink(host, it->link, bs + 1)) < 0)
+			return(fail(pt, host));
+		if (len >= (ssize_t)bs) {
+			errno = ENAMETOOLONG;
+			return(fail(pt, host));
+		}
+		it->link[len] = '\0';
+		it->nblocks = (size_t)len < FAST_LINK_MAX ? 0 : 1;
+	} else if (!S_ISDIR(it->st.st_mode)) {
+		pt->report->skipped++;
+		return(TRUE);
+	} else if (!recursive) {
+		errno = EISDIR;
+		snprintf(pt->report->error, sizeof(pt->report->error), "%s is a directory (use put -r)", host);
+		return(FALSE);
+	}
+
+	pt->nitems++;
+	if (parent != NONE) {
+		if (pt->items[parent].last_child == NONE)
+			pt->items[parent].first_child = idx;
+		else
+			pt->items[pt->items[parent].last_child].next_sibling = idx;
+		pt->items[parent].last_child = idx;
+		if (S_ISDIR(it->st.st_mode))
+			pt->items[parent].subdirs++;
+	}
+	if (!S_ISDIR(it->st.st_mode))
+		return(TRUE);
+
+	if ((count = scandir(host, &list, NULL, name_cmp)) < 0)
+		return(fail(pt, host));
+	for (i = 0; i < count; i++) {
+		name = list[i]->d_name;
+		if (strcmp(name, ".") && strcmp(name, "..")) {
+			path = arena_alloc(&pt->arena, strlen(host) + strlen(name) + 2);
+			sprintf(path, "%s/%s", host, name);
+			name = strcpy(arena_alloc(&pt->arena, strlen(name) + 1), name);
+			if (!plan(pt, path, name, idx, recursive))
+				break;
+		}
+	}
+	for (j = 0; j < count; j++)
+		free(list[j]);
+	free(list);
+	if (i < count)
+		return(FALSE);
+
+	pt->items[idx].nblocks = pack_dir(pt, idx, NULL);
+	return(TRUE);
+}
+
+/* plan_entry
+ *
+ * Finds room for the new entry in the existing directory: the slack
+ * after a live entry, or an unused entry, that is big enough.  If no
+ * block has room the directory grows by one block.  Also makes sure the
+ * name is not taken.
+ */
+
+static os_bool_t plan_entry(struct put *pt, const char *name)
+{
+	os_uint32_t bs = pt->fs->block_size, nblocks, b, off, used, need = ENTRY_LEN(strlen(name));
+	struct os_direntry_t *de;
+	unsigned char *buf;
+	os_uint32_t phys;
+
+	if (!fetch_inode(pt->dir_ino, pt->fd, pt->fs, &pt->dir) ||
+	    (pt->dir.i_mode & 0xF000) != EXT2_S_IFDIR) {
+		errno = ENOTDIR;
+		return(fail(pt, "target"));
+	}
+
+	nblocks = pt->dir.i_size / bs;
+	buf = arena_alloc(&pt->arena, bs);
+	for (b = 0; b < nblocks; b++) {
+		if ((phys = file_bmap(&pt->dir, pt->fd, pt->fs, b)) == 0)
+			continue;
+		read_block_as(pt->fd, pt->fs, phys, buf, TRACE_DIRECTORY);
+		for (off = 0; off + 8 <= bs; off += de->rec_len) {
+			de = (struct os_direntry_t *)(buf + off);
+			if (de->rec_len < 8 || off + de->rec_len > bs)
+				break;
+			if (de->inode && de->name_len == strlen(name) && !memcmp(de->file_name, name, de->name_len)) {
+				errno = EEXIST;
+				return(fail(pt, name));
+			}
+			used = de->inode ? ENTRY_LEN(de->name_len) : 0;
+			if (pt->dir_block == NULL && de->rec_len - used >= need) {
+				pt->dir_block = buf;
+				pt->dir_phys = phys;
+				pt->dir_off = off;
+				pt->dir_used = used;
+			}
+		}
+		if (pt->dir_block == buf)
+			buf = arena_alloc(&pt->arena, bs);
+	}
+
+	if (pt->dir_block == NULL) {
+		// growing past the direct blocks would mean new indirect blocks
+		if (nblocks >= 12) {
+			snprintf(pt->report->error, sizeof(pt->report->error),
+				 "no room in the target directory, and it cannot grow past 12 blocks");
+			return(FALSE);
+		}
+		pt->dir_grow = TRUE;
+	}
+	return(TRUE);
+}
+
+/* reserve_inodes
+ *
+ * Takes the first free inodes from the group of the target directory
+ * on, for every item in order.
+ */
+
+static os_bool_t reserve_inodes(struct put *pt)
+{
+	struct os_fs_metadata_t *fs = pt->fs;
+	os_uint32_t ipg = fs->inodes_per_group, bs = fs->block_size;
+	os_uint32_t goal = (pt->dir_ino - 1) / ipg, k, g, i, n = 0;
+	unsigned char *bits;
+
+	if (fs->sb->s_free_inodes_count < pt->nitems) {
+		errno = ENOSPC;
+		return(fail(pt, "not enough free inodes"));
+	}
+
+	for (k = 0; k < fs->num_blockgroups && n < pt->nitems; k++) {
+		g = (goal + k) % fs->num_blockgroups;
+		if (fs->bgdt[g].bg_free_inodes_count == 0)
+			continue;
+		bits = pt->ibitmap + (size_t)g * bs;
+		if (fs->inode_bitmap)
+			memcpy(bits, fs->inode_bitmap + (size_t)g * bs, bs);
+		else
+			read_block_as(pt->fd, fs, fs->bgdt[g].bg_inode_bitmap, bits, TRACE_BITMAP);
+
+		for (i = 0; i < ipg && n < pt->nitems && fs->bgdt[g].bg_free_inodes_count; i++) {
+			if ((bits[i / 8] & (1 << (i % 8))) || g * ipg + i + 1 < fs->sb->s_first_ino)
+				continue;
+			bits[i / 8] |= 1 << (i % 8);
+			pt->idirty[g] = 1;
+			pt->items[n].ino = g * ipg + i + 1;
+			fs->bgdt[g].bg_free_inodes_count--;
+			fs->sb->s_free_inodes_count--;
+			if (S_ISDIR(pt->items[n].st.st_mode))
+				fs->bgdt[g].bg_used_dirs_count++;
+			n++;
+		}
+	}
+	if (n < pt->nitems) {
+		errno = ENOSPC;
+		return(fail(pt, "inode bitmaps disagree with the free counts"));
+	}
+	return(TRUE);
+}
+
+static int run_by_size(const void *a, const void *b)
+{
+	const struct run *x = a, *y = b;
+
+	if (x->count != y->count)
+		return(x->count > y->count ? -1 : 1);
+	return(x->start < y->start ? -1 : x->start > y->start);
+}
+
+static int run_by_start(const void *a, const void *b)
+{
+	const struct run *x = a, *y = b;
+
+	return(x->start < y->start ? -1 : x->start > y->start);
+}
+
+/* reserve_blocks
+ *
+ * Finds the free runs of every group and reserves 'total' blocks: the
+ * first run at or after the goal that holds them all if there is one,
+ * else the biggest runs, so the import is split as little as possible.
+ * The chosen runs are then used in disk order.
+ */
+
+static os_bool_t reserve_blocks(struct put *pt, os_uint64_t total, os_uint32_t goal)
+{
+	struct os_fs_metadata_t *fs = pt->fs;
+	os_uint32_t bs = fs->block_size, bpg = fs->blockgroup_size, first = fs->sb->s_first_data_block;
+	os_uint32_t g, i, end, n, base, blk, nfree = 0, cap = 0, r, k;
+	struct run *free_runs = NULL, *fit = NULL;
+	unsigned char *bits;
+	os_uint64_t got;
+
+	if (total > fs->sb->s_free_blocks_count) {
+		errno = ENOSPC;
+		return(fail(pt, "not enough free blocks"));
+	}
+
+	if (total == 0)
+		return(TRUE);
+
+	for (g = 0; g < fs->num_blockgroups; g++) {
+		if (fs->bgdt[g].bg_free_blocks_count == 0)
+			continue;
+		bits = pt->bbitmap + (size_t)g * bs;
+		if (fs->block_bitmap)
+			memcpy(bits, fs->block_bitmap + (size_t)g * bs, bs);
+		else
+			read_block_as(pt->fd, fs, fs->bgdt[g].bg_block_bitmap, bits, TRACE_BITMAP);
+
+		base = first + g * bpg;
+		if (base >= fs->num_blocks)
+			break;
+		n = fs->num_blocks - base < bpg ? fs->num_blocks - base : bpg;
+
+		for (i = bitmap_find(bits, 0, n, 0); i < n; i = bitmap_find(bits, end, n, 0)) {
+			end = bitmap_find(bits, i, n, 1);
+			blk = base + i;
+			// extend the last run, across group boundaries too
+			if (nfree && free_runs[nfree - 1].start + free_runs[nfree - 1].count == blk) {
+				free_runs[nfree - 1].count += end - i;
+				continue;
+			}
+			if (nfree == cap) {
+				cap = cap ? cap * 2 : 256;
+				free_runs = realloc(free_runs, cap * sizeof(struct run));
+				assert(free_runs != NULL);
+			}
+			free_runs[nfree].start = blk;
+			free_runs[nfree].count = end - i;
+			nfree++;
+		}
+	}
+
+	for (r = 0; r < nfree; r++) {
+		if (free_runs[r].count < total)
+			continue;
+		if (fit == NULL || (fit->start < goal && free_runs[r].start >= goal))
+			fit = &free_runs[r];
+		if (fit->start >= goal)
+			break;
+	}
+
+	pt->runs = malloc((fit || nfree == 0 ? 1 : nfree) * sizeof(struct run));
+	assert(pt->runs != NULL);
+	if (fit) {
+		pt->runs[0].start = fit->start;
+		pt->runs[0].count = total;
+		pt->nruns = 1;
+	} else {
+		qsort(free_runs, nfree, sizeof(struct run), run_by_size);
+		for (got = 0, r = 0; r < nfree && got < total; r++) {
+			pt->runs[r] = free_runs[r];
+			if (got + pt->runs[r].count > total)
+				pt->runs[r].count = total - got;
+			got += pt->runs[r].count;
+		}
+		pt->nruns = r;
+		qsort(pt->runs, pt->nruns, sizeof(struct run), run_by_start);
+		if (got < total) {
+			free(free_runs);
+			errno = ENOSPC;
+			return(fail(pt, "block bitmaps disagree with the free counts"));
+		}
+	}
+	free(free_runs);
+
+	// mark them used now; they are handed out by next_block()
+	for (r = 0; r < pt->nruns; r++) {
+		for (k = 0; k < pt->runs[r].count; k++) {
+			blk = pt->runs[r].start + k - first;
+			g = blk / bpg;
+			pt->bbitmap[(size_t)g * bs + (blk % bpg) / 8] |= 1 << (blk % 8);
+			pt->bdirty[g] = 1;
+			fs->bgdt[g].bg_free_blocks_count--;
+		}
+	}
+	fs->sb->s_free_blocks_count -= total;
+	pt->report->blocks = total;
+	pt->report->runs = pt->nruns;
+	return(TRUE);
+}
+
+static os_uint32_t next_block(struct put *pt)
+{
+	os_uint32_t blk;
+
+	assert(pt->cur < pt->nruns);
+	blk = pt->runs[pt->cur].start + pt->used;
+	if (++pt->used == pt->runs[pt->cur].count) {
+		pt->cur++;
+		pt->used = 0;
+	}
+	return(blk);
+}
+
+// maps the next data blocks of 'it' under an indirect block of 'level'
+static os_uint32_t map_tree(struct put *pt, struct item *it, int level, os_uint32_t *logical)
+{
+	os_uint32_t blk = next_block(pt), *slots, i;
+
+	if (level == 0) {
+		it->map[(*logical)++] = blk;
+		return(blk);
+	}
+	slots = new_block(pt, blk);
+	for (i = 0; i < pt->ppb && *logical < it->nblocks; i++)
+		slots[i] = map_tree(pt, it, level - 1, logical);
+	return(blk);
+}
+
+static unsigned char *write_inode(struct put *pt, os_uint32_t ino, struct os_inode_t *inode)
+{
+	struct os_fs_metadata_t *fs = pt->fs;
+	os_uint32_t g = (ino - 1) / fs->inodes_per_group, i = (ino - 1) % fs->inodes_per_group;
+	unsigned char *buf = arena_alloc(&pt->arena, fs->inode_size);
+
+	memset(buf, 0, fs->inode_size);
+	memcpy(buf, inode, sizeof(*inode));
+	add_record(pt, (os_uint64_t)fs->bgdt[g].bg_inode_table * fs->block_size +
+		   (os_uint64_t)i * fs->inode_size, fs->inode_size, buf);
+	return(buf);
+}
+
+static void build_item(struct put *pt, os_uint32_t idx)
+{
+	struct item *it = &pt->items[idx];
+	struct os_fs_metadata_t *fs = pt->fs;
+	struct os_inode_t inode;
+	os_uint32_t logical = 0, i, type;
+	os_uint64_t size;
+	unsigned char *dir;
+
+	memset(&inode, 0, sizeof(inode));
+	it->map = arena_alloc(&pt->arena, (size_t)(it->nblocks ? it->nblocks : 1) * sizeof(os_uint32_t));
+	for (i = 0; i < 12 && logical < it->nblocks; i++)
+		inode.i_block[i] = map_tree(pt, it, 0, &logical);
+	for (i = 1; i <= 3 && logical < it->nblocks; i++)
+		inode.i_block[11 + i] = map_tree(pt, it, i, &logical);
+
+	if (S_ISDIR(it->st.st_mode)) {
+		type = EXT2_S_IFDIR;
+		size = (os_uint64_t)it->nblocks * fs->block_size;
+		inode.i_links_count = 2 + it->subdirs;
+		dir = arena_alloc(&pt->arena, size);
+		memset(dir, 0, size);
+		pack_dir(pt, idx, dir);
+		for (i = 0; i < it->nblocks; i++)
+			add_record(pt, (os_uint64_t)it->map[i] * fs->block_size, fs->block_size,
+				   dir + (size_t)i * fs->block_size);
+		pt->report->dirs++;
+	} else if (S_ISLNK(it->st.st_mode)) {
+		type = EXT2_S_IFLNK;
+		size = strlen(it->link);
+		inode.i_links_count = 1;
+		if (it->nblocks)
+			strcpy(new_block(pt, it->map[0]), it->link);
+		else
+			memcpy(inode.i_block, it->link, size);
+		pt->report->symlinks++;
+	} else {
+		type = EXT2_S_IFREG;
+		size = it->st.st_size;
+		inode.i_links_count = 1;
+		inode.i_dir_acl = size >> 32;
+		if (size > 0x7FFFFFFF)
+			fs->sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+		pt->report->files++;
+	}
+
+	inode.i_mode = type | (it->st.st_mode & 07777);
+	inode.i_uid = it->st.st_uid;
+	inode.i_gid = it->st.st_gid;
+	inode.i_osd2.linux2.l_i_uid_high = it->st.st_uid >> 16;
+	inode.i_osd2.linux2.l_i_gid_high = it->st.st_gid >> 16;
+	inode.i_size = size;
+	inode.i_atime = it->st.st_atime;
+	inode.i_mtime = it->st.st_mtime;
+	inode.i_ctime = pt->now;
+	inode.i_blocks = (it->nblocks + it->meta) * (fs->block_size / 512);
+	it->raw = write_inode(pt, it->ino, &inode);
+}
+
+/* link_entry
+ *
+ * Adds the top item to the existing directory, splitting the entry
+ * found by plan_entry() or filling the block it appends.
+ */
+
+static void link_entry(struct put *pt)
+{
+	struct os_fs_metadata_t *fs = pt->fs;
+	struct item *top = &pt->items[0];
+	os_uint32_t bs = fs->block_size, n;
+	struct os_direntry_t *de, *prev;
+
+	if (pt->dir_grow) {
+		n = pt->dir.i_size / bs;
+		pt->dir_phys = next_block(pt);
+		pt->dir_block = new_block(pt, pt->dir_phys);
+		pt->dir.i_block[n] = pt->dir_phys;
+		pt->dir.i_size += bs;
+		pt->dir.i_blocks += bs / 512;
+		de = (struct os_direntry_t *)pt->dir_block;
+		de->rec_len = bs;
+	} else {
+		prev = (struct os_direntry_t *)(pt->dir_block + pt->dir_off);
+		de = prev;
+		if (pt->dir_used) {
+			de = (struct os_direntry_t *)(pt->dir_block + pt->dir_off + pt->dir_used);
+			de->rec_len = prev->rec_len - pt->dir_used;
+			prev->rec_len = pt->dir_used;
+		}
+		add_record(pt, (os_uint64_t)pt->dir_phys * bs, bs, pt->dir_block);
+	}
+	de->inode = top->ino;
+	de->name_len = strlen(top->name);
+	de->file_type = 0;
+	if (fs->sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)
+		de->file_type = S_ISDIR(top->st.st_mode) ? EXT2_FT_DIR :
+				S_ISLNK(top->st.st_mode) ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+	memcpy(de->file_name, top->name, de->name_len);
+
+	if (S_ISDIR(top->st.st_mode))
+		pt->dir.i_links_count++;
+	// the hash index would not know about the entry
+	pt->dir.i_flags &= ~EXT2_INDEX_FL;
+	pt->dir.i_mtime = pt->dir.i_ctime = pt->now;
+	pt->dir_raw = write_inode(pt, pt->dir_ino, &pt->dir);
+}
+
+// streams the contents of a regular file to the blocks it was given
+static os_bool_t copy_data(struct put *pt, struct item *it, unsigned char *buf)
+{
+	os_uint32_t bs = pt->fs->block_size, b = 0, n;
+	size_t want, len;
+	ssize_t got;
+	int fd;
+
+	if (it->nblocks == 0)
+		return(TRUE);
+	if ((fd = open(it->host, O_RDONLY)) < 0)
+		return(fail(pt, it->host));
+
+	while (b < it->nblocks) {
+		// as many blocks as are contiguous on disk and fit the buffer
+		for (n = 1; b + n < it->nblocks && n < COPY_CHUNK / bs &&
+		     it->map[b + n] == it->map[b] + n; n++)
+			;
+		want = (size_t)n * bs;
+		for (len = 0; len < want; len += got)
+			if ((got = pread(fd, buf + len, want - len, (off_t)b * bs + len)) <= 0)
+				break;
+		if (got < 0) {
+			close(fd);
+			return(fail(pt, it->host));
+		}
+		// a file that shrank since it was sized reads as zeros
+		memset(buf + len, 0, want - len);
+		if (img_pwrite(pt->fd, buf, want, (os_uint64_t)it->map[b] * bs) != (ssize_t)want) {
+			close(fd);
+			return(fail(pt, it->host));
+		}
+		pt->report->bytes += len;
+		b += n;
+	}
+	close(fd);
+	return(TRUE);
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+	const struct record *x = a, *y = b;
+
+	return(x->off < y->off ? -1 : x->off > y->off);
+}
+
+/* flush
+ *
+ * Writes every pending record in disk order, records that follow each
+ * other on disk gathered into a single pwritev().
+ */
+
+static os_bool_t flush(struct put *pt)
+{
+	struct iovec iov[FLUSH_IOV];
+	os_uint32_t i, j, n;
+	size_t len;
+
+	qsort(pt->recs, pt->nrecs, sizeof(struct record), record_cmp);
+	for (i = 0; i < pt->nrecs; i = j) {
+		len = 0;
+		for (j = i, n = 0; j < pt->nrecs && n < FLUSH_IOV &&
+		     (j == i || pt->recs[j].off == pt->recs[j - 1].off + pt->recs[j - 1].len); j++, n++) {
+			iov[n].iov_base = pt->recs[j].buf;
+			iov[n].iov_len = pt->recs[j].len;
+			len += pt->recs[j].len;
+		}
+		if (img_pwritev(pt->fd, iov, n, pt->recs[i].off) != (ssize_t)len)
+			return(fail(pt, "writing metadata"));
+		pt->report->writes++;
+	}
+	pt->report->records = pt->nrecs;
+	if (fsync(pt->fd) != 0)
+		return(fail(pt, "sync"));
+	return(TRUE);
+}
+
+os_bool_t put_tree(int fd, struct os_fs_metadata_t *metadata, const char *host,
+                   os_uint32_t dir_inode, const char *name, os_bool_t recursive,
+                   struct os_put_report_t *report)
+{
+	struct put pt;
+	struct os_fs_metadata_t *fs = metadata;
+	struct os_superblock_t sb_saved;
+	struct os_blockgroup_descriptor_t *bgdt_saved;
+	os_uint32_t bs = fs->block_size, i, g, goal;
+	os_uint64_t total = 0;
+	os_bool_t ok = FALSE;
+	unsigned char *buf;
+
+	bgdt_saved = NULL;
+
+	memset(report, 0, sizeof(*report));
+	memset(&pt, 0, sizeof(pt));
+	pt.fd = fd;
+	pt.fs = fs;
+	pt.report = report;
+	pt.arena = (struct os_arena_t)ARENA_INIT;
+	pt.ppb = bs / sizeof(os_uint32_t);
+	pt.now = time(NULL);
+	pt.dir_ino = dir_inode;
+
+	if (!put_supported(fs)) {
+		snprintf(report->error, sizeof(report->error), "filesystem features not supported for writing");
+		return(FALSE);
+	}
+
+	// 1. size everything, with the image untouched
+	if (!plan_entry(&pt, name) || !plan(&pt, host, name, NONE, recursive))
+		goto out;
+	if (pt.nitems == 0) {
+		snprintf(report->error, sizeof(report->error), "%s: not a file, directory or symlink", host);
+		goto out;
+	}
+	for (i = 0; i < pt.nitems; i++)
+		total += pt.items[i].nblocks + pt.items[i].meta;
+	total += pt.dir_grow;
+
+	// 2. reserve the inodes and all blocks at once; the counts in the
+	// metadata change as they go, so they are put back on failure
+	sb_saved = *fs->sb;
+	bgdt_saved = malloc(fs->num_blockgroups * sizeof(struct os_blockgroup_descriptor_t));
+	assert(bgdt_saved != NULL);
+	memcpy(bgdt_saved, fs->bgdt, fs->num_blockgroups * sizeof(struct os_blockgroup_descriptor_t));
+	pt.bbitmap = malloc((size_t)fs->num_blockgroups * bs);
+	pt.ibitmap = malloc((size_t)fs->num_blockgroups * bs);
+	pt.bdirty = calloc(fs->num_blockgroups, 1);
+	pt.idirty = calloc(fs->num_blockgroups, 1);
+	assert(pt.bbitmap && pt.ibitmap && pt.bdirty && pt.idirty);
+	goal = fs->offsets[(dir_inode - 1) / fs->inodes_per_group].first_block_in_blockgroup;
+	if (!reserve_inodes(&pt) || !reserve_blocks(&pt, total, goal))
+		goto out;
+
+	// 3. lay out the tree in order, copy file contents, then flush the rest
+	for (i = 0; i < pt.nitems; i++)
+		build_item(&pt, i);
+	link_entry(&pt);
+	assert(pt.cur == pt.nruns);
+
+	buf = arena_alloc(&pt.arena, COPY_CHUNK);
+	for (i = 0; i < pt.nitems; i++)
+		if (S_ISREG(pt.items[i].st.st_mode) && !copy_data(&pt, &pt.items[i], buf))
+			goto out;
+
+	for (g = 0; g < fs->num_blockgroups; g++) {
+		if (pt.bdirty[g])
+			add_record(&pt, (os_uint64_t)fs->bgdt[g].bg_block_bitmap * bs, bs,
+				   pt.bbitmap + (size_t)g * bs);
+		if (pt.idirty[g])
+			add_record(&pt, (os_uint64_t)fs->bgdt[g].bg_inode_bitmap * bs, bs,
+				   pt.ibitmap + (size_t)g * bs);
+	}
+	add_record(&pt, (os_uint64_t)(fs->sb->s_first_data_block + 1) * bs,
+		   fs->num_blockgroups * sizeof(struct os_blockgroup_descriptor_t), fs->bgdt);
+	fs->sb->s_wtime = pt.now;
+	add_record(&pt, 1024, sizeof(struct os_superblock_t), fs->sb);
+	if (!(ok = flush(&pt)))
+		goto out;
+
+	// bring the cached copies up to date
+	for (g = 0; g < fs->num_blockgroups; g++) {
+		if (pt.bdirty[g] && fs->block_bitmap)
+			memcpy(fs->block_bitmap + (size_t)g * bs, pt.bbitmap + (size_t)g * bs, bs);
+		if (pt.idirty[g] && fs->inode_bitmap)
+			memcpy(fs->inode_bitmap + (size_t)g * bs, pt.ibitmap + (size_t)g * bs, bs);
+	}
+	if (fs->inode_table) {
+		for (i = 0; i < pt.nitems; i++)
+			memcpy(fs->inode_table + (size_t)(pt.items[i].ino - 1) * fs->inode_size,
+			       pt.items[i].raw, fs->inode_size);
+		memcpy(fs->inode_table + (size_t)(dir_inode - 1) * fs->inode_size,
+		       pt.dir_raw, fs->inode_size);
+	}
+
+out:
+	if (!ok && bgdt_saved) {
+		*fs->sb = sb_saved;
+		memcpy(fs->bgdt, bgdt_saved, fs->num_blockgroups * sizeof(struct os_blockgroup_descriptor_t));
+	}
+	free(bgdt_saved);
+	free(pt.items);
+	free(pt.recs);
+	free(pt.runs);
+	free(pt.bbitmap);
+	free(pt.ibitmap);
+	free(pt.bdirty);
+	free(pt.idirty);
+	arena_free(&pt.arena);
+	return(ok);
+}
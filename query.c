@@ -0,0 +1,353 @@
+/* =============
+ * inode queries
+ * =============
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/query.h"
+#include "inc/threadpool.h"
+#include "inc/arena.h"
+
+static const char *field_names[QUERY_NFIELDS] = {
+	"type", "perm", "size", "mtime", "uid", "links", "dtime"
+};
+
+// matches of one blockgroup, in inode order
+struct group_result {
+	os_uint32_t *inodes;
+	os_uint32_t n, cap;
+};
+
+struct run_arg {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	struct os_query_t *q;
+	struct group_result *res;
+	int failed;
+};
+
+static int parse_op(const char **s)
+{
+	static const struct { const char *text; int op; } ops[] = {
+		{ "<=", QUERY_LE }, { ">=", QUERY_GE }, { "!=", QUERY_NE },
+		{ "=", QUERY_EQ }, { "<", QUERY_LT }, { ">", QUERY_GT },
+	};
+	size_t i, len;
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		len = strlen(ops[i].text);
+		if (!strncmp(*s, ops[i].text, len)) {
+			*s += len;
+			return(ops[i].op);
+		}
+	}
+	return(-1);
+}
+
+static os_bool_t parse_number(const char *s, os_uint64_t *value, const char *units,
+                              const os_uint64_t *scale)
+{
+	char *end;
+	const char *u;
+
+	*value = strtoull(s, &end, 0);
+	if (end == s)
+		return(FALSE);
+	if (*end == '\0')
+		return(TRUE);
+	if (end[1] != '\0' || (u = strchr(units, *end)) == NULL)
+		return(FALSE);
+	*value *= scale[u - units];
+	return(TRUE);
+}
+
+static os_bool_t parse_time(const char *s, os_uint64_t *value, int *op)
+{
+	static const os_uint64_t age_scale[] = { 1, 60, 3600, 86400, 7 * 86400 };
+	static const int flipped[] = {
+		QUERY_EQ, QUERY_NE, QUERY_GT, QUERY_GE, QUERY_LT, QUERY_LE
+	};
+	os_uint64_t age, now = time(NULL);
+	struct tm tm;
+	char *end;
+
+	// calendar date, local time
+	if (strchr(s, '-')) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(s, "%Y-%m-%d", &tm);
+		if (end == NULL || *end != '\0')
+			return(FALSE);
+		tm.tm_isdst = -1;
+		*value = mktime(&tm);
+		return(TRUE);
+	}
+
+	// an age: older means a smaller timestamp
+	if (strchr("smhdw", s[strlen(s) - 1])) {
+		if (!parse_number(s, &age, "smhdw", age_scale))
+			return(FALSE);
+		*value = age > now ? 0 : now - age;
+		*op = flipped[*op];
+		return(TRUE);
+	}
+
+	return(parse_number(s, value, "", NULL));
+}
+
+os_bool_t query_parse(struct os_query_t *q, int n, char **preds)
+{
+	static const os_uint64_t size_scale[] = {
+		1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40,
+		1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40
+	};
+	static const char types[] = "pcdbfls";
+	static const os_uint16_t type_modes[] = {
+		EXT2_S_IFIFO, EXT2_S_IFCHR, EXT2_S_IFDIR, EXT2_S_IFBLK,
+		EXT2_S_IFREG, EXT2_S_IFLNK, EXT2_S_IFSOCK
+	};
+	struct os_query_pred_t *p;
+	const char *s, *t;
+	os_bool_t ok;
+	int i, field;
+
+	memset(q, 0, sizeof(*q));
+	if (n > QUERY_MAX_PREDS) {
+		printf("Too many predicates (at most %d)\n", QUERY_MAX_PREDS);
+		return(FALSE);
+	}
+
+	for (i = 0; i < n; i++) {
+		p = &q->preds[q->npreds++];
+		s = preds[i];
+		for (field = 0; field < QUERY_NFIELDS; field++)
+			if (!strncmp(s, field_names[field], strlen(field_names[field])))
+				break;
+		if (field == QUERY_NFIELDS) {
+			printf("Unknown field in \"%s\"\n", preds[i]);
+			return(FALSE);
+		}
+		s += strlen(field_names[field]);
+		p->field = field;
+		p->op = parse_op(&s);
+		if (p->op == -1 || *s == '\0') {
+			printf("Bad predicate \"%s\"\n", preds[i]);
+			return(FALSE);
+		}
+
+		switch (field) {
+		case QUERY_TYPE:
+			t = strchr(types, *s);
+			ok = s[1] == '\0' && t != NULL && (p->op == QUERY_EQ || p->op == QUERY_NE);
+			if (ok)
+				p->value = type_modes[t - types];
+			break;
+		case QUERY_PERM:
+			p->value = strtoull(s, (char **)&t, 8);
+			ok = *t == '\0';
+			break;
+		case QUERY_SIZE:
+			ok = parse_number(s, &p->value, "KMGTkmgt", size_scale);
+			break;
+		case QUERY_MTIME:
+		case QUERY_DTIME:
+			ok = parse_time(s, &p->value, &p->op);
+			break;
+		default:
+			ok = parse_number(s, &p->value, "", NULL);
+			break;
+		}
+		if (!ok || (field != QUERY_SIZE && p->value > 0xFFFFFFFFULL)) {
+			printf("Bad value in \"%s\"\n", preds[i]);
+			return(FALSE);
+		}
+		if (field == QUERY_LINKS || field == QUERY_DTIME)
+			q->any_state = TRUE;
+	}
+
+	return(TRUE);
+}
+
+#ifdef __SSE2__
+static inline __m128i cmp4(__m128i x, __m128i v, int op)
+{
+	switch (op) {
+	case QUERY_EQ: return(_mm_cmpeq_epi32(x, v));
+	case QUERY_NE: return(_mm_xor_si128(_mm_cmpeq_epi32(x, v), _mm_set1_epi32(-1)));
+	case QUERY_LT: return(_mm_cmplt_epi32(x, v));
+	case QUERY_LE: return(_mm_xor_si128(_mm_cmpgt_epi32(x, v), _mm_set1_epi32(-1)));
+	case QUERY_GT: return(_mm_cmpgt_epi32(x, v));
+	default:       return(_mm_xor_si128(_mm_cmplt_epi32(x, v), _mm_set1_epi32(-1)));
+	}
+}
+#endif
+
+static inline int cmp1(os_uint64_t x, os_uint64_t v, int op)
+{
+	switch (op) {
+	case QUERY_EQ: return(x == v);
+	case QUERY_NE: return(x != v);
+	case QUERY_LT: return(x < v);
+	case QUERY_LE: return(x <= v);
+	case QUERY_GT: return(x > v);
+	default:       return(x >= v);
+	}
+}
+
+/* filter_u32
+ *
+ * Clears sel[i] for every i where col[i] op value does not hold.  The
+ * columns are unsigned, so both sides are biased by 2^31 to use the
+ * signed SSE2 compares; four lanes are tested per instruction.
+ */
+
+static void filter_u32(const os_uint32_t *col, os_uint32_t n, int op,
+                       os_uint32_t value, os_uint32_t *sel)
+{
+	os_uint32_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i bias = _mm_set1_epi32((int)0x80000000);
+	__m128i v = _mm_xor_si128(_mm_set1_epi32((int)value), bias), x, s;
+
+	for (; i + 4 <= n; i += 4) {
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(col + i)), bias);
+		s = _mm_loadu_si128((const __m128i *)(sel + i));
+		_mm_storeu_si128((__m128i *)(sel + i), _mm_and_si128(s, cmp4(x, v, op)));
+	}
+#endif
+	for (; i < n; i++)
+		sel[i] &= -(os_uint32_t)cmp1(col[i], value, op);
+}
+
+static void filter_u64(const os_uint64_t *col, os_uint32_t n, int op,
+                       os_uint64_t value, os_uint32_t *sel)
+{
+	os_uint32_t i;
+
+	for (i = 0; i < n; i++)
+		sel[i] &= -(os_uint32_t)cmp1(col[i], value, op);
+}
+
+static void run_group(os_uint32_t g, void *arg)
+{
+	struct run_arg *ra = arg;
+	struct os_fs_metadata_t *fs = ra->fs;
+	struct os_query_t *q = ra->q;
+	struct group_result *res = &ra->res[g];
+	os_uint32_t n = fs->inodes_per_group, i, ino, first_ino;
+	size_t table_len = (size_t)n * fs->inode_size;
+	struct os_arena_mark_t mark;
+	const unsigned char *table;
+	const struct os_inode_t *in;
+	os_uint32_t *col[QUERY_NFIELDS], *sel;
+	os_uint64_t *size;
+	int f, k;
+
+	// free groups can only hold deleted inodes, which need dtime/links
+	if (fs->bgdt[g].bg_free_inodes_count == n && !q->any_state)
+		return;
+
+	mark = arena_mark(arena_scratch());
+	table = group_inode_table(ra->fd, fs, g,
+				  fs->inode_table ? NULL : arena_alloc(arena_scratch(), table_len));
+	if (table == NULL) {
+		ra->failed = 1;
+		arena_release(arena_scratch(), mark);
+		return;
+	}
+
+	// unpack the table into one column per field
+	for (f = 0; f < QUERY_NFIELDS; f++)
+		col[f] = arena_alloc(arena_scratch(), n * sizeof(os_uint32_t));
+	size = arena_alloc(arena_scratch(), n * sizeof(os_uint64_t));
+	sel = arena_alloc(arena_scratch(), n * sizeof(os_uint32_t));
+	for (i = 0; i < n; i++) {
+		in = (const struct os_inode_t *)(table + (size_t)i * fs->inode_size);
+		col[QUERY_TYPE][i] = in->i_mode & 0xF000;
+		col[QUERY_PERM][i] = in->i_mode & 07777;
+		size[i] = file_size((struct os_inode_t *)in);
+		col[QUERY_MTIME][i] = in->i_mtime;
+		col[QUERY_UID][i] = in->i_uid | (os_uint32_t)in->i_osd2.linux2.l_i_uid_high << 16;
+		col[QUERY_LINKS][i] = in->i_links_count;
+		col[QUERY_DTIME][i] = in->i_dtime;
+		sel[i] = 0xFFFFFFFF;
+	}
+
+	// never-used inodes, and unless asked for, deleted ones
+	filter_u32(col[QUERY_TYPE], n, QUERY_NE, 0, sel);
+	if (!q->any_state) {
+		filter_u32(col[QUERY_LINKS], n, QUERY_GT, 0, sel);
+		filter_u32(col[QUERY_DTIME], n, QUERY_EQ, 0, sel);
+	}
+	for (k = 0; k < q->npreds; k++) {
+		if (q->preds[k].field == QUERY_SIZE)
+			filter_u64(size, n, q->preds[k].op, q->preds[k].value, sel);
+		else
+			filter_u32(col[q->preds[k].field], n, q->preds[k].op,
+				   q->preds[k].value, sel);
+	}
+
+	first_ino = fs->sb->s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_FIRST_INO : fs->sb->s_first_ino;
+	for (i = 0; i < n; i++) {
+		if (!sel[i])
+			continue;
+		ino = g * n + i + 1;
+		if (ino > fs->sb->s_inodes_count)
+			break;
+		if (ino < first_ino && ino != EXT2_ROOT_INO)
+			continue;
+		if (res->n == res->cap) {
+			res->cap = res->cap ? res->cap * 2 : 64;
+			res->inodes = realloc(res->inodes, res->cap * sizeof(os_uint32_t));
+			assert(res->inodes != NULL);
+		}
+		res->inodes[res->n++] = ino;
+	}
+
+	arena_release(arena_scratch(), mark);
+}
+
+os_int64_t query_run(int fd, struct os_fs_metadata_t *metadata,
+                     struct os_query_t *q, struct os_threadpool_t *tp,
+                     os_query_cb_t cb, void *arg)
+{
+	struct run_arg ra = { fd, metadata, q, NULL, 0 };
+	struct os_inode_t *inodes;
+	os_int64_t matches = 0;
+	os_uint32_t g, i;
+
+	ra.res = calloc(metadata->num_blockgroups, sizeof(struct group_result));
+	assert(ra.res != NULL);
+
+	tp_parallel_for(tp, metadata->num_blockgroups, run_group, &ra);
+
+	// the matches of a group are read in one batch, in table order
+	for (g = 0; g < metadata->num_blockgroups; g++) {
+		if (ra.res[g].n && !ra.failed) {
+			inodes = malloc(ra.res[g].n * sizeof(struct os_inode_t));
+			assert(inodes != NULL);
+			if (!fetch_inodes(ra.res[g].inodes, ra.res[g].n, fd, metadata, inodes))
+				ra.failed = 1;
+			for (i = 0; i < ra.res[g].n && !ra.failed; i++) {
+				cb(ra.res[g].inodes[i], &inodes[i], arg);
+				matches++;
+			}
+			free(inodes);
+		}
+		free(ra.res[g].inodes);
+	}
+	free(ra.res);
+
+	return(ra.failed ? -1 : matches);
+}
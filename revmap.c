@@ -0,0 +1,306 @@
+/* =============
+ * reverse block map
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/revmap.h"
+#include "inc/threadpool.h"
+#include "inc/arena.h"
+#include "inc/memgov.h"
+
+// intervals found in the inodes of one blockgroup
+struct ext_vec {
+	struct os_revmap_ext_t *ext;
+	os_uint64_t n, cap;
+};
+
+struct build_arg {
+	int fd;
+	struct os_fs_metadata_t *fs;
+	struct ext_vec *groups;
+	int failed;
+};
+
+struct walk_arg {
+	struct ext_vec *v;
+	os_uint32_t inode;
+};
+
+static void push(struct ext_vec *v, os_uint32_t start, os_uint32_t count,
+                 os_uint32_t inode, os_uint32_t logical)
+{
+	struct os_revmap_ext_t *last = v->n ? &v->ext[v->n - 1] : NULL;
+
+	// runs of indirect blocks are usually laid out back to back
+	if (last && logical == REVMAP_INDIRECT && last->logical == REVMAP_INDIRECT &&
+	    last->inode == inode && last->start + last->count == start) {
+		last->count += count;
+		return;
+	}
+
+	if (v->n == v->cap) {
+		v->cap = v->cap ? v->cap * 2 : 256;
+		v->ext = realloc(v->ext, v->cap * sizeof(struct os_revmap_ext_t));
+		assert(v->ext != NULL);
+	}
+	v->ext[v->n].start = start;
+	v->ext[v->n].count = count;
+	v->ext[v->n].inode = inode;
+	v->ext[v->n].logical = logical;
+	v->n++;
+}
+
+static int data_extent(os_uint32_t logical, os_uint32_t physical,
+                       os_uint32_t count, void *arg)
+{
+	struct walk_arg *wa = arg;
+
+	if (physical)
+		push(wa->v, physical, count, wa->inode, logical);
+	return(0);
+}
+
+static int indirect_block(os_uint32_t logical, os_uint32_t physical,
+                          os_uint32_t level, void *arg)
+{
+	struct walk_arg *wa = arg;
+
+	push(wa->v, physical, 1, wa->inode, REVMAP_INDIRECT);
+	return(0);
+}
+
+static int ext_cmp(const void *a, const void *b)
+{
+	const struct os_revmap_ext_t *x = a, *y = b;
+
+	if (x->start != y->start)
+		return(x->start < y->start ? -1 : 1);
+	return(x->inode < y->inode ? -1 : x->inode > y->inode);
+}
+
+static void build_group(os_uint32_t g, void *arg)
+{
+	struct build_arg *ba = arg;
+	struct os_fs_metadata_t *fs = ba->fs;
+	size_t table_len = (size_t)fs->inodes_per_group * fs->inode_size;
+	struct os_arena_mark_t mark;
+	const unsigned char *table;
+	struct os_inode_t inode;
+	struct walk_arg wa;
+	os_uint32_t i;
+
+	if (fs->bgdt[g].bg_free_inodes_count == fs->inodes_per_group)
+		return;
+
+	mark = arena_mark(arena_scratch());
+	table = group_inode_table(ba->fd, fs, g,
+				  fs->inode_table ? NULL : arena_alloc(arena_scratch(), table_len));
+	if (table == NULL) {
+		ba->failed = 1;
+		arena_release(arena_scratch(), mark);
+		return;
+	}
+
+	wa.v = &ba->groups[g];
+	for (i = 0; i < fs->inodes_per_group; i++) {
+		memcpy(&inode, table + (size_t)i * fs->inode_size, sizeof(inode));
+		if (inode.i_mode == 0 || inode.i_links_count == 0 || inode.i_dtime != 0)
+			continue;
+		wa.inode = g * fs->inodes_per_group + i + 1;
+		if (wa.inode > fs->sb->s_inodes_count)
+			break;
+		file_map_walk(&inode, ba->fd, fs, data_extent, indirect_block, &wa);
+	}
+	arena_release(arena_scratch(), mark);
+
+	qsort(wa.v->ext, wa.v->n, sizeof(struct os_revmap_ext_t), ext_cmp);
+}
+
+// min-heap of group indices, ordered by each group's next interval
+struct merge_heap {
+	struct ext_vec *groups;
+	os_uint64_t *pos;
+	os_uint32_t *h;
+	os_uint32_t n;
+};
+
+static int heap_less(struct merge_heap *mh, os_uint32_t a, os_uint32_t b)
+{
+	return(ext_cmp(&mh->groups[a].ext[mh->pos[a]], &mh->groups[b].ext[mh->pos[b]]) < 0);
+}
+
+static void heap_down(struct merge_heap *mh, os_uint32_t i)
+{
+	os_uint32_t c, t;
+
+	for (; (c = 2 * i + 1) < mh->n; i = c) {
+		if (c + 1 < mh->n && heap_less(mh, mh->h[c + 1], mh->h[c]))
+			c++;
+		if (!heap_less(mh, mh->h[c], mh->h[i]))
+			break;
+		t = mh->h[i];
+		mh->h[i] = mh->h[c];
+		mh->h[c] = t;
+	}
+}
+
+struct os_revmap_t *revmap_build(int fd, struct os_fs_metadata_t *metadata,
+                                 struct os_threadpool_t *tp)
+{
+	struct build_arg ba = { fd, metadata, NULL, 0 };
+	struct os_revmap_t *map;
+	struct merge_heap mh;
+	struct os_revmap_ext_t *e;
+	os_uint32_t g, ngroups = metadata->num_blockgroups;
+	os_uint64_t total = 0;
+	os_int64_t i;
+
+	ba.groups = calloc(ngroups, sizeof(struct ext_vec));
+	assert(ba.groups != NULL);
+	tp_parallel_for(tp, ngroups, build_group, &ba);
+
+	map = calloc(1, sizeof(struct os_revmap_t));
+	assert(map != NULL);
+	for (g = 0; g < ngroups; g++)
+		total += ba.groups[g].n;
+	map->ext = malloc((total ? total : 1) * sizeof(struct os_revmap_ext_t));
+	map->reach = malloc((total ? total : 1) * sizeof(os_uint32_t));
+	assert(map->ext != NULL && map->reach != NULL);
+
+	// k-way merge of the per-group runs, each already sorted by its task
+	mh.groups = ba.groups;
+	mh.pos = calloc(ngroups, sizeof(os_uint64_t));
+	mh.h = malloc(ngroups * sizeof(os_uint32_t));
+	assert(mh.pos != NULL && mh.h != NULL);
+	mh.n = 0;
+	for (g = 0; g < ngroups; g++)
+		if (ba.groups[g].n)
+			mh.h[mh.n++] = g;
+	for (i = (os_int64_t)mh.n / 2 - 1; i >= 0; i--)
+		heap_down(&mh, i);
+
+	while (mh.n && !ba.failed) {
+		g = mh.h[0];
+		e = &map->ext[map->n++];
+		*e = ba.groups[g].ext[mh.pos[g]++];
+		map->reach[map->n - 1] = e->start + e->count - 1;
+		if (map->n > 1 && map->reach[map->n - 2] > map->reach[map->n - 1])
+			map->reach[map->n - 1] = map->reach[map->n - 2];
+		if (mh.pos[g] == ba.groups[g].n)
+			mh.h[0] = mh.h[--mh.n];
+		heap_down(&mh, 0);
+	}
+
+	for (g = 0; g < ngroups; g++)
+		free(ba.groups[g].ext);
+	free(ba.groups);
+	free(mh.pos);
+	free(mh.h);
+
+	if (ba.failed) {
+		revmap_free(map);
+		return(NULL);
+	}
+	map->charged = sizeof(*map) + (total ? total : 1) *
+		(sizeof(struct os_revmap_ext_t) + sizeof(os_uint32_t));
+	mg_charge(mg_register(MG_INDEXES, NULL, NULL), map->charged);
+	return(map);
+}
+
+struct os_revmap_t *revmap_get(int fd, struct os_fs_metadata_t *metadata)
+{
+	if (metadata->owners == NULL)
+		metadata->owners = revmap_build(fd, metadata, tp_shared());
+	return(metadata->owners);
+}
+
+os_uint64_t revmap_lookup(struct os_revmap_t *map, os_uint32_t first,
+                          os_uint32_t last,
+                          void (*cb)(const struct os_revmap_ext_t *ext, void *arg),
+                          void *arg)
+{
+	os_uint64_t lo = 0, hi = map->n, i, found = 0;
+
+	// first interval that reaches 'first': no interval before it does
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (map->reach[i] < first)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	// a later interval may still end before 'first' if an earlier, longer
+	// one overlaps it (cross-linked blocks); those are skipped
+	for (i = lo; i < map->n && map->ext[i].start <= last; i++) {
+		if ((os_uint64_t)map->ext[i].start + map->ext[i].count <= first)
+			continue;
+		cb(&map->ext[i], arg);
+		found++;
+	}
+
+	return(found);
+}
+
+static os_bool_t has_super_backup(struct os_fs_metadata_t *fs, os_uint32_t g)
+{
+	os_uint32_t p;
+
+	if (g <= 1 || !(fs->sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return(TRUE);
+	// only groups that are powers of 3, 5 or 7
+	for (p = 3; p <= 7; p += 2) {
+		os_uint64_t x = p;
+
+		while (x < g)
+			x *= p;
+		if (x == g)
+			return(TRUE);
+	}
+	return(FALSE);
+}
+
+const char *revmap_fs_block(struct os_fs_metadata_t *metadata, os_uint32_t block)
+{
+	struct os_blockgroup_descriptor_t *d;
+	os_uint32_t g, first;
+
+	if (block < metadata->sb->s_first_data_block || block >= metadata->num_blocks)
+		return(block == 0 ? "boot block" : NULL);
+
+	g = (block - metadata->sb->s_first_data_block) / metadata->blockgroup_size;
+	d = &metadata->bgdt[g];
+	first = metadata->offsets[g].first_block_in_blockgroup;
+
+	if (block == d->bg_block_bitmap)
+		return("block bitmap");
+	if (block == d->bg_inode_bitmap)
+		return("inode bitmap");
+	if (block >= d->bg_inode_table && block < d->bg_inode_table + metadata->inode_blocks_per_group)
+		return("inode table");
+	if (has_super_backup(metadata, g)) {
+		if (block == first)
+			return("superblock");
+		// s_padding_1 is s_reserved_gdt_blocks in later revisions
+		if (block <= first + metadata->num_blocks_per_desc_table + metadata->sb->s_padding_1)
+			return("group descriptors");
+	}
+	return(NULL);
+}
+
+void revmap_free(struct os_revmap_t *map)
+{
+	if (map == NULL)
+		return;
+	mg_uncharge(mg_register(MG_INDEXES, NULL, NULL), map->charged);
+	free(map->ext);
+	free(map->reach);
+	free(map);
+}
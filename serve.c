@@ -0,0 +1,653 @@
+/* =============
+ * query server
+ * =============
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "inc/types.h"
+#include "inc/ext2access.h"
+#include "inc/image.h"
+#include "inc/serve.h"
+#include "inc/bcache.h"
+#include "inc/threadpool.h"
+#include "inc/namefilter.h"
+#include "inc/trace.h"
+#include "inc/journal.h"
+#include "inc/memgov.h"
+
+#define SERVE_EVENTS 64
+#define SERVE_PATH_MAX 4096
+#define SERVE_MAX_BUFFERED (1 << 20)  // pipelined input kept per connection
+#define DCACHE_SLOTS 16384        // directory entries remembered
+#define DCACHE_LOCKS 64
+
+struct image {
+	int fd;
+	struct os_fs_metadata_t *fs;
+};
+
+// one growable output buffer
+struct sbuf {
+	unsigned char *data;
+	size_t len, cap;
+};
+
+struct conn {
+	int fd;
+	struct sbuf in, out;
+	size_t out_off;
+	int busy;                 // a request of this connection is on the pool
+	int closed;               // the peer went away while it was
+	unsigned char *req;       // the request being handled ...
+	os_uint32_t req_len;
+	struct sbuf resp;         // ... and its response
+	struct conn *next_done;
+	struct conn *next_dead;
+	struct server *srv;
+};
+
+struct server {
+	struct image *images;
+	int nimages;
+	int epfd, done_fd;
+	pthread_mutex_t done_lock;
+	struct conn *done;        // handled requests, for the epoll thread
+	struct conn *dead;        // closed, freed after the current events
+	os_uint64_t requests;
+};
+
+// direct-mapped (image, directory, name) -> inode cache
+struct dentry {
+	os_uint32_t image, dir, ino;
+	os_uint8_t len;
+	char name[EXT2_NAME_LEN];
+};
+
+static struct dentry dcache[DCACHE_SLOTS];
+static pthread_mutex_t dcache_lock[DCACHE_LOCKS];
+static struct os_memgov_cache_t *dcache_mg;   // fixed size, only counted
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+	stopping = 1;
+}
+
+static void sb_need(struct sbuf *b, size_t more)
+{
+	if (b->len + more <= b->cap)
+		return;
+	b->cap = b->cap ? b->cap : 4096;
+	while (b->cap < b->len + more)
+		b->cap *= 2;
+	b->data = realloc(b->data, b->cap);
+	assert(b->data != NULL);
+}
+
+static void sb_add(struct sbuf *b, const void *p, size_t len)
+{
+	sb_need(b, len);
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+}
+
+static void sb_printf(struct sbuf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	sb_need(b, n + 1);
+	va_start(ap, fmt);
+	vsnprintf((char *)b->data + b->len, n + 1, fmt, ap);
+	va_end(ap);
+	b->len += n;
+}
+
+static os_uint32_t dcache_slot(os_uint32_t image, os_uint32_t dir, const char *name, os_uint32_t len)
+{
+	os_uint64_t h = 0xcbf29ce484222325ULL ^ ((os_uint64_t)image << 32 | dir);
+	os_uint32_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+	return((h ^ (h >> 32)) % DCACHE_SLOTS);
+}
+
+static os_uint32_t dcache_get(os_uint32_t image, os_uint32_t dir, const char *name, os_uint32_t len)
+{
+	os_uint32_t s = dcache_slot(image, dir, name, len), ino = 0;
+	struct dentry *d = &dcache[s];
+
+	pthread_mutex_lock(&dcache_lock[s % DCACHE_LOCKS]);
+	if (d->ino && d->image == image && d->dir == dir && d->len == len && !memcmp(d->name, name, len))
+		ino = d->ino;
+	pthread_mutex_unlock(&dcache_lock[s % DCACHE_LOCKS]);
+	if (ino)
+		mg_hit(dcache_mg);
+	else
+		mg_miss(dcache_mg);
+	return(ino);
+}
+
+static void dcache_put(os_uint32_t image, os_uint32_t dir, const char *name, os_uint32_t len,
+                       os_uint32_t ino)
+{
+	os_uint32_t s = dcache_slot(image, dir, name, len);
+	struct dentry *d = &dcache[s];
+
+	pthread_mutex_lock(&dcache_lock[s % DCACHE_LOCKS]);
+	d->image = image;
+	d->dir = dir;
+	d->ino = ino;
+	d->len = len;
+	memcpy(d->name, name, len);
+	pthread_mutex_unlock(&dcache_lock[s % DCACHE_LOCKS]);
+}
+
+/* lookup
+ *
+ * Resolves an absolute path like path_lookup(), going through the
+ * dentry cache for every component.  Returns 0 with errno set if the
+ * path does not exist.
+ */
+
+static os_uint32_t lookup(struct server *srv, os_uint32_t image, const char *path)
+{
+	struct image *im = &srv->images[image];
+	os_uint32_t ino = EXT2_ROOT_INO, len, found;
+	struct os_dirent_view_t v;
+	struct os_dir_iter_t it;
+	struct os_inode_t inode;
+	const char *name;
+	os_uint64_t t0;
+
+	while (*path) {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+		name = path;
+		while (*path && *path != '/')
+			path++;
+		len = path - name;
+		if (len > EXT2_NAME_LEN) {
+			errno = ENAMETOOLONG;
+			return(0);
+		}
+
+		if ((found = dcache_get(image, ino, name, len)) == 0) {
+			t0 = trace_begin();
+			if (!fetch_inode(ino, im->fd, im->fs, &inode) ||
+			    (inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+				errno = ENOTDIR;
+				return(0);
+			}
+			dir_iter_init(&it, &inode, im->fd, im->fs, NULL);
+			while (dir_iter_next(&it, &v))
+				if (v.name_len == len && !memcmp(v.name, name, len)) {
+					found = v.inode;
+					break;
+				}
+			dir_iter_end(&it);
+			trace_end(t0, "dcache miss", TRACE_CACHE, "dir", ino);
+			if (found == 0) {
+				errno = ENOENT;
+				return(0);
+			}
+			dcache_put(image, ino, name, len, found);
+		}
+		ino = found;
+	}
+	return(ino);
+}
+
+static char type_char(struct image *im, const struct os_dirent_view_t *v)
+{
+	static const char types[] = "?fdcbpsl";
+	struct os_inode_t inode;
+
+	if (v->file_type && v->file_type < sizeof(types) - 1)
+		return(types[v->file_type]);
+	if (!fetch_inode(v->inode, im->fd, im->fs, &inode))
+		return('?');
+	switch (inode.i_mode & 0xF000) {
+	case EXT2_S_IFDIR: return('d');
+	case EXT2_S_IFREG: return('f');
+	case EXT2_S_IFLNK: return('l');
+	default: return('?');
+	}
+}
+
+static int do_ls(struct server *srv, os_uint32_t image, os_uint32_t ino, struct sbuf *out)
+{
+	struct image *im = &srv->images[image];
+	struct os_dirent_view_t v;
+	struct os_dir_iter_t it;
+	struct os_inode_t inode;
+
+	if (!fetch_inode(ino, im->fd, im->fs, &inode))
+		return(EIO);
+	if ((inode.i_mode & 0xF000) != EXT2_S_IFDIR)
+		return(ENOTDIR);
+	dir_iter_init(&it, &inode, im->fd, im->fs, NULL);
+	while (dir_iter_next(&it, &v)) {
+		sb_printf(out, "%u\t%c\t", v.inode, type_char(im, &v));
+		sb_add(out, v.name, v.name_len);
+		sb_add(out, "\n", 1);
+	}
+	dir_iter_end(&it);
+	return(0);
+}
+
+static int do_stat(struct server *srv, os_uint32_t image, os_uint32_t ino, struct sbuf *out)
+{
+	struct image *im = &srv->images[image];
+	struct os_inode_t inode;
+
+	if (!fetch_inode(ino, im->fd, im->fs, &inode))
+		return(EIO);
+	sb_printf(out, "%u %o %u %u %u %llu %u %u\n", ino, inode.i_mode, inode.i_links_count,
+		  inode.i_uid | (os_uint32_t)inode.i_osd2.linux2.l_i_uid_high << 16,
+		  inode.i_gid | (os_uint32_t)inode.i_osd2.linux2.l_i_gid_high << 16,
+		  file_size(&inode), inode.i_mtime, inode.i_blocks);
+	return(0);
+}
+
+static int do_read(struct server *srv, os_uint32_t image, os_uint32_t ino,
+                   os_uint64_t off, os_uint32_t len, struct sbuf *out)
+{
+	struct image *im = &srv->images[image];
+	struct os_inode_t inode;
+	ssize_t n;
+
+	if (!fetch_inode(ino, im->fd, im->fs, &inode))
+		return(EIO);
+	if ((inode.i_mode & 0xF000) != EXT2_S_IFREG)
+		return(EISDIR);
+	if (len > SERVE_MAX_READ)
+		len = SERVE_MAX_READ;
+
+	sb_need(out, len);
+	n = file_pread(im->fd, im->fs, &inode, off, len, out->data + out->len);
+	if (n < 0)
+		return(EIO);
+	out->len += n;
+	return(0);
+}
+
+static void find_in(struct image *im, os_uint32_t dir, char *path, size_t plen,
+                    const struct os_name_filter_t *filter, struct sbuf *out)
+{
+	struct os_dirent_view_t v;
+	struct os_dir_iter_t it;
+	struct os_inode_t inode;
+
+	if (!fetch_inode(dir, im->fd, im->fs, &inode))
+		return;
+	dir_iter_init(&it, &inode, im->fd, im->fs, NULL);
+	while (dir_iter_next(&it, &v)) {
+		if ((v.name_len == 1 && v.name[0] == '.') ||
+		    (v.name_len == 2 && v.name[0] == '.' && v.name[1] == '.') ||
+		    plen + 1 + v.name_len >= SERVE_PATH_MAX)
+			continue;
+		path[plen] = '/';
+		memcpy(path + plen + 1, v.name, v.name_len);
+		path[plen + 1 + v.name_len] = '\0';
+		if (name_filter_match(filter, v.name, v.name_len)) {
+			sb_add(out, path, plen + 1 + v.name_len);
+			sb_add(out, "\n", 1);
+		}
+		if (type_char(im, &v) == 'd')
+			find_in(im, v.inode, path, plen + 1 + v.name_len, filter, out);
+	}
+	dir_iter_end(&it);
+}
+
+/* handle
+ *
+ * Runs one request on a pool worker, then hands the connection back to
+ * the epoll thread through the done list.
+ */
+
+static const char *op_names[] = { "bad request", "ls", "stat", "read", "find" };
+
+static void handle(void *arg)
+{
+	struct conn *c = arg;
+	struct server *srv = c->srv;
+	struct os_serve_req_t rq;
+	struct os_name_filter_t filter;
+	char path[SERVE_PATH_MAX];
+	const char *pattern;
+	os_uint32_t ino, status = 0, len, plen;
+	os_uint64_t t0 = trace_begin();
+
+	c->resp.len = 0;
+	sb_need(&c->resp, 8);
+	c->resp.len = 8;
+
+	memcpy(&rq, c->req, sizeof(rq));
+	len = c->req_len - sizeof(rq);
+	if (rq.image >= srv->nimages) {
+		status = ENODEV;
+		goto done;
+	}
+	if (len >= SERVE_PATH_MAX) {
+		status = ENAMETOOLONG;
+		goto done;
+	}
+	memcpy(path, c->req + sizeof(rq), len);
+	path[len] = '\0';
+
+	if ((ino = lookup(srv, rq.image, path)) == 0) {
+		status = errno;
+		goto done;
+	}
+
+	switch (rq.op) {
+	case SERVE_LS:
+		status = do_ls(srv, rq.image, ino, &c->resp);
+		break;
+	case SERVE_STAT:
+		status = do_stat(srv, rq.image, ino, &c->resp);
+		break;
+	case SERVE_READ:
+		status = do_read(srv, rq.image, ino, rq.offset, rq.len, &c->resp);
+		break;
+	case SERVE_FIND:
+		// "path\0pattern"; the lookup stopped at the NUL
+		pattern = path + strlen(path) + 1;
+		if (pattern > path + len || !name_filter_init(&filter, pattern)) {
+			status = EINVAL;
+			break;
+		}
+		plen = strlen(path);
+		while (plen > 0 && path[plen - 1] == '/')
+			path[--plen] = '\0';
+		find_in(&srv->images[rq.image], ino, path, plen, &filter, &c->resp);
+		break;
+	default:
+		status = EINVAL;
+	}
+
+done:
+	if (status)
+		c->resp.len = 8;
+	len = c->resp.len - 4;
+	memcpy(c->resp.data, &len, 4);
+	memcpy(c->resp.data + 4, &status, 4);
+	trace_end(t0, rq.op <= SERVE_FIND ? op_names[rq.op] : "bad request", TRACE_CMD,
+		  "status", status);
+
+	pthread_mutex_lock(&srv->done_lock);
+	c->next_done = srv->done;
+	srv->done = c;
+	pthread_mutex_unlock(&srv->done_lock);
+	assert(eventfd_write(srv->done_fd, 1) == 0);
+}
+
+static void conn_free(struct conn *c)
+{
+	free(c->in.data);
+	free(c->out.data);
+	free(c->resp.data);
+	free(c->req);
+	free(c);
+}
+
+static void conn_close(struct server *srv, struct conn *c)
+{
+	if (c->fd == -1)
+		return;
+	epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	if (c->busy) {
+		c->closed = 1;
+	} else {
+		c->next_dead = srv->dead;
+		srv->dead = c;
+	}
+}
+
+// writes what it can of the pending output; FALSE if the peer is gone
+static os_bool_t conn_flush(struct server *srv, struct conn *c)
+{
+	struct epoll_event ev;
+	ssize_t n;
+
+	while (c->out_off < c->out.len) {
+		n = write(c->fd, c->out.data + c->out_off, c->out.len - c->out_off);
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0)
+			return(FALSE);
+		c->out_off += n;
+	}
+	if (c->out_off == c->out.len)
+		c->out.len = c->out_off = 0;
+
+	ev.events = EPOLLIN | (c->out.len ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(srv->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	return(TRUE);
+}
+
+// starts the next buffered request of an idle connection
+static os_bool_t conn_dispatch(struct server *srv, struct conn *c)
+{
+	os_uint32_t len;
+
+	if (c->busy || c->in.len < 4)
+		return(TRUE);
+	memcpy(&len, c->in.data, 4);
+	if (len < sizeof(struct os_serve_req_t) || len > SERVE_MAX_REQUEST)
+		return(FALSE);
+	if (c->in.len < 4 + len)
+		return(TRUE);
+
+	c->req = realloc(c->req, len);
+	assert(c->req != NULL);
+	memcpy(c->req, c->in.data + 4, len);
+	c->req_len = len;
+	memmove(c->in.data, c->in.data + 4 + len, c->in.len - 4 - len);
+	c->in.len -= 4 + len;
+	c->busy = 1;
+	srv->requests++;
+	tp_submit(tp_shared(), handle, c);
+	return(TRUE);
+}
+
+static void conn_read(struct server *srv, struct conn *c)
+{
+	ssize_t n;
+
+	for (;;) {
+		sb_need(&c->in, 4096);
+		n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0 || (c->in.len += n) > SERVE_MAX_BUFFERED) {
+			conn_close(srv, c);
+			return;
+		}
+	}
+	if (!conn_dispatch(srv, c))
+		conn_close(srv, c);
+}
+
+static void accept_all(struct server *srv, int lfd)
+{
+	struct epoll_event ev;
+	struct conn *c;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(struct conn));
+		assert(c != NULL);
+		c->fd = fd;
+		c->srv = srv;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		assert(epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+	}
+}
+
+// takes back the connections whose requests are done
+static void collect_done(struct server *srv)
+{
+	struct conn *c, *next;
+	eventfd_t n;
+
+	eventfd_read(srv->done_fd, &n);
+	pthread_mutex_lock(&srv->done_lock);
+	c = srv->done;
+	srv->done = NULL;
+	pthread_mutex_unlock(&srv->done_lock);
+
+	for (; c; c = next) {
+		next = c->next_done;
+		c->busy = 0;
+		if (c->closed) {
+			c->next_dead = srv->dead;
+			srv->dead = c;
+			continue;
+		}
+		sb_add(&c->out, c->resp.data, c->resp.len);
+		if (!conn_flush(srv, c) || !conn_dispatch(srv, c))
+			conn_close(srv, c);
+	}
+}
+
+static int open_images(struct server *srv, char **images, int nimages, int flags)
+{
+	struct os_journal_info_t jinfo;
+	os_uint32_t bad_groups;
+	int i;
+
+	srv->images = calloc(nimages, sizeof(struct image));
+	assert(srv->images != NULL);
+	srv->nimages = nimages;
+	for (i = 0; i < nimages; i++) {
+		srv->images[i].fd = img_open(images[i], flags);
+		if (srv->images[i].fd == -1 ||
+		    (srv->images[i].fs = load_fs_metadata(srv->images[i].fd)) == NULL) {
+			fprintf(stderr, "No ext2 filesystem in \"%s\"\n", images[i]);
+			return(-1);
+		}
+		if (!journal_attach(srv->images[i].fd, &srv->images[i].fs, &jinfo)) {
+			fprintf(stderr, "Could NOT read the journal of \"%s\": %s\n", images[i], jinfo.error);
+			return(-1);
+		}
+		if (!preload_metadata(srv->images[i].fd, srv->images[i].fs, tp_shared(), TRUE, &bad_groups)) {
+			fprintf(stderr, "Could NOT read the metadata of \"%s\"\n", images[i]);
+			return(-1);
+		}
+		fprintf(stderr, "image %d\t%s\n", i, images[i]);
+	}
+	return(0);
+}
+
+int serve(const char *sock_path, char **images, int nimages, int flags)
+{
+	struct epoll_event ev, events[SERVE_EVENTS];
+	struct sockaddr_un addr;
+	struct server srv;
+	struct sigaction sa;
+	struct conn *c;
+	os_uint64_t hits, misses, dhits, dmisses;
+	size_t bytes;
+	int lfd, n, i;
+
+	memset(&srv, 0, sizeof(srv));
+	for (i = 0; i < DCACHE_LOCKS; i++)
+		pthread_mutex_init(&dcache_lock[i], NULL);
+	dcache_mg = mg_register("dentries", NULL, NULL);
+	mg_charge(dcache_mg, sizeof(dcache));
+	pthread_mutex_init(&srv.done_lock, NULL);
+	if (nimages > 256 || open_images(&srv, images, nimages, flags) != 0)
+		return(1);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return(1);
+	}
+	strcpy(addr.sun_path, sock_path);
+	unlink(sock_path);
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 128) != 0) {
+		fprintf(stderr, "Could NOT listen on \"%s\": %s\n", sock_path, strerror(errno));
+		return(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+	srv.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(srv.epfd >= 0 && srv.done_fd >= 0);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &lfd;
+	assert(epoll_ctl(srv.epfd, EPOLL_CTL_ADD, lfd, &ev) == 0);
+	ev.data.ptr = &srv.done_fd;
+	assert(epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.done_fd, &ev) == 0);
+	fprintf(stderr, "serving %d image(s) on %s with %d threads\n", nimages, sock_path,
+		tp_size(tp_shared()));
+
+	while (!stopping) {
+		n = epoll_wait(srv.epfd, events, SERVE_EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &lfd)
+				accept_all(&srv, lfd);
+			else if (events[i].data.ptr == &srv.done_fd)
+				collect_done(&srv);
+			else if ((c = events[i].data.ptr)->fd == -1)
+				continue;	// closed by an earlier event of this batch
+			else if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+				 !(events[i].events & EPOLLIN))
+				conn_close(&srv, c);
+			else if (events[i].events & EPOLLIN)
+				conn_read(&srv, c);
+			else if (!conn_flush(&srv, c))
+				conn_close(&srv, c);
+		}
+		while (srv.dead) {
+			c = srv.dead;
+			srv.dead = c->next_dead;
+			conn_free(c);
+		}
+	}
+
+	close(lfd);
+	unlink(sock_path);
+	bcache_stats(&hits, &misses, &bytes);
+	mg_stats(dcache_mg, &dhits, &dmisses, &bytes);
+	fprintf(stderr, "\n%llu requests; dentry cache %llu hits, %llu misses; "
+		"block cache %llu hits, %llu misses\n",
+		srv.requests, dhits, dmisses, hits, misses);
+	mg_report(stderr);
+	return(0);
+}
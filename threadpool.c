@@ -0,0 +1,226 @@
+/* =============
+ * thread pool
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "inc/types.h"
+#include "inc/threadpool.h"
+#include "inc/trace.h"
+
+struct task {
+	void (*fn)(void *);
+	void *arg;
+	struct task *next;
+};
+
+struct os_threadpool_t {
+	int nthreads;
+	pthread_t *threads;
+	struct task *head, *tail;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+// State of one tp_parallel_for() call.  It is shared by the caller and
+// the helper tasks it queued, and freed by whoever drops the last
+// reference, since helpers may only get to run after the loop is over.
+struct loop {
+	void (*fn)(os_uint32_t, void *);
+	void *arg;
+	os_uint32_t n;
+	os_uint32_t next;
+	os_uint32_t done;
+	int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+};
+
+static struct os_threadpool_t *shared_pool;
+static int shared_threads;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *worker_main(void *arg)
+{
+	struct os_threadpool_t *tp = arg;
+	struct task *t;
+	os_uint64_t t0;
+
+	trace_thread_name("pool worker");
+	for (;;) {
+		pthread_mutex_lock(&tp->lock);
+		while (tp->head == NULL && !tp->stopping)
+			pthread_cond_wait(&tp->wake, &tp->lock);
+		t = tp->head;
+		if (t == NULL) {
+			pthread_mutex_unlock(&tp->lock);
+			break;
+		}
+		tp->head = t->next;
+		if (tp->head == NULL)
+			tp->tail = NULL;
+		pthread_mutex_unlock(&tp->lock);
+
+		t0 = trace_begin();
+		t->fn(t->arg);
+		trace_end(t0, "task", TRACE_POOL, NULL, 0);
+		free(t);
+	}
+
+	return(NULL);
+}
+
+struct os_threadpool_t *tp_create(int nthreads)
+{
+	struct os_threadpool_t *tp = calloc(1, sizeof(struct os_threadpool_t));
+	int i;
+
+	assert(tp != NULL);
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	tp->nthreads = nthreads;
+	tp->threads = malloc(nthreads * sizeof(pthread_t));
+	assert(tp->threads != NULL);
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->wake, NULL);
+	for (i = 0; i < nthreads; i++)
+		assert(pthread_create(&tp->threads[i], NULL, worker_main, tp) == 0);
+
+	return(tp);
+}
+
+void tp_submit(struct os_threadpool_t *tp, void (*fn)(void *), void *arg)
+{
+	struct task *t = malloc(sizeof(struct task));
+
+	assert(t != NULL);
+	t->fn = fn;
+	t->arg = arg;
+	t->next = NULL;
+
+	pthread_mutex_lock(&tp->lock);
+	if (tp->tail)
+		tp->tail->next = t;
+	else
+		tp->head = t;
+	tp->tail = t;
+	pthread_cond_signal(&tp->wake);
+	pthread_mutex_unlock(&tp->lock);
+}
+
+static void loop_put(struct loop *l)
+{
+	int refs;
+
+	pthread_mutex_lock(&l->lock);
+	refs = --l->refs;
+	pthread_mutex_unlock(&l->lock);
+	if (refs == 0) {
+		pthread_mutex_destroy(&l->lock);
+		pthread_cond_destroy(&l->finished);
+		free(l);
+	}
+}
+
+static void loop_run(struct loop *l)
+{
+	os_uint32_t i;
+	os_uint64_t t0;
+
+	while ((i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED)) < l->n) {
+		t0 = trace_begin();
+		l->fn(i, l->arg);
+		trace_end(t0, "loop", TRACE_POOL, "i", i);
+		if (__atomic_add_fetch(&l->done, 1, __ATOMIC_ACQ_REL) == l->n) {
+			pthread_mutex_lock(&l->lock);
+			pthread_cond_broadcast(&l->finished);
+			pthread_mutex_unlock(&l->lock);
+		}
+	}
+}
+
+static void loop_helper(void *arg)
+{
+	struct loop *l = arg;
+
+	loop_run(l);
+	loop_put(l);
+}
+
+void tp_parallel_for(struct os_threadpool_t *tp, os_uint32_t n,
+                     void (*fn)(os_uint32_t i, void *arg), void *arg)
+{
+	struct loop *l;
+	int helpers, i;
+
+	if (n == 0)
+		return;
+
+	l = calloc(1, sizeof(struct loop));
+	assert(l != NULL);
+	l->fn = fn;
+	l->arg = arg;
+	l->n = n;
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->finished, NULL);
+
+	helpers = tp->nthreads < (int)n - 1 ? tp->nthreads : (int)n - 1;
+	l->refs = 1 + helpers;
+	for (i = 0; i < helpers; i++)
+		tp_submit(tp, loop_helper, l);
+
+	loop_run(l);
+
+	pthread_mutex_lock(&l->lock);
+	while (__atomic_load_n(&l->done, __ATOMIC_ACQUIRE) < n)
+		pthread_cond_wait(&l->finished, &l->lock);
+	pthread_mutex_unlock(&l->lock);
+	loop_put(l);
+}
+
+int tp_size(struct os_threadpool_t *tp)
+{
+	return(tp->nthreads);
+}
+
+void tp_destroy(struct os_threadpool_t *tp)
+{
+	int i;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->stopping = 1;
+	pthread_cond_broadcast(&tp->wake);
+	pthread_mutex_unlock(&tp->lock);
+
+	for (i = 0; i < tp->nthreads; i++)
+		pthread_join(tp->threads[i], NULL);
+
+	pthread_mutex_destroy(&tp->lock);
+	pthread_cond_destroy(&tp->wake);
+	free(tp->threads);
+	free(tp);
+}
+
+void tp_set_threads(int nthreads)
+{
+	shared_threads = nthreads;
+}
+
+struct os_threadpool_t *tp_shared(void)
+{
+	pthread_mutex_lock(&shared_lock);
+	if (shared_pool == NULL)
+		shared_pool = tp_create(shared_threads);
+	pthread_mutex_unlock(&shared_lock);
+
+	return(shared_pool);
+}
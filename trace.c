@@ -0,0 +1,168 @@
+/* =============
+ * trace-event timeline
+ * =============
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "inc/types.h"
+#include "inc/trace.h"
+
+struct event {
+	os_uint64_t ts, dur;         // nanoseconds
+	const char *cat, *arg_name;
+	os_uint64_t arg;
+	char name[TRACE_NAME_LEN];
+};
+
+struct ring {
+	struct ring *next;           // all rings, newest first
+	long tid;
+	char thread[TRACE_NAME_LEN];
+	os_uint64_t head;            // spans ever recorded
+	struct event ev[TRACE_RING_EVENTS];
+};
+
+int trace_enabled;
+
+static FILE *trace_out;
+static struct ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct ring *my_ring;
+
+os_uint64_t trace_clock(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return((os_uint64_t)t.tv_sec * 1000000000 + t.tv_nsec);
+}
+
+// the calling thread's ring, registered on its first span
+static struct ring *ring_get(void)
+{
+	struct ring *r = my_ring;
+
+	if (r != NULL)
+		return(r);
+
+	r = malloc(sizeof(struct ring));
+	assert(r != NULL);
+	r->tid = syscall(SYS_gettid);
+	r->head = 0;
+	snprintf(r->thread, sizeof(r->thread), r->tid == getpid() ? "main" : "thread %ld", r->tid);
+
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	my_ring = r;
+	return(r);
+}
+
+void trace_thread_name(const char *name)
+{
+	if (trace_enabled)
+		snprintf(ring_get()->thread, TRACE_NAME_LEN, "%s", name);
+}
+
+void trace_span(os_uint64_t t0, const char *name, const char *cat,
+                const char *arg_name, os_uint64_t arg)
+{
+	os_uint64_t now = trace_clock();
+	struct ring *r = ring_get();
+	struct event *e = &r->ev[r->head % TRACE_RING_EVENTS];
+
+	e->ts = t0;
+	e->dur = now - t0;
+	e->cat = cat;
+	e->arg_name = arg_name;
+	e->arg = arg;
+	strncpy(e->name, name, TRACE_NAME_LEN - 1);
+	e->name[TRACE_NAME_LEN - 1] = '\0';
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// writes 's' as a JSON string
+static void put_string(const char *s)
+{
+	fputc('"', trace_out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(trace_out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(trace_out, "\\u%04x", *s);
+		else
+			fputc(*s, trace_out);
+	}
+	fputc('"', trace_out);
+}
+
+os_bool_t trace_start(const char *path)
+{
+	trace_out = fopen(path, "w");
+	if (trace_out == NULL)
+		return(FALSE);
+	trace_enabled = 1;
+	atexit(trace_stop);
+	return(TRUE);
+}
+
+/* trace_stop
+ *
+ * Writes every ring as "X" (complete) events, each thread named by an
+ * "M" (metadata) event.  Timestamps and durations are in microseconds.
+ * Threads still running may add spans meanwhile; those are missed or,
+ * if their ring wrapped, cut short, which is fine for a trace.
+ */
+
+void trace_stop(void)
+{
+	struct ring *r;
+	struct event *e;
+	os_uint64_t i, head, spans = 0, dropped = 0;
+	long pid = getpid();
+	int first = 1;
+
+	if (trace_out == NULL)
+		return;
+	trace_enabled = 0;
+
+	fprintf(trace_out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r; r = r->next) {
+		fprintf(trace_out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,"
+			"\"args\":{\"name\":", first ? "" : ",\n", pid, r->tid);
+		put_string(r->thread);
+		fprintf(trace_out, "}}");
+		first = 0;
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		i = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+		dropped += i;
+		for (; i < head; i++, spans++) {
+			e = &r->ev[i % TRACE_RING_EVENTS];
+			fprintf(trace_out, ",\n{\"name\":");
+			put_string(e->name);
+			fprintf(trace_out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+				"\"pid\":%ld,\"tid\":%ld", e->cat,
+				e->ts / 1000, e->ts % 1000, e->dur / 1000, e->dur % 1000, pid, r->tid);
+			if (e->arg_name)
+				fprintf(trace_out, ",\"args\":{\"%s\":%llu}", e->arg_name, e->arg);
+			fprintf(trace_out, "}");
+		}
+	}
+	pthread_mutex_unlock(&rings_lock);
+	fprintf(trace_out, "\n]}\n");
+	fclose(trace_out);
+	trace_out = NULL;
+
+	fprintf(stderr, "trace: %llu spans written, %llu overwritten\n", spans, dropped);
+}